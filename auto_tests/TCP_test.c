@@ -496,6 +496,60 @@ START_TEST(test_client)
 }
 END_TEST
 
+START_TEST(test_client_precompute)
+{
+    unix_time_update();
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+    Precompute_Pool *pool = new_precompute_pool(2, 16);
+    ck_assert_msg(pool != NULL, "Failed to create precompute pool");
+    TCP_server_set_precompute_pool(tcp_s, pool);
+
+    uint8_t f_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t f_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(f_public_key, f_secret_key);
+    IP_Port ip_port_tcp_s;
+
+    ip_port_tcp_s.port = net_htons(ports[rand() % NUM_PORTS]);
+    ip_port_tcp_s.ip.family = AF_INET6;
+    get_ip6(&ip_port_tcp_s.ip.ip6, &in6addr_loopback);
+    TCP_Client_Connection *conn = new_TCP_connection(ip_port_tcp_s, self_public_key, f_public_key, f_secret_key, 0);
+    c_sleep(50);
+    do_TCP_connection(conn, NULL);
+    ck_assert_msg(conn->status == TCP_CLIENT_UNCONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_UNCONFIRMED,
+                  conn->status);
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    do_TCP_connection(conn, NULL);
+    ck_assert_msg(conn->status == TCP_CLIENT_UNCONFIRMED, "Handshake was answered before the pool finished it.");
+
+    /* The response is only sent by do_precompute_pool(). */
+    uint32_t i;
+
+    for (i = 0; i < 20 && conn->status != TCP_CLIENT_CONFIRMED; ++i) {
+        do_precompute_pool(pool, NULL);
+        c_sleep(50);
+        do_TCP_connection(conn, NULL);
+    }
+
+    ck_assert_msg(conn->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
+                  conn->status);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    do_TCP_connection(conn, NULL);
+    ck_assert_msg(conn->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
+                  conn->status);
+
+    kill_precompute_pool(pool);
+    kill_TCP_server(tcp_s);
+    kill_TCP_connection(conn);
+}
+END_TEST
+
 START_TEST(test_client_invalid)
 {
     unix_time_update();
@@ -744,13 +798,121 @@ START_TEST(test_tcp_connection2)
 }
 END_TEST
 
+#define NUM_TIMERS 8
+
+static uint64_t timer_fired_at[NUM_TIMERS];
+static uint64_t timer_now;
+
+static void timer_fired(void *object, uint32_t number, void *userdata)
+{
+    ck_assert_msg(timer_fired_at[number] == 0, "timer %u ran out twice", number);
+    timer_fired_at[number] = timer_now;
+
+    /* Timer 0 sets itself again once. */
+    if (number == 0 && timer_now < 100000) {
+        timer_fired_at[number] = 0;
+        timer_set((Timer_Wheel *)object, *(uint32_t *)userdata, 200000);
+    }
+}
+
+START_TEST(test_timer_wheel)
+{
+    /* Deadlines in the first level, on the edges of levels and beyond the last one. */
+    static const uint64_t deadlines[NUM_TIMERS] = {
+        1000, 1063, 1064, 5095, 1000 + 64 * 64 * 64 + 7, 1000 + (1ULL << 40), 990, 2000
+    };
+    uint32_t timers[NUM_TIMERS];
+    uint32_t i;
+
+    Timer_Wheel *wheel = timer_wheel_new(1000);
+    ck_assert_msg(wheel != NULL, "failed to create timer wheel");
+    ck_assert_msg(timer_wheel_next_deadline(wheel) == UINT64_MAX, "empty wheel has a deadline");
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        timers[i] = timer_new(wheel, &timer_fired, wheel, i);
+        ck_assert_msg(timers[i] != 0, "failed to create timer");
+        timer_set(wheel, timers[i], deadlines[i]);
+    }
+
+    timer_stop(wheel, timers[7]);
+    ck_assert_msg(timer_wheel_next_deadline(wheel) < 1000, "passed deadline not due");
+
+    /* Times are visited in steps, as a module running its timers would. */
+    for (timer_now = 1000; timer_now < 1000 + (1ULL << 41); timer_now += 1 + timer_now / 7) {
+        const uint64_t next = timer_wheel_next_deadline(wheel);
+        timer_wheel_run(wheel, timer_now, &timers[0]);
+
+        for (i = 0; i < NUM_TIMERS; ++i) {
+            if (timer_fired_at[i] == 0) {
+                ck_assert_msg(next <= deadlines[i] || i == 7 || (i == 0 && next <= 200000), "deadline %u before the next one", i);
+            }
+        }
+    }
+
+    for (i = 1; i < NUM_TIMERS - 1; ++i) {
+        ck_assert_msg(timer_fired_at[i] >= deadlines[i], "timer %u ran out before its deadline", i);
+        ck_assert_msg(timer_fired_at[i] < deadlines[i] + 1 + deadlines[i] / 7, "timer %u ran out late", i);
+    }
+
+    ck_assert_msg(timer_fired_at[0] >= 200000, "timer set again by its callback ran out early");
+    ck_assert_msg(timer_fired_at[7] == 0, "stopped timer ran out");
+
+    /* Killed timers are reused. */
+    timer_kill(wheel, timers[3]);
+    ck_assert_msg(timer_new(wheel, &timer_fired, wheel, 3) == timers[3], "killed timer not reused");
+
+    timer_wheel_kill(wheel);
+}
+END_TEST
+
+#include "../toxcore/packet_pool.h"
+
+#define NUM_BLOCKS 100
+
+START_TEST(test_packet_pool)
+{
+    static const size_t sizes[] = {16, 1400};
+    void *blocks[NUM_BLOCKS];
+    uint32_t i;
+
+    Packet_Pool pool;
+    ck_assert_msg(packet_pool_init(&pool, sizes, 2) == 0, "failed to initialize packet pool");
+    ck_assert_msg(packet_pool_alloc(&pool, 1401) == NULL, "got a block larger than the largest size class");
+
+    for (i = 0; i < NUM_BLOCKS; ++i) {
+        blocks[i] = packet_pool_alloc(&pool, i % 2 ? 1400 : 3);
+        ck_assert_msg(blocks[i] != NULL, "failed to allocate block %u", i);
+        memset(blocks[i], i, i % 2 ? 1400 : 3);
+    }
+
+    for (i = 0; i < NUM_BLOCKS; ++i) {
+        packet_pool_free(&pool, blocks[i], i % 2 ? 1400 : 3);
+    }
+
+    ck_assert_msg(packet_pool_free_blocks(&pool) == NUM_BLOCKS, "freed blocks not kept");
+    void *block = packet_pool_alloc(&pool, 1000);
+    ck_assert_msg(block == blocks[NUM_BLOCKS - 1], "last freed block of the size class not reused");
+
+    /* The blocks of the burst are kept over one trim, and freed by the next. */
+    ck_assert_msg(packet_pool_trim(&pool) == 0, "blocks used since the last trim freed");
+    ck_assert_msg(packet_pool_trim(&pool) == NUM_BLOCKS - 1, "unused blocks not freed");
+    ck_assert_msg(packet_pool_free_blocks(&pool) == 0, "unused blocks kept");
+
+    packet_pool_free(&pool, block, 1000);
+    packet_pool_free_all(&pool);
+}
+END_TEST
+
 static Suite *TCP_suite(void)
 {
     Suite *s = suite_create("TCP");
 
+    DEFTESTCASE(timer_wheel);
+    DEFTESTCASE(packet_pool);
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
     DEFTESTCASE_SLOW(client, 10);
+    DEFTESTCASE_SLOW(client_precompute, 10);
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
     DEFTESTCASE_SLOW(tcp_connection2, 20);
@@ -11,6 +11,11 @@
 #include <sys/types.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #include "helpers.h"
 
 static void rand_bytes(uint8_t *b, size_t blen)
@@ -272,6 +277,95 @@ START_TEST(test_large_data_symmetric)
 }
 END_TEST
 
+START_TEST(test_inplace_detached)
+{
+    unsigned char k[CRYPTO_SHARED_KEY_SIZE];
+    unsigned char buf[CRYPTO_MAC_SIZE + 131];
+    unsigned char c[131];
+    unsigned char mac[CRYPTO_MAC_SIZE];
+    int len;
+
+    encrypt_precompute(bobpk, alicesk, k);
+
+    /* In place: the MAC goes in front of the cipher text like with encrypt_data_symmetric(). */
+    memcpy(buf + CRYPTO_MAC_SIZE, test_m, sizeof(test_m));
+    len = encrypt_data_symmetric_inplace(k, test_nonce, buf, sizeof(test_m));
+    ck_assert_msg(len == sizeof(test_c), "wrong ciphertext length");
+    ck_assert_msg(memcmp(test_c, buf, sizeof(test_c)) == 0, "in place cyphertext doesn't match test vector");
+
+    len = decrypt_data_symmetric_inplace(k, test_nonce, buf, sizeof(buf));
+    ck_assert_msg(len == sizeof(test_m), "wrong plaintext length");
+    ck_assert_msg(memcmp(test_m, buf + CRYPTO_MAC_SIZE, sizeof(test_m)) == 0, "in place decryption failed");
+
+    /* Detached: the MAC and the cipher text are where they are in test_c. */
+    len = encrypt_data_symmetric_detached(k, test_nonce, test_m, sizeof(test_m), c, mac);
+    ck_assert_msg(len == sizeof(test_m), "wrong ciphertext length");
+    ck_assert_msg(memcmp(test_c, mac, CRYPTO_MAC_SIZE) == 0, "detached MAC doesn't match test vector");
+    ck_assert_msg(memcmp(test_c + CRYPTO_MAC_SIZE, c, sizeof(c)) == 0, "detached cyphertext doesn't match test vector");
+
+    /* Decrypting c into itself. */
+    len = decrypt_data_symmetric_detached(k, test_nonce, c, sizeof(c), mac, c);
+    ck_assert_msg(len == sizeof(test_m), "wrong plaintext length");
+    ck_assert_msg(memcmp(test_m, c, sizeof(test_m)) == 0, "detached decryption failed");
+
+    /* Tampering is detected. */
+    memcpy(buf, test_c, sizeof(test_c));
+    buf[sizeof(buf) - 1] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_inplace(k, test_nonce, buf, sizeof(buf)) == -1, "tampering not detected");
+    mac[0] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_detached(k, test_nonce, test_c + CRYPTO_MAC_SIZE, sizeof(c), mac, c) == -1,
+                  "tampering not detected");
+    ck_assert_msg(decrypt_data_symmetric_inplace(k, test_nonce, buf, CRYPTO_MAC_SIZE) == -1, "empty message accepted");
+}
+END_TEST
+
+#define BATCH_PACKETS 4
+
+START_TEST(test_batch)
+{
+    unsigned char k[CRYPTO_SHARED_KEY_SIZE];
+    unsigned char nonces[BATCH_PACKETS][CRYPTO_NONCE_SIZE];
+    unsigned char plain[BATCH_PACKETS][100];
+    unsigned char data[BATCH_PACKETS][CRYPTO_MAC_SIZE + 100];
+    Crypto_Batch_Packet batch[BATCH_PACKETS];
+    uint32_t i;
+
+    new_symmetric_key(k);
+    random_nonce(nonces[0]);
+
+    for (i = 0; i < BATCH_PACKETS; ++i) {
+        if (i != 0) {
+            memcpy(nonces[i], nonces[i - 1], CRYPTO_NONCE_SIZE);
+            increment_nonce(nonces[i]);
+        }
+
+        random_bytes(plain[i], sizeof(plain[i]));
+        encrypt_data_symmetric(k, nonces[i], plain[i], sizeof(plain[i]) - i, data[i]);
+        batch[i].nonce = nonces[i];
+        batch[i].data = data[i];
+        batch[i].length = sizeof(data[i]) - i;
+    }
+
+    /* A bad packet in the middle doesn't stop the ones after it. */
+    data[1][CRYPTO_MAC_SIZE] ^= 1;
+
+    ck_assert_msg(decrypt_data_symmetric_batch(k, batch, BATCH_PACKETS) == BATCH_PACKETS - 1,
+                  "wrong number of packets decrypted");
+
+    for (i = 0; i < BATCH_PACKETS; ++i) {
+        if (i == 1) {
+            ck_assert_msg(batch[i].result == -1, "tampering not detected");
+            continue;
+        }
+
+        ck_assert_msg(batch[i].result == (int32_t)(sizeof(plain[i]) - i), "wrong plaintext length %d", batch[i].result);
+        ck_assert_msg(memcmp(plain[i], data[i] + CRYPTO_MAC_SIZE, batch[i].result) == 0, "batch decryption failed");
+    }
+
+    ck_assert_msg(decrypt_data_symmetric_batch(k, batch, 0) == 0, "empty batch decrypted something");
+}
+END_TEST
+
 static void increment_nonce_number_cmp(uint8_t *nonce, uint32_t num)
 {
     uint32_t num1, num2;
@@ -324,6 +418,57 @@ START_TEST(test_increment_nonce)
 }
 END_TEST
 
+#define RANDOM_VALUES 4096
+
+START_TEST(test_random)
+{
+    uint64_t values[RANDOM_VALUES];
+    uint8_t nonce1[CRYPTO_NONCE_SIZE];
+    uint8_t nonce2[CRYPTO_NONCE_SIZE];
+    uint32_t i, j;
+
+    /* Enough values for several refills of the pool, none repeat. */
+    for (i = 0; i < RANDOM_VALUES; ++i) {
+        values[i] = random_64b();
+
+        if (i % 7 == 0) {
+            random_int();
+        }
+    }
+
+    for (i = 0; i < RANDOM_VALUES; ++i) {
+        for (j = i + 1; j < RANDOM_VALUES; ++j) {
+            ck_assert_msg(values[i] != values[j], "random_64b() repeated a value");
+        }
+    }
+
+    random_nonce(nonce1);
+    random_nonce(nonce2);
+    ck_assert_msg(memcmp(nonce1, nonce2, CRYPTO_NONCE_SIZE) != 0, "random_nonce() repeated a nonce");
+
+#ifndef _WIN32
+    /* A forked child doesn't get the values its parent gets. */
+    int fds[2];
+    ck_assert_msg(pipe(fds) == 0, "pipe failed");
+    const pid_t pid = fork();
+    ck_assert_msg(pid != -1, "fork failed");
+
+    if (pid == 0) {
+        const uint64_t value = random_64b();
+        _exit(write(fds[1], &value, sizeof(value)) == sizeof(value) ? 0 : 1);
+    }
+
+    uint64_t child_value = 0;
+    const uint64_t parent_value = random_64b();
+    ck_assert_msg(read(fds[0], &child_value, sizeof(child_value)) == sizeof(child_value), "child didn't answer");
+    waitpid(pid, NULL, 0);
+    close(fds[0]);
+    close(fds[1]);
+    ck_assert_msg(child_value != parent_value, "forked child got the same random value as its parent");
+#endif
+}
+END_TEST
+
 START_TEST(test_memzero)
 {
     uint8_t src[sizeof(test_c)];
@@ -420,7 +565,10 @@ static Suite *crypto_suite(void)
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
+    DEFTESTCASE(inplace_detached);
+    DEFTESTCASE(batch);
     DEFTESTCASE_SLOW(increment_nonce, 20);
+    DEFTESTCASE(random);
     DEFTESTCASE(memzero);
     DEFTESTCASE(memcmp);
 
@@ -27,25 +27,19 @@ static bool enable_broken_tests = false;
 static void mark_bad(IPPTsPng *ipptp)
 {
     ipptp->timestamp = unix_time() - 2 * BAD_NODE_TIMEOUT;
-    ipptp->hardening.routes_requests_ok = 0;
-    ipptp->hardening.send_nodes_ok = 0;
-    ipptp->hardening.testing_requests = 0;
 }
 
+/* Hardening checks are only kept for the close list, in close_hardening, so
+ * a node of a client list can't be told apart from a good one by them.
+ */
 static void mark_possible_bad(IPPTsPng *ipptp)
 {
     ipptp->timestamp = unix_time();
-    ipptp->hardening.routes_requests_ok = 0;
-    ipptp->hardening.send_nodes_ok = 0;
-    ipptp->hardening.testing_requests = 0;
 }
 
 static void mark_good(IPPTsPng *ipptp)
 {
     ipptp->timestamp = unix_time();
-    ipptp->hardening.routes_requests_ok = (HARDENING_ALL_OK >> 0) & 1;
-    ipptp->hardening.send_nodes_ok = (HARDENING_ALL_OK >> 1) & 1;
-    ipptp->hardening.testing_requests = (HARDENING_ALL_OK >> 2) & 1;
 }
 
 static void mark_all_good(Client_data *list, uint32_t length, uint8_t ipv6)
@@ -677,10 +671,683 @@ START_TEST(test_dht_create_packet)
 }
 END_TEST
 
+#define CACHE_TEST_KEYS 64
+
+START_TEST(test_shared_key_cache)
+{
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t public_keys[CACHE_TEST_KEYS][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t expected[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    Shared_Key_Cache_Stats stats;
+    uint32_t i;
+
+    crypto_new_keypair(self_public_key, self_secret_key);
+
+    for (i = 0; i < CACHE_TEST_KEYS; ++i) {
+        random_bytes(public_keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+    }
+
+    /* Smaller than the number of keys used. */
+    Shared_Key_Cache *cache = shared_key_cache_new(CACHE_TEST_KEYS / 4);
+    ck_assert_msg(cache != NULL, "failed to create the cache");
+    ck_assert_msg(shared_key_cache_capacity(cache) >= CACHE_TEST_KEYS / 4, "capacity too small");
+
+    for (i = 0; i < CACHE_TEST_KEYS; ++i) {
+        shared_key_cache_get(cache, shared_key, self_secret_key, public_keys[i]);
+        encrypt_precompute(public_keys[i], self_secret_key, expected);
+        ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "wrong shared key computed");
+    }
+
+    shared_key_cache_get_stats(cache, &stats);
+    ck_assert_msg(stats.hits == 0 && stats.misses == CACHE_TEST_KEYS, "wrong number of hits %u, misses %u",
+                  (unsigned int)stats.hits, (unsigned int)stats.misses);
+    ck_assert_msg(stats.evictions > 0, "a full cache evicted nothing");
+
+    /* The key used last is always kept, and kept again after the keys it evicted are used. */
+    shared_key_cache_get(cache, shared_key, self_secret_key, public_keys[CACHE_TEST_KEYS - 1]);
+    encrypt_precompute(public_keys[CACHE_TEST_KEYS - 1], self_secret_key, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "wrong shared key cached");
+    shared_key_cache_get_stats(cache, &stats);
+    ck_assert_msg(stats.hits == 1, "recently used key was not cached");
+
+    /* Another secret key must not get the keys of the first one. */
+    uint8_t other_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(self_public_key, other_secret_key);
+    shared_key_cache_get(cache, shared_key, other_secret_key, public_keys[CACHE_TEST_KEYS - 1]);
+    encrypt_precompute(public_keys[CACHE_TEST_KEYS - 1], other_secret_key, expected);
+    ck_assert_msg(memcmp(shared_key, expected, sizeof(expected)) == 0, "key of another secret key returned");
+
+    shared_key_cache_free(cache);
+}
+END_TEST
+
+/* A public key sharing exactly bits leading bits with base. */
+static void key_sharing_bits(uint8_t *public_key, const uint8_t *base, unsigned int bits)
+{
+    random_bytes(public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(public_key, base, bits / 8);
+
+    const uint8_t mask = 0xff << (7 - bits % 8);
+    public_key[bits / 8] = (base[bits / 8] & mask) | (public_key[bits / 8] & ~mask);
+    public_key[bits / 8] ^= 0x80 >> (bits % 8);
+}
+
+START_TEST(test_close_nodes_buckets)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, DHT_DEFAULT_PORT), true);
+    ck_assert_msg(dht != NULL, "failed to create DHT");
+    uint32_t i, j, k;
+
+    /* Half full buckets, so the walk has to look past some of them. */
+    for (i = 0; i < LCLIENT_LENGTH; ++i) {
+        for (j = 0; j < (i % 3) * LCLIENT_NODES / 2; ++j) {
+            uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+            IP_Port ip_port;
+            key_sharing_bits(public_key, dht->self_public_key, i);
+            ip_init(&ip_port.ip, 0);
+            ip_port.ip.ip4.uint32 = net_htonl(0x01000000 + i * LCLIENT_NODES + j);
+            ip_port.port = net_htons(33445);
+            addto_lists(dht, ip_port, public_key);
+            ck_assert_msg(DHT_close_client(dht, public_key) != NULL, "node not found in its bucket");
+        }
+    }
+
+    for (i = 0; i < 1000; ++i) {
+        uint8_t target[CRYPTO_PUBLIC_KEY_SIZE];
+        Node_format nodes[MAX_SENT_NODES];
+        Node_format expected[MAX_SENT_NODES];
+        uint32_t num_expected = 0;
+
+        /* Targets sharing from none to all bits with us. */
+        key_sharing_bits(target, dht->self_public_key, i % (CRYPTO_PUBLIC_KEY_SIZE * 8));
+
+        for (j = 0; j < LCLIENT_LIST; ++j) {
+            const Client_data *client = &dht->close_clientlist[j];
+
+            if (is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+                continue;
+            }
+
+            if (num_expected < MAX_SENT_NODES) {
+                memcpy(expected[num_expected].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+                expected[num_expected].ip_port = client->assoc4.ip_port;
+                ++num_expected;
+            } else {
+                add_to_list(expected, MAX_SENT_NODES, client->public_key, client->assoc4.ip_port, target);
+            }
+        }
+
+        int num = get_close_nodes(dht, target, nodes, 0, 1, 0);
+        ck_assert_msg(num == (int)num_expected, "got %d nodes instead of %u", num, num_expected);
+
+        for (j = 0; j < num_expected; ++j) {
+            for (k = 0; k < (uint32_t)num; ++k) {
+                if (id_equal(expected[j].public_key, nodes[k].public_key)) {
+                    break;
+                }
+            }
+
+            ck_assert_msg(k != (uint32_t)num, "closest node %u to target %u not returned", j, i);
+        }
+    }
+
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+START_TEST(test_precompute_pool)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, DHT_DEFAULT_PORT), true);
+    ck_assert_msg(dht != NULL, "failed to create DHT");
+    Precompute_Pool *pool = new_precompute_pool(2, 4);
+    ck_assert_msg(pool != NULL, "failed to create precompute pool");
+    DHT_set_precompute_pool(dht, pool);
+
+    uint8_t public_keys[8][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t packet[1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + sizeof(uint64_t) +
+                   CRYPTO_MAC_SIZE];
+    IP_Port source;
+    ip_init(&source.ip, 1);
+    source.ip.ip6.uint8[15] = 1;
+    source.port = net_htons(DHT_DEFAULT_PORT);
+    uint32_t i, deferred = 0;
+
+    for (i = 0; i < 8; ++i) {
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(public_keys[i], secret_key);
+        random_bytes(packet, sizeof(packet));
+        packet[0] = NET_PACKET_GET_NODES;
+        memcpy(packet + 1, public_keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        deferred += DHT_defer_packet(dht, source, public_keys[i], packet, sizeof(packet));
+    }
+
+    /* Packets of unknown keys are deferred, or dropped once 4 are pending. */
+    ck_assert_msg(deferred == 8, "packet of unknown key handled right away");
+    ck_assert_msg(precompute_pool_dropped(pool) == 4, "%u packets dropped instead of 4",
+                  (unsigned int)precompute_pool_dropped(pool));
+
+    for (i = 0; i < 100 && !shared_key_cache_contains(dht->shared_keys, dht->self_secret_key, public_keys[3]); ++i) {
+        c_sleep(10);
+        do_precompute_pool(pool, NULL);
+    }
+
+    for (i = 0; i < 4; ++i) {
+        ck_assert_msg(shared_key_cache_contains(dht->shared_keys, dht->self_secret_key, public_keys[i]),
+                      "shared key computed by pool not cached");
+        ck_assert_msg(DHT_defer_packet(dht, source, public_keys[i], packet, sizeof(packet)) == 0,
+                      "packet of known key deferred");
+    }
+
+    ck_assert_msg(!shared_key_cache_contains(dht->shared_keys, dht->self_secret_key, public_keys[4]),
+                  "dropped packet was computed");
+
+    kill_precompute_pool(pool);
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+typedef struct {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t group;
+    uint32_t number;
+} Sort_Test_Entry;
+
+START_TEST(test_sort_list_by_keys)
+{
+    Sort_Test_Entry list[100];
+    List_Sort_Key keys[100];
+    uint8_t base[CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t i, round;
+
+    random_bytes(base, sizeof(base));
+
+    for (i = 0; i < 100; ++i) {
+        random_bytes(list[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        list[i].group = random_int() % 3;
+        list[i].number = i;
+    }
+
+    /* Keys sharing the leading bytes of their distance are ordered too. */
+    memcpy(list[1].public_key, list[0].public_key, 16);
+
+    for (round = 0; round < 3; ++round) {
+        bool seen[100] = {0};
+
+        for (i = 0; i < 100; ++i) {
+            list_sort_key_init(&keys[i], base, list[i].public_key, i, list[i].group);
+        }
+
+        sort_list_by_keys(list, sizeof(Sort_Test_Entry), keys, 100);
+
+        for (i = 0; i < 100; ++i) {
+            ck_assert_msg(!seen[list[i].number], "entry %u moved twice", list[i].number);
+            seen[list[i].number] = 1;
+        }
+
+        for (i = 1; i < 100; ++i) {
+            ck_assert_msg(list[i - 1].group <= list[i].group, "entry of lower group after higher one");
+
+            if (list[i - 1].group == list[i].group) {
+                ck_assert_msg(id_closest(base, list[i - 1].public_key, list[i].public_key) == 2,
+                              "closer entry before farther one");
+            }
+        }
+
+        /* Change one entry, as the lists are between sorts. */
+        random_bytes(list[round * 10].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    }
+}
+END_TEST
+
+/* The byte at a time distance comparison key_distance_cmp() replaced. */
+static int byte_distance_cmp(const uint8_t *target, const uint8_t *key1, const uint8_t *key2)
+{
+    uint32_t i;
+
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        const uint8_t distance1 = target[i] ^ key1[i];
+        const uint8_t distance2 = target[i] ^ key2[i];
+
+        if (distance1 != distance2) {
+            return distance1 < distance2 ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+START_TEST(test_key_distance)
+{
+    uint8_t target[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t key1[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t key2[CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t shared, bit;
+
+    /* Keys first differing at every byte, in and out of the vector halves. */
+    for (shared = 0; shared < CRYPTO_PUBLIC_KEY_SIZE; ++shared) {
+        for (bit = 0; bit < 8; ++bit) {
+            random_bytes(target, sizeof(target));
+            random_bytes(key1, sizeof(key1));
+            memcpy(key2, key1, sizeof(key2));
+            key2[shared] ^= 0x80 >> bit;
+
+            const int expected = byte_distance_cmp(target, key1, key2);
+            ck_assert_msg(key_distance_cmp(target, key1, key2) == expected, "wrong order of keys differing at byte %u",
+                          shared);
+            ck_assert_msg(key_distance_cmp(target, key2, key1) == -expected, "order of keys isn't symmetric");
+            ck_assert_msg(key_common_bits(key1, key2) == shared * 8 + bit, "wrong common bits");
+
+            if (shared < sizeof(uint64_t)) {
+                ck_assert_msg((key_distance_prefix(target, key1) < key_distance_prefix(target, key2)) == (expected < 0),
+                              "prefix order differs from key order");
+            } else {
+                ck_assert_msg(key_distance_prefix(target, key1) == key_distance_prefix(target, key2),
+                              "prefix differs after 8 bytes");
+            }
+        }
+    }
+
+    ck_assert_msg(key_distance_cmp(target, key1, key1) == 0, "key is not as far as itself");
+    ck_assert_msg(key_common_bits(key1, key1) == CRYPTO_PUBLIC_KEY_SIZE * 8, "key doesn't share all bits with itself");
+    ck_assert_msg(key_distance_prefix(key1, key1) == 0, "key is not at distance 0 of itself");
+}
+END_TEST
+
+#define NODE_CACHE_TEST_FILE "dht_test_node_cache"
+
+static void node_cache_test_answers(Node_Cache *cache, const uint8_t *public_key, uint16_t port, uint16_t requests,
+                                    uint16_t answers)
+{
+    IP_Port ip_port;
+    uint16_t i;
+
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(0x01020304);
+    ip_port.port = net_htons(port);
+
+    /* The first answer adds the node, counting its request. */
+    ck_assert_msg(node_cache_answered(cache, public_key, ip_port, 50) == 0, "node not added to the cache");
+
+    for (i = 1; i < requests; ++i) {
+        node_cache_asked(cache, public_key);
+
+        if (i < answers) {
+            ck_assert_msg(node_cache_answered(cache, public_key, ip_port, 50) == 0, "node not in the cache");
+        }
+    }
+}
+
+START_TEST(test_node_cache)
+{
+    uint8_t keys[4][CRYPTO_PUBLIC_KEY_SIZE];
+    Node_Cache_Entry entries[4];
+    uint32_t i;
+
+    for (i = 0; i < 4; ++i) {
+        random_bytes(keys[i], sizeof(keys[i]));
+    }
+
+    unix_time_update();
+    remove(NODE_CACHE_TEST_FILE);
+
+    Node_Cache *cache = node_cache_open(NODE_CACHE_TEST_FILE, 8);
+    ck_assert_msg(cache != NULL, "failed to create the node cache");
+    ck_assert_msg(node_cache_count(cache) == 0, "new cache isn't empty");
+
+    node_cache_test_answers(cache, keys[0], 1000, 10, 10);
+    node_cache_test_answers(cache, keys[1], 1001, 10, 2);
+    node_cache_test_answers(cache, keys[2], 1002, 1, 1);
+    node_cache_close(cache);
+
+    /* The nodes are still there after a restart, the most reliable first. */
+    cache = node_cache_open(NODE_CACHE_TEST_FILE, 8);
+    ck_assert_msg(cache != NULL, "failed to open the node cache");
+    ck_assert_msg(node_cache_count(cache) == 3, "cache has %u nodes instead of 3", node_cache_count(cache));
+    ck_assert_msg(node_cache_best(cache, entries, 4) == 3, "wrong number of best nodes");
+    ck_assert_msg(public_key_cmp(entries[0].public_key, keys[0]) == 0, "most reliable node isn't first");
+    ck_assert_msg(public_key_cmp(entries[1].public_key, keys[2]) == 0, "new node isn't second");
+    ck_assert_msg(public_key_cmp(entries[2].public_key, keys[1]) == 0, "unreliable node isn't last");
+    ck_assert_msg(entries[0].requests == 10 && entries[0].answers == 10, "wrong counts %u/%u",
+                  entries[0].answers, entries[0].requests);
+    ck_assert_msg(entries[0].ip_port.ip.family == AF_INET && entries[0].ip_port.ip.ip4.uint32 == net_htonl(0x01020304)
+                  && entries[0].ip_port.port == net_htons(1000), "wrong address");
+    ck_assert_msg(entries[0].rtt_ms == 50, "wrong round trip time %u", entries[0].rtt_ms);
+    node_cache_close(cache);
+
+    /* A smaller cache keeps the first records, a new node replaces the worst. */
+    cache = node_cache_open(NODE_CACHE_TEST_FILE, 2);
+    ck_assert_msg(cache != NULL, "failed to open the node cache");
+    ck_assert_msg(node_cache_count(cache) == 2, "cache has %u nodes instead of 2", node_cache_count(cache));
+    node_cache_test_answers(cache, keys[3], 1003, 1, 1);
+    ck_assert_msg(node_cache_count(cache) == 2, "full cache grew");
+    ck_assert_msg(node_cache_best(cache, entries, 4) == 2, "wrong number of best nodes");
+    ck_assert_msg(public_key_cmp(entries[0].public_key, keys[0]) == 0, "best node was replaced");
+    ck_assert_msg(public_key_cmp(entries[1].public_key, keys[3]) == 0, "worst node wasn't replaced");
+    node_cache_close(cache);
+
+    /* Files that aren't node caches of this version are started over. */
+    FILE *file = fopen(NODE_CACHE_TEST_FILE, "r+b");
+    ck_assert_msg(file != NULL, "cache file is gone");
+    fputc('x', file);
+    fclose(file);
+
+    cache = node_cache_open(NODE_CACHE_TEST_FILE, 8);
+    ck_assert_msg(cache != NULL, "failed to open the node cache");
+    ck_assert_msg(node_cache_count(cache) == 0, "nodes kept from an invalid file");
+    node_cache_close(cache);
+    remove(NODE_CACHE_TEST_FILE);
+}
+END_TEST
+
+#define NODE_CACHE_FULL_SIZE 8
+
+static bool node_cache_test_has(const Node_Cache *cache, const uint8_t *public_key)
+{
+    Node_Cache_Entry entries[NODE_CACHE_FULL_SIZE];
+    const uint32_t num = node_cache_best(cache, entries, NODE_CACHE_FULL_SIZE);
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (public_key_cmp(entries[i].public_key, public_key) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+START_TEST(test_node_cache_full)
+{
+    uint8_t keys[NODE_CACHE_FULL_SIZE][CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t new_key[CRYPTO_PUBLIC_KEY_SIZE];
+    IP_Port ip_port;
+    uint32_t i;
+
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(0x01020304);
+    ip_port.port = net_htons(2000);
+    random_bytes(new_key, sizeof(new_key));
+    unix_time_update();
+    remove(NODE_CACHE_TEST_FILE);
+
+    Node_Cache *cache = node_cache_open(NODE_CACHE_TEST_FILE, NODE_CACHE_FULL_SIZE);
+    ck_assert_msg(cache != NULL, "failed to create the node cache");
+
+    for (i = 0; i < NODE_CACHE_FULL_SIZE; ++i) {
+        random_bytes(keys[i], sizeof(keys[i]));
+        node_cache_test_answers(cache, keys[i], 1000 + i, 10, 10);
+    }
+
+    /* Every cached node answered more reliably than a new one, which is turned
+     * away however often it answers.
+     */
+    for (i = 0; i < NODE_CACHE_FULL_SIZE * 2; ++i) {
+        ck_assert_msg(node_cache_answered(cache, new_key, ip_port, 50) == -1, "new node replaced a better one");
+    }
+
+    ck_assert_msg(node_cache_count(cache) == NODE_CACHE_FULL_SIZE, "full cache changed size");
+    ck_assert_msg(!node_cache_test_has(cache, new_key), "rejected node is in the cache");
+
+    /* A node that stopped answering is found and replaced within a round of
+     * the records.
+     */
+    for (i = 0; i < 100; ++i) {
+        node_cache_asked(cache, keys[5]);
+    }
+
+    for (i = 0; i < NODE_CACHE_FULL_SIZE; ++i) {
+        if (node_cache_answered(cache, new_key, ip_port, 50) == 0) {
+            break;
+        }
+    }
+
+    ck_assert_msg(i < NODE_CACHE_FULL_SIZE, "unreliable node wasn't replaced");
+    ck_assert_msg(node_cache_count(cache) == NODE_CACHE_FULL_SIZE, "full cache changed size");
+    ck_assert_msg(node_cache_test_has(cache, new_key), "new node isn't in the cache");
+    ck_assert_msg(!node_cache_test_has(cache, keys[5]), "unreliable node is still in the cache");
+
+    node_cache_close(cache);
+    remove(NODE_CACHE_TEST_FILE);
+}
+END_TEST
+
+static DHT *new_test_DHT(uint16_t port)
+{
+    IP ip;
+    ip_init(&ip, 1);
+
+    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, port), true);
+    ck_assert_msg(dht != NULL, "failed to create a DHT");
+    return dht;
+}
+
+static void kill_test_DHT(DHT *dht)
+{
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+
+static IP_Port test_DHT_ip_port(const DHT *dht)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 1);
+    ip_port.ip.ip6.uint8[15] = 1;
+    ip_port.port = dht->net->port;
+    return ip_port;
+}
+
+/* return seconds it took until dht was connected through the other DHT. */
+static unsigned int wait_connected(DHT *dht, DHT *other)
+{
+    const uint64_t start = unix_time();
+
+    while (!DHT_isconnected(dht)) {
+        ck_assert_msg(unix_time() - start < 20, "DHT didn't connect");
+
+        networking_poll(other->net, NULL);
+        do_DHT(other);
+        networking_poll(dht->net, NULL);
+        do_DHT(dht);
+        c_sleep(50);
+    }
+
+    return unix_time() - start;
+}
+
+START_TEST(test_node_cache_warm_start)
+{
+    remove(NODE_CACHE_TEST_FILE);
+
+    DHT *bootstrap = new_test_DHT(DHT_DEFAULT_PORT + NUM_DHT);
+    DHT *dht = new_test_DHT(DHT_DEFAULT_PORT + NUM_DHT + 1);
+    Node_Cache *cache = node_cache_open(NODE_CACHE_TEST_FILE, NODE_CACHE_DEFAULT_SIZE);
+    ck_assert_msg(cache != NULL, "failed to create the node cache");
+    DHT_set_node_cache(dht, cache);
+
+    DHT_bootstrap(dht, test_DHT_ip_port(bootstrap), bootstrap->self_public_key);
+    wait_connected(dht, bootstrap);
+    ck_assert_msg(node_cache_count(cache) == 1, "answering node not cached");
+
+    kill_test_DHT(dht);
+    node_cache_close(cache);
+
+    /* Restarted without bootstrapping, it finds the node in the cache. */
+    dht = new_test_DHT(DHT_DEFAULT_PORT + NUM_DHT + 1);
+    cache = node_cache_open(NODE_CACHE_TEST_FILE, NODE_CACHE_DEFAULT_SIZE);
+    ck_assert_msg(cache != NULL, "failed to open the node cache");
+    DHT_set_node_cache(dht, cache);
+    ck_assert_msg(dht->loaded_num_nodes == 1, "cached node not loaded");
+
+    printf("Connected %u seconds after a restart\n", wait_connected(dht, bootstrap));
+
+    kill_test_DHT(dht);
+    kill_test_DHT(bootstrap);
+    node_cache_close(cache);
+    remove(NODE_CACHE_TEST_FILE);
+}
+END_TEST
+
+#define INDEX_MAP_TEST_KEYS 1000
+
+START_TEST(test_index_map)
+{
+    /* An odd key size, so keys don't fill whole hash chunks. */
+    uint8_t keys[INDEX_MAP_TEST_KEYS][13];
+    bool added[INDEX_MAP_TEST_KEYS] = {0};
+    Index_Map map;
+    uint32_t i, j;
+
+    ck_assert_msg(index_map_init(&map, sizeof(keys[0]), 0) == 0, "failed to create the map");
+
+    for (i = 0; i < INDEX_MAP_TEST_KEYS; ++i) {
+        random_bytes(keys[i], sizeof(keys[i]));
+    }
+
+    for (j = 0; j < 20000; ++j) {
+        i = random_int() % INDEX_MAP_TEST_KEYS;
+
+        if (added[i]) {
+            ck_assert_msg(index_map_add(&map, keys[i], i) == -1, "key added twice");
+            ck_assert_msg(index_map_remove(&map, keys[i]) == 0, "failed to remove key");
+        } else {
+            ck_assert_msg(index_map_remove(&map, keys[i]) == -1, "removed key that wasn't added");
+            ck_assert_msg(index_map_add(&map, keys[i], i) == 0, "failed to add key");
+        }
+
+        added[i] = !added[i];
+    }
+
+    uint32_t count = 0;
+
+    for (i = 0; i < INDEX_MAP_TEST_KEYS; ++i) {
+        ck_assert_msg(index_map_find(&map, keys[i]) == (added[i] ? (int32_t)i : -1), "wrong id for key %u", i);
+        count += added[i];
+    }
+
+    ck_assert_msg(map.count == count, "map has %u keys instead of %u", map.count, count);
+
+    for (i = 0; i < INDEX_MAP_TEST_KEYS; ++i) {
+        if (added[i]) {
+            ck_assert_msg(index_map_update(&map, keys[i], i + 1) == 0, "failed to update key");
+            ck_assert_msg(index_map_find(&map, keys[i]) == (int32_t)i + 1, "key not updated");
+        } else {
+            ck_assert_msg(index_map_update(&map, keys[i], i + 1) == -1, "updated key that isn't there");
+        }
+    }
+
+    index_map_free(&map);
+}
+END_TEST
+
+START_TEST(test_friends_index)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    DHT *dht = new_DHT(NULL, new_networking(NULL, ip, DHT_DEFAULT_PORT), true);
+    ck_assert_msg(dht != NULL, "failed to create DHT");
+
+    uint8_t public_keys[64][CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t i;
+
+    for (i = 0; i < 64; ++i) {
+        random_bytes(public_keys[i], CRYPTO_PUBLIC_KEY_SIZE);
+        ck_assert_msg(DHT_addfriend(dht, public_keys[i], 0, 0, 0, 0) == 0, "failed to add friend");
+    }
+
+    /* Deleting moves the last friend into the hole, the index must follow. */
+    for (i = 0; i < 64; i += 3) {
+        ck_assert_msg(DHT_delfriend(dht, public_keys[i], 0) == 0, "failed to delete friend");
+    }
+
+    for (i = 0; i < 64; ++i) {
+        const int num = friend_number(dht, public_keys[i]);
+
+        if (i % 3 == 0) {
+            ck_assert_msg(num == -1, "deleted friend %u still found", i);
+        } else {
+            ck_assert_msg(num != -1 && id_equal(dht->friends_list[num].public_key, public_keys[i]),
+                          "friend %u not found at its index", i);
+        }
+    }
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        ck_assert_msg(friend_number(dht, dht->friends_list[i].public_key) == (int)i, "friend at wrong index");
+    }
+
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+START_TEST(test_ping_array)
+{
+    Ping_Array array;
+    uint8_t data[64], out[64];
+    uint64_t ping_ids[16];
+    uint32_t i;
+
+    ck_assert_msg(ping_array_init(&array, 8, 10, sizeof(data)) == 0, "failed to init ping array");
+    random_bytes(data, sizeof(data));
+
+    ck_assert_msg(ping_array_add(&array, data, sizeof(data) + 1) == 0, "added data larger than the slots");
+
+    const uint64_t ping_id = ping_array_add(&array, data, 10);
+    ck_assert_msg(ping_id != 0, "failed to add");
+    ck_assert_msg(ping_array_check(out, 9, &array, ping_id) == -1, "copied data into a buffer too small");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id + 8) == -1, "wrong ping id accepted");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id) == 10, "failed to check");
+    ck_assert_msg(memcmp(out, data, 10) == 0, "wrong data");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id) == -1, "ping id accepted twice");
+
+    /* Once the array comes around, the oldest entries are written over. */
+    for (i = 0; i < 16; ++i) {
+        data[0] = i;
+        ping_ids[i] = ping_array_add(&array, data, sizeof(data));
+        ck_assert_msg(ping_ids[i] != 0, "failed to add");
+    }
+
+    for (i = 0; i < 16; ++i) {
+        const int length = ping_array_check(out, sizeof(out), &array, ping_ids[i]);
+
+        if (i < 8) {
+            ck_assert_msg(length == -1, "entry %u not written over", i);
+        } else {
+            ck_assert_msg(length == sizeof(data) && out[0] == i, "entry %u lost", i);
+        }
+    }
+
+    ping_array_free_all(&array);
+    ck_assert_msg(ping_array_init(&array, 8, 10, 0) == -1, "created ping array without data");
+}
+END_TEST
+
 static Suite *dht_suite(void)
 {
     Suite *s = suite_create("DHT");
     DEFTESTCASE(dht_create_packet);
+    DEFTESTCASE(shared_key_cache);
+    DEFTESTCASE(close_nodes_buckets);
+    DEFTESTCASE(precompute_pool);
+    DEFTESTCASE(sort_list_by_keys);
+    DEFTESTCASE(key_distance);
+    DEFTESTCASE(node_cache);
+    DEFTESTCASE(node_cache_full);
+    DEFTESTCASE_SLOW(node_cache_warm_start, 30);
+    DEFTESTCASE(index_map);
+    DEFTESTCASE(friends_index);
+    DEFTESTCASE(ping_array);
 
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
@@ -166,6 +166,36 @@ START_TEST(test_m_addfriend)
 }
 END_TEST
 
+START_TEST(test_getfriend_id_after_delfriend)
+{
+    uint8_t public_keys[32][CRYPTO_PUBLIC_KEY_SIZE];
+    int32_t friendnumbers[32];
+    uint32_t i;
+
+    for (i = 0; i < 32; ++i) {
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(public_keys[i], secret_key);
+        friendnumbers[i] = m_addfriend_norequest(m, public_keys[i]);
+        ck_assert_msg(friendnumbers[i] >= 0, "m_addfriend_norequest failed: %d", friendnumbers[i]);
+    }
+
+    for (i = 0; i < 32; i += 2) {
+        ck_assert_msg(m_delfriend(m, friendnumbers[i]) == 0, "m_delfriend failed");
+    }
+
+    for (i = 0; i < 32; ++i) {
+        const int32_t expected = i % 2 ? friendnumbers[i] : -1;
+        ck_assert_msg(getfriend_id(m, public_keys[i]) == expected, "getfriend_id returned %d instead of %d",
+                      getfriend_id(m, public_keys[i]), expected);
+    }
+
+    /* A deleted friend can be added again, and the numbers freed are reused. */
+    ck_assert_msg(m_addfriend_norequest(m, public_keys[0]) == getfriend_id(m, public_keys[0]),
+                  "friend added again can't be found");
+    ck_assert_msg(getfriend_id(m, (const uint8_t *)friend_id) == friend_id_num, "default friend lost");
+}
+END_TEST
+
 START_TEST(test_setname)
 {
     const char *good_name = "consensualCorn";
@@ -330,6 +360,7 @@ static Suite *messenger_suite(void)
     DEFTESTCASE(m_friend_exists);
     DEFTESTCASE(m_get_friend_connectionstatus);
     DEFTESTCASE(m_delfriend);
+    DEFTESTCASE(getfriend_id_after_delfriend);
 
     DEFTESTCASE(setname);
     DEFTESTCASE(getname);
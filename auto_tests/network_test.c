@@ -1,10 +1,14 @@
+#define _XOPEN_SOURCE 600
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include <check.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -14,6 +18,13 @@
 
 #include "helpers.h"
 
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
 START_TEST(test_addr_resolv_localhost)
 {
 #ifdef __CYGWIN__
@@ -135,12 +146,678 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+START_TEST(test_ipport_pack_key)
+{
+    uint8_t key1[IPPORT_KEY_SIZE], key2[IPPORT_KEY_SIZE];
+    IP_Port ip_port1, ip_port2;
+
+    /* The bytes the struct has besides the address and port don't matter. */
+    memset(&ip_port1, 0x55, sizeof(IP_Port));
+    memset(&ip_port2, 0xaa, sizeof(IP_Port));
+    ip_port1.ip.family = AF_INET;
+    ip_port1.ip.ip4.uint32 = net_htonl(0x7F000001);
+    ip_port1.port = net_htons(33445);
+    ip_port2.ip.family = AF_INET;
+    ip_port2.ip.ip4.uint32 = net_htonl(0x7F000001);
+    ip_port2.port = net_htons(33445);
+
+    ipport_pack_key(key1, &ip_port1);
+    ipport_pack_key(key2, &ip_port2);
+    ck_assert_msg(memcmp(key1, key2, IPPORT_KEY_SIZE) == 0, "keys of equal IPv4 addresses differ");
+
+    ip_port2.port = net_htons(33446);
+    ipport_pack_key(key2, &ip_port2);
+    ck_assert_msg(memcmp(key1, key2, IPPORT_KEY_SIZE) != 0, "keys of different ports are equal");
+
+    memset(&ip_port2, 0, sizeof(IP_Port));
+    ip_port2.ip.family = AF_INET6;
+    ip_port2.ip.ip6.uint32[0] = net_htonl(0x7F000001);
+    ip_port2.port = net_htons(33445);
+    ipport_pack_key(key2, &ip_port2);
+    ck_assert_msg(memcmp(key1, key2, IPPORT_KEY_SIZE) != 0, "keys of different families are equal");
+
+    memcpy(&ip_port1, &ip_port2, sizeof(IP_Port));
+    ip_port1.ip.ip6.uint8[15] = 1;
+    ipport_pack_key(key1, &ip_port1);
+    ck_assert_msg(memcmp(key1, key2, IPPORT_KEY_SIZE) != 0, "keys of different IPv6 addresses are equal");
+}
+END_TEST
+
+static unsigned int batch_packets_received;
+
+static int handle_batch_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                    void *userdata)
+{
+    if (length == 100 && packet[99] == packet[1]) {
+        ++batch_packets_received;
+    }
+
+    return 0;
+}
+
+START_TEST(test_batching)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "Failed to create networking instances.");
+
+    ck_assert_msg(networking_set_batching(net1, true) == 0, "Failed to enable batching.");
+    ck_assert_msg(networking_set_batching(net2, true) == 0, "Failed to enable batching.");
+    networking_registerhandler(net2, 254, &handle_batch_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    /* More than one batch, so the queue has to be flushed while sending. */
+    uint8_t packet[100] = {254};
+    unsigned int i;
+
+    for (i = 0; i < NET_BATCH_SIZE * 2 + 3; ++i) {
+        packet[1] = i;
+        packet[99] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, sizeof(packet)) == sizeof(packet), "Failed to queue packet %u.", i);
+    }
+
+    networking_flush(net1);
+
+    for (i = 0; i < 50 && batch_packets_received != NET_BATCH_SIZE * 2 + 3; ++i) {
+        networking_poll(net2, NULL);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(batch_packets_received == NET_BATCH_SIZE * 2 + 3, "Received %u packets, expected %u.",
+                  batch_packets_received, NET_BATCH_SIZE * 2 + 3);
+
+    ck_assert_msg(networking_set_batching(net1, false) == 0, "Failed to disable batching.");
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+#define THREAD_TEST_PACKETS 200
+
+typedef struct {
+    Networking_Core *net;
+    IP_Port ip_port;
+    uint8_t id;
+} Batch_Sender;
+
+static void *batch_sender_thread(void *arg)
+{
+    const Batch_Sender *sender = (const Batch_Sender *)arg;
+    uint8_t packet[100] = {254};
+    unsigned int i;
+
+    for (i = 0; i < THREAD_TEST_PACKETS; ++i) {
+        packet[1] = sender->id + i;
+        packet[99] = sender->id + i;
+
+        if (sendpacket(sender->net, sender->ip_port, packet, sizeof(packet)) != sizeof(packet)) {
+            return (void *)1;
+        }
+    }
+
+    return NULL;
+}
+
+/* Packets are queued from another thread while this one queues and flushes. */
+START_TEST(test_batching_threads)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "Failed to create networking instances.");
+
+    ck_assert_msg(networking_set_batching(net1, true) == 0, "Failed to enable batching.");
+    ck_assert_msg(networking_set_batching(net2, true) == 0, "Failed to enable batching.");
+    networking_registerhandler(net2, 254, &handle_batch_test_packet, NULL);
+    batch_packets_received = 0;
+
+    Batch_Sender senders[2];
+    senders[0].net = net1;
+    senders[0].ip_port.ip = ip;
+    senders[0].ip_port.port = net2->port;
+    senders[0].id = 0;
+    senders[1] = senders[0];
+    senders[1].id = 128;
+
+    pthread_t thread;
+    ck_assert_msg(pthread_create(&thread, NULL, batch_sender_thread, &senders[1]) == 0, "Failed to start thread.");
+    ck_assert_msg(batch_sender_thread(&senders[0]) == NULL, "Failed to queue a packet.");
+
+    unsigned int i;
+
+    for (i = 0; i < THREAD_TEST_PACKETS; ++i) {
+        networking_flush(net1);
+        networking_poll(net2, NULL);
+    }
+
+    void *ret;
+    pthread_join(thread, &ret);
+    ck_assert_msg(ret == NULL, "Failed to queue a packet from the thread.");
+    networking_flush(net1);
+
+    for (i = 0; i < 50 && batch_packets_received != THREAD_TEST_PACKETS * 2; ++i) {
+        networking_poll(net2, NULL);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(batch_packets_received == THREAD_TEST_PACKETS * 2, "Received %u packets, expected %u.",
+                  batch_packets_received, THREAD_TEST_PACKETS * 2);
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+static unsigned int shard_packets_received;
+
+static int handle_shard_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                    void *userdata)
+{
+    ++shard_packets_received;
+    return 0;
+}
+
+START_TEST(test_shards)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net = new_networking_reuseport(NULL, ip, 33600, NULL);
+
+    if (net == NULL) {
+        /* SO_REUSEPORT is not supported here. */
+        return;
+    }
+
+    networking_registerhandler(net, 254, &handle_shard_test_packet, NULL);
+    ck_assert_msg(networking_start_shards(net, ip, 3, NULL) == 0, "Failed to start shards.");
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net->port;
+
+    /* Packets from different source ports end up on different sockets. */
+    enum { NUM_SENDERS = 16 };
+    Networking_Core *senders[NUM_SENDERS];
+    uint8_t packet[32] = {254};
+    unsigned int i;
+
+    for (i = 0; i < NUM_SENDERS; ++i) {
+        senders[i] = new_networking(NULL, ip, 33700);
+        ck_assert_msg(senders[i] != NULL, "Failed to create sender %u.", i);
+        ck_assert_msg(sendpacket(senders[i], ip_port, packet, sizeof(packet)) == sizeof(packet), "Failed to send.");
+    }
+
+    unsigned int received = 0;
+
+    for (i = 0; i < 50 && received != NUM_SENDERS; ++i) {
+        c_sleep(10);
+
+        networking_lock(net);
+        networking_poll(net, NULL);
+        received = shard_packets_received;
+        networking_unlock(net);
+    }
+
+    ck_assert_msg(received == NUM_SENDERS, "Received %u packets, expected %u.", received, NUM_SENDERS);
+
+    for (i = 0; i < NUM_SENDERS; ++i) {
+        kill_networking(senders[i]);
+    }
+
+    kill_networking(net);
+}
+END_TEST
+
+static int handle_stats_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+                                    void *userdata)
+{
+    return 0;
+}
+
+START_TEST(test_stats)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "Failed to create networking instances.");
+
+    networking_registerhandler(net2, 253, &handle_stats_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    uint8_t packet[50] = {253};
+    unsigned int i;
+
+    for (i = 0; i < 5; ++i) {
+        ck_assert_msg(sendpacket(net1, ip_port, packet, sizeof(packet)) == sizeof(packet), "Failed to send packet %u.", i);
+    }
+
+    /* No handler is registered for this one. */
+    packet[0] = 252;
+    ck_assert_msg(sendpacket(net1, ip_port, packet, 10) == 10, "Failed to send packet.");
+
+    Net_Packet_Stats stats;
+
+#ifdef NET_STATS
+
+    for (i = 0; i < 50; ++i) {
+        networking_poll(net2, NULL);
+        ck_assert_msg(networking_get_packet_stats(net2, 252, &stats) == 0, "Failed to get stats.");
+
+        if (stats.recv_packets == 1) {
+            break;
+        }
+
+        c_sleep(10);
+    }
+
+    ck_assert_msg(networking_get_packet_stats(net1, 253, &stats) == 0, "Failed to get stats.");
+    ck_assert_msg(stats.sent_packets == 5 && stats.sent_bytes == 5 * sizeof(packet) && stats.send_failed == 0,
+                  "Wrong send counters: %u packets, %u bytes.", (unsigned)stats.sent_packets, (unsigned)stats.sent_bytes);
+    ck_assert_msg(stats.recv_packets == 0, "Counted received packets on the sender.");
+
+    ck_assert_msg(networking_get_packet_stats(net2, 253, &stats) == 0, "Failed to get stats.");
+    ck_assert_msg(stats.recv_packets == 5 && stats.recv_bytes == 5 * sizeof(packet) && stats.recv_unhandled == 0,
+                  "Wrong receive counters: %u packets, %u bytes.", (unsigned)stats.recv_packets, (unsigned)stats.recv_bytes);
+
+    uint64_t calls = 0;
+
+    for (i = 0; i < NET_STATS_HISTOGRAM_SIZE; ++i) {
+        calls += stats.handler_histogram[i];
+    }
+
+    ck_assert_msg(calls == 5, "Handler histogram counts %u calls, expected 5.", (unsigned)calls);
+
+    ck_assert_msg(networking_get_packet_stats(net2, 252, &stats) == 0, "Failed to get stats.");
+    ck_assert_msg(stats.recv_packets == 1 && stats.recv_unhandled == 1, "Unhandled packet was not counted.");
+#else
+    ck_assert_msg(networking_get_packet_stats(net2, 253, &stats) == -1, "Got stats without NET_STATS.");
+#endif
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+/* Packets are numbered in data[1], and every other byte of packet i is i. */
+static unsigned int offload_packets_received;
+static unsigned int offload_packets_in_order;
+
+static int handle_offload_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                      void *userdata)
+{
+    const uint16_t expected_length = packet[1] == 2 * NET_BATCH_SIZE - 1 ? 300 : 1200;
+    uint16_t i;
+
+    if (length != expected_length) {
+        return 0;
+    }
+
+    for (i = 2; i < length; ++i) {
+        if (packet[i] != packet[1]) {
+            return 0;
+        }
+    }
+
+    if (packet[1] == offload_packets_received) {
+        ++offload_packets_in_order;
+    }
+
+    ++offload_packets_received;
+    return 0;
+}
+
+START_TEST(test_offload)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, 33445);
+    Networking_Core *net2 = new_networking(NULL, ip, 33445);
+    ck_assert_msg(net1 != NULL && net2 != NULL, "Failed to create networking instances.");
+
+    ck_assert_msg(networking_set_offload(net1, true) == -1, "Offload can't be enabled without batching.");
+    ck_assert_msg(networking_set_batching(net1, true) == 0, "Failed to enable batching.");
+    ck_assert_msg(networking_set_batching(net2, true) == 0, "Failed to enable batching.");
+
+    if (networking_set_offload(net1, true) != 0 || networking_set_offload(net2, true) != 0) {
+        printf("UDP offload is not supported here, skipping.\n");
+        kill_networking(net1);
+        kill_networking(net2);
+        return;
+    }
+
+    networking_registerhandler(net2, 254, &handle_offload_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    /* Two batches of equal sized packets, the last one shorter. */
+    uint8_t packet[1200];
+    unsigned int i;
+
+    for (i = 0; i < 2 * NET_BATCH_SIZE; ++i) {
+        const uint16_t length = i == 2 * NET_BATCH_SIZE - 1 ? 300 : 1200;
+        memset(packet, i, sizeof(packet));
+        packet[0] = 254;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, length) == length, "Failed to queue packet %u.", i);
+    }
+
+    networking_flush(net1);
+
+    for (i = 0; i < 50 && offload_packets_received != 2 * NET_BATCH_SIZE; ++i) {
+        networking_poll(net2, NULL);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(offload_packets_received == 2 * NET_BATCH_SIZE, "Received %u packets, expected %u.",
+                  offload_packets_received, 2 * NET_BATCH_SIZE);
+    ck_assert_msg(offload_packets_in_order == 2 * NET_BATCH_SIZE, "Packets were reordered.");
+
+    ck_assert_msg(networking_set_offload(net2, false) == 0, "Failed to disable offload.");
+    ck_assert_msg(networking_set_batching(net1, false) == 0, "Failed to disable batching.");
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+/* A backend that hands every packet to the one instance it belongs to. */
+typedef struct {
+    IP_Port from;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    int length;
+} Test_Mailbox;
+
+static Test_Mailbox test_mailbox;
+
+static int loopback_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    const IP_Port *self = (const IP_Port *)object;
+
+    if (!ipport_equal(&ip_port, self) || test_mailbox.length != 0) {
+        return -1;
+    }
+
+    test_mailbox.from = *self;
+    memcpy(test_mailbox.data, data, length);
+    test_mailbox.length = length;
+    return length;
+}
+
+static int loopback_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t max_length)
+{
+    int length = test_mailbox.length;
+
+    if (length == 0 || length > max_length) {
+        return 0;
+    }
+
+    *ip_port = test_mailbox.from;
+    memcpy(data, test_mailbox.data, length);
+    test_mailbox.length = 0;
+    return length;
+}
+
+static const Net_Backend loopback_backend = {
+    loopback_send,
+    loopback_recv,
+};
+
+static unsigned int backend_packets_received;
+
+static int handle_backend_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+                                      void *userdata)
+{
+    if (len == 20 && data[19] == 19) {
+        ++backend_packets_received;
+    }
+
+    return 0;
+}
+
+static uint64_t test_clock(void *object)
+{
+    return *(const uint64_t *)object;
+}
+
+START_TEST(test_backend)
+{
+    IP_Port self;
+    ip_init(&self.ip, 0);
+    self.ip.ip4.uint32 = net_htonl(0x0B000001);
+    self.port = net_htons(33445);
+
+    Networking_Core *net = new_networking_backend(NULL, self, &loopback_backend, &self);
+    ck_assert_msg(net != NULL, "Failed to create networking instance.");
+    ck_assert_msg(net->port == self.port, "Wrong port.");
+    ck_assert_msg(networking_set_batching(net, true) == -1, "Batching can't be enabled with a backend.");
+
+    networking_registerhandler(net, 254, &handle_backend_test_packet, NULL);
+
+    uint8_t packet[20] = {254};
+    packet[19] = 19;
+    ck_assert_msg(sendpacket(net, self, packet, sizeof(packet)) == sizeof(packet), "Failed to send packet.");
+
+    IP_Port other = self;
+    other.port = net_htons(33446);
+    ck_assert_msg(sendpacket(net, other, packet, sizeof(packet)) == -1, "Backend error was not returned.");
+
+    networking_poll(net, NULL);
+    ck_assert_msg(backend_packets_received == 1, "Packet was not received through the backend.");
+
+    kill_networking(net);
+
+    uint64_t now = 12345678;
+    current_time_monotonic_set_callback(test_clock, &now);
+    ck_assert_msg(current_time_monotonic() == 12345678, "Clock callback was not used.");
+    now += 1000;
+    ck_assert_msg(current_time_monotonic() == 12346678, "Clock callback was not used.");
+    current_time_monotonic_set_callback(NULL, NULL);
+    ck_assert_msg(current_time_monotonic() != 12346678, "Clock callback was not removed.");
+}
+END_TEST
+
+#define CAPTURE_TEST_FILE "network_test_capture.tmp"
+
+static unsigned int capture_packets_received;
+
+static int handle_capture_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+                                      void *userdata)
+{
+    if (len >= 2 && data[len - 1] == (uint8_t)len) {
+        ++capture_packets_received;
+    }
+
+    return 0;
+}
+
+START_TEST(test_capture)
+{
+    IP_Port self;
+    ip_init(&self.ip, 0);
+    self.ip.ip4.uint32 = net_htonl(0x0B000001);
+    self.port = net_htons(33445);
+
+    IP_Port other;
+    ip_init(&other.ip, 1);
+    other.ip.ip6.uint8[0] = 0x20;
+    other.ip.ip6.uint8[15] = 0x01;
+    other.port = net_htons(33446);
+
+    Networking_Core *net = new_networking_backend(NULL, self, &loopback_backend, &self);
+    ck_assert_msg(net != NULL, "Failed to create networking instance.");
+    networking_registerhandler(net, 252, &handle_capture_test_packet, NULL);
+
+    ck_assert_msg(networking_capture_start(net, CAPTURE_TEST_FILE) == 0, "Failed to start capture.");
+
+    uint8_t packet[MAX_UDP_PACKET_SIZE] = {252};
+    uint16_t length;
+
+    /* Received through the backend and injected ones are captured alike. */
+    for (length = 2; length < 100; length += 7) {
+        packet[length - 1] = (uint8_t)length;
+
+        if (length % 2) {
+            ck_assert_msg(sendpacket(net, self, packet, length) == length, "Failed to send packet.");
+            networking_poll(net, NULL);
+        } else {
+            networking_inject_packet(net, other, packet, length, NULL);
+        }
+    }
+
+    networking_capture_stop(net);
+    ck_assert_msg(capture_packets_received == 14, "Expected 14 packets, got %u.", capture_packets_received);
+
+    Net_Capture_Reader *reader = net_capture_open(CAPTURE_TEST_FILE);
+    ck_assert_msg(reader != NULL, "Failed to open capture.");
+
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint64_t time, last_time = 0;
+    IP_Port ip_port;
+    int res;
+
+    for (length = 2; length < 100; length += 7) {
+        res = net_capture_read(reader, &time, &ip_port, data, sizeof(data));
+        ck_assert_msg(res == length, "Expected a packet of length %u, got %d.", length, res);
+        ck_assert_msg(data[0] == 252 && data[length - 1] == length, "Wrong packet data.");
+        ck_assert_msg(ipport_equal(&ip_port, length % 2 ? &self : &other), "Wrong sender.");
+        ck_assert_msg(time >= last_time, "Time went backwards.");
+        last_time = time;
+
+        networking_inject_packet(net, ip_port, data, res, NULL);
+    }
+
+    ck_assert_msg(net_capture_read(reader, &time, &ip_port, data, sizeof(data)) == 0, "Capture didn't end.");
+    ck_assert_msg(capture_packets_received == 28, "Replayed packets were not handled.");
+    net_capture_close(reader);
+
+    /* A truncated capture is an error. */
+    FILE *file = fopen(CAPTURE_TEST_FILE, "r+b");
+    ck_assert_msg(file != NULL, "Failed to open capture file.");
+    ck_assert_msg(ftruncate(fileno(file), NET_CAPTURE_MAGIC_SIZE + 20) == 0, "Failed to truncate capture file.");
+    fclose(file);
+
+    reader = net_capture_open(CAPTURE_TEST_FILE);
+    ck_assert_msg(reader != NULL, "Failed to open capture.");
+    ck_assert_msg(net_capture_read(reader, &time, &ip_port, data, sizeof(data)) == -1, "Truncation not detected.");
+    net_capture_close(reader);
+
+    unlink(CAPTURE_TEST_FILE);
+    kill_networking(net);
+}
+END_TEST
+
+static unsigned int rate_limit_packets_received;
+
+static int handle_rate_limit_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+        void *userdata)
+{
+    ++rate_limit_packets_received;
+    return 0;
+}
+
+/* return the number of count packets from ip_port that got through. */
+static unsigned int inject_packets(Networking_Core *net, IP_Port ip_port, uint8_t packet_id, unsigned int count)
+{
+    const unsigned int received = rate_limit_packets_received;
+    uint8_t packet[32] = {packet_id};
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        networking_inject_packet(net, ip_port, packet, sizeof(packet), NULL);
+    }
+
+    return rate_limit_packets_received - received;
+}
+
+START_TEST(test_rate_limit)
+{
+    IP_Port self;
+    ip_init(&self.ip, 0);
+    self.ip.ip4.uint32 = net_htonl(0x0B000001);
+    self.port = net_htons(33445);
+
+    IP_Port a, b, c, d;
+    a = self;
+    a.ip.ip4.uint32 = net_htonl(0x0B000002);
+    b = self;
+    b.ip.ip4.uint32 = net_htonl(0x0B000003);
+    ip_init(&c.ip, 1);
+    c.ip.ip6.uint8[0] = 0x20;
+    c.ip.ip6.uint8[15] = 0x01;
+    c.port = self.port;
+    d = c;
+    d.ip.ip6.uint8[15] = 0x02;
+
+    uint64_t now = 1000000;
+    current_time_monotonic_set_callback(test_clock, &now);
+
+    Networking_Core *net = new_networking_backend(NULL, self, &loopback_backend, &self);
+    ck_assert_msg(net != NULL, "Failed to create networking instance.");
+    networking_registerhandler(net, 250, &handle_rate_limit_test_packet, NULL);
+    networking_registerhandler(net, 251, &handle_rate_limit_test_packet, NULL);
+
+    ck_assert_msg(networking_set_rate_limit(net, 250, 10, 0) == -1, "Burst of 0 was accepted.");
+    ck_assert_msg(networking_set_rate_limit(net, 250, 10, 5) == 0, "Failed to set rate limit.");
+
+    ck_assert_msg(inject_packets(net, a, 250, 20) == 5, "Burst was not limited.");
+    ck_assert_msg(networking_get_rate_limit_drops(net, 250) == 15, "Wrong drop count.");
+    ck_assert_msg(inject_packets(net, b, 250, 20) == 5, "Sources are not limited separately.");
+    ck_assert_msg(inject_packets(net, a, 251, 20) == 20, "Packet without a limit was limited.");
+    ck_assert_msg(networking_get_rate_limit_drops(net, 251) == 0, "Wrong drop count.");
+
+    /* Addresses in one IPv6 /64 share a bucket. */
+    ck_assert_msg(inject_packets(net, c, 250, 3) == 3, "IPv6 source was limited too early.");
+    ck_assert_msg(inject_packets(net, d, 250, 3) == 2, "IPv6 /64 is not limited as one.");
+
+    /* 10 per second refill one packet every 100ms, up to the burst. */
+    now += 250;
+    ck_assert_msg(inject_packets(net, a, 250, 5) == 2, "Bucket didn't refill at the rate.");
+    now += 60 * 1000;
+    ck_assert_msg(inject_packets(net, a, 250, 20) == 5, "Bucket didn't refill to the burst.");
+
+    ck_assert_msg(networking_set_rate_limit(net, 250, 0, 0) == 0, "Failed to remove rate limit.");
+    ck_assert_msg(inject_packets(net, a, 250, 20) == 20, "Rate limit was not removed.");
+
+    kill_networking(net);
+    current_time_monotonic_set_callback(NULL, NULL);
+}
+END_TEST
+
 static Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(ipport_pack_key);
+    DEFTESTCASE(batching);
+    DEFTESTCASE(batching_threads);
+    DEFTESTCASE(shards);
+    DEFTESTCASE(stats);
+    DEFTESTCASE(backend);
+    DEFTESTCASE(offload);
+    DEFTESTCASE(capture);
+    DEFTESTCASE(rate_limit);
 
     return s;
 }
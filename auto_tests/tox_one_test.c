@@ -130,6 +130,19 @@ START_TEST(test_one)
         ck_assert_msg(error == TOX_ERR_GET_PORT_OK, "wrong error");
     }
 
+    {
+        tox_iterate(tox1, NULL);
+        ck_assert_msg(tox_iteration_deadline(tox1) <= 1000, "Idle instance has a deadline over a second away.");
+
+        size_t fds_size = tox_get_fds_size(tox1);
+        ck_assert_msg(fds_size >= 1, "No sockets to watch.");
+
+        int32_t *fds = (int32_t *)calloc(fds_size, sizeof(int32_t));
+        tox_get_fds(tox1, fds);
+        ck_assert_msg(fds[0] >= 0, "Invalid UDP socket: %d.", fds[0]);
+        free(fds);
+    }
+
     tox_options_free(options);
     tox_kill(tox1);
     tox_kill(tox2);
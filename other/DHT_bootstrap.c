@@ -137,6 +137,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    /* Packets sent from do_DHT() and the TCP server are flushed by networking_poll(). */
+    if (networking_set_batching(dht->net, true) != 0) {
+        printf("Failed to enable batched networking.\n");
+    }
+
     perror("Initialization");
 
     manage_keys(dht);
@@ -142,12 +142,20 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 }
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
-                       int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       int *udp_threads, int *net_stats_interval, char **capture_file_path, int *rate_limit,
+                       int *shared_key_cache_size, int *precompute_threads, char **node_cache_path, int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay, uint16_t **tcp_relay_ports,
+                       int *tcp_relay_port_count, int *enable_motd, char **motd)
 {
     config_t cfg;
 
     const char *NAME_PORT                 = "port";
+    const char *NAME_UDP_THREADS          = "udp_threads";
+    const char *NAME_NET_STATS_INTERVAL   = "net_stats_interval";
+    const char *NAME_CAPTURE_FILE_PATH    = "capture_file_path";
+    const char *NAME_RATE_LIMIT           = "rate_limit";
+    const char *NAME_SHARED_KEY_CACHE_SIZE = "shared_key_cache_size";
+    const char *NAME_PRECOMPUTE_THREADS   = "precompute_threads";
+    const char *NAME_NODE_CACHE_PATH      = "node_cache_path";
     const char *NAME_PID_FILE_PATH        = "pid_file_path";
     const char *NAME_KEYS_FILE_PATH       = "keys_file_path";
     const char *NAME_ENABLE_IPV6          = "enable_ipv6";
@@ -173,6 +181,66 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         *port = DEFAULT_PORT;
     }
 
+    // Get number of UDP threads
+    if (config_lookup_int(&cfg, NAME_UDP_THREADS, udp_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_UDP_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_THREADS, DEFAULT_UDP_THREADS);
+        *udp_threads = DEFAULT_UDP_THREADS;
+    }
+
+    // Get network statistics interval
+    if (config_lookup_int(&cfg, NAME_NET_STATS_INTERVAL, net_stats_interval) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_NET_STATS_INTERVAL);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_NET_STATS_INTERVAL, DEFAULT_NET_STATS_INTERVAL);
+        *net_stats_interval = DEFAULT_NET_STATS_INTERVAL;
+    }
+
+    // Get packet capture file location
+    const char *tmp_capture_file;
+
+    if (config_lookup_string(&cfg, NAME_CAPTURE_FILE_PATH, &tmp_capture_file) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_CAPTURE_FILE_PATH);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_CAPTURE_FILE_PATH, DEFAULT_CAPTURE_FILE_PATH);
+        tmp_capture_file = DEFAULT_CAPTURE_FILE_PATH;
+    }
+
+    *capture_file_path = (char *)malloc(strlen(tmp_capture_file) + 1);
+    strcpy(*capture_file_path, tmp_capture_file);
+
+    // Get rate limit of requests
+    if (config_lookup_int(&cfg, NAME_RATE_LIMIT, rate_limit) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_RATE_LIMIT);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_RATE_LIMIT, DEFAULT_RATE_LIMIT);
+        *rate_limit = DEFAULT_RATE_LIMIT;
+    }
+
+    // Get number of shared keys to cache
+    if (config_lookup_int(&cfg, NAME_SHARED_KEY_CACHE_SIZE, shared_key_cache_size) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_SHARED_KEY_CACHE_SIZE);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_SHARED_KEY_CACHE_SIZE,
+                  DEFAULT_SHARED_KEY_CACHE_SIZE);
+        *shared_key_cache_size = DEFAULT_SHARED_KEY_CACHE_SIZE;
+    }
+
+    // Get number of threads computing shared keys with new nodes
+    if (config_lookup_int(&cfg, NAME_PRECOMPUTE_THREADS, precompute_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_PRECOMPUTE_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_PRECOMPUTE_THREADS, DEFAULT_PRECOMPUTE_THREADS);
+        *precompute_threads = DEFAULT_PRECOMPUTE_THREADS;
+    }
+
+    // Get node cache file location
+    const char *tmp_node_cache;
+
+    if (config_lookup_string(&cfg, NAME_NODE_CACHE_PATH, &tmp_node_cache) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_NODE_CACHE_PATH);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %s\n", NAME_NODE_CACHE_PATH, DEFAULT_NODE_CACHE_PATH);
+        tmp_node_cache = DEFAULT_NODE_CACHE_PATH;
+    }
+
+    *node_cache_path = (char *)malloc(strlen(tmp_node_cache) + 1);
+    strcpy(*node_cache_path, tmp_node_cache);
+
     // Get PID file location
     const char *tmp_pid_file;
 
@@ -265,6 +333,13 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_PID_FILE_PATH,        *pid_file_path);
     write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_KEYS_FILE_PATH,       *keys_file_path);
     write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_PORT,                 *port);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_UDP_THREADS,          *udp_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_NET_STATS_INTERVAL,   *net_stats_interval);
+    write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_CAPTURE_FILE_PATH,    *capture_file_path);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_RATE_LIMIT,           *rate_limit);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_SHARED_KEY_CACHE_SIZE, *shared_key_cache_size);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_PRECOMPUTE_THREADS,   *precompute_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_NODE_CACHE_PATH,      *node_cache_path);
     write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_IPV6,          *enable_ipv6          ? "true" : "false");
     write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_IPV4_FALLBACK, *enable_ipv4_fallback ? "true" : "false");
     write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_ENABLE_LAN_DISCOVERY, *enable_lan_discovery ? "true" : "false");
@@ -30,7 +30,8 @@
 /**
  * Gets general config options from the config file.
  *
- * Important: You are responsible for freeing `pid_file_path` and `keys_file_path`
+ * Important: You are responsible for freeing `pid_file_path`, `keys_file_path`, `capture_file_path` and
+ *            `node_cache_path`
  *            also, iff `tcp_relay_ports_count` > 0, then you are responsible for freeing `tcp_relay_ports`
  *            and also `motd` iff `enable_motd` is set.
  *
@@ -38,8 +39,9 @@
  *         0 on failure, doesn't modify any data pointed by arguments.
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
-                       int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       int *udp_threads, int *net_stats_interval, char **capture_file_path, int *rate_limit,
+                       int *shared_key_cache_size, int *precompute_threads, char **node_cache_path, int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay, uint16_t **tcp_relay_ports,
+                       int *tcp_relay_port_count, int *enable_motd, char **motd);
 
 /**
  * Bootstraps off nodes listed in the config file.
@@ -30,6 +30,13 @@
 #define DEFAULT_PID_FILE_PATH         "tox-bootstrapd.pid"
 #define DEFAULT_KEYS_FILE_PATH        "tox-bootstrapd.keys"
 #define DEFAULT_PORT                  33445
+#define DEFAULT_UDP_THREADS           1
+#define DEFAULT_NET_STATS_INTERVAL    0 // in seconds, 0 - disabled
+#define DEFAULT_CAPTURE_FILE_PATH     "" // empty - disabled
+#define DEFAULT_RATE_LIMIT            0 // requests per second per source address, 0 - disabled
+#define DEFAULT_SHARED_KEY_CACHE_SIZE 8192
+#define DEFAULT_PRECOMPUTE_THREADS    0 // 0 - shared keys with new nodes are computed by the main thread
+#define DEFAULT_NODE_CACHE_PATH       "" // empty - disabled
 #define DEFAULT_ENABLE_IPV6           1 // 1 - true, 0 - false
 #define DEFAULT_ENABLE_IPV4_FALLBACK  1 // 1 - true, 0 - false
 #define DEFAULT_ENABLE_LAN_DISCOVERY  1 // 1 - true, 0 - false
@@ -25,6 +25,7 @@
 #define _XOPEN_SOURCE 600
 
 // system provided
+#include <poll.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -52,6 +53,18 @@
 
 #define SLEEP_MILLISECONDS(MS) usleep(1000*MS)
 
+// How long to sleep while the TCP server has data it couldn't send yet
+#define TCP_SEND_RETRY_MILLISECONDS 30
+
+// How often to log the packets dropped by the rate limit, in seconds
+#define RATE_LIMIT_LOG_INTERVAL 60
+
+// How often the shared key cache hits and misses are logged, in seconds
+#define SHARED_KEY_CACHE_LOG_INTERVAL 600
+
+// Most packets from new nodes and TCP handshakes waiting for a precompute thread
+#define PRECOMPUTE_MAX_PENDING 1024
+
 // Uses the already existing key or creates one if it didn't exist
 //
 // returns 1 on success
@@ -175,6 +188,196 @@ static void daemonize(LOG_BACKEND log_backend, char *pid_file_path)
     }
 }
 
+// Creates the networking core the daemon listens on.
+// With more than one UDP thread the socket is created with SO_REUSEPORT, so that
+// networking_start_shards() can bind the sockets of the other threads to the same port.
+
+static Networking_Core *new_daemon_networking(IP ip, int port, int udp_threads)
+{
+    if (udp_threads > 1) {
+        return new_networking_reuseport(NULL, ip, port, NULL);
+    }
+
+    return new_networking(NULL, ip, port);
+}
+
+// Logs the non-zero traffic counters of the UDP socket, one line per packet id.
+// Must be called with the networking lock held.
+
+static void print_net_stats(const DHT *dht)
+{
+    static Net_Stats stats;
+
+    if (DHT_get_net_stats(dht, &stats) == -1) {
+        return;
+    }
+
+    write_log(LOG_LEVEL_INFO, "UDP traffic per packet id (received/bytes/unhandled, sent/bytes/failed, handler us):\n");
+
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        const Net_Packet_Stats *p = &stats.packets[i];
+
+        if (p->recv_packets == 0 && p->sent_packets == 0 && p->send_failed == 0) {
+            continue;
+        }
+
+        write_log(LOG_LEVEL_INFO, "  0x%02x: %llu/%llu/%llu, %llu/%llu/%llu, %llu\n", i,
+                  (unsigned long long)p->recv_packets, (unsigned long long)p->recv_bytes,
+                  (unsigned long long)p->recv_unhandled, (unsigned long long)p->sent_packets,
+                  (unsigned long long)p->sent_bytes, (unsigned long long)p->send_failed,
+                  (unsigned long long)p->handler_time);
+    }
+}
+
+// Packets that make the daemon do public key crypto or send replies, limited by the rate_limit option.
+static const uint8_t rate_limited_packets[] = {
+    NET_PACKET_PING_REQUEST,
+    NET_PACKET_GET_NODES,
+    NET_PACKET_LAN_DISCOVERY,
+    NET_PACKET_ONION_SEND_INITIAL,
+    NET_PACKET_ANNOUNCE_REQUEST,
+    NET_PACKET_ONION_DATA_REQUEST,
+    BOOTSTRAP_INFO_PACKET_ID,
+};
+
+static int set_rate_limits(Networking_Core *net, int rate_limit)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(rate_limited_packets); ++i) {
+        if (networking_set_rate_limit(net, rate_limited_packets[i], rate_limit, 2 * rate_limit) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Logs how many packets the rate limit dropped, if it dropped any since the last call.
+
+static void print_rate_limit_drops(const Networking_Core *net, uint64_t *last_total)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(rate_limited_packets); ++i) {
+        total += networking_get_rate_limit_drops(net, rate_limited_packets[i]);
+    }
+
+    if (total == *last_total) {
+        return;
+    }
+
+    *last_total = total;
+    write_log(LOG_LEVEL_INFO, "Rate limit dropped packets per packet id (total):\n");
+
+    for (i = 0; i < sizeof(rate_limited_packets); ++i) {
+        write_log(LOG_LEVEL_INFO, "  0x%02x: %llu\n", rate_limited_packets[i],
+                  (unsigned long long)networking_get_rate_limit_drops(net, rate_limited_packets[i]));
+    }
+}
+
+// Logs the hits, misses and evictions of the shared key cache.
+
+static void print_shared_key_cache_stats(const DHT *dht)
+{
+    Shared_Key_Cache_Stats stats;
+    shared_key_cache_get_stats(dht->shared_keys, &stats);
+
+    const uint64_t requests = stats.hits + stats.misses;
+    write_log(LOG_LEVEL_INFO, "Shared key cache of %u keys: %llu hits (%.1f%%), %llu misses, %llu evictions\n",
+              shared_key_cache_capacity(dht->shared_keys), (unsigned long long)stats.hits,
+              requests ? 100.0 * stats.hits / requests : 0.0, (unsigned long long)stats.misses,
+              (unsigned long long)stats.evictions);
+}
+
+// Logs the requests dropped because the precompute threads had too many waiting.
+
+static void print_precompute_drops(Precompute_Pool *pool, uint64_t *last_drops)
+{
+    const uint64_t drops = precompute_pool_dropped(pool);
+
+    if (drops != *last_drops) {
+        write_log(LOG_LEVEL_WARNING, "Dropped %llu requests waiting for a precompute thread.\n",
+                  (unsigned long long)(drops - *last_drops));
+        *last_drops = drops;
+    }
+}
+
+// Sleeps until one of the sockets has data to read, the precompute pool has finished jobs or the DHT and TCP
+// server have timers to run. The sockets are put in `*fds`, which is grown as needed.
+// Must be called without the networking lock held, the sockets are collected with it held.
+
+static void wait_for_events(Networking_Core *net, const TCP_Server *tcp_server, const Precompute_Pool *pool,
+                            struct pollfd **fds, unsigned int *fds_size)
+{
+    networking_lock(net);
+
+    int timeout = unix_time_next_update();
+    unsigned int count = 1;
+    const int pool_fd = pool != NULL ? precompute_pool_fd(pool) : -1;
+
+    if (pool_fd != -1) {
+        ++count;
+    }
+
+    if (tcp_server != NULL) {
+        if (tcp_server_send_pending(tcp_server) && timeout > TCP_SEND_RETRY_MILLISECONDS) {
+            timeout = TCP_SEND_RETRY_MILLISECONDS;
+        }
+
+        Socket unused;
+        count += tcp_server_fds(tcp_server, &unused, 0);
+    }
+
+    if (count > *fds_size) {
+        struct pollfd *new_fds = (struct pollfd *)realloc(*fds, count * sizeof(struct pollfd));
+
+        if (new_fds == NULL) {
+            networking_unlock(net);
+            SLEEP_MILLISECONDS(TCP_SEND_RETRY_MILLISECONDS);
+            return;
+        }
+
+        *fds = new_fds;
+        *fds_size = count;
+    }
+
+    Socket *socks = (Socket *)malloc(count * sizeof(Socket));
+
+    if (socks == NULL) {
+        networking_unlock(net);
+        SLEEP_MILLISECONDS(TCP_SEND_RETRY_MILLISECONDS);
+        return;
+    }
+
+    socks[0] = net->sock;
+
+    if (pool_fd != -1) {
+        socks[count - 1] = pool_fd;
+    }
+
+    if (tcp_server != NULL) {
+        tcp_server_fds(tcp_server, socks + 1, count - 1 - (pool_fd != -1));
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        (*fds)[i].fd = socks[i];
+        (*fds)[i].events = POLLIN;
+        (*fds)[i].revents = 0;
+    }
+
+    free(socks);
+
+    networking_unlock(net);
+
+    poll(*fds, count, timeout);
+}
+
 int main(int argc, char *argv[])
 {
     umask(077);
@@ -193,8 +396,13 @@ int main(int argc, char *argv[])
 
     write_log(LOG_LEVEL_INFO, "Running \"%s\" version %lu.\n", DAEMON_NAME, DAEMON_VERSION_NUMBER);
 
-    char *pid_file_path, *keys_file_path;
+    char *pid_file_path, *keys_file_path, *capture_file_path, *node_cache_path;
     int port;
+    int udp_threads;
+    int net_stats_interval;
+    int rate_limit;
+    int shared_key_cache_size;
+    int precompute_threads;
     int enable_ipv6;
     int enable_ipv4_fallback;
     int enable_lan_discovery;
@@ -204,20 +412,49 @@ int main(int argc, char *argv[])
     int enable_motd;
     char *motd;
 
-    if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+    if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &udp_threads, &net_stats_interval,
+                           &capture_file_path, &rate_limit, &shared_key_cache_size, &precompute_threads, &node_cache_path, &enable_ipv6, &enable_ipv4_fallback, &enable_lan_discovery, &enable_tcp_relay,
+                           &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
         write_log(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         write_log(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
         return 1;
     }
 
+    if (net_stats_interval < 0) {
+        write_log(LOG_LEVEL_ERROR, "Invalid network statistics interval: %d, should be at least 0. Exiting.\n",
+                  net_stats_interval);
+        return 1;
+    }
+
+    if (rate_limit < 0) {
+        write_log(LOG_LEVEL_ERROR, "Invalid rate limit: %d, should be at least 0. Exiting.\n", rate_limit);
+        return 1;
+    }
+
+    if (shared_key_cache_size < 1) {
+        write_log(LOG_LEVEL_ERROR, "Invalid shared key cache size: %d, should be at least 1. Exiting.\n",
+                  shared_key_cache_size);
+        return 1;
+    }
+
+    if (precompute_threads < 0 || precompute_threads > UINT16_MAX) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of precompute threads: %d, should be in [0, %d]. Exiting.\n",
+                  precompute_threads, UINT16_MAX);
+        return 1;
+    }
+
     if (port < MIN_ALLOWED_PORT || port > MAX_ALLOWED_PORT) {
         write_log(LOG_LEVEL_ERROR, "Invalid port: %d, should be in [%d, %d]. Exiting.\n", port, MIN_ALLOWED_PORT,
                   MAX_ALLOWED_PORT);
         return 1;
     }
 
+    if (udp_threads < 1) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of UDP threads: %d, should be at least 1. Exiting.\n", udp_threads);
+        return 1;
+    }
+
     if (!run_in_foreground) {
         daemonize(log_backend, pid_file_path);
     }
@@ -227,14 +464,14 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, enable_ipv6);
 
-    Networking_Core *net = new_networking(NULL, ip, port);
+    Networking_Core *net = new_daemon_networking(ip, port, udp_threads);
 
     if (net == NULL) {
         if (enable_ipv6 && enable_ipv4_fallback) {
             write_log(LOG_LEVEL_WARNING, "Couldn't initialize IPv6 networking. Falling back to using IPv4.\n");
             enable_ipv6 = 0;
             ip_init(&ip, enable_ipv6);
-            net = new_networking(NULL, ip, port);
+            net = new_daemon_networking(ip, port, udp_threads);
 
             if (net == NULL) {
                 write_log(LOG_LEVEL_ERROR, "Couldn't fallback to IPv4. Exiting.\n");
@@ -246,6 +483,13 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Packets sent from do_DHT() and do_TCP_server() are flushed at the end of networking_poll()
+    if (networking_set_batching(net, true) == 0) {
+        write_log(LOG_LEVEL_INFO, "Enabled batched networking.\n");
+    } else {
+        write_log(LOG_LEVEL_WARNING, "Couldn't enable batched networking.\n");
+    }
+
     DHT *dht = new_DHT(NULL, net, true);
 
     if (dht == NULL) {
@@ -253,6 +497,12 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (shared_key_cache_size != SHARED_KEY_CACHE_DEFAULT_SIZE
+            && DHT_set_shared_key_cache_size(dht, shared_key_cache_size) == -1) {
+        write_log(LOG_LEVEL_ERROR, "Couldn't allocate a shared key cache of %d keys. Exiting.\n", shared_key_cache_size);
+        return 1;
+    }
+
     Onion *onion = new_onion(dht);
     Onion_Announce *onion_a = new_onion_announce(dht);
 
@@ -302,6 +552,22 @@ int main(int argc, char *argv[])
         }
     }
 
+    Node_Cache *node_cache = NULL;
+
+    if (node_cache_path[0] != '\0') {
+        node_cache = node_cache_open(node_cache_path, NODE_CACHE_DEFAULT_SIZE);
+
+        if (node_cache == NULL) {
+            write_log(LOG_LEVEL_ERROR, "Couldn't open the node cache file: %s. Exiting.\n", node_cache_path);
+            return 1;
+        }
+
+        DHT_set_node_cache(dht, node_cache);
+        write_log(LOG_LEVEL_INFO, "Loaded %u nodes from the node cache.\n", node_cache_count(node_cache));
+    }
+
+    free(node_cache_path);
+
     if (bootstrap_from_config(cfg_file_path, dht, enable_ipv6)) {
         write_log(LOG_LEVEL_INFO, "List of bootstrap nodes read successfully.\n");
     } else {
@@ -312,16 +578,91 @@ int main(int argc, char *argv[])
     print_public_key(dht->self_public_key);
 
     uint64_t last_LANdiscovery = 0;
+    uint64_t last_net_stats = unix_time();
+    uint64_t last_rate_limit_log = unix_time();
+    uint64_t rate_limit_drops = 0;
+    uint64_t last_shared_key_cache_log = unix_time();
     const uint16_t net_htons_port = net_htons(port);
 
     int waiting_for_dht_connection = 1;
+    const uint64_t start_time = unix_time();
 
     if (enable_lan_discovery) {
         LANdiscovery_init(dht);
         write_log(LOG_LEVEL_INFO, "Initialized LAN discovery successfully.\n");
     }
 
+    if (net_stats_interval > 0) {
+        Net_Packet_Stats unused;
+
+        if (networking_get_packet_stats(net, 0, &unused) == 0) {
+            write_log(LOG_LEVEL_INFO, "Logging network statistics every %d seconds.\n", net_stats_interval);
+        } else {
+            write_log(LOG_LEVEL_WARNING, "'net_stats_interval' is set, but toxcore was built without NET_STATS.\n");
+            net_stats_interval = 0;
+        }
+    }
+
+    if (capture_file_path[0] != '\0') {
+        if (networking_capture_start(net, capture_file_path) == 0) {
+            write_log(LOG_LEVEL_INFO, "Capturing received packets to %s.\n", capture_file_path);
+        } else {
+            write_log(LOG_LEVEL_ERROR, "Couldn't open the packet capture file: %s. Exiting.\n", capture_file_path);
+            return 1;
+        }
+    }
+
+    free(capture_file_path);
+
+    if (rate_limit > 0) {
+        if (set_rate_limits(net, rate_limit) == 0) {
+            write_log(LOG_LEVEL_INFO, "Limiting requests to %d per second per address.\n", rate_limit);
+        } else {
+            write_log(LOG_LEVEL_ERROR, "Couldn't set rate limit. Exiting.\n");
+            return 1;
+        }
+    }
+
+    Precompute_Pool *precompute_pool = NULL;
+    uint64_t precompute_drops = 0;
+
+    if (precompute_threads > 0) {
+        precompute_pool = new_precompute_pool(precompute_threads, PRECOMPUTE_MAX_PENDING);
+
+        if (precompute_pool == NULL) {
+            write_log(LOG_LEVEL_ERROR, "Couldn't start precompute threads. Exiting.\n");
+            return 1;
+        }
+
+        DHT_set_precompute_pool(dht, precompute_pool);
+
+        if (tcp_server != NULL) {
+            TCP_server_set_precompute_pool(tcp_server, precompute_pool);
+        }
+
+        write_log(LOG_LEVEL_INFO, "Started %d precompute threads.\n", precompute_threads);
+    }
+
+    if (udp_threads > 1) {
+        if (networking_start_shards(net, ip, udp_threads - 1, NULL) == 0) {
+            write_log(LOG_LEVEL_INFO, "Started %d UDP threads.\n", udp_threads);
+        } else {
+            write_log(LOG_LEVEL_ERROR, "Couldn't start UDP threads. Exiting.\n");
+            return 1;
+        }
+    }
+
+    struct pollfd *poll_fds = NULL;
+    unsigned int poll_fds_size = 0;
+
     while (1) {
+        // The UDP threads dispatch packets with this lock held
+        networking_lock(net);
+
+        if (precompute_pool != NULL) {
+            do_precompute_pool(precompute_pool, NULL);
+        }
+
         do_DHT(dht);
 
         if (enable_lan_discovery && is_timeout(last_LANdiscovery, LAN_DISCOVERY_INTERVAL)) {
@@ -333,13 +674,36 @@ int main(int argc, char *argv[])
             do_TCP_server(tcp_server);
         }
 
+        if (net_stats_interval && is_timeout(last_net_stats, net_stats_interval)) {
+            print_net_stats(dht);
+            last_net_stats = unix_time();
+        }
+
+        if (rate_limit && is_timeout(last_rate_limit_log, RATE_LIMIT_LOG_INTERVAL)) {
+            print_rate_limit_drops(net, &rate_limit_drops);
+            last_rate_limit_log = unix_time();
+        }
+
+        if (is_timeout(last_shared_key_cache_log, SHARED_KEY_CACHE_LOG_INTERVAL)) {
+            print_shared_key_cache_stats(dht);
+
+            if (precompute_pool != NULL) {
+                print_precompute_drops(precompute_pool, &precompute_drops);
+            }
+
+            last_shared_key_cache_log = unix_time();
+        }
+
         networking_poll(dht->net, NULL);
 
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
-            write_log(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
+            write_log(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully after %llu seconds.\n",
+                      (unsigned long long)(unix_time() - start_time));
             waiting_for_dht_connection = 0;
         }
 
-        SLEEP_MILLISECONDS(30);
+        networking_unlock(net);
+
+        wait_for_events(net, tcp_server, precompute_pool, &poll_fds, &poll_fds_size);
     }
 }
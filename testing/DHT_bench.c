@@ -0,0 +1,361 @@
+/* DHT benchmark
+ * Runs many DHT nodes in one process on a simulated network and reports how
+ * long they take to bootstrap and how many packets a lookup costs.
+ *
+ * Usage: DHT_bench [-n nodes] [-l lookups] [-s seed] [-t latency_ms] [-j jitter_ms]
+ *                  [-p loss_per_mille] [-b bandwidth_bytes_per_s] [-r restricted_nat_percent]
+ *                  [-y symmetric_nat_percent] [-i tick_ms] [-T timeout_s]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sim_network.h"
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Nodes everyone else bootstraps from. */
+#define BOOTSTRAP_NODES 4
+
+/* A node counts as bootstrapped once it has this many good nodes close to it. */
+#define BOOTSTRAPPED_CLOSE_NODES 8
+
+typedef struct {
+    uint32_t node;
+    uint32_t target;
+    uint64_t start_time;
+    uint64_t start_sent;
+    uint64_t time;
+    uint64_t sent;
+    int found;
+} Lookup;
+
+static Networking_Core **nets;
+static DHT **dhts;
+
+static unsigned int good_close_nodes(const DHT *dht)
+{
+    unsigned int count = 0;
+    uint32_t i;
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *client = &dht->close_clientlist[i];
+
+        if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+static void bootstrap(Sim_Network *sim, uint32_t node)
+{
+    const uint32_t from = node < BOOTSTRAP_NODES ? (node + 1) % BOOTSTRAP_NODES : sim_random(sim) % BOOTSTRAP_NODES;
+    DHT_bootstrap(dhts[node], sim_node_ip_port(sim, from), dhts[from]->self_public_key);
+}
+
+static void run_tick(Sim_Network *sim, uint32_t num_nodes, uint32_t tick)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_nodes; ++i) {
+        networking_poll(nets[i], NULL);
+        do_DHT(dhts[i]);
+    }
+
+    sim_advance(sim, tick);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-n nodes] [-l lookups] [-s seed] [-t latency_ms] [-j jitter_ms]\n"
+           "          [-p loss_per_mille] [-b bandwidth_bytes_per_s] [-r restricted_nat_percent]\n"
+           "          [-y symmetric_nat_percent] [-i tick_ms] [-T timeout_s]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_nodes = 10000;
+    uint32_t num_lookups = 100;
+    uint32_t seed = 1;
+    uint32_t restricted = 0;
+    uint32_t symmetric = 0;
+    uint32_t tick = 50;
+    uint32_t timeout = 600;
+    Sim_Link link = {50, 10, 0, 0};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:s:t:j:p:b:r:y:i:T:h")) != -1) {
+        const uint32_t value = (uint32_t)strtoul(optarg ? optarg : "0", NULL, 10);
+
+        switch (opt) {
+            case 'n':
+                num_nodes = value;
+                break;
+
+            case 'l':
+                num_lookups = value;
+                break;
+
+            case 's':
+                seed = value;
+                break;
+
+            case 't':
+                link.latency = value;
+                break;
+
+            case 'j':
+                link.jitter = value;
+                break;
+
+            case 'p':
+                link.loss = value * 1000;
+                break;
+
+            case 'b':
+                link.bandwidth = value;
+                break;
+
+            case 'r':
+                restricted = value;
+                break;
+
+            case 'y':
+                symmetric = value;
+                break;
+
+            case 'i':
+                tick = value;
+                break;
+
+            case 'T':
+                timeout = value;
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (num_nodes <= BOOTSTRAP_NODES || tick == 0 || restricted + symmetric > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (num_lookups > (num_nodes - BOOTSTRAP_NODES) / 2) {
+        num_lookups = (num_nodes - BOOTSTRAP_NODES) / 2;
+    }
+
+    Sim_Network *sim = new_sim_network(seed);
+    nets = (Networking_Core **)calloc(num_nodes, sizeof(Networking_Core *));
+    dhts = (DHT **)calloc(num_nodes, sizeof(DHT *));
+    Lookup *lookups = (Lookup *)calloc(num_lookups ? num_lookups : 1, sizeof(Lookup));
+    uint8_t *searching = (uint8_t *)calloc(num_nodes, 1);
+
+    if (sim == NULL || nets == NULL || dhts == NULL || lookups == NULL || searching == NULL) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    sim_set_default_link(sim, &link);
+
+    uint32_t i;
+
+    for (i = 0; i < num_nodes; ++i) {
+        const uint32_t r = sim_random(sim) % 100;
+        Sim_Nat nat = SIM_NAT_NONE;
+
+        if (i >= BOOTSTRAP_NODES) {
+            if (r < restricted) {
+                nat = SIM_NAT_RESTRICTED;
+            } else if (r < restricted + symmetric) {
+                nat = SIM_NAT_SYMMETRIC;
+            }
+        }
+
+        nets[i] = sim_new_networking(sim, NULL, nat);
+        dhts[i] = nets[i] ? new_DHT(NULL, nets[i], true) : NULL;
+
+        if (dhts[i] == NULL) {
+            printf("Failed to create node %u.\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_nodes; ++i) {
+        bootstrap(sim, i);
+    }
+
+    printf("%u nodes, latency %ums, jitter %ums, loss %u/1000, bandwidth %u B/s, NAT %u%% restricted %u%% symmetric\n",
+           num_nodes, link.latency, link.jitter, link.loss / 1000, link.bandwidth, restricted, symmetric);
+
+    /* Bootstrap: run until every node has enough close nodes. */
+    const uint64_t start = sim_time(sim);
+    uint64_t time_half = 0;
+    uint64_t time_90 = 0;
+    uint64_t time_all = 0;
+    uint64_t last_check = start;
+
+    while (time_all == 0 && sim_time(sim) - start < timeout * 1000ULL) {
+        run_tick(sim, num_nodes, tick);
+
+        if (sim_time(sim) - last_check < 1000) {
+            continue;
+        }
+
+        last_check = sim_time(sim);
+        uint32_t bootstrapped = 0;
+
+        for (i = 0; i < num_nodes; ++i) {
+            if (good_close_nodes(dhts[i]) >= BOOTSTRAPPED_CLOSE_NODES) {
+                ++bootstrapped;
+            }
+
+            /* Like clients do, try again while not connected: the first
+             * answer of a bootstrap node that knew no one yet is ignored.
+             */
+            if (!DHT_isconnected(dhts[i])) {
+                bootstrap(sim, i);
+            }
+        }
+
+        const uint64_t elapsed = sim_time(sim) - start;
+
+        if (time_half == 0 && bootstrapped * 2 >= num_nodes) {
+            time_half = elapsed;
+        }
+
+        if (time_90 == 0 && bootstrapped * 10 >= num_nodes * 9) {
+            time_90 = elapsed;
+        }
+
+        if (bootstrapped == num_nodes) {
+            time_all = elapsed;
+        }
+
+        if ((elapsed / 1000) % 10 == 0) {
+            printf("%3us: %u/%u nodes bootstrapped, %llu packets sent\n", (unsigned int)(elapsed / 1000), bootstrapped,
+                   num_nodes, (unsigned long long)sim_packets_sent(sim));
+        }
+    }
+
+    printf("Bootstrap time: 50%% %.1fs, 90%% %.1fs, all %.1fs (0 = not reached)\n", time_half / 1000.0,
+           time_90 / 1000.0, time_all / 1000.0);
+
+    /* Lookups: distinct nodes each search for a random other node. */
+    const uint64_t lookup_start = sim_time(sim);
+    const uint64_t lookup_start_sent = sim_packets_sent(sim);
+
+    for (i = 0; i < num_lookups; ++i) {
+        Lookup *lookup = &lookups[i];
+
+        do {
+            lookup->node = BOOTSTRAP_NODES + sim_random(sim) % (num_nodes - BOOTSTRAP_NODES);
+        } while (searching[lookup->node]);
+
+        searching[lookup->node] = 1;
+
+        do {
+            lookup->target = sim_random(sim) % num_nodes;
+        } while (lookup->target == lookup->node);
+
+        lookup->start_time = sim_time(sim);
+        lookup->start_sent = sim_node_packets_sent(sim, lookup->node);
+        DHT_addfriend(dhts[lookup->node], dhts[lookup->target]->self_public_key, NULL, NULL, 0, NULL);
+    }
+
+    uint32_t found = 0;
+
+    while (found < num_lookups && sim_time(sim) - lookup_start < timeout * 1000ULL) {
+        run_tick(sim, num_nodes, tick);
+
+        for (i = 0; i < num_lookups; ++i) {
+            Lookup *lookup = &lookups[i];
+            IP_Port ip_port;
+
+            if (lookup->found || DHT_getfriendip(dhts[lookup->node], dhts[lookup->target]->self_public_key, &ip_port) != 1) {
+                continue;
+            }
+
+            lookup->found = 1;
+            lookup->time = sim_time(sim) - lookup->start_time;
+            lookup->sent = sim_node_packets_sent(sim, lookup->node) - lookup->start_sent;
+            ++found;
+        }
+    }
+
+    /* Packets every node sends anyway, to tell the cost of a lookup from it. */
+    const uint64_t window = sim_time(sim) - lookup_start;
+    uint64_t searcher_sent = 0;
+
+    for (i = 0; i < num_lookups; ++i) {
+        searcher_sent += sim_node_packets_sent(sim, lookups[i].node) - lookups[i].start_sent;
+    }
+
+    const double background = window ? (double)(sim_packets_sent(sim) - lookup_start_sent - searcher_sent)
+                              / (num_nodes - num_lookups) / (window / 1000.0) : 0;
+
+    uint64_t total_time = 0;
+    uint64_t total_sent = 0;
+
+    for (i = 0; i < num_lookups; ++i) {
+        if (lookups[i].found) {
+            total_time += lookups[i].time;
+            total_sent += lookups[i].sent;
+        }
+    }
+
+    if (found != 0) {
+        const double mean_time = (double)total_time / found / 1000.0;
+        const double mean_sent = (double)total_sent / found;
+        printf("Lookups: %u/%u found, mean time %.2fs, mean packets sent by the searcher %.1f (%.1f over the background of %.1f/s)\n",
+               found, num_lookups, mean_time, mean_sent, mean_sent - background * mean_time, background);
+    } else {
+        printf("Lookups: 0/%u found\n", num_lookups);
+    }
+
+    printf("Packets sent %llu, dropped %llu\n", (unsigned long long)sim_packets_sent(sim),
+           (unsigned long long)sim_packets_dropped(sim));
+
+    for (i = 0; i < num_nodes; ++i) {
+        kill_DHT(dhts[i]);
+        kill_networking(nets[i]);
+    }
+
+    kill_sim_network(sim);
+    free(searching);
+    free(lookups);
+    free(dhts);
+    free(nets);
+    return 0;
+}
@@ -101,7 +101,6 @@ static void print_assoc(IPPTsPng *assoc, uint8_t ours)
     }
 
     printf("Timestamp: %llu\n", (long long unsigned int) assoc->ret_timestamp);
-    print_hardening(&assoc->hardening);
 }
 
 static void print_clientlist(DHT *dht)
@@ -120,7 +119,9 @@ static void print_clientlist(DHT *dht)
         print_client_id(client->public_key);
 
         print_assoc(&client->assoc4, 1);
+        print_hardening(&dht->close_hardening[i].assoc4);
         print_assoc(&client->assoc6, 1);
+        print_hardening(&dht->close_hardening[i].assoc6);
     }
 }
 
@@ -0,0 +1,371 @@
+/* Packet copy benchmark
+ * Counts the bytes memcpy() moves per packet on the hot paths: queueing and
+ * sending a lossless net_crypto packet the way Messenger sends file chunks and
+ * messages, receiving it, and forwarding an onion packet at each of the three
+ * hops. The nodes run in one process over a loopback backend that moves
+ * packets with memmove(), so the copies a socket would make aren't counted.
+ *
+ * memcpy() is counted by defining it here, which calls from toxcore and
+ * libsodium resolve to with ELF linkers as on Linux.
+ *
+ * Usage: copy_bench [-n packets]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/onion.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Client, three onion hops and a destination, the client also uses a net_crypto
+ * connection to the destination.
+ */
+#define NUM_NODES 5
+#define QUEUE_SIZE 4096
+
+/* Packet ids Messenger uses, see Messenger.h. */
+#define BENCH_PACKET_ID_MESSAGE 64
+#define BENCH_PACKET_ID_FILE_DATA 82
+
+typedef struct {
+    uint32_t to;
+    IP_Port from;
+    uint16_t length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Queued_Packet;
+
+typedef struct {
+    uint32_t number;
+    IP_Port ip_port;
+    Networking_Core *net;
+    DHT *dht;
+    Net_Crypto *c;
+    Onion *onion;
+} Node;
+
+static Node nodes[NUM_NODES];
+static Queued_Packet queue[QUEUE_SIZE];
+static uint32_t queue_start;
+static uint32_t queue_end;
+static uint64_t copied;
+static uint32_t received;
+static int accepted_id = -1;
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    copied += n;
+    return memmove(dest, src, n);
+}
+
+static int loopback_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    const Node *node = (const Node *)object;
+    uint32_t i;
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        if (ipport_equal(&nodes[i].ip_port, &ip_port)) {
+            break;
+        }
+    }
+
+    if (i == NUM_NODES || queue_end - queue_start == QUEUE_SIZE) {
+        return length;
+    }
+
+    Queued_Packet *packet = &queue[queue_end++ % QUEUE_SIZE];
+    packet->to = i;
+    packet->from = node->ip_port;
+    packet->length = length;
+    memmove(packet->data, data, length);
+    return length;
+}
+
+/* Packets are taken in order, the ones for other nodes wait for them. */
+static int loopback_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t max_length)
+{
+    const Node *node = (const Node *)object;
+    uint32_t i;
+
+    for (i = queue_start; i != queue_end; ++i) {
+        Queued_Packet *packet = &queue[i % QUEUE_SIZE];
+
+        if (packet->to != node->number || packet->length > max_length) {
+            continue;
+        }
+
+        *ip_port = packet->from;
+        const uint16_t length = packet->length;
+        memmove(data, packet->data, length);
+
+        /* Close the gap so the queue stays in order. */
+        for (; i != queue_start; --i) {
+            memmove(&queue[i % QUEUE_SIZE], &queue[(i - 1) % QUEUE_SIZE], sizeof(Queued_Packet));
+        }
+
+        ++queue_start;
+        return length;
+    }
+
+    return 0;
+}
+
+static const Net_Backend loopback_backend = {
+    loopback_send,
+    loopback_recv,
+};
+
+static int count_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    ++received;
+    return 0;
+}
+
+static int accept_connection(void *object, New_Connection *n_c)
+{
+    Net_Crypto *c = (Net_Crypto *)object;
+    accepted_id = accept_crypto_connection(c, n_c);
+
+    if (accepted_id != -1) {
+        connection_data_handler(c, accepted_id, &count_data, NULL, 0);
+    }
+
+    return 0;
+}
+
+static void run_node(const Node *node)
+{
+    networking_poll(node->net, NULL);
+    do_net_crypto(node->c, NULL);
+}
+
+static void run_nodes(void)
+{
+    uint32_t i;
+    unix_time_update();
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        run_node(&nodes[i]);
+    }
+}
+
+/* return bytes copied by the handlers of the packets waiting for node. */
+static uint64_t poll_counted(const Node *node)
+{
+    const uint64_t before = copied;
+    networking_poll(node->net, NULL);
+    return copied - before;
+}
+
+static bool established(const Node *node, int id)
+{
+    return id != -1 && crypto_connection_status(node->c, id, NULL, NULL) == CRYPTO_CONN_ESTABLISHED;
+}
+
+/* Send packets of a header and length bytes of data from the client to the
+ * destination and print the bytes copied to send and to receive one.
+ */
+static bool bench_lossless(const char *name, int id, const uint8_t *header, uint16_t header_length, uint16_t length,
+                           uint32_t packets)
+{
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    uint64_t send_copied = 0;
+    uint64_t recv_copied = 0;
+    uint32_t sent = 0;
+
+    memset(data, 0, sizeof(data));
+    received = 0;
+
+    while (sent < packets) {
+        const uint64_t before = copied;
+
+        if (write_cryptpacket_parts(nodes[0].c, id, header, header_length, data, length, 0) == -1) {
+            printf("Couldn't queue packet %u.\n", sent);
+            return 0;
+        }
+
+        send_copied += copied - before;
+        ++sent;
+        recv_copied += poll_counted(&nodes[NUM_NODES - 1]);
+
+        /* Let acknowledgements through every now and then. */
+        if (sent % 256 == 0) {
+            run_nodes();
+        }
+    }
+
+    if (received != packets) {
+        printf("Received %u of %u packets.\n", received, packets);
+        return 0;
+    }
+
+    printf("%-22s %6u %12.1f %12.1f\n", name, header_length + length, (double)send_copied / packets,
+           (double)recv_copied / packets);
+    return 1;
+}
+
+static bool bench_onion(uint16_t length, uint32_t packets)
+{
+    Node_format path_nodes[3];
+    Onion_Path path;
+    uint8_t data[ONION_MAX_DATA_SIZE];
+    uint8_t packet[ONION_MAX_PACKET_SIZE];
+    uint64_t hop_copied[3] = {0};
+    uint32_t i, j;
+
+    for (i = 0; i < 3; ++i) {
+        memmove(path_nodes[i].public_key, nodes[i + 1].dht->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        path_nodes[i].ip_port = nodes[i + 1].ip_port;
+    }
+
+    if (create_onion_path(nodes[0].dht, &path, path_nodes) == -1) {
+        printf("Couldn't create the onion path.\n");
+        return 0;
+    }
+
+    /* An id no node handles, the destination drops it. */
+    memset(data, 0, sizeof(data));
+    data[0] = 254;
+
+    const int packet_length = create_onion_packet(packet, sizeof(packet), &path, nodes[NUM_NODES - 1].ip_port, data,
+                              length);
+
+    if (packet_length == -1) {
+        printf("Couldn't create the onion packet.\n");
+        return 0;
+    }
+
+    for (i = 0; i < packets; ++i) {
+        sendpacket(nodes[0].net, path.ip_port1, packet, packet_length);
+
+        for (j = 0; j < 3; ++j) {
+            hop_copied[j] += poll_counted(&nodes[j + 1]);
+        }
+
+        networking_poll(nodes[NUM_NODES - 1].net, NULL);
+    }
+
+    printf("onion forward          %6u %12.1f %12.1f %12.1f\n", length, (double)hop_copied[0] / packets,
+           (double)hop_copied[1] / packets, (double)hop_copied[2] / packets);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint16_t onion_lengths[] = {64, 256, ONION_MAX_DATA_SIZE};
+    uint32_t packets = 10000;
+    uint32_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                packets = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("Usage: %s [-n packets]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (packets == 0) {
+        printf("At least one packet must be sent.\n");
+        return 1;
+    }
+
+    unix_time_update();
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        TCP_Proxy_Info proxy_info = {{{0}}};
+        Node *node = &nodes[i];
+        node->number = i;
+        ip_init(&node->ip_port.ip, 1);
+        node->ip_port.ip.ip6.uint8[15] = i + 1;
+        node->ip_port.port = net_htons(33445);
+        node->net = new_networking_backend(NULL, node->ip_port, &loopback_backend, node);
+        node->dht = node->net ? new_DHT(NULL, node->net, true) : NULL;
+        node->c = node->dht ? new_net_crypto(NULL, node->dht, &proxy_info) : NULL;
+        node->onion = node->c ? new_onion(node->dht) : NULL;
+
+        if (node->onion == NULL) {
+            printf("Couldn't create node %u.\n", i);
+            return 1;
+        }
+    }
+
+    const Node *dest = &nodes[NUM_NODES - 1];
+    new_connection_handler(dest->c, &accept_connection, dest->c);
+    const int id = new_crypto_connection(nodes[0].c, dest->c->self_public_key, dest->dht->self_public_key);
+
+    if (id == -1 || set_direct_ip_port(nodes[0].c, id, dest->ip_port, 1) == -1) {
+        printf("Couldn't create the connection.\n");
+        return 1;
+    }
+
+    for (i = 0; i < 10000 && !(established(&nodes[0], id) && established(dest, accepted_id)); ++i) {
+        run_nodes();
+        usleep(1000);
+    }
+
+    if (!established(&nodes[0], id) || !established(dest, accepted_id)) {
+        printf("The connection wasn't established.\n");
+        return 1;
+    }
+
+    const uint8_t file_header[] = {BENCH_PACKET_ID_FILE_DATA, 0};
+    const uint8_t message_header[] = {BENCH_PACKET_ID_MESSAGE};
+
+    printf("memcpy() bytes per packet\n");
+    printf("path                   length         send      receive\n");
+
+    if (!bench_lossless("file chunk", id, file_header, sizeof(file_header), MAX_CRYPTO_DATA_SIZE - sizeof(file_header),
+                        packets)
+            || !bench_lossless("message", id, message_header, sizeof(message_header), 64, packets)) {
+        return 1;
+    }
+
+    printf("path                   length        hop 1        hop 2        hop 3\n");
+
+    for (i = 0; i < sizeof(onion_lengths) / sizeof(onion_lengths[0]); ++i) {
+        if (!bench_onion(onion_lengths[i], packets)) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < NUM_NODES; ++i) {
+        kill_onion(nodes[i].onion);
+        kill_net_crypto(nodes[i].c);
+        kill_DHT(nodes[i].dht);
+        kill_networking(nodes[i].net);
+    }
+
+    return 0;
+}
@@ -0,0 +1,305 @@
+/* Symmetric crypto benchmark
+ * Measures the throughput of the zero padded crypto_box_afternm() calls
+ * encrypt_data_symmetric() is built on, of libsodium's _easy functions and of
+ * the in place variants for typical packet sizes. Then measures the callers
+ * that encrypt in place, net_crypto data packets and onion packets, built
+ * with in place encryption and built the way they were before, copying every
+ * layer into a buffer of its own.
+ *
+ * Usage: crypto_bench [-s seconds_per_run]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/onion.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef VANILLA_NACL
+#include <sodium.h>
+#else
+#include <crypto_box.h>
+#endif
+
+/* Largest size measured: a TCP relay packet. */
+#define MAX_BENCH_SIZE 2048
+
+typedef int bench_cb(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length);
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static int padded_decrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    VLA(uint8_t, temp_plain, length + CRYPTO_MAC_SIZE + crypto_box_ZEROBYTES);
+    VLA(uint8_t, temp_encrypted, length + CRYPTO_MAC_SIZE + crypto_box_BOXZEROBYTES);
+
+    memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
+    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, in, length + CRYPTO_MAC_SIZE);
+
+    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + CRYPTO_MAC_SIZE + crypto_box_BOXZEROBYTES, nonce,
+                                key) != 0) {
+        return -1;
+    }
+
+    memcpy(out, temp_plain + crypto_box_ZEROBYTES, length);
+    return length;
+}
+
+static int bench_encrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    return encrypt_data_symmetric(key, nonce, in, length, out);
+}
+
+#ifndef VANILLA_NACL
+static int easy_encrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    return crypto_box_easy_afternm(out, in, length, nonce, key) == 0 ? (int)(length + CRYPTO_MAC_SIZE) : -1;
+}
+
+static int easy_decrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    return crypto_box_open_easy_afternm(out, in, length + CRYPTO_MAC_SIZE, nonce, key) == 0 ? (int)length : -1;
+}
+#endif
+
+static int bench_encrypt_inplace(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    return encrypt_data_symmetric_inplace(key, nonce, out, length);
+}
+
+static int bench_decrypt_inplace(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    /* Decrypt a copy, the cipher text is needed again for the next call. */
+    memcpy(out, in, length + CRYPTO_MAC_SIZE);
+    return decrypt_data_symmetric_inplace(key, nonce, out, length + CRYPTO_MAC_SIZE);
+}
+
+/* The header net_crypto puts in front of the data of a data packet. */
+#define DATA_PACKET_HEADER (sizeof(uint32_t) * 2)
+
+static uint16_t data_packet_padding(size_t length)
+{
+    return (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+}
+
+/* A net_crypto data packet as send_data_packet_helper() built it before: the
+ * plain text in a buffer of its own, encrypted into the packet.
+ */
+static int data_packet_copy(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    const uint16_t padding_length = data_packet_padding(length);
+    VLA(uint8_t, plain, DATA_PACKET_HEADER + padding_length + length);
+    memset(plain, 0, DATA_PACKET_HEADER);
+    memset(plain + DATA_PACKET_HEADER, PACKET_ID_PADDING, padding_length);
+    memcpy(plain + DATA_PACKET_HEADER + padding_length, in, length);
+
+    VLA(uint8_t, packet, 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE + SIZEOF_VLA(plain));
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    return encrypt_data_symmetric(key, nonce, plain, SIZEOF_VLA(plain), packet + 1 + sizeof(uint16_t));
+}
+
+/* A net_crypto data packet as it is built now: the plain text in the packet,
+ * encrypted in place.
+ */
+static int data_packet_inplace(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    const uint16_t padding_length = data_packet_padding(length);
+    VLA(uint8_t, packet, 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE + DATA_PACKET_HEADER + padding_length + length);
+    uint8_t *plain = packet + 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE;
+    memset(plain, 0, DATA_PACKET_HEADER);
+    memset(plain + DATA_PACKET_HEADER, PACKET_ID_PADDING, padding_length);
+    memcpy(plain + DATA_PACKET_HEADER + padding_length, in, length);
+
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    memcpy(packet + 1, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    return encrypt_data_symmetric_inplace(key, nonce, packet + 1 + sizeof(uint16_t),
+                                          SIZEOF_VLA(packet) - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE));
+}
+
+/* The three layers of an onion packet as create_onion_packet() built them
+ * before, every layer in a buffer of its own. The addresses and keys of the
+ * path are left zero, they don't change the cost.
+ */
+static int onion_packet_copy(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    VLA(uint8_t, step1, SIZE_IPPORT + length);
+    memset(step1, 0, SIZE_IPPORT);
+    memcpy(step1 + SIZE_IPPORT, in, length);
+
+    VLA(uint8_t, step2, SIZE_IPPORT + ONION_SEND_BASE + length);
+    memset(step2, 0, SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (encrypt_data_symmetric(key, nonce, step1, SIZEOF_VLA(step1), step2 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE) == -1) {
+        return -1;
+    }
+
+    VLA(uint8_t, step3, SIZE_IPPORT + ONION_SEND_BASE * 2 + length);
+    memset(step3, 0, SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (encrypt_data_symmetric(key, nonce, step2, SIZEOF_VLA(step2), step3 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE) == -1) {
+        return -1;
+    }
+
+    return encrypt_data_symmetric(key, nonce, step3, SIZEOF_VLA(step3), out);
+}
+
+/* The three layers of an onion packet as create_onion_packet() builds them
+ * now, every layer where it ends up in the packet, encrypted in place.
+ */
+static int onion_packet_inplace(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, size_t length)
+{
+    uint8_t *layer1 = out;
+    uint8_t *layer2 = layer1 + CRYPTO_MAC_SIZE + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE;
+    uint8_t *layer3 = layer2 + CRYPTO_MAC_SIZE + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE;
+
+    memset(layer3 + CRYPTO_MAC_SIZE, 0, SIZE_IPPORT);
+    memcpy(layer3 + CRYPTO_MAC_SIZE + SIZE_IPPORT, in, length);
+    int len = encrypt_data_symmetric_inplace(key, nonce, layer3, SIZE_IPPORT + length);
+
+    memset(layer2 + CRYPTO_MAC_SIZE, 0, SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    len = encrypt_data_symmetric_inplace(key, nonce, layer2, SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE + len);
+
+    memset(layer1 + CRYPTO_MAC_SIZE, 0, SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    return encrypt_data_symmetric_inplace(key, nonce, layer1, SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE + len);
+}
+
+/* return bytes of plain text processed per second by callback. */
+static double run(bench_cb *callback, const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out,
+                  size_t length, double seconds)
+{
+    const uint64_t end = time_us() + (uint64_t)(seconds * 1000000);
+    const uint64_t start = time_us();
+    uint64_t bytes = 0;
+    uint64_t now;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 256; ++i) {
+            if (callback(key, nonce, in, out, length) == -1) {
+                printf("Crypto failed.\n");
+                exit(1);
+            }
+        }
+
+        bytes += 256 * length;
+        now = time_us();
+    } while (now < end);
+
+    return bytes / ((now - start) / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {64, 256, 1024, 1373, MAX_BENCH_SIZE};
+    double seconds = 0.5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    uint8_t key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint8_t plain[MAX_BENCH_SIZE];
+    uint8_t encrypted[MAX_BENCH_SIZE + CRYPTO_MAC_SIZE];
+    uint8_t out[ONION_MAX_PACKET_SIZE > MAX_BENCH_SIZE + CRYPTO_MAC_SIZE ? ONION_MAX_PACKET_SIZE :
+                MAX_BENCH_SIZE + CRYPTO_MAC_SIZE];
+
+    new_symmetric_key(key);
+    random_nonce(nonce);
+    random_bytes(plain, sizeof(plain));
+
+#ifndef VANILLA_NACL
+    printf("MB/s of plain text      size   padded     easy  in place\n");
+#else
+    printf("MB/s of plain text      size   padded  in place\n");
+#endif
+
+    size_t i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        const size_t length = sizes[i];
+
+        encrypt_data_symmetric(key, nonce, plain, length, encrypted);
+        memcpy(out + CRYPTO_MAC_SIZE, plain, length);
+
+        printf("encrypt              %7u %8.1f", (unsigned int)length,
+               run(bench_encrypt, key, nonce, plain, out, length, seconds) / 1000000);
+#ifndef VANILLA_NACL
+        printf(" %8.1f", run(easy_encrypt, key, nonce, plain, out, length, seconds) / 1000000);
+#endif
+        printf(" %9.1f\n", run(bench_encrypt_inplace, key, nonce, plain, out, length, seconds) / 1000000);
+
+        printf("decrypt              %7u %8.1f", (unsigned int)length,
+               run(padded_decrypt, key, nonce, encrypted, out, length, seconds) / 1000000);
+#ifndef VANILLA_NACL
+        printf(" %8.1f", run(easy_decrypt, key, nonce, encrypted, out, length, seconds) / 1000000);
+#endif
+        printf(" %9.1f\n", run(bench_decrypt_inplace, key, nonce, encrypted, out, length, seconds) / 1000000);
+    }
+
+    static const size_t data_sizes[] = {64, 256, 1024, MAX_CRYPTO_DATA_SIZE};
+    static const size_t onion_sizes[] = {64, 256, ONION_MAX_DATA_SIZE};
+
+    printf("\nMB/s of data by caller   size   copied  in place\n");
+
+    for (i = 0; i < sizeof(data_sizes) / sizeof(data_sizes[0]); ++i) {
+        const size_t length = data_sizes[i];
+        printf("net_crypto data packet %5u %8.1f %9.1f\n", (unsigned int)length,
+               run(data_packet_copy, key, nonce, plain, out, length, seconds) / 1000000,
+               run(data_packet_inplace, key, nonce, plain, out, length, seconds) / 1000000);
+    }
+
+    for (i = 0; i < sizeof(onion_sizes) / sizeof(onion_sizes[0]); ++i) {
+        const size_t length = onion_sizes[i];
+        printf("onion packet           %5u %8.1f %9.1f\n", (unsigned int)length,
+               run(onion_packet_copy, key, nonce, plain, out, length, seconds) / 1000000,
+               run(onion_packet_inplace, key, nonce, plain, out, length, seconds) / 1000000);
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* Crypto connection memory benchmark
+ * Creates many idle net_crypto connections, to random keys that never
+ * answer, and prints the size of a connection and the peak resident memory
+ * before and after, so the memory an idle friend costs can be compared
+ * between versions.
+ *
+ * Usage: crypto_conn_bench [-c connections] [-r rounds]
+ *
+ * -c  Number of connections, 10000 by default.
+ * -r  Number of do_net_crypto() rounds run over them afterwards, 10 by default.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Packets of the connections go nowhere. */
+static int discard_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    return length;
+}
+
+static int discard_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t max_length)
+{
+    return 0;
+}
+
+static const Net_Backend discard_backend = {
+    discard_send,
+    discard_recv,
+};
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static long max_rss_kb(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+
+    return usage.ru_maxrss;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int connections = 10000;
+    unsigned int rounds = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:h")) != -1) {
+        switch (opt) {
+            case 'c':
+                connections = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                rounds = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("Usage: %s [-c connections] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    IP_Port self;
+    ip_init(&self.ip, 1);
+    self.ip.ip6.uint8[15] = 1;
+    self.port = net_htons(33445);
+
+    Networking_Core *net = new_networking_backend(NULL, self, &discard_backend, NULL);
+    DHT *dht = net ? new_DHT(NULL, net, true) : NULL;
+    TCP_Proxy_Info proxy_info = {{{0}}};
+    Net_Crypto *c = dht ? new_net_crypto(NULL, dht, &proxy_info) : NULL;
+
+    if (c == NULL) {
+        printf("Couldn't create the net_crypto instance.\n");
+        return 1;
+    }
+
+    const long rss_before = max_rss_kb();
+    const uint64_t start = time_us();
+    unsigned int i;
+
+    for (i = 0; i < connections; ++i) {
+        uint8_t real_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(real_public_key, sizeof(real_public_key));
+        random_bytes(dht_public_key, sizeof(dht_public_key));
+
+        if (new_crypto_connection(c, real_public_key, dht_public_key) == -1) {
+            printf("Couldn't create connection %u.\n", i);
+            return 1;
+        }
+    }
+
+    const uint64_t created = time_us();
+
+    for (i = 0; i < rounds; ++i) {
+        unix_time_update();
+        do_net_crypto(c, NULL);
+    }
+
+    const uint64_t end = time_us();
+    const long rss_after = max_rss_kb();
+
+    printf("Connection size:       %lu bytes\n", (unsigned long)sizeof(Crypto_Connection));
+    printf("Connections:           %u, created in %.3fs\n", connections, (created - start) / 1000000.0);
+    printf("do_net_crypto() round: %.3fms\n", rounds ? (end - created) / 1000.0 / rounds : 0.0);
+    printf("Max RSS:               %ld kB before, %ld kB after, %.2f kB per connection\n", rss_before, rss_after,
+           connections ? (double)(rss_after - rss_before) / connections : 0.0);
+
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
@@ -0,0 +1,201 @@
+/* Key distance benchmark
+ * Measures how many distance comparisons and common bit counts per second
+ * key_distance.c does, and the byte at a time loops DHT.c used before, for
+ * keys sharing more and more leading bytes, as keys close in the DHT do.
+ *
+ * Usage: distance_bench [-s seconds_per_run]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/key_distance.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define NUM_KEYS 4096
+
+static uint8_t keys[NUM_KEYS][CRYPTO_PUBLIC_KEY_SIZE];
+static uint32_t next_key;
+static volatile uint64_t sink;
+
+typedef void bench_cb(void);
+typedef int distance_cmp_cb(const uint8_t *target, const uint8_t *key1, const uint8_t *key2);
+typedef unsigned int common_bits_cb(const uint8_t *key1, const uint8_t *key2);
+
+/* Both versions are called through these, so neither is inlined into the loop. */
+static distance_cmp_cb *distance_cmp;
+static common_bits_cb *common_bits;
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static int byte_distance_cmp(const uint8_t *target, const uint8_t *key1, const uint8_t *key2)
+{
+    uint32_t i;
+
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        const uint8_t distance1 = target[i] ^ key1[i];
+        const uint8_t distance2 = target[i] ^ key2[i];
+
+        if (distance1 != distance2) {
+            return distance1 < distance2 ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+static unsigned int byte_common_bits(const uint8_t *key1, const uint8_t *key2)
+{
+    unsigned int i, j = 0;
+
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        if (key1[i] == key2[i]) {
+            continue;
+        }
+
+        for (j = 0; j < 8; ++j) {
+            if ((key1[i] & (1 << (7 - j))) != (key2[i] & (1 << (7 - j)))) {
+                break;
+            }
+        }
+
+        break;
+    }
+
+    return i * 8 + j;
+}
+
+/* The first shared bytes of all keys are the same. */
+static void make_keys(uint32_t shared)
+{
+    uint32_t i;
+
+    random_bytes(&keys[0][0], sizeof(keys));
+
+    for (i = 1; i < NUM_KEYS; ++i) {
+        memcpy(keys[i], keys[0], shared);
+    }
+}
+
+static const uint8_t *key(uint32_t offset)
+{
+    return keys[(next_key + offset) % NUM_KEYS];
+}
+
+/* return calls of callback per second. */
+static double run(bench_cb *callback, double seconds)
+{
+    const uint64_t start = time_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000);
+    uint64_t calls = 0;
+    uint64_t now;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 4096; ++i) {
+            callback();
+        }
+
+        calls += 4096;
+        now = time_us();
+    } while (now < end);
+
+    return calls / ((now - start) / 1000000.0);
+}
+
+static void bench_distance_cmp(void)
+{
+    sink += distance_cmp(key(0), key(1), key(2));
+    ++next_key;
+}
+
+static void bench_common_bits(void)
+{
+    sink += common_bits(key(0), key(1));
+    ++next_key;
+}
+
+static double run_distance_cmp(distance_cmp_cb *callback, double seconds)
+{
+    distance_cmp = callback;
+    return run(bench_distance_cmp, seconds);
+}
+
+static double run_common_bits(common_bits_cb *callback, double seconds)
+{
+    common_bits = callback;
+    return run(bench_common_bits, seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t shared_bytes[] = {0, 2, 8, 20};
+    double seconds = 1;
+    uint32_t i, j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("shared bytes   byte cmp/s    key cmp/s   byte bits/s    key bits/s\n");
+
+    for (i = 0; i < sizeof(shared_bytes) / sizeof(shared_bytes[0]); ++i) {
+        make_keys(shared_bytes[i]);
+
+        for (j = 0; j + 2 < NUM_KEYS; ++j) {
+            if (byte_distance_cmp(keys[j], keys[j + 1], keys[j + 2]) != key_distance_cmp(keys[j], keys[j + 1], keys[j + 2])
+                    || byte_common_bits(keys[j], keys[j + 1]) != key_common_bits(keys[j], keys[j + 1])) {
+                printf("Results differ from the byte loops.\n");
+                return 1;
+            }
+        }
+
+        printf("%12u %12.0f %12.0f %13.0f %13.0f\n", shared_bytes[i],
+               run_distance_cmp(byte_distance_cmp, seconds), run_distance_cmp(key_distance_cmp, seconds),
+               run_common_bits(byte_common_bits, seconds), run_common_bits(key_common_bits, seconds));
+    }
+
+    return 0;
+}
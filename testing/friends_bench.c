@@ -0,0 +1,193 @@
+/* Friends lookup benchmark
+ * Measures how many public key lookups per second the friend tables handle
+ * with the Index_Map they use, and with the linear scan over the table they
+ * used before, from 10 to 100000 friends.
+ *
+ * Usage: friends_bench [-s seconds_per_run] [-n max_friends]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/index_map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Looked up keys are picked up front, half of them aren't friends. */
+#define NUM_LOOKUPS 4096
+
+/* Like the friend structs, a public key followed by other state. */
+typedef struct {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t status;
+    uint8_t other[215];
+} Friend;
+
+static Friend *friends;
+static uint32_t num_friends;
+static Index_Map friends_index;
+static uint8_t (*lookups)[CRYPTO_PUBLIC_KEY_SIZE];
+static uint32_t next_lookup;
+static volatile int64_t sink;
+
+typedef void bench_cb(void);
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static int32_t linear_find(const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < num_friends; ++i) {
+        if (friends[i].status != 0 && public_key_cmp(public_key, friends[i].public_key) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void bench_linear(void)
+{
+    sink += linear_find(lookups[next_lookup++ % NUM_LOOKUPS]);
+}
+
+static void bench_index_map(void)
+{
+    sink += index_map_find(&friends_index, lookups[next_lookup++ % NUM_LOOKUPS]);
+}
+
+/* return calls of callback per second. */
+static double run(bench_cb *callback, double seconds)
+{
+    const uint64_t start = time_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000);
+    uint64_t calls = 0;
+    uint64_t now;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 16; ++i) {
+            callback();
+        }
+
+        calls += 16;
+        now = time_us();
+    } while (now < end);
+
+    return calls / ((now - start) / 1000000.0);
+}
+
+static void add_friends(uint32_t count)
+{
+    Friend *temp = (Friend *)realloc(friends, count * sizeof(Friend));
+
+    if (temp == NULL) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+
+    friends = temp;
+
+    while (num_friends < count) {
+        Friend *f = &friends[num_friends];
+        memset(f, 0, sizeof(Friend));
+        random_bytes(f->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        f->status = 1;
+
+        if (index_map_add(&friends_index, f->public_key, num_friends) == -1) {
+            printf("Failed to add friend.\n");
+            exit(1);
+        }
+
+        ++num_friends;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < NUM_LOOKUPS; ++i) {
+        if (i % 2 == 0) {
+            memcpy(lookups[i], friends[random_int() % num_friends].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        } else {
+            random_bytes(lookups[i], CRYPTO_PUBLIC_KEY_SIZE);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 0.5;
+    uint32_t max_friends = 100000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            case 'n':
+                max_friends = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run] [-n max_friends]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    lookups = (uint8_t (*)[CRYPTO_PUBLIC_KEY_SIZE])malloc(NUM_LOOKUPS * CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (lookups == NULL || index_map_init(&friends_index, CRYPTO_PUBLIC_KEY_SIZE, 0) == -1) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    printf("%10s %16s %16s\n", "friends", "linear/s", "index_map/s");
+
+    uint32_t count;
+
+    for (count = 10; count <= max_friends; count *= 10) {
+        add_friends(count);
+        const double linear = run(bench_linear, seconds);
+        const double indexed = run(bench_index_map, seconds);
+        printf("%10u %16.0f %16.0f\n", count, linear, indexed);
+    }
+
+    index_map_free(&friends_index);
+    free(friends);
+    free(lookups);
+    return 0;
+}
@@ -0,0 +1,285 @@
+/* Get nodes benchmark
+ * Fills the close list of a DHT with good nodes, every bucket full, and
+ * measures how many get nodes requests it handles per second, and how fast
+ * get_close_nodes() alone is. With -f, that many DHT friends with full client
+ * lists are added first, get_close_nodes() looks through them too.
+ *
+ * Usage: getnodes_bench [-s seconds_per_run] [-k sender_keys] [-f friends]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define GET_NODES_PLAIN_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(uint64_t))
+#define GET_NODES_SIZE (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + GET_NODES_PLAIN_SIZE + CRYPTO_MAC_SIZE)
+
+/* Requests are built up front, so the run measures their handling only. */
+#define NUM_PACKETS 4096
+
+typedef struct {
+    IP_Port source;
+    uint8_t data[GET_NODES_SIZE];
+} Request;
+
+static DHT *dht;
+static Request *requests;
+static uint32_t next_request;
+static volatile uint64_t sink;
+
+typedef void bench_cb(void);
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+/* A public key sharing exactly bucket bits with ours. */
+static void key_in_bucket(uint8_t *public_key, unsigned int bucket)
+{
+    random_bytes(public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(public_key, dht->self_public_key, bucket / 8);
+
+    const uint8_t mask = 0xff << (7 - bucket % 8);
+    public_key[bucket / 8] = (dht->self_public_key[bucket / 8] & mask) | (public_key[bucket / 8] & ~mask);
+    public_key[bucket / 8] ^= 0x80 >> (bucket % 8);
+}
+
+/* return number of nodes in the close list afterwards. */
+static unsigned int fill_close_list(void)
+{
+    unsigned int bucket, i, count = 0;
+
+    for (bucket = 0; bucket < LCLIENT_LENGTH; ++bucket) {
+        for (i = 0; i < LCLIENT_NODES; ++i) {
+            uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+            IP_Port ip_port;
+
+            key_in_bucket(public_key, bucket);
+            ip_init(&ip_port.ip, 0);
+            ip_port.ip.ip4.uint32 = net_htonl(0x01000000 + bucket * LCLIENT_NODES + i);
+            ip_port.port = net_htons(33445);
+            addto_lists(dht, ip_port, public_key);
+        }
+    }
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        count += !is_timeout(dht->close_clientlist[i].assoc4.timestamp, BAD_NODE_TIMEOUT);
+    }
+
+    return count;
+}
+
+/* return number of friend client list entries filled. */
+static unsigned int fill_friends(uint32_t num_friends)
+{
+    unsigned int i, j, count = 0;
+
+    for (i = 0; i < num_friends; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(public_key, sizeof(public_key));
+
+        if (DHT_addfriend(dht, public_key, NULL, NULL, 0, NULL) != 0) {
+            printf("Failed to add friend.\n");
+            exit(1);
+        }
+    }
+
+    /* Each node goes into the client list of every friend that has room. */
+    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        IP_Port ip_port;
+
+        random_bytes(public_key, sizeof(public_key));
+        ip_init(&ip_port.ip, 0);
+        ip_port.ip.ip4.uint32 = net_htonl(0x02000000 + i);
+        ip_port.port = net_htons(33445);
+        addto_lists(dht, ip_port, public_key);
+    }
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+            count += !is_timeout(dht->friends_list[i].client_list[j].assoc4.timestamp, BAD_NODE_TIMEOUT);
+        }
+    }
+
+    return count;
+}
+
+static void make_requests(uint32_t num_keys, IP_Port source)
+{
+    uint8_t (*public_keys)[CRYPTO_PUBLIC_KEY_SIZE] = (uint8_t (*)[CRYPTO_PUBLIC_KEY_SIZE])malloc(
+                num_keys * CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t (*shared_keys)[CRYPTO_SHARED_KEY_SIZE] = (uint8_t (*)[CRYPTO_SHARED_KEY_SIZE])malloc(
+                num_keys * CRYPTO_SHARED_KEY_SIZE);
+    uint32_t i;
+
+    if (public_keys == NULL || shared_keys == NULL) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < num_keys; ++i) {
+        uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+        crypto_new_keypair(public_keys[i], secret_key);
+        encrypt_precompute(dht->self_public_key, secret_key, shared_keys[i]);
+    }
+
+    for (i = 0; i < NUM_PACKETS; ++i) {
+        Request *request = &requests[i];
+        const uint32_t key = i % num_keys;
+        uint8_t plain[GET_NODES_PLAIN_SIZE];
+
+        /* Look for random nodes, as others searching the DHT do. */
+        random_bytes(plain, sizeof(plain));
+
+        request->source = source;
+        request->data[0] = NET_PACKET_GET_NODES;
+        memcpy(request->data + 1, public_keys[key], CRYPTO_PUBLIC_KEY_SIZE);
+        random_nonce(request->data + 1 + CRYPTO_PUBLIC_KEY_SIZE);
+        encrypt_data_symmetric(shared_keys[key], request->data + 1 + CRYPTO_PUBLIC_KEY_SIZE, plain, sizeof(plain),
+                               request->data + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
+    }
+
+    free(public_keys);
+    free(shared_keys);
+}
+
+static void bench_handle_getnodes(void)
+{
+    const Request *request = &requests[next_request++ % NUM_PACKETS];
+    networking_inject_packet(dht->net, request->source, request->data, sizeof(request->data), NULL);
+}
+
+static void bench_get_close_nodes(void)
+{
+    const Request *request = &requests[next_request++ % NUM_PACKETS];
+    Node_format nodes[MAX_SENT_NODES];
+
+    /* The nonce is as random as a searched for public key. */
+    sink += get_close_nodes(dht, request->data + 1 + CRYPTO_PUBLIC_KEY_SIZE - 8, nodes, 0, 1, 0);
+}
+
+/* return calls of callback per second. */
+static double run(bench_cb *callback, double seconds)
+{
+    const uint64_t start = time_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000);
+    uint64_t calls = 0;
+    uint64_t now;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 256; ++i) {
+            callback();
+        }
+
+        calls += 256;
+        now = time_us();
+    } while (now < end);
+
+    return calls / ((now - start) / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 2;
+    uint32_t num_keys = 256;
+    uint32_t num_friends = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:k:f:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            case 'k':
+                num_keys = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'f':
+                num_friends = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run] [-k sender_keys] [-f friends]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (num_keys == 0) {
+        num_keys = 1;
+    }
+
+    unix_time_update();
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = net_htonl(0x7f000001);
+    dht = new_DHT(NULL, new_networking(NULL, ip, 33445), true);
+    requests = (Request *)malloc(NUM_PACKETS * sizeof(Request));
+
+    if (dht == NULL || requests == NULL) {
+        printf("Couldn't create the DHT.\n");
+        return 1;
+    }
+
+    printf("Close list: %u of %u nodes\n", fill_close_list(), LCLIENT_LIST);
+
+    if (num_friends != 0) {
+        printf("Friends: %u, %u client list entries\n", num_friends, fill_friends(num_friends));
+    }
+
+    /* Answers go to a port no one listens on. */
+    IP_Port source;
+    source.ip = ip;
+    source.port = net_htons(9);
+    make_requests(num_keys, source);
+
+    printf("get_close_nodes  %10.0f calls/s\n", run(bench_get_close_nodes, seconds));
+    printf("handle_getnodes  %10.0f packets/s (%u sender keys)\n", run(bench_handle_getnodes, seconds), num_keys);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Client_data %u bytes, max RSS %ld kB\n", (unsigned int)sizeof(Client_data), usage.ru_maxrss);
+
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+    free(requests);
+    return 0;
+}
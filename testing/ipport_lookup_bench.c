@@ -0,0 +1,218 @@
+/* IP_Port lookup benchmark
+ * Measures what finding the connection a UDP packet belongs to costs with the
+ * index of packed ip_ports net_crypto uses, and with the sorted list of raw
+ * IP_Port structs it used before, for 1000, 10000 and 100000 connections with
+ * an IPv4 and an IPv6 address each. Also measures changing the address of a
+ * connection, which moved the entries behind it in the sorted list.
+ *
+ * Usage: ipport_lookup_bench [-s seconds_per_run]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/index_map.h"
+#include "../toxcore/list.h"
+#include "../toxcore/network.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Addresses given to connections and back are picked from these. */
+#define NUM_NEW_IP_PORTS 1024
+
+static IP_Port *ip_ports;
+static uint32_t num_ip_ports;
+static uint32_t next_ip_port;
+static IP_Port new_ip_ports[NUM_NEW_IP_PORTS];
+static uint32_t next_new_ip_port;
+static BS_LIST list;
+static Index_Map map;
+static volatile int64_t sink;
+
+typedef void bench_cb(void);
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static void random_ip_port(IP_Port *ip_port, bool ipv6)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+
+    if (ipv6) {
+        ip_port->ip.family = AF_INET6;
+        random_bytes(ip_port->ip.ip6.uint8, sizeof(IP6));
+    } else {
+        ip_port->ip.family = AF_INET;
+        random_bytes(ip_port->ip.ip4.uint8, sizeof(IP4));
+    }
+
+    ip_port->port = (uint16_t)random_int();
+}
+
+static const IP_Port *next(void)
+{
+    next_ip_port = (next_ip_port + 7919) % num_ip_ports;
+    return &ip_ports[next_ip_port];
+}
+
+static int map_find(const IP_Port *ip_port)
+{
+    uint8_t key[IPPORT_KEY_SIZE];
+    ipport_pack_key(key, ip_port);
+    return index_map_find(&map, key);
+}
+
+static int map_add(const IP_Port *ip_port, int id)
+{
+    uint8_t key[IPPORT_KEY_SIZE];
+    ipport_pack_key(key, ip_port);
+    return index_map_add(&map, key, id);
+}
+
+static void map_remove(const IP_Port *ip_port)
+{
+    uint8_t key[IPPORT_KEY_SIZE];
+    ipport_pack_key(key, ip_port);
+    index_map_remove(&map, key);
+}
+
+/* return calls of callback per second. */
+static double run(bench_cb *callback, double seconds)
+{
+    const uint64_t start = time_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000);
+    uint64_t calls = 0;
+    uint64_t now;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 1024; ++i) {
+            callback();
+        }
+
+        calls += 1024;
+        now = time_us();
+    } while (now < end);
+
+    return calls / ((now - start) / 1000000.0);
+}
+
+static void bench_list_find(void)
+{
+    sink += bs_list_find(&list, (const uint8_t *)next());
+}
+
+static void bench_map_find(void)
+{
+    sink += map_find(next());
+}
+
+/* A connection gets a new address and gives it back, as add_ip_port_connection() does. */
+static void bench_list_change(void)
+{
+    const IP_Port *ip_port = &new_ip_ports[next_new_ip_port++ % NUM_NEW_IP_PORTS];
+    bs_list_add(&list, (const uint8_t *)ip_port, 0);
+    bs_list_remove(&list, (const uint8_t *)ip_port, 0);
+}
+
+static void bench_map_change(void)
+{
+    const IP_Port *ip_port = &new_ip_ports[next_new_ip_port++ % NUM_NEW_IP_PORTS];
+    map_add(ip_port, 0);
+    map_remove(ip_port);
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t connections[] = {1000, 10000, 100000};
+    double seconds = 1;
+    uint32_t i, j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (i = 0; i < NUM_NEW_IP_PORTS; ++i) {
+        random_ip_port(&new_ip_ports[i], i % 2);
+    }
+
+    printf("connections   list ns/find   index ns/find   list ns/change   index ns/change\n");
+
+    for (i = 0; i < sizeof(connections) / sizeof(connections[0]); ++i) {
+        num_ip_ports = connections[i] * 2;
+        ip_ports = (IP_Port *)malloc(num_ip_ports * sizeof(IP_Port));
+
+        if (ip_ports == NULL || index_map_init(&map, IPPORT_KEY_SIZE, 0) == -1) {
+            printf("Couldn't allocate the addresses.\n");
+            return 1;
+        }
+
+        bs_list_init(&list, sizeof(IP_Port), 8);
+
+        for (j = 0; j < num_ip_ports; ++j) {
+            random_ip_port(&ip_ports[j], j % 2);
+
+            if (!bs_list_add(&list, (const uint8_t *)&ip_ports[j], j / 2) || map_add(&ip_ports[j], j / 2) == -1) {
+                printf("Couldn't add address %u.\n", j);
+                return 1;
+            }
+        }
+
+        for (j = 0; j < num_ip_ports; ++j) {
+            if (bs_list_find(&list, (const uint8_t *)&ip_ports[j]) != map_find(&ip_ports[j])) {
+                printf("The list and the index found different connections.\n");
+                return 1;
+            }
+        }
+
+        printf("%11u %14.1f %15.1f %16.1f %17.1f\n", connections[i],
+               1000000000.0 / run(bench_list_find, seconds), 1000000000.0 / run(bench_map_find, seconds),
+               1000000000.0 / run(bench_list_change, seconds), 1000000000.0 / run(bench_map_change, seconds));
+
+        bs_list_free(&list);
+        index_map_free(&map);
+        free(ip_ports);
+    }
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/* Packet pool benchmark
+ * Keeps a window of packets in flight, as the send array of a connection does
+ * during a transfer: every step stores a new packet and frees the oldest one.
+ * Measures how many steps per second malloc() and free() manage, and the
+ * packet pool net_crypto uses, for file chunks only and for a mix of file
+ * chunks and small messages.
+ *
+ * Usage: packet_pool_bench [-s seconds_per_run] [-w window]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/packet_pool.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Lengths are picked from this many random ones made up front. */
+#define NUM_LENGTHS 4096
+
+static uint16_t lengths[NUM_LENGTHS];
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static size_t packet_size(uint16_t length)
+{
+    return offsetof(Packet_Data, data) + length;
+}
+
+/* Every packet is a file chunk, or one in small_percent is a short message. */
+static void make_lengths(unsigned int small_percent)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_LENGTHS; ++i) {
+        lengths[i] = (unsigned int)rand() % 100 < small_percent ? 2 + rand() % 200 : MAX_CRYPTO_DATA_SIZE;
+    }
+}
+
+/* pool is NULL for malloc() and free().
+ *
+ * return steps per second.
+ */
+static double run(Packet_Pool *pool, uint32_t window, double seconds)
+{
+    Packet_Data **packets = (Packet_Data **)calloc(window, sizeof(Packet_Data *));
+    const uint64_t start = time_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000);
+    uint64_t steps = 0;
+    uint64_t now;
+
+    if (packets == NULL) {
+        return 0;
+    }
+
+    do {
+        uint32_t i;
+
+        for (i = 0; i < 4096; ++i, ++steps) {
+            Packet_Data **slot = &packets[steps % window];
+
+            if (*slot != NULL) {
+                if (pool != NULL) {
+                    packet_pool_free(pool, *slot, packet_size((*slot)->length));
+                } else {
+                    free(*slot);
+                }
+            }
+
+            const uint16_t length = lengths[steps % NUM_LENGTHS];
+            *slot = (Packet_Data *)(pool != NULL ? packet_pool_alloc(pool, packet_size(length))
+                                    : malloc(packet_size(length)));
+
+            if (*slot == NULL) {
+                printf("Allocation failed.\n");
+                exit(1);
+            }
+
+            (*slot)->sent_time = steps;
+            (*slot)->length = length;
+            memset((*slot)->data, 0, length);
+        }
+
+        now = time_us();
+    } while (now < end);
+
+    const double steps_per_second = steps / ((now - start) / 1000000.0);
+    uint32_t i;
+
+    for (i = 0; i < window; ++i) {
+        if (pool == NULL) {
+            free(packets[i]);
+        } else if (packets[i] != NULL) {
+            packet_pool_free(pool, packets[i], packet_size(packets[i]->length));
+        }
+    }
+
+    free(packets);
+    return steps_per_second;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int small_percents[] = {0, 50, 90};
+    double seconds = 1;
+    uint32_t window = 4096;
+    uint32_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:w:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            case 'w':
+                window = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run] [-w window]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (window == 0) {
+        printf("The window must hold at least one packet.\n");
+        return 1;
+    }
+
+    /* The size classes of the pools of connections. */
+    const size_t sizes[] = {packet_size(64), packet_size(256), sizeof(Packet_Data)};
+    Packet_Pool pool;
+
+    if (packet_pool_init(&pool, sizes, sizeof(sizes) / sizeof(sizes[0])) != 0) {
+        printf("Couldn't initialize the packet pool.\n");
+        return 1;
+    }
+
+    printf("window %u packets\n", window);
+    printf("small messages   million malloc steps/s   million pool steps/s\n");
+
+    for (i = 0; i < sizeof(small_percents) / sizeof(small_percents[0]); ++i) {
+        make_lengths(small_percents[i]);
+        const double malloc_steps = run(NULL, window, seconds);
+        const double pool_steps = run(&pool, window, seconds);
+        printf("%13u%% %24.2f %22.2f\n", small_percents[i], malloc_steps / 1000000, pool_steps / 1000000);
+    }
+
+    const uint32_t kept = packet_pool_free_blocks(&pool);
+    packet_pool_trim(&pool);
+    packet_pool_trim(&pool);
+    printf("Blocks kept after the runs: %u, after trimming twice: %u\n", kept, packet_pool_free_blocks(&pool));
+
+    packet_pool_free_all(&pool);
+    return 0;
+}
@@ -0,0 +1,271 @@
+/* Packet replay
+ * Feeds a packet capture written by networking_capture_start() through the
+ * packet handlers of a bootstrap node (DHT, onion, onion announce and
+ * net_crypto) and reports how fast they were handled.
+ *
+ * Usage: packet_replay [-k keys_file] [-p] [-l loops] capture_file
+ *
+ * -k  Use the keys of the node the capture was taken on, in the format of the
+ *     keys file of tox-bootstrapd, so packets encrypted to it can be decrypted.
+ * -p  Replay at the pace the packets were recorded at instead of as fast as
+ *     possible.
+ * -l  Replay the capture that many times.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/onion.h"
+#include "../toxcore/onion_announce.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define KEYS_SIZE (CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SECRET_KEY_SIZE)
+
+/* Replies of the handlers go nowhere. */
+static int discard_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    return length;
+}
+
+static int discard_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t max_length)
+{
+    return 0;
+}
+
+static const Net_Backend discard_backend = {
+    discard_send,
+    discard_recv,
+};
+
+/* return wall clock time in us. */
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static int load_keys(DHT *dht, const char *path)
+{
+    uint8_t keys[KEYS_SIZE];
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    const size_t read = fread(keys, 1, sizeof(keys), file);
+    fclose(file);
+
+    if (read != sizeof(keys)) {
+        return -1;
+    }
+
+    memcpy(dht->self_public_key, keys, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(dht->self_secret_key, keys + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_SECRET_KEY_SIZE);
+    return 0;
+}
+
+/* Replay the capture at path once.
+ *
+ * return the number of packets replayed.
+ * return -1 on failure.
+ */
+static long replay(Networking_Core *net, const char *path, int paced, uint64_t *bytes)
+{
+    Net_Capture_Reader *reader = net_capture_open(path);
+
+    if (reader == NULL) {
+        printf("Couldn't open capture %s.\n", path);
+        return -1;
+    }
+
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    IP_Port ip_port;
+    uint64_t time;
+    uint64_t first_time = 0;
+    const uint64_t start = time_us();
+    long count = 0;
+    int length;
+
+    while ((length = net_capture_read(reader, &time, &ip_port, data, sizeof(data))) > 0) {
+        if (count == 0) {
+            first_time = time;
+        }
+
+        if (paced) {
+            const uint64_t due = start + (time - first_time);
+            const uint64_t now = time_us();
+
+            if (due > now) {
+                usleep(due - now);
+            }
+
+            unix_time_update();
+        } else if (count % 1024 == 0) {
+            unix_time_update();
+        }
+
+        networking_inject_packet(net, ip_port, data, length, NULL);
+        *bytes += length;
+        ++count;
+    }
+
+    net_capture_close(reader);
+
+    if (length == -1) {
+        printf("Capture %s is truncated or invalid after %ld packets.\n", path, count);
+    }
+
+    return count;
+}
+
+static void print_stats(const Networking_Core *net)
+{
+    Net_Stats stats;
+
+    if (networking_get_stats(net, &stats) != 0) {
+        printf("Build toxcore with NET_STATS for the time spent per packet id.\n");
+        return;
+    }
+
+    printf("id   packets      bytes  unhandled  handler us  us/packet\n");
+
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        const Net_Packet_Stats *packet = &stats.packets[i];
+
+        if (packet->recv_packets == 0) {
+            continue;
+        }
+
+        printf("%3u %8llu %10llu %10llu %11llu %10.2f\n", i, (unsigned long long)packet->recv_packets,
+               (unsigned long long)packet->recv_bytes, (unsigned long long)packet->recv_unhandled,
+               (unsigned long long)packet->handler_time, (double)packet->handler_time / packet->recv_packets);
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-k keys_file] [-p] [-l loops] capture_file\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *keys_file = NULL;
+    int paced = 0;
+    unsigned int loops = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:pl:h")) != -1) {
+        switch (opt) {
+            case 'k':
+                keys_file = optarg;
+                break;
+
+            case 'p':
+                paced = 1;
+                break;
+
+            case 'l':
+                loops = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || loops == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    IP_Port self;
+    ip_init(&self.ip, 1);
+    self.ip.ip6.uint8[15] = 1;
+    self.port = net_htons(33445);
+
+    Networking_Core *net = new_networking_backend(NULL, self, &discard_backend, NULL);
+    DHT *dht = net ? new_DHT(NULL, net, true) : NULL;
+
+    if (dht == NULL) {
+        printf("Couldn't create DHT.\n");
+        return 1;
+    }
+
+    if (keys_file != NULL && load_keys(dht, keys_file) != 0) {
+        printf("Couldn't read keys from %s.\n", keys_file);
+        return 1;
+    }
+
+    TCP_Proxy_Info proxy_info = {{{0}}};
+    Net_Crypto *c = new_net_crypto(NULL, dht, &proxy_info);
+    Onion *onion = new_onion(dht);
+    Onion_Announce *onion_a = new_onion_announce(dht);
+
+    if (c == NULL || onion == NULL || onion_a == NULL) {
+        printf("Couldn't create the onion and net_crypto instances.\n");
+        return 1;
+    }
+
+    uint64_t bytes = 0;
+    long packets = 0;
+    const uint64_t start = time_us();
+    unsigned int i;
+
+    for (i = 0; i < loops; ++i) {
+        const long count = replay(net, argv[optind], paced, &bytes);
+
+        if (count == -1) {
+            return 1;
+        }
+
+        packets += count;
+    }
+
+    const double seconds = (time_us() - start) / 1000000.0;
+
+    printf("Replayed %ld packets (%llu bytes) in %.3fs: %.0f packets/s, %.1f MB/s\n", packets,
+           (unsigned long long)bytes, seconds, seconds > 0 ? packets / seconds : 0,
+           seconds > 0 ? bytes / seconds / 1000000.0 : 0);
+    print_stats(net);
+
+    kill_onion_announce(onion_a);
+    kill_onion(onion);
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* Ping array benchmark
+ * Adds entries to a ping array the size of the DHT one and answers half of
+ * them a few hundred entries later, the rest time out or are written over,
+ * as with pings to a busy DHT. Prints the adds and checks per second and the
+ * peak resident memory after every report interval, so a long run shows
+ * whether memory use stays flat.
+ *
+ * Usage: ping_array_bench [-s seconds_per_report] [-n reports]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/network.h"
+#include "../toxcore/ping_array.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* As the DHT ping array and the data of a ping in ping.c. */
+#define PING_ARRAY_SIZE 512
+#define PING_TIMEOUT 5
+#define PING_DATA_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint64_t))
+
+/* Answers arrive this many pings after their request. */
+#define ANSWER_DELAY 256
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static long max_rss_kb(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+
+    return usage.ru_maxrss;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 1;
+    unsigned int reports = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            case 'n':
+                reports = atoi(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_report] [-n reports]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    Ping_Array array;
+    uint64_t ping_ids[ANSWER_DELAY] = {0};
+    uint8_t data[PING_DATA_SIZE];
+    uint64_t added = 0;
+    unsigned int i;
+
+    unix_time_update();
+
+    if (ping_array_init(&array, PING_ARRAY_SIZE, PING_TIMEOUT, PING_DATA_SIZE) != 0) {
+        printf("Couldn't create the ping array.\n");
+        return 1;
+    }
+
+    random_bytes(data, sizeof(data));
+
+    printf("seconds   million adds/s   million checks/s   answered   max RSS (kB)\n");
+
+    for (i = 0; i < reports; ++i) {
+        const uint64_t start = time_us();
+        const uint64_t end = start + (uint64_t)(seconds * 1000000);
+        uint64_t adds = 0, checks = 0, answered = 0;
+        uint64_t now;
+
+        do {
+            unsigned int j;
+
+            unix_time_update();
+
+            for (j = 0; j < 1024; ++j) {
+                const uint32_t slot = added % ANSWER_DELAY;
+
+                /* Every other ping sent ANSWER_DELAY pings ago is answered now. */
+                if (ping_ids[slot] != 0 && slot % 2 == 0) {
+                    if (ping_array_check(data, sizeof(data), &array, ping_ids[slot]) == sizeof(data)) {
+                        ++answered;
+                    }
+
+                    ++checks;
+                }
+
+                ping_ids[slot] = ping_array_add(&array, data, sizeof(data));
+
+                if (ping_ids[slot] == 0) {
+                    printf("Ping array add failed.\n");
+                    return 1;
+                }
+
+                ++added;
+                ++adds;
+            }
+
+            now = time_us();
+        } while (now < end);
+
+        const double elapsed = (now - start) / 1000000.0;
+        printf("%7.0f %16.2f %18.2f %9.0f%% %14ld\n", (i + 1) * seconds, adds / elapsed / 1000000,
+               checks / elapsed / 1000000, checks ? 100.0 * answered / checks : 0.0, max_rss_kb());
+        fflush(stdout);
+    }
+
+    ping_array_free_all(&array);
+    return 0;
+}
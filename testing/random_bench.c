@@ -0,0 +1,193 @@
+/* Random number benchmark
+ * Measures how fast random_64b(), random_int() and random_nonce() are next to
+ * asking the system RNG for every value, and how fast the ping id paths built
+ * on them are: the ping array of DHT pings and the sendback of onion
+ * announce requests.
+ *
+ * Usage: random_bench [-s seconds_per_run]
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/network.h"
+#include "../toxcore/ping_array.h"
+#include "../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef VANILLA_NACL
+#include <sodium.h>
+#else
+#include <randombytes.h>
+#endif
+
+/* Sizes of the ping array and of the data stored in it, as in ping.c and
+ * onion_client.c.
+ */
+#define PING_ARRAY_SIZE 512
+#define PING_TIMEOUT 5
+#define PING_DATA_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint64_t))
+#define SENDBACK_DATA_SIZE (sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t))
+
+typedef void bench_cb(void);
+
+static Ping_Array ping_array;
+static volatile uint64_t sink;
+
+static uint64_t time_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
+static void bench_random_64b(void)
+{
+    sink += random_64b();
+}
+
+static void bench_system_64b(void)
+{
+    uint64_t value;
+    randombytes((uint8_t *)&value, sizeof(value));
+    sink += value;
+}
+
+static void bench_random_int(void)
+{
+    sink += random_int();
+}
+
+static void bench_system_int(void)
+{
+    uint32_t value;
+    randombytes((uint8_t *)&value, sizeof(value));
+    sink += value;
+}
+
+static void bench_random_nonce(void)
+{
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    random_nonce(nonce);
+    sink += nonce[0];
+}
+
+static void bench_system_nonce(void)
+{
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    randombytes(nonce, sizeof(nonce));
+    sink += nonce[0];
+}
+
+/* A DHT ping: a ping id for the node pinged and its answer checked. */
+static void bench_ping(void)
+{
+    uint8_t data[PING_DATA_SIZE] = {0};
+    const uint64_t ping_id = ping_array_add(&ping_array, data, sizeof(data));
+
+    if (ping_array_check(data, sizeof(data), &ping_array, ping_id) != sizeof(data)) {
+        printf("Ping array check failed.\n");
+        exit(1);
+    }
+}
+
+/* An onion announce request: a sendback ping id and a nonce per onion layer. */
+static void bench_announce(void)
+{
+    uint8_t data[SENDBACK_DATA_SIZE] = {0};
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    unsigned int i;
+
+    sink += ping_array_add(&ping_array, data, sizeof(data));
+
+    for (i = 0; i < 4; ++i) {
+        random_nonce(nonce);
+    }
+}
+
+/* return calls of callback per second. */
+static double run(bench_cb *callback, double seconds)
+{
+    const uint64_t start = time_us();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000);
+    uint64_t calls = 0;
+    uint64_t now;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 1024; ++i) {
+            callback();
+        }
+
+        calls += 1024;
+        now = time_us();
+    } while (now < end);
+
+    return calls / ((now - start) / 1000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 0.5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-s seconds_per_run]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    unix_time_update();
+
+    if (ping_array_init(&ping_array, PING_ARRAY_SIZE, PING_TIMEOUT, PING_DATA_SIZE) != 0) {
+        printf("Couldn't create the ping array.\n");
+        return 1;
+    }
+
+    printf("million calls/s   toxcore   system RNG\n");
+    printf("random_64b     %10.2f %12.2f\n", run(bench_random_64b, seconds) / 1000000,
+           run(bench_system_64b, seconds) / 1000000);
+    printf("random_int     %10.2f %12.2f\n", run(bench_random_int, seconds) / 1000000,
+           run(bench_system_int, seconds) / 1000000);
+    printf("random_nonce   %10.2f %12.2f\n", run(bench_random_nonce, seconds) / 1000000,
+           run(bench_system_nonce, seconds) / 1000000);
+    printf("ping           %10.2f\n", run(bench_ping, seconds) / 1000000);
+    printf("announce       %10.2f\n", run(bench_announce, seconds) / 1000000);
+
+    ping_array_free_all(&ping_array);
+    return 0;
+}
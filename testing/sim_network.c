@@ -0,0 +1,564 @@
+/*
+ * An in-process simulated network for running many DHT nodes in one process.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sim_network.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Node n is at SIM_BASE_IP + n (11.0.0.1 and up, so it isn't a LAN address)
+ * port SIM_PORT. Nodes behind a symmetric NAT are seen on SIM_PORT + 1 and up.
+ */
+#define SIM_BASE_IP 0x0B000001
+#define SIM_PORT 33445
+#define SIM_MAX_MAPPED_PORTS (65535 - SIM_PORT)
+
+/* Start the clock at one hour, some code treats timestamps near 0 as unset. */
+#define SIM_START_TIME (3600ULL * 1000 * 1000)
+
+typedef struct Sim_Packet {
+    struct Sim_Packet *next;
+    /* Arrival time in us, then the order the packets were sent in. */
+    uint64_t time;
+    uint64_t seq;
+
+    uint32_t to;
+    uint16_t to_port;
+    IP_Port from;
+
+    uint16_t length;
+    uint8_t *data;
+} Sim_Packet;
+
+typedef struct {
+    /* Address the node has sent to, 0 if the slot is empty. */
+    uint64_t key;
+    /* Port a symmetric NAT maps the node to for that address. */
+    uint16_t port;
+} Sim_Peer;
+
+typedef struct {
+    Sim_Network *sim;
+    uint32_t number;
+    Sim_Nat nat;
+
+    Sim_Peer *peers;
+    uint32_t peers_size;
+    uint32_t num_peers;
+
+    /* Address each mapped port of a symmetric NAT belongs to, port
+     * SIM_PORT + 1 + i at index i.
+     */
+    uint64_t *mapped;
+    uint32_t num_mapped;
+
+    /* Time in us the uplink is busy until. */
+    uint64_t busy_until;
+    uint64_t packets_sent;
+
+    Sim_Packet *inbox;
+    Sim_Packet *inbox_last;
+} Sim_Node;
+
+struct Sim_Network {
+    /* Virtual time in us. */
+    uint64_t time;
+    uint64_t random_state;
+
+    Sim_Link link;
+    sim_link_cb *link_callback;
+    void *link_callback_object;
+
+    Sim_Node **nodes;
+    uint32_t num_nodes;
+    uint32_t nodes_size;
+
+    /* Packets in flight, a binary heap ordered by arrival. */
+    Sim_Packet **heap;
+    uint32_t heap_count;
+    uint32_t heap_size;
+    uint64_t seq;
+
+    uint64_t packets_sent;
+    uint64_t packets_dropped;
+};
+
+static uint64_t sim_clock(void *object)
+{
+    const Sim_Network *sim = (const Sim_Network *)object;
+    return sim->time / 1000;
+}
+
+uint32_t sim_random(Sim_Network *sim)
+{
+    /* splitmix64 */
+    uint64_t z = (sim->random_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (uint32_t)((z ^ (z >> 31)) >> 32);
+}
+
+static uint64_t address_key(IP_Port ip_port)
+{
+    return ((uint64_t)net_ntohl(ip_port.ip.ip4.uint32) << 16) | net_ntohs(ip_port.port);
+}
+
+/* return the node at ip, or NULL if there is none. */
+static Sim_Node *node_at(const Sim_Network *sim, const IP *ip)
+{
+    if (ip->family != AF_INET) {
+        return NULL;
+    }
+
+    const uint32_t number = net_ntohl(ip->ip4.uint32) - SIM_BASE_IP;
+
+    if (number >= sim->num_nodes) {
+        return NULL;
+    }
+
+    return sim->nodes[number];
+}
+
+/* return the index of key in peers, or of the empty slot it would go in. */
+static uint32_t peer_index(const Sim_Peer *peers, uint32_t size, uint64_t key)
+{
+    uint32_t i = (uint32_t)(key * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+
+    while (peers[i].key != 0 && peers[i].key != key) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return i;
+}
+
+static Sim_Peer *find_peer(const Sim_Node *node, uint64_t key)
+{
+    if (node->peers_size == 0) {
+        return NULL;
+    }
+
+    Sim_Peer *peer = &node->peers[peer_index(node->peers, node->peers_size, key)];
+    return peer->key == key ? peer : NULL;
+}
+
+static Sim_Peer *insert_peer(Sim_Node *node, uint64_t key)
+{
+    if ((node->num_peers + 1) * 4 > node->peers_size * 3) {
+        const uint32_t new_size = node->peers_size ? node->peers_size * 2 : 16;
+        Sim_Peer *peers = (Sim_Peer *)calloc(new_size, sizeof(Sim_Peer));
+
+        if (peers == NULL) {
+            return NULL;
+        }
+
+        uint32_t i;
+
+        for (i = 0; i < node->peers_size; ++i) {
+            if (node->peers[i].key != 0) {
+                peers[peer_index(peers, new_size, node->peers[i].key)] = node->peers[i];
+            }
+        }
+
+        free(node->peers);
+        node->peers = peers;
+        node->peers_size = new_size;
+    }
+
+    Sim_Peer *peer = &node->peers[peer_index(node->peers, node->peers_size, key)];
+    peer->key = key;
+    peer->port = 0;
+    ++node->num_peers;
+    return peer;
+}
+
+/* return the port a packet from node to ip_port comes from, 0 if the NAT ran
+ * out of ports.
+ */
+static uint16_t source_port(Sim_Node *node, IP_Port ip_port)
+{
+    if (node->nat == SIM_NAT_NONE) {
+        return SIM_PORT;
+    }
+
+    const uint64_t key = address_key(ip_port);
+    Sim_Peer *peer = find_peer(node, key);
+
+    if (peer == NULL) {
+        if (node->nat == SIM_NAT_SYMMETRIC && node->num_mapped == SIM_MAX_MAPPED_PORTS) {
+            return 0;
+        }
+
+        peer = insert_peer(node, key);
+
+        if (peer == NULL) {
+            return 0;
+        }
+
+        if (node->nat == SIM_NAT_SYMMETRIC) {
+            uint64_t *mapped = (uint64_t *)realloc(node->mapped, (node->num_mapped + 1) * sizeof(uint64_t));
+
+            if (mapped == NULL) {
+                return 0;
+            }
+
+            node->mapped = mapped;
+            node->mapped[node->num_mapped] = key;
+            peer->port = SIM_PORT + 1 + node->num_mapped;
+            ++node->num_mapped;
+        }
+    }
+
+    return node->nat == SIM_NAT_SYMMETRIC ? peer->port : SIM_PORT;
+}
+
+/* return 1 if the NAT of node lets a packet from from to port through. */
+static int nat_accepts(const Sim_Node *node, IP_Port from, uint16_t port)
+{
+    const uint64_t key = address_key(from);
+
+    switch (node->nat) {
+        case SIM_NAT_NONE:
+            return port == SIM_PORT;
+
+        case SIM_NAT_RESTRICTED:
+            return port == SIM_PORT && find_peer(node, key) != NULL;
+
+        case SIM_NAT_SYMMETRIC:
+            return port > SIM_PORT && (uint32_t)(port - SIM_PORT - 1) < node->num_mapped
+                   && node->mapped[port - SIM_PORT - 1] == key;
+    }
+
+    return 0;
+}
+
+static int packet_before(const Sim_Packet *a, const Sim_Packet *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static int heap_push(Sim_Network *sim, Sim_Packet *packet)
+{
+    if (sim->heap_count == sim->heap_size) {
+        const uint32_t new_size = sim->heap_size ? sim->heap_size * 2 : 1024;
+        Sim_Packet **heap = (Sim_Packet **)realloc(sim->heap, new_size * sizeof(Sim_Packet *));
+
+        if (heap == NULL) {
+            return -1;
+        }
+
+        sim->heap = heap;
+        sim->heap_size = new_size;
+    }
+
+    uint32_t i = sim->heap_count++;
+
+    while (i > 0 && packet_before(packet, sim->heap[(i - 1) / 2])) {
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    sim->heap[i] = packet;
+    return 0;
+}
+
+static Sim_Packet *heap_pop(Sim_Network *sim)
+{
+    Sim_Packet *top = sim->heap[0];
+    Sim_Packet *last = sim->heap[--sim->heap_count];
+    uint32_t i = 0;
+
+    while (1) {
+        uint32_t child = i * 2 + 1;
+
+        if (child >= sim->heap_count) {
+            break;
+        }
+
+        if (child + 1 < sim->heap_count && packet_before(sim->heap[child + 1], sim->heap[child])) {
+            ++child;
+        }
+
+        if (!packet_before(sim->heap[child], last)) {
+            break;
+        }
+
+        sim->heap[i] = sim->heap[child];
+        i = child;
+    }
+
+    sim->heap[i] = last;
+    return top;
+}
+
+static int sim_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    Sim_Node *node = (Sim_Node *)object;
+    Sim_Network *sim = node->sim;
+
+    if (ip_port.ip.family != AF_INET) {
+        return -1;
+    }
+
+    ++node->packets_sent;
+    ++sim->packets_sent;
+
+    const uint16_t port = source_port(node, ip_port);
+    const Sim_Node *to = node_at(sim, &ip_port.ip);
+    Sim_Link link = sim->link;
+
+    if (to != NULL && sim->link_callback != NULL) {
+        sim->link_callback(sim->link_callback_object, node->number, to->number, &link);
+    }
+
+    if (port == 0 || to == NULL || sim_random(sim) % 1000000 < link.loss) {
+        ++sim->packets_dropped;
+        return length;
+    }
+
+    uint64_t departure = sim->time;
+
+    if (link.bandwidth != 0) {
+        if (node->busy_until > departure) {
+            departure = node->busy_until;
+        }
+
+        departure += (uint64_t)length * 1000000 / link.bandwidth;
+        node->busy_until = departure;
+    }
+
+    Sim_Packet *packet = (Sim_Packet *)malloc(sizeof(Sim_Packet) + length);
+
+    if (packet == NULL) {
+        return -1;
+    }
+
+    packet->next = NULL;
+    packet->time = departure + link.latency * 1000ULL;
+
+    if (link.jitter != 0) {
+        packet->time += sim_random(sim) % (link.jitter * 1000ULL + 1);
+    }
+
+    packet->seq = sim->seq++;
+    packet->to = to->number;
+    packet->to_port = net_ntohs(ip_port.port);
+    packet->from.ip.family = AF_INET;
+    packet->from.ip.ip4.uint32 = net_htonl(SIM_BASE_IP + node->number);
+    packet->from.port = net_htons(port);
+    packet->length = length;
+    packet->data = (uint8_t *)(packet + 1);
+    memcpy(packet->data, data, length);
+
+    if (heap_push(sim, packet) == -1) {
+        free(packet);
+        return -1;
+    }
+
+    return length;
+}
+
+static int sim_recv(void *object, IP_Port *ip_port, uint8_t *data, uint16_t max_length)
+{
+    Sim_Node *node = (Sim_Node *)object;
+    Sim_Packet *packet = node->inbox;
+
+    if (packet == NULL) {
+        return 0;
+    }
+
+    node->inbox = packet->next;
+
+    if (node->inbox == NULL) {
+        node->inbox_last = NULL;
+    }
+
+    int length = packet->length < max_length ? packet->length : max_length;
+    memcpy(data, packet->data, length);
+    *ip_port = packet->from;
+    free(packet);
+    return length;
+}
+
+static const Net_Backend sim_backend = {
+    sim_send,
+    sim_recv,
+};
+
+Sim_Network *new_sim_network(uint32_t seed)
+{
+    Sim_Network *sim = (Sim_Network *)calloc(1, sizeof(Sim_Network));
+
+    if (sim == NULL) {
+        return NULL;
+    }
+
+    sim->time = SIM_START_TIME;
+    sim->random_state = seed;
+    current_time_monotonic_set_callback(sim_clock, sim);
+    return sim;
+}
+
+static void free_packets(Sim_Packet *packet)
+{
+    while (packet != NULL) {
+        Sim_Packet *next = packet->next;
+        free(packet);
+        packet = next;
+    }
+}
+
+void kill_sim_network(Sim_Network *sim)
+{
+    if (sim == NULL) {
+        return;
+    }
+
+    current_time_monotonic_set_callback(NULL, NULL);
+
+    uint32_t i;
+
+    for (i = 0; i < sim->heap_count; ++i) {
+        free(sim->heap[i]);
+    }
+
+    for (i = 0; i < sim->num_nodes; ++i) {
+        free_packets(sim->nodes[i]->inbox);
+        free(sim->nodes[i]->peers);
+        free(sim->nodes[i]->mapped);
+        free(sim->nodes[i]);
+    }
+
+    free(sim->heap);
+    free(sim->nodes);
+    free(sim);
+}
+
+void sim_set_default_link(Sim_Network *sim, const Sim_Link *link)
+{
+    sim->link = *link;
+}
+
+void sim_set_link_callback(Sim_Network *sim, sim_link_cb *callback, void *object)
+{
+    sim->link_callback = callback;
+    sim->link_callback_object = object;
+}
+
+Networking_Core *sim_new_networking(Sim_Network *sim, Logger *log, Sim_Nat nat)
+{
+    if (sim->num_nodes == sim->nodes_size) {
+        const uint32_t new_size = sim->nodes_size ? sim->nodes_size * 2 : 64;
+        Sim_Node **nodes = (Sim_Node **)realloc(sim->nodes, new_size * sizeof(Sim_Node *));
+
+        if (nodes == NULL) {
+            return NULL;
+        }
+
+        sim->nodes = nodes;
+        sim->nodes_size = new_size;
+    }
+
+    Sim_Node *node = (Sim_Node *)calloc(1, sizeof(Sim_Node));
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->sim = sim;
+    node->number = sim->num_nodes;
+    node->nat = nat;
+
+    Networking_Core *net = new_networking_backend(log, sim_node_ip_port(sim, node->number), &sim_backend, node);
+
+    if (net == NULL) {
+        free(node);
+        return NULL;
+    }
+
+    sim->nodes[sim->num_nodes] = node;
+    ++sim->num_nodes;
+    return net;
+}
+
+uint32_t sim_num_nodes(const Sim_Network *sim)
+{
+    return sim->num_nodes;
+}
+
+IP_Port sim_node_ip_port(const Sim_Network *sim, uint32_t node)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = net_htonl(SIM_BASE_IP + node);
+    ip_port.port = net_htons(SIM_PORT);
+    return ip_port;
+}
+
+uint64_t sim_node_packets_sent(const Sim_Network *sim, uint32_t node)
+{
+    return sim->nodes[node]->packets_sent;
+}
+
+uint64_t sim_packets_sent(const Sim_Network *sim)
+{
+    return sim->packets_sent;
+}
+
+uint64_t sim_packets_dropped(const Sim_Network *sim)
+{
+    return sim->packets_dropped;
+}
+
+uint64_t sim_time(const Sim_Network *sim)
+{
+    return sim->time / 1000;
+}
+
+void sim_advance(Sim_Network *sim, uint32_t ms)
+{
+    sim->time += ms * 1000ULL;
+
+    while (sim->heap_count != 0 && sim->heap[0]->time <= sim->time) {
+        Sim_Packet *packet = heap_pop(sim);
+        Sim_Node *node = sim->nodes[packet->to];
+
+        if (!nat_accepts(node, packet->from, packet->to_port)) {
+            ++sim->packets_dropped;
+            free(packet);
+            continue;
+        }
+
+        packet->next = NULL;
+
+        if (node->inbox_last != NULL) {
+            node->inbox_last->next = packet;
+        } else {
+            node->inbox = packet;
+        }
+
+        node->inbox_last = packet;
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * An in-process simulated network for running many DHT nodes in one process.
+ *
+ * Every node gets a Networking_Core that sends through in-memory queues
+ * instead of a UDP socket. Packets are delayed, dropped and filtered
+ * according to link and NAT settings, and time is a virtual clock that only
+ * advances in sim_advance(), so runs with the same seed see the same network.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIM_NETWORK_H
+#define SIM_NETWORK_H
+
+#include "../toxcore/network.h"
+
+/* Properties of the path a packet takes from one node to another. */
+typedef struct {
+    /* One way delay in ms. */
+    uint32_t latency;
+    /* Up to this many ms are added to the delay at random. */
+    uint32_t jitter;
+    /* Packets lost per million. */
+    uint32_t loss;
+    /* Uplink of the sender in bytes per second, 0 for unlimited. Packets
+     * queue behind each other when a node sends faster than that.
+     */
+    uint32_t bandwidth;
+} Sim_Link;
+
+typedef enum {
+    /* Reachable by everyone. */
+    SIM_NAT_NONE,
+    /* Port restricted cone: only packets from addresses the node has sent to
+     * get through, and the node keeps its address.
+     */
+    SIM_NAT_RESTRICTED,
+    /* Symmetric: every destination sees the node on a different port, and only
+     * packets from that destination to that port get through.
+     */
+    SIM_NAT_SYMMETRIC,
+} Sim_Nat;
+
+/* Called for every packet with the default link, can change it to give
+ * particular pairs of nodes other properties.
+ */
+typedef void sim_link_cb(void *object, uint32_t from, uint32_t to, Sim_Link *link);
+
+typedef struct Sim_Network Sim_Network;
+
+/* Create a simulated network whose random choices are made from seed.
+ *
+ * current_time_monotonic() and so unix_time() follow the virtual clock of the
+ * network until it is killed. Only one network can exist at a time.
+ *
+ * return NULL on failure.
+ */
+Sim_Network *new_sim_network(uint32_t seed);
+
+/* Free the network and the packets still in flight. The Networking_Cores of
+ * the nodes must have been killed before.
+ */
+void kill_sim_network(Sim_Network *sim);
+
+void sim_set_default_link(Sim_Network *sim, const Sim_Link *link);
+void sim_set_link_callback(Sim_Network *sim, sim_link_cb *callback, void *object);
+
+/* Add a node behind nat and create the Networking_Core it sends and receives
+ * through. The node number is the number of nodes added before it.
+ *
+ * return NULL on failure.
+ */
+Networking_Core *sim_new_networking(Sim_Network *sim, Logger *log, Sim_Nat nat);
+
+uint32_t sim_num_nodes(const Sim_Network *sim);
+
+/* return the address other nodes reach node on. */
+IP_Port sim_node_ip_port(const Sim_Network *sim, uint32_t node);
+
+/* return the number of packets node has sent. */
+uint64_t sim_node_packets_sent(const Sim_Network *sim, uint32_t node);
+
+/* return the number of packets sent by all nodes. */
+uint64_t sim_packets_sent(const Sim_Network *sim);
+
+/* return the number of packets lost on links or dropped by NATs. */
+uint64_t sim_packets_dropped(const Sim_Network *sim);
+
+/* return the virtual time in ms. */
+uint64_t sim_time(const Sim_Network *sim);
+
+/* Advance the virtual clock by ms and queue the packets that arrived in that
+ * time for the nodes, to be read by networking_poll().
+ */
+void sim_advance(Sim_Network *sim, uint32_t ms);
+
+/* return a random number from the generator of the network. */
+uint32_t sim_random(Sim_Network *sim);
+
+#endif
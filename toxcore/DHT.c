@@ -27,6 +27,7 @@
 
 #include "DHT.h"
 
+#include "key_distance.h"
 #include "LAN_discovery.h"
 #include "logger.h"
 #include "network.h"
@@ -62,96 +63,139 @@
  */
 int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
 {
-    size_t   i;
-    uint8_t distance1, distance2;
+    const int cmp = key_distance_cmp(pk, pk1, pk2);
 
-    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+    if (cmp < 0) {
+        return 1;
+    }
 
-        distance1 = pk[i] ^ pk1[i];
-        distance2 = pk[i] ^ pk2[i];
+    return cmp > 0 ? 2 : 0;
+}
 
-        if (distance1 < distance2) {
-            return 1;
-        }
+void list_sort_key_init(List_Sort_Key *key, const uint8_t *base_public_key, const uint8_t *public_key, uint32_t index,
+                        uint8_t group)
+{
+    key->base_public_key = base_public_key;
+    key->public_key = public_key;
+    key->distance = key_distance_prefix(base_public_key, public_key);
+    key->index = index;
+    key->group = group;
+}
 
-        if (distance1 > distance2) {
-            return 2;
-        }
+static int cmp_list_sort_key(const List_Sort_Key *key1, const List_Sort_Key *key2)
+{
+    if (key1->group != key2->group) {
+        return key1->group < key2->group ? -1 : 1;
+    }
+
+    if (key1->distance != key2->distance) {
+        return key1->distance > key2->distance ? -1 : 1;
+    }
+
+    const int close = id_closest(key1->base_public_key, key1->public_key, key2->public_key);
+
+    if (close == 1) {
+        return 1;
+    }
+
+    if (close == 2) {
+        return -1;
     }
 
     return 0;
 }
 
-/* Return index of first unequal bit number.
- */
-static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
+void sort_list_by_keys(void *list, size_t entry_size, List_Sort_Key *keys, uint32_t length)
 {
-    unsigned int i, j = 0;
+    uint8_t *entries = (uint8_t *)list;
+    uint32_t i;
 
-    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
-        if (pk1[i] == pk2[i]) {
+    /* The lists are sorted whenever an entry changes, so they are nearly sorted
+     * already and an insertion sort only looks at most keys once.
+     */
+    for (i = 1; i < length; ++i) {
+        if (cmp_list_sort_key(&keys[i - 1], &keys[i]) <= 0) {
             continue;
         }
 
-        for (j = 0; j < 8; ++j) {
-            if ((pk1[i] & (1 << (7 - j))) != (pk2[i] & (1 << (7 - j)))) {
-                break;
-            }
+        const List_Sort_Key key = keys[i];
+        uint32_t j = i;
+
+        do {
+            keys[j] = keys[j - 1];
+            --j;
+        } while (j != 0 && cmp_list_sort_key(&keys[j - 1], &key) > 0);
+
+        keys[j] = key;
+    }
+
+    VLA(uint8_t, temp, entry_size);
+
+    /* keys[i].index is the entry that goes to i, follow each cycle of moves
+     * from i back to it.
+     */
+    for (i = 0; i < length; ++i) {
+        if (keys[i].index == i) {
+            continue;
         }
 
-        break;
+        uint32_t j = i;
+        memcpy(temp, entries + i * entry_size, entry_size);
+
+        while (keys[j].index != i) {
+            const uint32_t from = keys[j].index;
+            memcpy(entries + j * entry_size, entries + from * entry_size, entry_size);
+            keys[j].index = j;
+            j = from;
+        }
+
+        memcpy(entries + j * entry_size, temp, entry_size);
+        keys[j].index = j;
     }
+}
 
-    return i * 8 + j;
+/* return bit i of public_key, counting from the most significant bit of the first byte. */
+static uint8_t public_key_bit(const uint8_t *public_key, unsigned int i)
+{
+    return (public_key[i / 8] >> (7 - i % 8)) & 1;
 }
 
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
+/* return the bucket of the close list public_key belongs in: the number of
+ * leading bits it shares with our public key. The last bucket also takes the
+ * keys sharing more.
  */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
+static unsigned int close_bucket(const DHT *dht, const uint8_t *public_key)
 {
-    uint32_t i, num = ~0, curr = 0;
-
-    for (i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
+    const unsigned int bucket = key_common_bits(public_key, dht->self_public_key);
+    return bucket < LCLIENT_LENGTH ? bucket : LCLIENT_LENGTH - 1;
+}
 
-        if (shared_keys->keys[index].stored) {
-            if (public_key_cmp(public_key, shared_keys->keys[index].public_key) == 0) {
-                memcpy(shared_key, shared_keys->keys[index].shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++shared_keys->keys[index].times_requested;
-                shared_keys->keys[index].time_last_requested = unix_time();
-                return;
-            }
+/* return index of public_key in the close list.
+ * return -1 if it isn't in it.
+ */
+static int close_list_index(const DHT *dht, const uint8_t *public_key)
+{
+    const unsigned int first = close_bucket(dht, public_key) * LCLIENT_NODES;
+    unsigned int i;
 
-            if (num != 0) {
-                if (is_timeout(shared_keys->keys[index].time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > shared_keys->keys[index].times_requested) {
-                    num = shared_keys->keys[index].times_requested;
-                    curr = index;
-                }
-            }
-        } else {
-            if (num != 0) {
-                num = 0;
-                curr = index;
-            }
+    for (i = first; i < first + LCLIENT_NODES; ++i) {
+        if (id_equal(dht->close_clientlist[i].public_key, public_key)) {
+            return i;
         }
     }
 
-    encrypt_precompute(public_key, secret_key, shared_key);
+    return -1;
+}
 
-    if (num != (uint32_t)~0) {
-        shared_keys->keys[curr].stored = 1;
-        shared_keys->keys[curr].times_requested = 1;
-        memcpy(shared_keys->keys[curr].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(shared_keys->keys[curr].shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        shared_keys->keys[curr].time_last_requested = unix_time();
+const Client_data *DHT_close_client(const DHT *dht, const uint8_t *public_key)
+{
+    const int index = close_list_index(dht, public_key);
+
+    if (index == -1) {
+        return NULL;
     }
+
+    return &dht->close_clientlist[index];
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -159,7 +203,7 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
  */
 void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(&dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    shared_key_cache_get(dht->shared_keys, shared_key, dht->self_secret_key, public_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -167,7 +211,121 @@ void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(&dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    shared_key_cache_get(dht->shared_keys, shared_key, dht->self_secret_key, public_key);
+}
+
+int DHT_set_shared_key_cache_size(DHT *dht, uint32_t capacity)
+{
+    Shared_Key_Cache *shared_keys = shared_key_cache_new(capacity);
+
+    if (shared_keys == NULL) {
+        return -1;
+    }
+
+    shared_key_cache_free(dht->shared_keys);
+    dht->shared_keys = shared_keys;
+    return 0;
+}
+
+void DHT_set_precompute_pool(DHT *dht, Precompute_Pool *pool)
+{
+    dht->precompute_pool = pool;
+}
+
+/* Bootstrap from at most this number of the best nodes of a node cache. */
+#define NODE_CACHE_BOOTSTRAP_NODES 64
+
+void DHT_set_node_cache(DHT *dht, Node_Cache *cache)
+{
+    dht->node_cache = cache;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    Node_Cache_Entry entries[NODE_CACHE_BOOTSTRAP_NODES];
+    const uint32_t num = node_cache_best(cache, entries, NODE_CACHE_BOOTSTRAP_NODES);
+
+    if (num == 0) {
+        return;
+    }
+
+    Node_format *nodes = (Node_format *)calloc(num + dht->loaded_num_nodes, sizeof(Node_format));
+
+    if (nodes == NULL) {
+        return;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        memcpy(nodes[i].public_key, entries[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        nodes[i].ip_port = entries[i].ip_port;
+    }
+
+    if (dht->loaded_nodes_list != NULL) {
+        memcpy(nodes + num, dht->loaded_nodes_list, dht->loaded_num_nodes * sizeof(Node_format));
+        free(dht->loaded_nodes_list);
+    }
+
+    dht->loaded_nodes_list = nodes;
+    dht->loaded_num_nodes += num;
+    dht->loaded_nodes_index = 0;
+}
+
+/* The data of a precompute job, followed by the packet. */
+typedef struct {
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    IP_Port source;
+} DHT_Precompute_Job;
+
+static void precompute_work(uint8_t *data, uint16_t length)
+{
+    DHT_Precompute_Job *job = (DHT_Precompute_Job *)data;
+    encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+}
+
+static void precompute_done(void *object, uint8_t *data, uint16_t length, void *userdata)
+{
+    DHT *dht = (DHT *)object;
+    const DHT_Precompute_Job *job = (const DHT_Precompute_Job *)data;
+
+    /* The key pair changed while the job waited. */
+    if (public_key_cmp(job->secret_key, dht->self_secret_key) != 0) {
+        return;
+    }
+
+    shared_key_cache_put(dht->shared_keys, job->secret_key, job->public_key, job->shared_key);
+    networking_handle_packet(dht->net, job->source, data + sizeof(DHT_Precompute_Job),
+                             length - sizeof(DHT_Precompute_Job), userdata);
+}
+
+int DHT_defer_packet(DHT *dht, IP_Port source, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
+{
+    if (dht->precompute_pool == NULL
+            || shared_key_cache_contains(dht->shared_keys, dht->self_secret_key, public_key)
+            || length > MAX_UDP_PACKET_SIZE) {
+        return 0;
+    }
+
+    DHT_Precompute_Job job;
+    memcpy(job.secret_key, dht->self_secret_key, CRYPTO_SECRET_KEY_SIZE);
+    memcpy(job.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    job.source = source;
+
+    VLA(uint8_t, data, sizeof(job) + length);
+    memcpy(data, &job, sizeof(job));
+    memcpy(data + sizeof(job), packet, length);
+
+    if (precompute_pool_submit(dht->precompute_pool, precompute_work, precompute_done, dht, data, SIZEOF_VLA(data)) == -1) {
+        LOGGER_DEBUG(dht->log, "Precompute pool full, dropped packet %u", packet[0]);
+    }
+
+    crypto_memzero(data, SIZEOF_VLA(data));
+    crypto_memzero(job.secret_key, CRYPTO_SECRET_KEY_SIZE);
+    return 1;
 }
 
 /* Create a request to peer.
@@ -632,15 +790,7 @@ static int client_in_nodelist(const Node_format *list, uint16_t length, const ui
  */
 static int friend_number(const DHT *dht, const uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < dht->num_friends; ++i) {
-        if (id_equal(dht->friends_list[i].public_key, public_key)) {
-            return i;
-        }
-    }
-
-    return -1;
+    return index_map_find(&dht->friends_index, public_key);
 }
 
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
@@ -683,42 +833,66 @@ static uint8_t hardening_correct(const Hardening *h)
 {
     return h->routes_requests_ok + (h->send_nodes_ok << 1) + (h->testing_requests << 2);
 }
+/* return the distance prefix to public_key of the farthest node in a full nodes_list. */
+static uint64_t farthest_prefix(const Node_format *nodes_list, const uint8_t *public_key)
+{
+    uint64_t farthest = 0;
+    unsigned int i;
+
+    for (i = 0; i < MAX_SENT_NODES; ++i) {
+        const uint64_t prefix = key_distance_prefix(public_key, nodes_list[i].public_key);
+
+        if (prefix > farthest) {
+            farthest = prefix;
+        }
+    }
+
+    return farthest;
+}
+
 /*
  * helper for get_close_nodes(). argument list is a monster :D
  */
 static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_list,
-                                  Family sa_family, const Client_data *client_list, uint32_t client_list_length,
-                                  uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
+                                  Family sa_family, const Client_data *client_list, const Client_Hardening *hardening_list,
+                                  uint32_t client_list_length, uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
 {
     if ((sa_family != AF_INET) && (sa_family != AF_INET6) && (sa_family != 0)) {
         return;
     }
 
     uint32_t num_nodes = *num_nodes_ptr;
+    uint64_t farthest = num_nodes < MAX_SENT_NODES ? UINT64_MAX : farthest_prefix(nodes_list, public_key);
     uint32_t i;
 
     for (i = 0; i < client_list_length; i++) {
         const Client_data *client = &client_list[i];
 
+        /* A full list only takes nodes closer than its farthest one, which the
+         * distance prefix rules out for almost all nodes of large lists.
+         */
+        if (num_nodes == MAX_SENT_NODES && key_distance_prefix(public_key, client->public_key) > farthest) {
+            continue;
+        }
+
         /* node already in list? */
         if (client_in_nodelist(nodes_list, MAX_SENT_NODES, client->public_key)) {
             continue;
         }
 
         const IPPTsPng *ipptp = NULL;
+        bool ipv4;
 
         if (sa_family == AF_INET) {
-            ipptp = &client->assoc4;
+            ipv4 = 1;
         } else if (sa_family == AF_INET6) {
-            ipptp = &client->assoc6;
+            ipv4 = 0;
         } else {
-            if (client->assoc4.timestamp >= client->assoc6.timestamp) {
-                ipptp = &client->assoc4;
-            } else {
-                ipptp = &client->assoc6;
-            }
+            ipv4 = client->assoc4.timestamp >= client->assoc6.timestamp;
         }
 
+        ipptp = ipv4 ? &client->assoc4 : &client->assoc6;
+
         /* node not in a good condition? */
         if (is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT)) {
             continue;
@@ -729,9 +903,17 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
             continue;
         }
 
-        if (LAN_ip(ipptp->ip_port.ip) != 0 && want_good && hardening_correct(&ipptp->hardening) != HARDENING_ALL_OK
-                && !id_equal(public_key, client->public_key)) {
-            continue;
+        if (LAN_ip(ipptp->ip_port.ip) != 0 && want_good && !id_equal(public_key, client->public_key)) {
+            /* Nodes of lists without hardening checks never passed them. */
+            if (hardening_list == NULL) {
+                continue;
+            }
+
+            const Hardening *hardening = ipv4 ? &hardening_list[i].assoc4 : &hardening_list[i].assoc6;
+
+            if (hardening_correct(hardening) != HARDENING_ALL_OK) {
+                continue;
+            }
         }
 
         if (num_nodes < MAX_SENT_NODES) {
@@ -744,11 +926,67 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
         } else {
             add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, ipptp->ip_port, public_key);
         }
+
+        if (num_nodes == MAX_SENT_NODES) {
+            farthest = farthest_prefix(nodes_list, public_key);
+        }
     }
 
     *num_nodes_ptr = num_nodes;
 }
 
+/* Add the nodes of the close list closest to public_key to nodes_list, see
+ * get_close_nodes_inner().
+ *
+ * The buckets are visited from the closest to public_key to the farthest,
+ * every node of a bucket being closer than those of the buckets after it, so
+ * the walk stops once the list is full.
+ */
+static void get_close_nodes_close_list(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       Family sa_family, uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
+{
+    const unsigned int last = LCLIENT_LENGTH - 1;
+    const unsigned int target = close_bucket(dht, public_key);
+    unsigned int order[LCLIENT_LENGTH];
+    unsigned int count = 0;
+    unsigned int i;
+
+    /* Nodes sharing as many bits with us as public_key does share one more with it. */
+    order[count++] = target;
+
+    if (target != last) {
+        /* Nodes sharing more bits with us differ from public_key at bit
+         * target. Those of bucket i also differ from us at bit i, which puts
+         * them closer to public_key than the buckets after i if public_key
+         * differs from us there, else farther.
+         */
+        for (i = target + 1; i < last; ++i) {
+            if (public_key_bit(public_key, i) != public_key_bit(dht->self_public_key, i)) {
+                order[count++] = i;
+            }
+        }
+
+        order[count++] = last;
+
+        for (i = last - 1; i > target; --i) {
+            if (public_key_bit(public_key, i) == public_key_bit(dht->self_public_key, i)) {
+                order[count++] = i;
+            }
+        }
+    }
+
+    /* Nodes sharing fewer bits with us than public_key differ from it earlier. */
+    for (i = target; i > 0; --i) {
+        order[count++] = i - 1;
+    }
+
+    for (i = 0; i < count && *num_nodes_ptr < MAX_SENT_NODES; ++i) {
+        get_close_nodes_inner(public_key, nodes_list, sa_family, &dht->close_clientlist[order[i] * LCLIENT_NODES],
+                              &dht->close_hardening[order[i] * LCLIENT_NODES], LCLIENT_NODES, num_nodes_ptr, is_LAN,
+                              want_good);
+    }
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -761,15 +999,14 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     Family sa_family, uint8_t is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0, i;
-    get_close_nodes_inner(public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_nodes_close_list(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN, 0);
 
     /* TODO(irungentoo): uncomment this when hardening is added to close friend clients */
 #if 0
 
     for (i = 0; i < dht->num_friends; ++i) {
         get_close_nodes_inner(dht, public_key, nodes_list, sa_family,
-                              dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS,
+                              dht->friends_list[i].client_list, NULL, MAX_FRIEND_CLIENTS,
                               &num_nodes, is_LAN, want_good);
     }
 
@@ -777,7 +1014,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
 
     for (i = 0; i < dht->num_friends; ++i) {
         get_close_nodes_inner(public_key, nodes_list, sa_family,
-                              dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS,
+                              dht->friends_list[i].client_list, NULL, MAX_FRIEND_CLIENTS,
                               &num_nodes, is_LAN, 0);
     }
 
@@ -791,63 +1028,6 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
     return get_somewhat_close_nodes(dht, public_key, nodes_list, sa_family, is_LAN, want_good);
 }
 
-typedef struct {
-    const uint8_t *base_public_key;
-    Client_data entry;
-} Cmp_data;
-
-static int cmp_dht_entry(const void *a, const void *b)
-{
-    Cmp_data cmp1, cmp2;
-    memcpy(&cmp1, a, sizeof(Cmp_data));
-    memcpy(&cmp2, b, sizeof(Cmp_data));
-    Client_data entry1 = cmp1.entry;
-    Client_data entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
-
-    int t1 = is_timeout(entry1.assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry1.assoc6.timestamp, BAD_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(entry2.assoc6.timestamp, BAD_NODE_TIMEOUT);
-
-    if (t1 && t2) {
-        return 0;
-    }
-
-    if (t1) {
-        return -1;
-    }
-
-    if (t2) {
-        return 1;
-    }
-
-    t1 = hardening_correct(&entry1.assoc4.hardening) != HARDENING_ALL_OK
-         && hardening_correct(&entry1.assoc6.hardening) != HARDENING_ALL_OK;
-    t2 = hardening_correct(&entry2.assoc4.hardening) != HARDENING_ALL_OK
-         && hardening_correct(&entry2.assoc6.hardening) != HARDENING_ALL_OK;
-
-    if (t1 != t2) {
-        if (t1) {
-            return -1;
-        }
-
-        if (t2) {
-            return 1;
-        }
-    }
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1) {
-        return 1;
-    }
-
-    if (close == 2) {
-        return -1;
-    }
-
-    return 0;
-}
-
 /* Is it ok to store node with public_key in client.
  *
  * return 0 if node can't be stored.
@@ -865,20 +1045,21 @@ static unsigned int store_node_ok(const Client_data *client, const uint8_t *publ
 
 static void sort_client_list(Client_data *list, unsigned int length, const uint8_t *comp_public_key)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(Cmp_data, cmp_list, length);
-
-    for (uint32_t i = 0; i < length; i++) {
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
-    }
+    VLA(List_Sort_Key, keys, length);
+    uint32_t i;
 
-    qsort(cmp_list, length, sizeof(Cmp_data), cmp_dht_entry);
+    for (i = 0; i < length; ++i) {
+        const Client_data *client = &list[i];
 
-    for (uint32_t i = 0; i < length; i++) {
-        list[i] = cmp_list[i].entry;
+        /* Timed out nodes go first. Only friend client lists are sorted, and
+         * their nodes have no hardening checks to order the rest by.
+         */
+        const uint8_t group = !(is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT)
+                                && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT));
+        list_sort_key_init(&keys[i], comp_public_key, client->public_key, i, group);
     }
+
+    sort_list_by_keys(list, sizeof(Client_data), keys, length);
 }
 
 /* Replace a first bad (or empty) node with this one
@@ -948,11 +1129,7 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bo
 {
     unsigned int i;
 
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index > LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const unsigned int index = close_bucket(dht, public_key);
 
     for (i = 0; i < LCLIENT_NODES; ++i) {
         Client_data *client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
@@ -980,6 +1157,9 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bo
 
                 /* zero out other address */
                 memset(ipptp_clear, 0, sizeof(*ipptp_clear));
+#if DHT_HARDENING
+                memset(&dht->close_hardening[(index * LCLIENT_NODES) + i], 0, sizeof(Client_Hardening));
+#endif
             }
 
             return 0;
@@ -1091,8 +1271,15 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
 
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
+     *
+     * public_key can only be in its own bucket of the close list, and only a
+     * node of that bucket can take over the ip_port of another without
+     * breaking the order of the list. Nodes of other buckets that had ip_port
+     * time out instead.
      */
-    if (!client_or_ip_port_in_list(dht->log, dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
+    Client_data *close_bucket_list = &dht->close_clientlist[close_bucket(dht, public_key) * LCLIENT_NODES];
+
+    if (!client_or_ip_port_in_list(dht->log, close_bucket_list, LCLIENT_NODES, public_key, ip_port)) {
         if (add_to_close(dht, public_key, ip_port, 0)) {
             used++;
         }
@@ -1146,7 +1333,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
  */
 static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const uint8_t *nodepublic_key)
 {
-    uint32_t i, j;
+    uint32_t j;
     uint64_t temp_time = unix_time();
 
     uint32_t used = 0;
@@ -1158,45 +1345,53 @@ static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        for (i = 0; i < LCLIENT_LIST; ++i) {
-            if (id_equal(nodepublic_key, dht->close_clientlist[i].public_key)) {
+        const int index = close_list_index(dht, nodepublic_key);
+
+        if (index != -1) {
+            if (ip_port.ip.family == AF_INET) {
+                dht->close_clientlist[index].assoc4.ret_ip_port = ip_port;
+                dht->close_clientlist[index].assoc4.ret_timestamp = temp_time;
+            } else if (ip_port.ip.family == AF_INET6) {
+                dht->close_clientlist[index].assoc6.ret_ip_port = ip_port;
+                dht->close_clientlist[index].assoc6.ret_timestamp = temp_time;
+            }
+
+            ++used;
+        }
+    } else {
+        const int friend_num = friend_number(dht, public_key);
+
+        if (friend_num == -1) {
+            return 0;
+        }
+
+        Client_data *client_list = dht->friends_list[friend_num].client_list;
+
+        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+            if (id_equal(nodepublic_key, client_list[j].public_key)) {
                 if (ip_port.ip.family == AF_INET) {
-                    dht->close_clientlist[i].assoc4.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc4.ret_timestamp = temp_time;
+                    client_list[j].assoc4.ret_ip_port = ip_port;
+                    client_list[j].assoc4.ret_timestamp = temp_time;
                 } else if (ip_port.ip.family == AF_INET6) {
-                    dht->close_clientlist[i].assoc6.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc6.ret_timestamp = temp_time;
+                    client_list[j].assoc6.ret_ip_port = ip_port;
+                    client_list[j].assoc6.ret_timestamp = temp_time;
                 }
 
                 ++used;
                 break;
             }
         }
-    } else {
-        for (i = 0; i < dht->num_friends; ++i) {
-            if (id_equal(public_key, dht->friends_list[i].public_key)) {
-                for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
-                    if (id_equal(nodepublic_key, dht->friends_list[i].client_list[j].public_key)) {
-                        if (ip_port.ip.family == AF_INET) {
-                            dht->friends_list[i].client_list[j].assoc4.ret_ip_port = ip_port;
-                            dht->friends_list[i].client_list[j].assoc4.ret_timestamp = temp_time;
-                        } else if (ip_port.ip.family == AF_INET6) {
-                            dht->friends_list[i].client_list[j].assoc6.ret_ip_port = ip_port;
-                            dht->friends_list[i].client_list[j].assoc6.ret_timestamp = temp_time;
-                        }
-
-                        ++used;
-                        goto end;
-                    }
-                }
-            }
-        }
     }
 
-end:
     return 0;
 }
 
+/* Data stored in the ping arrays for a getnodes request: the receiver and the
+ * send time, or the receiver and the sendback node of a hardening request.
+ */
+#define GETNODE_DATA_SIZE (sizeof(Node_format) + sizeof(uint64_t))
+#define HARDEN_GETNODE_DATA_SIZE (sizeof(Node_format) * 2)
+
 /* Send a getnodes request.
    sendback_node is the node that it will send back the response to (set to NULL to disable this) */
 static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const uint8_t *client_id,
@@ -1207,7 +1402,7 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
         return -1;
     }
 
-    uint8_t plain_message[sizeof(Node_format) * 2] = {0};
+    uint8_t plain_message[HARDEN_GETNODE_DATA_SIZE] = {0};
 
     Node_format receiver;
     memcpy(receiver.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
@@ -1220,13 +1415,20 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
         memcpy(plain_message + sizeof(receiver), sendback_node, sizeof(Node_format));
         ping_id = ping_array_add(&dht->dht_harden_ping_array, plain_message, sizeof(plain_message));
     } else {
-        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver));
+        /* The send time gives the round trip time of the node for the node cache. */
+        const uint64_t sent_time = current_time_monotonic();
+        memcpy(plain_message + sizeof(receiver), &sent_time, sizeof(sent_time));
+        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, GETNODE_DATA_SIZE);
     }
 
     if (ping_id == 0) {
         return -1;
     }
 
+    if (sendback_node == NULL && dht->node_cache != NULL) {
+        node_cache_asked(dht->node_cache, public_key);
+    }
+
     uint8_t plain[CRYPTO_PUBLIC_KEY_SIZE + sizeof(ping_id)];
     uint8_t data[1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + sizeof(plain) + CRYPTO_MAC_SIZE];
 
@@ -1306,6 +1508,10 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
         return 1;
     }
 
+    if (DHT_defer_packet(dht, source, packet + 1, packet, length)) {
+        return 0;
+    }
+
     uint8_t plain[CRYPTO_PUBLIC_KEY_SIZE + sizeof(uint64_t)];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
@@ -1326,17 +1532,22 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
 
     return 0;
 }
-/* return 0 if no
-   return 1 if yes */
+/* sent_time is set to when the request was sent, 0 for hardening requests.
+ *
+ * return 0 if no
+ * return 1 if yes
+ */
 static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port node_ip_port, uint64_t ping_id,
-                                    Node_format *sendback_node)
+                                    Node_format *sendback_node, uint64_t *sent_time)
 {
-    uint8_t data[sizeof(Node_format) * 2];
+    uint8_t data[HARDEN_GETNODE_DATA_SIZE];
 
-    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format)) {
+    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == GETNODE_DATA_SIZE) {
         memset(sendback_node, 0, sizeof(Node_format));
+        memcpy(sent_time, data + sizeof(Node_format), sizeof(uint64_t));
     } else if (ping_array_check(data, sizeof(data), &dht->dht_harden_ping_array, ping_id) == sizeof(data)) {
         memcpy(sendback_node, data + sizeof(Node_format), sizeof(Node_format));
+        *sent_time = 0;
     } else {
         return 0;
     }
@@ -1394,11 +1605,12 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     }
 
     Node_format sendback_node;
+    uint64_t sent_time;
 
     uint64_t ping_id;
     memcpy(&ping_id, plain + 1 + data_size, sizeof(ping_id));
 
-    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node)) {
+    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node, &sent_time)) {
         return 1;
     }
 
@@ -1420,6 +1632,11 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     /* store the address the *request* was sent to */
     addto_lists(dht, source, packet + 1);
 
+    if (dht->node_cache != NULL && sent_time != 0) {
+        const uint64_t rtt = current_time_monotonic() - sent_time;
+        node_cache_answered(dht->node_cache, packet + 1, source, rtt < UINT16_MAX ? rtt : UINT16_MAX);
+    }
+
     *num_nodes_out = num_nodes;
 
     send_hardening_getnode_res(dht, &sendback_node, packet + 1, plain + 1, data_size);
@@ -1495,6 +1712,11 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
     memcpy(dht_friend->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
     dht_friend->nat.NATping_id = random_64b();
+
+    if (index_map_add(&dht->friends_index, public_key, dht->num_friends) == -1) {
+        return -1;
+    }
+
     ++dht->num_friends;
 
     lock_num = dht_friend->lock_count;
@@ -1531,12 +1753,14 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
         return 0;
     }
 
+    index_map_remove(&dht->friends_index, dht_friend->public_key);
     --dht->num_friends;
 
     if (dht->num_friends != friend_num) {
         memcpy(&dht->friends_list[friend_num],
                &dht->friends_list[dht->num_friends],
                sizeof(DHT_Friend));
+        index_map_update(&dht->friends_index, dht->friends_list[friend_num].public_key, friend_num);
     }
 
     if (dht->num_friends == 0) {
@@ -1555,38 +1779,36 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
     return 0;
 }
 
-/* TODO(irungentoo): Optimize this. */
 int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
 {
-    uint32_t i, j;
+    uint32_t j;
 
     ip_reset(&ip_port->ip);
     ip_port->port = 0;
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        /* Equal */
-        if (id_equal(dht->friends_list[i].public_key, public_key)) {
-            for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
-                Client_data *client = &dht->friends_list[i].client_list[j];
-
-                if (id_equal(client->public_key, public_key)) {
-                    IPPTsPng *assoc = NULL;
-                    uint32_t a;
-
-                    for (a = 0, assoc = &client->assoc6; a < 2; a++, assoc = &client->assoc4) {
-                        if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
-                            *ip_port = assoc->ip_port;
-                            return 1;
-                        }
-                    }
+    const int friend_num = friend_number(dht, public_key);
+
+    if (friend_num == -1) {
+        return -1;
+    }
+
+    for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+        const Client_data *client = &dht->friends_list[friend_num].client_list[j];
+
+        if (id_equal(client->public_key, public_key)) {
+            const IPPTsPng *assoc = NULL;
+            uint32_t a;
+
+            for (a = 0, assoc = &client->assoc6; a < 2; a++, assoc = &client->assoc4) {
+                if (!is_timeout(assoc->timestamp, BAD_NODE_TIMEOUT)) {
+                    *ip_port = assoc->ip_port;
+                    return 1;
                 }
             }
-
-            return 0;
         }
     }
 
-    return -1;
+    return 0;
 }
 
 /* returns number of nodes not in kill-timeout */
@@ -1763,22 +1985,18 @@ int DHT_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    uint32_t i;
-
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *client = &dht->close_clientlist[i];
+    const Client_data *client = DHT_close_client(dht, public_key);
 
-            if (ip_isset(&client->assoc6.ip_port.ip)) {
-                return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
-            }
+    if (client == NULL) {
+        return -1;
+    }
 
-            if (ip_isset(&client->assoc4.ip_port.ip)) {
-                return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
-            }
+    if (ip_isset(&client->assoc6.ip_port.ip)) {
+        return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
+    }
 
-            break;
-        }
+    if (ip_isset(&client->assoc4.ip_port.ip)) {
+        return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
     }
 
     return -1;
@@ -2261,23 +2479,39 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO(irungentoo): improve */
+static Hardening *get_closelist_hardening(DHT *dht, const uint8_t *public_key, Family sa_family)
+{
+    const int index = close_list_index(dht, public_key);
+
+    if (index == -1) {
+        return NULL;
+    }
+
+    if (sa_family == AF_INET) {
+        return &dht->close_hardening[index].assoc4;
+    }
+
+    if (sa_family == AF_INET6) {
+        return &dht->close_hardening[index].assoc6;
+    }
+
+    return NULL;
+}
+
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, Family sa_family)
 {
-    uint32_t i;
+    const int index = close_list_index(dht, public_key);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (public_key_cmp(dht->close_clientlist[i].public_key, public_key) != 0) {
-            continue;
-        }
+    if (index == -1) {
+        return NULL;
+    }
 
-        if (sa_family == AF_INET) {
-            return &dht->close_clientlist[i].assoc4;
-        }
+    if (sa_family == AF_INET) {
+        return &dht->close_clientlist[index].assoc4;
+    }
 
-        if (sa_family == AF_INET6) {
-            return &dht->close_clientlist[i].assoc6;
-        }
+    if (sa_family == AF_INET6) {
+        return &dht->close_clientlist[index].assoc6;
     }
 
     return NULL;
@@ -2366,22 +2600,22 @@ static int handle_hardening(void *object, IP_Port source, const uint8_t *source_
                 return 1;
             }
 
-            IPPTsPng *temp = get_closelist_IPPTsPng(dht, packet + 1, nodes[0].ip_port.ip.family);
+            Hardening *temp = get_closelist_hardening(dht, packet + 1, nodes[0].ip_port.ip.family);
 
             if (temp == NULL) {
                 return 1;
             }
 
-            if (is_timeout(temp->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
+            if (is_timeout(temp->send_nodes_timestamp, HARDENING_INTERVAL)) {
                 return 1;
             }
 
-            if (public_key_cmp(temp->hardening.send_nodes_pingedid, source_pubkey) != 0) {
+            if (public_key_cmp(temp->send_nodes_pingedid, source_pubkey) != 0) {
                 return 1;
             }
 
             /* If Nodes look good and the request checks out */
-            temp->hardening.send_nodes_ok = 1;
+            temp->send_nodes_ok = 1;
             return 0;/* success*/
         }
     }
@@ -2499,14 +2733,17 @@ static void do_hardening(DHT *dht)
 
     for (i = 0; i < LCLIENT_LIST * 2; ++i) {
         IPPTsPng  *cur_iptspng;
+        Hardening *hardening;
         Family sa_family;
         uint8_t   *public_key = dht->close_clientlist[i / 2].public_key;
 
         if (i % 2 == 0) {
             cur_iptspng = &dht->close_clientlist[i / 2].assoc4;
+            hardening = &dht->close_hardening[i / 2].assoc4;
             sa_family = AF_INET;
         } else {
             cur_iptspng = &dht->close_clientlist[i / 2].assoc6;
+            hardening = &dht->close_hardening[i / 2].assoc6;
             sa_family = AF_INET6;
         }
 
@@ -2514,8 +2751,8 @@ static void do_hardening(DHT *dht)
             continue;
         }
 
-        if (cur_iptspng->hardening.send_nodes_ok == 0) {
-            if (is_timeout(cur_iptspng->hardening.send_nodes_timestamp, HARDENING_INTERVAL)) {
+        if (hardening->send_nodes_ok == 0) {
+            if (is_timeout(hardening->send_nodes_timestamp, HARDENING_INTERVAL)) {
                 Node_format rand_node = random_node(dht, sa_family);
 
                 if (!ipport_isset(&rand_node.ip_port)) {
@@ -2532,13 +2769,13 @@ static void do_hardening(DHT *dht)
 
                 // TODO(irungentoo): The search id should maybe not be ours?
                 if (send_hardening_getnode_req(dht, &rand_node, &to_test, dht->self_public_key) > 0) {
-                    memcpy(cur_iptspng->hardening.send_nodes_pingedid, rand_node.public_key, CRYPTO_PUBLIC_KEY_SIZE);
-                    cur_iptspng->hardening.send_nodes_timestamp = unix_time();
+                    memcpy(hardening->send_nodes_pingedid, rand_node.public_key, CRYPTO_PUBLIC_KEY_SIZE);
+                    hardening->send_nodes_timestamp = unix_time();
                 }
             }
         } else {
-            if (is_timeout(cur_iptspng->hardening.send_nodes_timestamp, HARDEN_TIMEOUT)) {
-                cur_iptspng->hardening.send_nodes_ok = 0;
+            if (is_timeout(hardening->send_nodes_timestamp, HARDEN_TIMEOUT)) {
+                hardening->send_nodes_ok = 0;
             }
         }
 
@@ -2616,9 +2853,13 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
 
     dht->hole_punching_enabled = holepunching_enabled;
 
+    dht->shared_keys = shared_key_cache_new(SHARED_KEY_CACHE_DEFAULT_SIZE);
     dht->ping = new_ping(dht);
 
-    if (dht->ping == NULL) {
+    if (dht->shared_keys == NULL || dht->ping == NULL
+            || index_map_init(&dht->friends_index, CRYPTO_PUBLIC_KEY_SIZE, DHT_FAKE_FRIEND_NUMBER) == -1
+            || ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT, GETNODE_DATA_SIZE) == -1
+            || ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT, HARDEN_GETNODE_DATA_SIZE) == -1) {
         kill_DHT(dht);
         return NULL;
     }
@@ -2632,8 +2873,6 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
     new_symmetric_key(dht->secret_symmetric_key);
     crypto_new_keypair(dht->self_public_key, dht->self_secret_key);
 
-    ping_array_init(&dht->dht_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
-    ping_array_init(&dht->dht_harden_ping_array, DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
     uint32_t i;
 
     for (i = 0; i < DHT_FAKE_FRIEND_NUMBER; ++i) {
@@ -2680,6 +2919,8 @@ void kill_DHT(DHT *dht)
     ping_array_free_all(&dht->dht_ping_array);
     ping_array_free_all(&dht->dht_harden_ping_array);
     kill_ping(dht->ping);
+    shared_key_cache_free(dht->shared_keys);
+    index_map_free(&dht->friends_index);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
@@ -2781,6 +3022,11 @@ void DHT_save(DHT *dht, uint8_t *data)
 /* Bootstrap from this number of nodes every time DHT_connect_after_load() is called */
 #define SAVE_BOOTSTAP_FREQUENCY 8
 
+/* The first time, bootstrap from this number at once. The loaded nodes start
+ * with the best ones of the node cache, which are likely to answer.
+ */
+#define SAVE_BOOTSTRAP_FIRST 32
+
 /* Start sending packets after DHT loaded_friends_list and loaded_clients_list are set */
 int DHT_connect_after_load(DHT *dht)
 {
@@ -2800,9 +3046,10 @@ int DHT_connect_after_load(DHT *dht)
         return 0;
     }
 
+    const unsigned int num = dht->loaded_nodes_index == 0 ? SAVE_BOOTSTRAP_FIRST : SAVE_BOOTSTAP_FREQUENCY;
     unsigned int i;
 
-    for (i = 0; i < dht->loaded_num_nodes && i < SAVE_BOOTSTAP_FREQUENCY; ++i) {
+    for (i = 0; i < dht->loaded_num_nodes && i < num; ++i) {
         unsigned int index = dht->loaded_nodes_index % dht->loaded_num_nodes;
         DHT_bootstrap(dht, dht->loaded_nodes_list[index].ip_port, dht->loaded_nodes_list[index].public_key);
         ++dht->loaded_nodes_index;
@@ -2910,3 +3157,8 @@ int DHT_non_lan_connected(const DHT *dht)
 
     return 0;
 }
+
+int DHT_get_net_stats(const DHT *dht, Net_Stats *stats)
+{
+    return networking_get_stats(dht->net, stats);
+}
@@ -25,9 +25,13 @@
 #define DHT_H
 
 #include "crypto_core.h"
+#include "index_map.h"
 #include "logger.h"
 #include "network.h"
+#include "node_cache.h"
 #include "ping_array.h"
+#include "precompute_pool.h"
+#include "shared_key_cache.h"
 
 #include <stdbool.h>
 
@@ -37,7 +41,10 @@
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
 #define LCLIENT_LENGTH 128
 
-/* A list of the clients mathematically closest to ours. */
+/* A list of the clients mathematically closest to ours, in LCLIENT_LENGTH
+ * buckets of LCLIENT_NODES: bucket i holds the clients sharing the first i bits
+ * of our public key, the last one those sharing more too.
+ */
 #define LCLIENT_LIST (LCLIENT_LENGTH * LCLIENT_NODES)
 
 #define MAX_CLOSE_TO_BOOTSTRAP_NODES 8
@@ -129,7 +136,6 @@ typedef struct {
     uint64_t    timestamp;
     uint64_t    last_pinged;
 
-    Hardening hardening;
     /* Returned by this node. Either our friend or us. */
     IP_Port     ret_ip_port;
     uint64_t    ret_timestamp;
@@ -141,6 +147,14 @@ typedef struct {
     IPPTsPng    assoc6;
 } Client_data;
 
+/* The hardening checks of a close list node. They are kept out of Client_data
+ * so that the loops over the node lists don't have to read past them.
+ */
+typedef struct {
+    Hardening   assoc4;
+    Hardening   assoc6;
+} Client_Hardening;
+
 /*----------------------------------------------------------------------------------*/
 
 typedef struct {
@@ -210,20 +224,6 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
                  uint16_t length, uint8_t tcp_enabled);
 
 
-/*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
-typedef struct {
-    struct {
-        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-        uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-        uint32_t times_requested;
-        uint8_t  stored; /* 0 if not, 1 if is */
-        uint64_t time_last_requested;
-    } keys[256 * MAX_KEYS_PER_SLOT];
-} Shared_Keys;
-
 /*----------------------------------------------------------------------------------*/
 
 typedef int (*cryptopacket_handler_callback)(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
@@ -241,6 +241,7 @@ typedef struct {
     bool hole_punching_enabled;
 
     Client_data    close_clientlist[LCLIENT_LIST];
+    Client_Hardening close_hardening[LCLIENT_LIST]; /* Of the node at the same index. */
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
@@ -252,13 +253,16 @@ typedef struct {
 
     DHT_Friend    *friends_list;
     uint16_t       num_friends;
+    Index_Map      friends_index; /* Public key to index in friends_list. */
 
     Node_format   *loaded_nodes_list;
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
-    Shared_Keys shared_keys_recv;
-    Shared_Keys shared_keys_sent;
+    /* Shared keys of the DHT key pair with other nodes, also used by the onion. */
+    Shared_Key_Cache *shared_keys;
+    Precompute_Pool *precompute_pool;
+    Node_Cache *node_cache;
 
     struct PING   *ping;
     Ping_Array    dht_ping_array;
@@ -272,15 +276,6 @@ typedef struct {
 } DHT;
 /*----------------------------------------------------------------------------------*/
 
-/* Shared key generations are costly, it is therefor smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
- */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
-                    const uint8_t *public_key);
-
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -291,6 +286,35 @@ void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key);
 
+/* Replace the shared key cache with an empty one keeping about capacity keys.
+ *
+ * return 0 on success.
+ * return -1 on failure, the old cache is kept.
+ */
+int DHT_set_shared_key_cache_size(DHT *dht, uint32_t capacity);
+
+/* Compute the shared keys of packets from public keys that aren't cached on the
+ * workers of pool, see DHT_defer_packet(). NULL to compute them while the
+ * packet is handled (the default). The pool must be killed before the DHT.
+ */
+void DHT_set_precompute_pool(DHT *dht, Precompute_Pool *pool);
+
+/* Keep the nodes that answer our get nodes requests and pings in cache, NULL to stop,
+ * and bootstrap from the best ones of it first. Call it after DHT_load(), which
+ * replaces the nodes to bootstrap from. The cache must be closed after the DHT
+ * is killed.
+ */
+void DHT_set_node_cache(DHT *dht, Node_Cache *cache);
+
+/* For the handlers of packets encrypted for the DHT key by public_key.
+ *
+ * return 1 if the shared key isn't cached and the packet was handed to the
+ *   precompute pool, or dropped because the pool is full. The handler must
+ *   return without handling it, it is handled again once the key is cached.
+ * return 0 if the packet can be handled now.
+ */
+int DHT_defer_packet(DHT *dht, IP_Port source, const uint8_t *public_key, const uint8_t *packet, uint16_t length);
+
 void DHT_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 /* Add a new friend to the friends list.
@@ -337,11 +361,37 @@ int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
  */
 int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
 
+/* Where an entry of a list of nodes goes when the list is sorted with
+ * sort_list_by_keys(). Entries of lower groups go first, in a group the ones
+ * farthest from base_public_key go first.
+ */
+typedef struct {
+    const uint8_t *base_public_key;
+    const uint8_t *public_key;
+    uint64_t distance; /* Leading bytes of the distance, most keys differ in them. */
+    uint32_t index;    /* Of the entry in the list. */
+    uint8_t group;
+} List_Sort_Key;
+
+void list_sort_key_init(List_Sort_Key *key, const uint8_t *base_public_key, const uint8_t *public_key, uint32_t index,
+                        uint8_t group);
+
+/* Sort the length entries of entry_size bytes in list by their keys, keys[i]
+ * being the key of the entry at index i. Only the keys are moved while
+ * sorting, then every entry that isn't in its place yet is moved once.
+ */
+void sort_list_by_keys(void *list, size_t entry_size, List_Sort_Key *keys, uint32_t length);
+
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
  */
 bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
                  const uint8_t *cmp_pk);
 
+/* return the entry of public_key in the close list.
+ * return NULL if it isn't in it.
+ */
+const Client_data *DHT_close_client(const DHT *dht, const uint8_t *public_key);
+
 /* Return 1 if node can be added to close list, 0 if it can't.
  */
 bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port);
@@ -451,6 +501,13 @@ int DHT_isconnected(const DHT *dht);
  */
 int DHT_non_lan_connected(const DHT *dht);
 
+/* Copy the per packet id traffic counters of the DHT's UDP socket into stats.
+ *
+ * return 0 on success.
+ * return -1 if toxcore was built without NET_STATS.
+ */
+int DHT_get_net_stats(const DHT *dht, Net_Stats *stats);
+
 
 int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key);
 
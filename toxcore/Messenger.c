@@ -77,17 +77,7 @@ static int realloc_friendlist(Messenger *m, uint32_t num)
  */
 int32_t getfriend_id(const Messenger *m, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status > 0) {
-            if (id_equal(real_pk, m->friendlist[i].real_pk)) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return index_map_find(&m->friends_index, real_pk);
 }
 
 /* Copies the public key associated to that friend id into real_pk buffer.
@@ -190,6 +180,11 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
 
     for (i = 0; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (index_map_add(&m->friends_index, real_pk, i) == -1) {
+                kill_friend_connection(m->fr_c, friendcon_id);
+                return FAERR_NOMEM;
+            }
+
             m->friendlist[i].status = status;
             m->friendlist[i].friendcon_id = friendcon_id;
             m->friendlist[i].friendrequest_lastsent = 0;
@@ -422,6 +417,7 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
     }
 
     kill_friend_connection(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    index_map_remove(&m->friends_index, m->friendlist[friendnumber].real_pk);
     memset(&(m->friendlist[friendnumber]), 0, sizeof(Friend));
     uint32_t i;
 
@@ -964,15 +960,8 @@ static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_
         return 0;
     }
 
-    VLA(uint8_t, packet, length + 1);
-    packet[0] = packet_id;
-
-    if (length != 0) {
-        memcpy(packet + 1, data, length);
-    }
-
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, length + 1, congestion_control) != -1;
+    return write_cryptpacket_parts(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                   m->friendlist[friendnumber].friendcon_id), &packet_id, 1, data, length, congestion_control) != -1;
 }
 
 /**********CONFERENCES************/
@@ -1377,16 +1366,9 @@ static int64_t send_file_data_packet(const Messenger *m, int32_t friendnumber, u
         return -1;
     }
 
-    VLA(uint8_t, packet, 2 + length);
-    packet[0] = PACKET_ID_FILE_DATA;
-    packet[1] = filenumber;
-
-    if (length) {
-        memcpy(packet + 2, data, length);
-    }
-
-    return write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                             m->friendlist[friendnumber].friendcon_id), packet, SIZEOF_VLA(packet), 1);
+    const uint8_t header[2] = {PACKET_ID_FILE_DATA, filenumber};
+    return write_cryptpacket_parts(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                   m->friendlist[friendnumber].friendcon_id), header, sizeof(header), data, length, 1);
 }
 
 #define MAX_FILE_DATA_SIZE (MAX_CRYPTO_DATA_SIZE - 2)
@@ -1963,6 +1945,13 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         return NULL;
     }
 
+    if (options->udp_offload_enabled && !options->udp_disabled) {
+        if (networking_set_batching(m->net, 1) != 0 || networking_set_offload(m->net, 1) != 0) {
+            LOGGER_WARNING(m->log, "UDP offload is not available, sending packets one by one");
+            networking_set_batching(m->net, 0);
+        }
+    }
+
     m->dht = new_DHT(m->log, m->net, options->hole_punching_enabled);
 
     if (m->dht == NULL) {
@@ -2018,6 +2007,11 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
         }
     }
 
+    if (index_map_init(&m->friends_index, CRYPTO_PUBLIC_KEY_SIZE, 0) == -1) {
+        kill_messenger(m);
+        return NULL;
+    }
+
     m->options = *options;
     friendreq_init(&(m->fr), m->fr_c);
     set_nospam(&(m->fr), random_int());
@@ -2058,6 +2052,7 @@ void kill_messenger(Messenger *m)
     }
 
     logger_kill(m->log);
+    index_map_free(&m->friends_index);
     free(m->friendlist);
     free(m);
 }
@@ -2501,13 +2496,66 @@ static char *id_to_string(const uint8_t *pk, char *id_str, size_t length)
  */
 uint32_t messenger_run_interval(const Messenger *m)
 {
-    uint32_t crypto_interval = crypto_run_interval(m->net_crypto);
+    uint32_t interval = crypto_run_interval(m->net_crypto);
 
-    if (crypto_interval > MIN_RUN_INTERVAL) {
-        return MIN_RUN_INTERVAL;
+    if (interval > MIN_RUN_INTERVAL) {
+        interval = MIN_RUN_INTERVAL;
+    }
+
+    if (m->tcp_server) {
+        interval = MIN(interval, tcp_server_run_interval(m->tcp_server));
+    }
+
+    return interval;
+}
+
+/* Return the time in milliseconds before do_messenger() has work to do that
+ * isn't started by data arriving on one of the sockets from messenger_fds().
+ */
+uint32_t messenger_run_deadline(const Messenger *m)
+{
+    if (m->has_added_relays == 0) {
+        return 0;
+    }
+
+    if (!crypto_idle(m->net_crypto) || (m->tcp_server && tcp_server_send_pending(m->tcp_server))) {
+        return messenger_run_interval(m);
+    }
+
+    uint32_t deadline = unix_time_next_update();
+
+    if (m->tcp_server) {
+        deadline = MIN(deadline, tcp_server_run_interval(m->tcp_server));
+    }
+
+    /* All other timers compare against unix_time(). */
+    return deadline;
+}
+
+/* Copy the sockets do_messenger() reads from into fds, at most max_fds of
+ * them.
+ *
+ * return the number of sockets, which may be more than max_fds.
+ */
+unsigned int messenger_fds(const Messenger *m, Socket *fds, unsigned int max_fds)
+{
+    unsigned int count = 0;
+
+    if (count < max_fds) {
+        fds[count] = m->net->sock;
+    }
+
+    ++count;
+
+    unsigned int used = MIN(count, max_fds);
+    count += tcp_connections_fds(m->net_crypto->tcp_c, fds + used, max_fds - used);
+
+    if (m->tcp_server) {
+        used = MIN(count, max_fds);
+        count += tcp_server_fds(m->tcp_server, fds + used, max_fds - used);
     }
 
-    return crypto_interval;
+    return count;
 }
 
 /* The main loop that needs to be run at least 20 times per second. */
@@ -78,6 +78,7 @@ typedef struct {
 
     uint8_t hole_punching_enabled;
     bool local_discovery_enabled;
+    bool udp_offload_enabled;
 
     logger_cb *log_callback;
     void *log_user_data;
@@ -239,6 +240,7 @@ struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    Index_Map friends_index; /* real_pk to friend number. */
 
     time_t lastdump;
 
@@ -744,6 +746,18 @@ void kill_messenger(Messenger *m);
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata);
 
+/* Return the time in milliseconds before do_messenger() has work to do that
+ * isn't started by data arriving on one of the sockets from messenger_fds().
+ */
+uint32_t messenger_run_deadline(const Messenger *m);
+
+/* Copy the sockets do_messenger() reads from into fds, at most max_fds of
+ * them.
+ *
+ * return the number of sockets, which may be more than max_fds.
+ */
+unsigned int messenger_fds(const Messenger *m, Socket *fds, unsigned int max_fds);
+
 /* Return the time in milliseconds before do_messenger() should be called again
  * for optimal performance.
  *
@@ -66,6 +66,51 @@ const uint8_t *tcp_connections_public_key(const TCP_Connections *tcp_c)
     return tcp_c->self_public_key;
 }
 
+unsigned int tcp_connections_fds(const TCP_Connections *tcp_c, Socket *fds, unsigned int max_fds)
+{
+    unsigned int count = 0;
+    uint32_t i;
+
+    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = &tcp_c->tcp_connections[i];
+
+        if (tcp_con->status == TCP_CONN_NONE || tcp_con->status == TCP_CONN_SLEEPING || !tcp_con->connection) {
+            continue;
+        }
+
+        if (count < max_fds) {
+            fds[count] = tcp_con->connection->sock;
+        }
+
+        ++count;
+    }
+
+    return count;
+}
+
+bool tcp_connections_send_pending(const TCP_Connections *tcp_c)
+{
+    uint32_t i;
+
+    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = &tcp_c->tcp_connections[i];
+
+        if (tcp_con->status == TCP_CONN_NONE || tcp_con->status == TCP_CONN_SLEEPING || !tcp_con->connection) {
+            continue;
+        }
+
+        const TCP_Client_Connection *con = tcp_con->connection;
+
+        /* Connections that aren't confirmed yet wait for connect() to finish
+         * or for their handshake to be written. */
+        if (con->status != TCP_CLIENT_CONFIRMED || con->last_packet_length != 0 || con->priority_queue_start) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 
 /* Set the size of the array to num.
  *
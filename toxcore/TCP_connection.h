@@ -82,6 +82,19 @@ typedef struct TCP_Connections TCP_Connections;
 
 const uint8_t *tcp_connections_public_key(const TCP_Connections *tcp_c);
 
+/* Copy the sockets of the TCP relay connections into fds, at most max_fds of
+ * them.
+ *
+ * return the number of sockets, which may be more than max_fds.
+ */
+unsigned int tcp_connections_fds(const TCP_Connections *tcp_c, Socket *fds, unsigned int max_fds);
+
+/* return 1 if a relay connection is still connecting or has data that
+ * couldn't be written to its socket yet.
+ * return 0 otherwise.
+ */
+bool tcp_connections_send_pending(const TCP_Connections *tcp_c);
+
 /* Send a packet to the TCP connection.
  *
  * return -1 on failure.
@@ -54,9 +54,14 @@ struct TCP_Server {
     uint32_t size_accepted_connections;
     uint32_t num_accepted_connections;
 
+    /* When to ping the accepted connections and when their pings time out. */
+    Timer_Wheel *ping_timers;
+
     uint64_t counter;
 
     BS_LIST accepted_key_list;
+
+    Precompute_Pool *precompute_pool;
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -69,6 +74,70 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
     return tcp_server->num_listening_socks;
 }
 
+/* Add sock to fds if there is room, and count it either way. */
+static void add_fd(Socket sock, Socket *fds, unsigned int max_fds, unsigned int *count)
+{
+    if (*count < max_fds) {
+        fds[*count] = sock;
+    }
+
+    ++*count;
+}
+
+unsigned int tcp_server_fds(const TCP_Server *tcp_server, Socket *fds, unsigned int max_fds)
+{
+    unsigned int count = 0;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    /* All sockets of the server are registered with the epoll instance. */
+    add_fd(tcp_server->efd, fds, max_fds, &count);
+#else
+    uint32_t i;
+
+    for (i = 0; i < tcp_server->num_listening_socks; ++i) {
+        add_fd(tcp_server->socks_listening[i], fds, max_fds, &count);
+    }
+
+    for (i = 0; i < MAX_INCOMMING_CONNECTIONS; ++i) {
+        if (tcp_server->incomming_connection_queue[i].status != TCP_STATUS_NO_STATUS) {
+            add_fd(tcp_server->incomming_connection_queue[i].sock, fds, max_fds, &count);
+        }
+
+        if (tcp_server->unconfirmed_connection_queue[i].status != TCP_STATUS_NO_STATUS) {
+            add_fd(tcp_server->unconfirmed_connection_queue[i].sock, fds, max_fds, &count);
+        }
+    }
+
+    for (i = 0; i < tcp_server->size_accepted_connections; ++i) {
+        if (tcp_server->accepted_connection_array[i].status == TCP_STATUS_CONFIRMED) {
+            add_fd(tcp_server->accepted_connection_array[i].sock, fds, max_fds, &count);
+        }
+    }
+
+#endif
+    return count;
+}
+
+bool tcp_server_send_pending(const TCP_Server *tcp_server)
+{
+    uint32_t i;
+
+    for (i = 0; i < tcp_server->size_accepted_connections; ++i) {
+        const TCP_Secure_Connection *conn = &tcp_server->accepted_connection_array[i];
+
+        if (conn->status == TCP_STATUS_CONFIRMED && (conn->last_packet_length != 0 || conn->priority_queue_start)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t tcp_server_run_interval(const TCP_Server *tcp_server)
+{
+    return unix_time_until(timer_wheel_next_deadline(tcp_server->ping_timers));
+}
+
 /* This is needed to compile on Android below API 21
  */
 #ifndef EPOLLRDHUP
@@ -122,6 +191,7 @@ static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t
 
 
 static int kill_accepted(TCP_Server *TCP_server, int index);
+static void ping_accepted(void *object, uint32_t index, void *userdata);
 
 /* Add accepted TCP connection to the list.
  *
@@ -159,7 +229,14 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
         return -1;
     }
 
+    const uint32_t ping_timer = timer_new(TCP_server->ping_timers, &ping_accepted, TCP_server, index);
+
+    if (ping_timer == 0) {
+        return -1;
+    }
+
     if (!bs_list_add(&TCP_server->accepted_key_list, con->public_key, index)) {
+        timer_kill(TCP_server->ping_timers, ping_timer);
         return -1;
     }
 
@@ -169,6 +246,8 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
     TCP_server->accepted_connection_array[index].identifier = ++TCP_server->counter;
     TCP_server->accepted_connection_array[index].last_pinged = unix_time();
     TCP_server->accepted_connection_array[index].ping_id = 0;
+    TCP_server->accepted_connection_array[index].ping_timer = ping_timer;
+    timer_set(TCP_server->ping_timers, ping_timer, unix_time() + TCP_PING_FREQUENCY);
 
     return index;
 }
@@ -192,6 +271,7 @@ static int del_accepted(TCP_Server *TCP_server, int index)
         return -1;
     }
 
+    timer_kill(TCP_server->ping_timers, TCP_server->accepted_connection_array[index].ping_timer);
     crypto_memzero(&TCP_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
 
@@ -512,57 +592,109 @@ static int kill_accepted(TCP_Server *TCP_server, int index)
     return 0;
 }
 
-/* return 1 if everything went well.
- * return -1 if the connection must be killed.
- */
-static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-                                const uint8_t *self_secret_key)
-{
-    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
-        return -1;
-    }
+/* The crypto of a client handshake, which can run on another thread. */
+typedef struct {
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
 
-    if (con->status != TCP_STATUS_CONNECTED) {
-        return -1;
-    }
+    /* Set by compute_TCP_handshake(). */
+    uint8_t recv_nonce[CRYPTO_NONCE_SIZE];
+    uint8_t sent_nonce[CRYPTO_NONCE_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+    int8_t result;
+
+    /* Which incoming connection the handshake is for, when run by a precompute pool. */
+    uint32_t index;
+    uint64_t identifier;
+} TCP_Handshake;
+
+static void compute_TCP_handshake(TCP_Handshake *handshake)
+{
+    handshake->result = -1;
 
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    encrypt_precompute(data, self_secret_key, shared_key);
+    encrypt_precompute(handshake->data, handshake->secret_key, shared_key);
     uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
-                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
+    int len = decrypt_data_symmetric(shared_key, handshake->data + CRYPTO_PUBLIC_KEY_SIZE,
+                                     handshake->data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
 
     if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
-        return -1;
+        crypto_memzero(shared_key, sizeof(shared_key));
+        return;
     }
 
-    memcpy(con->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
     uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
     uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
     crypto_new_keypair(resp_plain, temp_secret_key);
-    random_nonce(con->sent_nonce);
-    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, con->sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(con->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
+    random_nonce(handshake->sent_nonce);
+    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, handshake->sent_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(handshake->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
 
-    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
-    random_nonce(response);
+    random_nonce(handshake->response);
 
-    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
-                                 response + CRYPTO_NONCE_SIZE);
+    len = encrypt_data_symmetric(shared_key, handshake->response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
+                                 handshake->response + CRYPTO_NONCE_SIZE);
+    crypto_memzero(shared_key, sizeof(shared_key));
 
     if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
+        crypto_memzero(temp_secret_key, sizeof(temp_secret_key));
+        return;
+    }
+
+    encrypt_precompute(plain, temp_secret_key, handshake->shared_key);
+    crypto_memzero(temp_secret_key, sizeof(temp_secret_key));
+    handshake->result = 0;
+}
+
+/* Send the response of a computed handshake and make con unconfirmed.
+ *
+ * return 1 on success.
+ * return -1 on failure.
+ */
+static int finish_TCP_handshake(TCP_Secure_Connection *con, const TCP_Handshake *handshake)
+{
+    if (handshake->result == -1) {
         return -1;
     }
 
-    if (TCP_SERVER_HANDSHAKE_SIZE != send(con->sock, (const char *)response, TCP_SERVER_HANDSHAKE_SIZE, MSG_NOSIGNAL)) {
+    if (TCP_SERVER_HANDSHAKE_SIZE != send(con->sock, (const char *)handshake->response, TCP_SERVER_HANDSHAKE_SIZE,
+                                          MSG_NOSIGNAL)) {
         return -1;
     }
 
-    encrypt_precompute(plain, temp_secret_key, con->shared_key);
+    memcpy(con->public_key, handshake->data, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(con->recv_nonce, handshake->recv_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(con->sent_nonce, handshake->sent_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(con->shared_key, handshake->shared_key, CRYPTO_SHARED_KEY_SIZE);
     con->status = TCP_STATUS_UNCONFIRMED;
     return 1;
 }
 
+/* return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
+                                const uint8_t *self_secret_key)
+{
+    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
+        return -1;
+    }
+
+    if (con->status != TCP_STATUS_CONNECTED) {
+        return -1;
+    }
+
+    TCP_Handshake handshake;
+    memcpy(handshake.secret_key, self_secret_key, CRYPTO_SECRET_KEY_SIZE);
+    memcpy(handshake.data, data, TCP_CLIENT_HANDSHAKE_SIZE);
+    compute_TCP_handshake(&handshake);
+
+    int ret = finish_TCP_handshake(con, &handshake);
+    crypto_memzero(&handshake, sizeof(handshake));
+    return ret;
+}
+
 /* return 1 if connection handshake was handled correctly.
  * return 0 if we didn't get it yet.
  * return -1 if the connection must be killed.
@@ -843,6 +975,7 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
             if (ping_id) {
                 if (ping_id == con->ping_id) {
                     con->ping_id = 0;
+                    timer_set(TCP_server->ping_timers, con->ping_timer, con->last_pinged + TCP_PING_FREQUENCY);
                 }
 
                 return 0;
@@ -971,6 +1104,7 @@ static int accept_connection(TCP_Server *TCP_server, Socket sock)
     conn->status = TCP_STATUS_CONNECTED;
     conn->sock = sock;
     conn->next_packet_length = 0;
+    conn->identifier = ++TCP_server->counter;
 
     ++TCP_server->incomming_connection_queue_index;
     return index;
@@ -1028,10 +1162,20 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
         return NULL;
     }
 
+    unix_time_update();
+    temp->ping_timers = timer_wheel_new(unix_time());
+
+    if (temp->ping_timers == NULL) {
+        free(temp->socks_listening);
+        free(temp);
+        return NULL;
+    }
+
 #ifdef TCP_SERVER_USE_EPOLL
     temp->efd = epoll_create(8);
 
     if (temp->efd == -1) {
+        timer_wheel_kill(temp->ping_timers);
         free(temp->socks_listening);
         free(temp);
         return NULL;
@@ -1072,6 +1216,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     if (temp->num_listening_socks == 0) {
+        timer_wheel_kill(temp->ping_timers);
         free(temp->socks_listening);
         free(temp);
         return NULL;
@@ -1105,30 +1250,135 @@ static void do_TCP_accept_new(TCP_Server *TCP_server)
     }
 }
 
+/* Move incoming connection i, which finished its handshake, to the unconfirmed ones.
+ *
+ * return index in the unconfirmed connection queue.
+ */
+static int move_to_unconfirmed(TCP_Server *TCP_server, uint32_t i)
+{
+    int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
+    TCP_Secure_Connection *conn_old = &TCP_server->incomming_connection_queue[i];
+    TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
+
+    if (conn_new->status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_connection(conn_new);
+    }
+
+    memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
+    crypto_memzero(conn_old, sizeof(TCP_Secure_Connection));
+    ++TCP_server->unconfirmed_connection_queue_index;
+
+    return index_new;
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Watch unconfirmed connection index, which was an incoming one before.
+ *
+ * return 0 on success.
+ * return -1 if it had to be killed.
+ */
+static int epoll_watch_unconfirmed(TCP_Server *TCP_server, int index)
+{
+    TCP_Secure_Connection *conn = &TCP_server->unconfirmed_connection_queue[index];
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET | EPOLLRDHUP,
+        .data.u64 = conn->sock | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index << 40)
+    };
+
+    if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, conn->sock, &ev) == -1) {
+        kill_TCP_connection(conn);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+static void handshake_work(uint8_t *data, uint16_t length)
+{
+    compute_TCP_handshake((TCP_Handshake *)data);
+}
+
+static void handshake_done(void *object, uint8_t *data, uint16_t length, void *userdata)
+{
+    TCP_Server *TCP_server = (TCP_Server *)object;
+    const TCP_Handshake *handshake = (const TCP_Handshake *)data;
+    TCP_Secure_Connection *conn = &TCP_server->incomming_connection_queue[handshake->index];
+
+    /* The connection may have been killed and its slot reused meanwhile. */
+    if (conn->status != TCP_STATUS_HANDSHAKING || conn->identifier != handshake->identifier) {
+        return;
+    }
+
+    if (finish_TCP_handshake(conn, handshake) == -1) {
+        kill_TCP_connection(conn);
+        return;
+    }
+
+    int index_new = move_to_unconfirmed(TCP_server, handshake->index);
+
+#ifdef TCP_SERVER_USE_EPOLL
+    epoll_watch_unconfirmed(TCP_server, index_new);
+#else
+    (void)index_new;
+#endif
+}
+
+/* Read the handshake of incoming connection i and give it to the precompute pool.
+ *
+ * return 0 if the handshake was given to the pool or isn't there yet.
+ * return -1 if the connection must be killed.
+ */
+static int submit_connection_handshake(TCP_Server *TCP_server, uint32_t i)
+{
+    TCP_Secure_Connection *conn = &TCP_server->incomming_connection_queue[i];
+    TCP_Handshake handshake;
+    int len = read_TCP_packet(conn->sock, handshake.data, TCP_CLIENT_HANDSHAKE_SIZE);
+
+    if (len == -1) {
+        return 0;
+    }
+
+    if (len != TCP_CLIENT_HANDSHAKE_SIZE) {
+        return -1;
+    }
+
+    memcpy(handshake.secret_key, TCP_server->secret_key, CRYPTO_SECRET_KEY_SIZE);
+    handshake.index = i;
+    handshake.identifier = conn->identifier;
+
+    int ret = precompute_pool_submit(TCP_server->precompute_pool, handshake_work, handshake_done, TCP_server,
+                                     (const uint8_t *)&handshake, sizeof(handshake));
+    crypto_memzero(&handshake, sizeof(handshake));
+
+    if (ret == -1) {
+        return -1;
+    }
+
+    conn->status = TCP_STATUS_HANDSHAKING;
+    return 0;
+}
+
 static int do_incoming(TCP_Server *TCP_server, uint32_t i)
 {
     if (TCP_server->incomming_connection_queue[i].status != TCP_STATUS_CONNECTED) {
         return -1;
     }
 
+    if (TCP_server->precompute_pool != NULL) {
+        if (submit_connection_handshake(TCP_server, i) == -1) {
+            kill_TCP_connection(&TCP_server->incomming_connection_queue[i]);
+        }
+
+        return -1;
+    }
+
     int ret = read_connection_handshake(&TCP_server->incomming_connection_queue[i], TCP_server->secret_key);
 
     if (ret == -1) {
         kill_TCP_connection(&TCP_server->incomming_connection_queue[i]);
     } else if (ret == 1) {
-        int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
-        TCP_Secure_Connection *conn_old = &TCP_server->incomming_connection_queue[i];
-        TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
-
-        if (conn_new->status != TCP_STATUS_NO_STATUS) {
-            kill_TCP_connection(conn_new);
-        }
-
-        memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
-        crypto_memzero(conn_old, sizeof(TCP_Secure_Connection));
-        ++TCP_server->unconfirmed_connection_queue_index;
-
-        return index_new;
+        return move_to_unconfirmed(TCP_server, i);
     }
 
     return -1;
@@ -1197,8 +1447,50 @@ static void do_TCP_unconfirmed(TCP_Server *TCP_server)
     }
 }
 
+/* Called by the ping timer of an accepted connection: TCP_PING_FREQUENCY after
+ * the last ping was answered, or TCP_PING_TIMEOUT after it was sent.
+ */
+static void ping_accepted(void *object, uint32_t index, void *userdata)
+{
+    TCP_Server *TCP_server = (TCP_Server *)object;
+    TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[index];
+
+    if (conn->ping_id) {
+        kill_accepted(TCP_server, index);
+        return;
+    }
+
+    uint8_t ping[1 + sizeof(uint64_t)];
+    ping[0] = TCP_PACKET_PING;
+    uint64_t ping_id = random_64b();
+
+    if (!ping_id) {
+        ++ping_id;
+    }
+
+    memcpy(ping + 1, &ping_id, sizeof(uint64_t));
+    int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
+
+    if (ret == 1) {
+        conn->last_pinged = unix_time();
+        conn->ping_id = ping_id;
+        timer_set(TCP_server->ping_timers, conn->ping_timer, unix_time() + TCP_PING_TIMEOUT);
+        return;
+    }
+
+    if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
+        kill_accepted(TCP_server, index);
+        return;
+    }
+
+    /* Try again once the socket has room. */
+    timer_set(TCP_server->ping_timers, conn->ping_timer, unix_time() + 1);
+}
+
 static void do_TCP_confirmed(TCP_Server *TCP_server)
 {
+    timer_wheel_run(TCP_server->ping_timers, unix_time(), NULL);
+
 #ifdef TCP_SERVER_USE_EPOLL
 
     if (TCP_server->last_run_pinged == unix_time()) {
@@ -1216,34 +1508,6 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
             continue;
         }
 
-        if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY)) {
-            uint8_t ping[1 + sizeof(uint64_t)];
-            ping[0] = TCP_PACKET_PING;
-            uint64_t ping_id = random_64b();
-
-            if (!ping_id) {
-                ++ping_id;
-            }
-
-            memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
-
-            if (ret == 1) {
-                conn->last_pinged = unix_time();
-                conn->ping_id = ping_id;
-            } else {
-                if (is_timeout(conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
-                    kill_accepted(TCP_server, i);
-                    continue;
-                }
-            }
-        }
-
-        if (conn->ping_id && is_timeout(conn->last_pinged, TCP_PING_TIMEOUT)) {
-            kill_accepted(TCP_server, i);
-            continue;
-        }
-
         send_pending_data(conn);
 
 #ifndef TCP_SERVER_USE_EPOLL
@@ -1336,13 +1600,7 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                     int index_new;
 
                     if ((index_new = do_incoming(TCP_server, index)) != -1) {
-                        events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                        events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
-
-                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
-                            kill_TCP_connection(&TCP_server->unconfirmed_connection_queue[index_new]);
-                            break;
-                        }
+                        epoll_watch_unconfirmed(TCP_server, index_new);
                     }
 
                     break;
@@ -1377,6 +1635,11 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
 }
 #endif
 
+void TCP_server_set_precompute_pool(TCP_Server *TCP_server, Precompute_Pool *pool)
+{
+    TCP_server->precompute_pool = pool;
+}
+
 void do_TCP_server(TCP_Server *TCP_server)
 {
     unix_time_update();
@@ -1411,6 +1674,7 @@ void kill_TCP_server(TCP_Server *TCP_server)
     close(TCP_server->efd);
 #endif
 
+    timer_wheel_kill(TCP_server->ping_timers);
     free(TCP_server->socks_listening);
     free(TCP_server->accepted_connection_array);
     free(TCP_server);
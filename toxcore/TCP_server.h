@@ -27,6 +27,7 @@
 #include "crypto_core.h"
 #include "list.h"
 #include "onion.h"
+#include "precompute_pool.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
 #include <sys/epoll.h>
@@ -79,6 +80,7 @@ enum {
     TCP_STATUS_CONNECTED,
     TCP_STATUS_UNCONFIRMED,
     TCP_STATUS_CONFIRMED,
+    TCP_STATUS_HANDSHAKING, /* Handshake being computed by a precompute pool. */
 };
 
 typedef struct TCP_Priority_List TCP_Priority_List;
@@ -113,6 +115,7 @@ typedef struct TCP_Secure_Connection {
 
     uint64_t last_pinged;
     uint64_t ping_id;
+    uint32_t ping_timer;
 } TCP_Secure_Connection;
 
 
@@ -121,11 +124,35 @@ typedef struct TCP_Server TCP_Server;
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server);
 size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 
+/* Copy the sockets the server wants watched for incoming data into fds, at
+ * most max_fds of them. With TCP_SERVER_USE_EPOLL this is the epoll
+ * descriptor only.
+ *
+ * return the number of sockets, which may be more than max_fds.
+ */
+unsigned int tcp_server_fds(const TCP_Server *tcp_server, Socket *fds, unsigned int max_fds);
+
+/* return 1 if a connection has data that couldn't be written to its socket yet.
+ * return 0 otherwise.
+ */
+bool tcp_server_send_pending(const TCP_Server *tcp_server);
+
+/* return the time in milliseconds until a connection may need to be pinged or
+ * times out.
+ */
+uint32_t tcp_server_run_interval(const TCP_Server *tcp_server);
+
 /* Create new TCP server instance.
  */
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Compute the handshakes of incoming connections with pool instead of in
+ * do_TCP_server(). The pool must be killed before the server, and the done
+ * callbacks of its jobs need do_precompute_pool() to be called.
+ */
+void TCP_server_set_precompute_pool(TCP_Server *TCP_server, Precompute_Pool *pool);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *TCP_server);
@@ -40,4 +40,14 @@
 
 #endif
 
+// Thread local storage. THREAD_LOCAL is left undefined if the compiler has no
+// way to declare thread local variables, code using it must check for that.
+#if !defined(__cplusplus) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#endif
+
 #endif /* CCOMPAT_H */
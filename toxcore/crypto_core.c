@@ -46,6 +46,14 @@
 #define crypto_box_MACBYTES (crypto_box_ZEROBYTES - crypto_box_BOXZEROBYTES)
 #endif
 
+#if !defined(VANILLA_NACL) && defined(THREAD_LOCAL)
+#define USE_RANDOM_POOL
+#endif
+
+#if defined(USE_RANDOM_POOL) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 #if CRYPTO_PUBLIC_KEY_SIZE != crypto_box_PUBLICKEYBYTES
 #error CRYPTO_PUBLIC_KEY_SIZE should be equal to crypto_box_PUBLICKEYBYTES
 #endif
@@ -78,6 +86,89 @@
 #error CRYPTO_SHA512_SIZE should be equal to crypto_hash_sha512_BYTES
 #endif
 
+#ifdef USE_RANDOM_POOL
+/* Number of bytes handed out between two refills of the pool. */
+#define RANDOM_POOL_SIZE 256
+
+/* Number of refills after which the key is taken from the system RNG again. */
+#define RANDOM_POOL_RESEED_INTERVAL 4096
+
+/* Ping ids, nonces and other small random values are taken from a per thread
+ * ChaCha20 keystream instead of asking the system RNG for each of them.
+ *
+ * Every refill replaces the key with the first bytes of its own keystream and
+ * bytes are wiped as they are handed out, so the state never allows to recover
+ * values that were already returned.
+ */
+typedef struct Random_Pool {
+    uint8_t key[crypto_stream_chacha20_KEYBYTES];
+    uint8_t bytes[RANDOM_POOL_SIZE];
+    uint16_t available;
+    uint16_t refills; /* 0 if the key must be taken from the system RNG. */
+} Random_Pool;
+
+static THREAD_LOCAL Random_Pool random_pool;
+
+#ifndef _WIN32
+static pthread_once_t random_pool_fork_once = PTHREAD_ONCE_INIT;
+
+/* Only the forking thread exists in the child, its pool is the one to forget
+ * so parent and child don't hand out the same values.
+ */
+static void random_pool_forget(void)
+{
+    memset(&random_pool, 0, sizeof(random_pool));
+}
+
+static void random_pool_register_fork(void)
+{
+    pthread_atfork(NULL, NULL, random_pool_forget);
+}
+#endif
+
+static void random_pool_refill(Random_Pool *pool)
+{
+    static const uint8_t nonce[crypto_stream_chacha20_NONCEBYTES] = {0};
+    uint8_t stream[crypto_stream_chacha20_KEYBYTES + RANDOM_POOL_SIZE];
+
+    if (pool->refills == 0) {
+#ifndef _WIN32
+        pthread_once(&random_pool_fork_once, random_pool_register_fork);
+#endif
+        randombytes_buf(pool->key, sizeof(pool->key));
+    }
+
+    pool->refills = (pool->refills + 1) % RANDOM_POOL_RESEED_INTERVAL;
+
+    crypto_stream_chacha20(stream, sizeof(stream), nonce, pool->key);
+    memcpy(pool->key, stream, sizeof(pool->key));
+    memcpy(pool->bytes, stream + sizeof(pool->key), RANDOM_POOL_SIZE);
+    crypto_memzero(stream, sizeof(stream));
+    pool->available = RANDOM_POOL_SIZE;
+}
+#endif
+
+/* Fill data with length (at most a nonce) random bytes for values that are asked
+ * for often, like ping ids and nonces.
+ */
+static void random_small(uint8_t *data, size_t length)
+{
+#ifdef USE_RANDOM_POOL
+    Random_Pool *pool = &random_pool;
+
+    if (pool->available < length) {
+        random_pool_refill(pool);
+    }
+
+    uint8_t *bytes = pool->bytes + (RANDOM_POOL_SIZE - pool->available);
+    memcpy(data, bytes, length);
+    memset(bytes, 0, length);
+    pool->available -= length;
+#else
+    randombytes(data, length);
+#endif
+}
+
 int32_t public_key_cmp(const uint8_t *pk1, const uint8_t *pk2)
 {
 #if CRYPTO_PUBLIC_KEY_SIZE != 32
@@ -89,14 +180,14 @@ int32_t public_key_cmp(const uint8_t *pk1, const uint8_t *pk2)
 uint32_t random_int(void)
 {
     uint32_t randnum;
-    randombytes((uint8_t *)&randnum , sizeof(randnum));
+    random_small((uint8_t *)&randnum, sizeof(randnum));
     return randnum;
 }
 
 uint64_t random_64b(void)
 {
     uint64_t randnum;
-    randombytes((uint8_t *)&randnum, sizeof(randnum));
+    random_small((uint8_t *)&randnum, sizeof(randnum));
     return randnum;
 }
 
@@ -126,6 +217,10 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
         return -1;
     }
 
+    /* crypto_box_easy_afternm() would save the copies, but it computes the MAC
+     * with incremental Poly1305, which is slower for packets of a few hundred
+     * bytes than padding and the one pass crypto_box_afternm() does.
+     */
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES);
 
@@ -148,6 +243,13 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
         return -1;
     }
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_easy_afternm(plain, encrypted, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+#else
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_BOXZEROBYTES);
 
@@ -159,9 +261,106 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     }
 
     memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+#endif
     return length - crypto_box_MACBYTES;
 }
 
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *plain,
+                                        size_t length, uint8_t *encrypted, uint8_t *mac)
+{
+    if (length == 0 || !shared_key || !nonce || !plain || !encrypted || !mac) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_detached_afternm(encrypted, mac, plain, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
+    VLA(uint8_t, temp, length + crypto_box_MACBYTES);
+
+    if (encrypt_data_symmetric(shared_key, nonce, plain, length, temp) == -1) {
+        return -1;
+    }
+
+    memcpy(mac, temp, crypto_box_MACBYTES);
+    memcpy(encrypted, temp + crypto_box_MACBYTES, length);
+#endif
+    return length;
+}
+
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted,
+                                        size_t length, const uint8_t *mac, uint8_t *plain)
+{
+    if (length == 0 || !shared_key || !nonce || !encrypted || !mac || !plain) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_detached_afternm(plain, encrypted, mac, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
+    VLA(uint8_t, temp, length + crypto_box_MACBYTES);
+
+    memcpy(temp, mac, crypto_box_MACBYTES);
+    memcpy(temp + crypto_box_MACBYTES, encrypted, length);
+
+    if (decrypt_data_symmetric(shared_key, nonce, temp, SIZEOF_VLA(temp), plain) == -1) {
+        return -1;
+    }
+
+#endif
+    return length;
+}
+
+int32_t encrypt_data_symmetric_inplace(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length)
+{
+    /* Encrypting the plain text where it is and putting the MAC in front of it
+     * gives the layout of encrypt_data_symmetric().
+     */
+    if (encrypt_data_symmetric_detached(shared_key, nonce, data + crypto_box_MACBYTES, length,
+                                        data + crypto_box_MACBYTES, data) == -1) {
+        return -1;
+    }
+
+    return length + crypto_box_MACBYTES;
+}
+
+int32_t decrypt_data_symmetric_inplace(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length)
+{
+    if (length <= crypto_box_MACBYTES) {
+        return -1;
+    }
+
+    return decrypt_data_symmetric_detached(shared_key, nonce, data + crypto_box_MACBYTES, length - crypto_box_MACBYTES,
+                                           data, data + crypto_box_MACBYTES);
+}
+
+uint32_t decrypt_data_symmetric_batch(const uint8_t *shared_key, Crypto_Batch_Packet *packets, uint32_t count)
+{
+    uint32_t decrypted = 0;
+    uint32_t i;
+
+    /* libsodium has no multi-buffer XSalsa20-Poly1305, so this is a loop for
+     * now. A multi-buffer implementation can replace it behind the same API.
+     */
+    for (i = 0; i < count; ++i) {
+        Crypto_Batch_Packet *packet = &packets[i];
+        packet->result = decrypt_data_symmetric_inplace(shared_key, packet->nonce, packet->data, packet->length);
+
+        if (packet->result != -1) {
+            ++decrypted;
+        }
+    }
+
+    return decrypted;
+}
+
 int32_t encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
                      const uint8_t *plain, size_t length, uint8_t *encrypted)
 {
@@ -252,7 +451,7 @@ void increment_nonce_number(uint8_t *nonce, uint32_t host_order_num)
 /* Fill the given nonce with random bytes. */
 void random_nonce(uint8_t *nonce)
 {
-    randombytes(nonce, crypto_box_NONCEBYTES);
+    random_small(nonce, crypto_box_NONCEBYTES);
 }
 
 /* Fill a key CRYPTO_SYMMETRIC_KEY_SIZE big with random bytes */
@@ -204,6 +204,76 @@ int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce,
 int32_t decrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
                                uint8_t *plain);
 
+/**
+ * Encrypts plain of length length to encrypted of the same length and writes
+ * the CRYPTO_MAC_SIZE byte MAC to mac, using a shared key
+ * CRYPTO_SYMMETRIC_KEY_SIZE big and a CRYPTO_NONCE_SIZE byte nonce.
+ * encrypted may be plain.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *plain,
+                                        size_t length, uint8_t *encrypted, uint8_t *mac);
+
+/**
+ * Decrypts encrypted of length length with its CRYPTO_MAC_SIZE byte MAC to
+ * plain of the same length using a shared key CRYPTO_SHARED_KEY_SIZE big and
+ * a CRYPTO_NONCE_SIZE byte nonce. plain may be encrypted.
+ *
+ * @return -1 if there was a problem (decryption failed), length of plain data
+ * if everything was fine.
+ */
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted,
+                                        size_t length, const uint8_t *mac, uint8_t *plain);
+
+/**
+ * Encrypts the plain text of length length at data + CRYPTO_MAC_SIZE in
+ * place, leaving length + CRYPTO_MAC_SIZE bytes of encrypted data at data as
+ * encrypt_data_symmetric() would write them. The first CRYPTO_MAC_SIZE bytes
+ * of data are overwritten.
+ *
+ * libsodium computes the MAC of detached encryption incrementally, which makes
+ * this slower than copying for encrypt_data_symmetric() at most packet sizes,
+ * see testing/crypto_bench.c.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+int32_t encrypt_data_symmetric_inplace(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length);
+
+/**
+ * Decrypts the encrypted data of length length at data in place. The plain
+ * text of length - CRYPTO_MAC_SIZE is left at data + CRYPTO_MAC_SIZE.
+ *
+ * @return -1 if there was a problem (decryption failed), length of plain data
+ * if everything was fine.
+ */
+int32_t decrypt_data_symmetric_inplace(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, size_t length);
+
+/**
+ * A packet for decrypt_data_symmetric_batch(). data holds length bytes of
+ * encrypted data, nonce the CRYPTO_NONCE_SIZE byte nonce it was encrypted with.
+ */
+typedef struct Crypto_Batch_Packet {
+    const uint8_t *nonce;
+    uint8_t *data;
+    size_t length;
+    /**
+     * Set to what decrypt_data_symmetric_inplace() returned for this packet.
+     */
+    int32_t result;
+} Crypto_Batch_Packet;
+
+/**
+ * Decrypts count packets encrypted with the same shared key in place, as
+ * decrypt_data_symmetric_inplace() would. A packet failing to decrypt does not
+ * stop the others from being decrypted, its result is set to -1.
+ *
+ * @return the number of packets that decrypted successfully.
+ */
+uint32_t decrypt_data_symmetric_batch(const uint8_t *shared_key, Crypto_Batch_Packet *packets, uint32_t count);
+
 /**
  * Increment the given nonce by 1 in big endian (rightmost byte incremented
  * first).
@@ -141,19 +141,7 @@ static Friend_Conn *get_conn(const Friend_Connections *fr_c, int friendcon_id)
  */
 int getfriend_conn_id_pk(Friend_Connections *fr_c, const uint8_t *real_pk)
 {
-    uint32_t i;
-
-    for (i = 0; i < fr_c->num_cons; ++i) {
-        Friend_Conn *friend_con = get_conn(fr_c, i);
-
-        if (friend_con) {
-            if (public_key_cmp(friend_con->real_public_key, real_pk) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return index_map_find(&fr_c->conns_index, real_pk);
 }
 
 /* Add a TCP relay associated to the friend.
@@ -718,6 +706,11 @@ int new_friend_connection(Friend_Connections *fr_c, const uint8_t *real_public_k
         return -1;
     }
 
+    if (index_map_add(&fr_c->conns_index, real_public_key, friendcon_id) == -1) {
+        onion_delfriend(fr_c->onion_c, onion_friendnum);
+        return -1;
+    }
+
     Friend_Conn *friend_con = &fr_c->conns[friendcon_id];
 
     friend_con->crypt_connection_id = -1;
@@ -756,6 +749,7 @@ int kill_friend_connection(Friend_Connections *fr_c, int friendcon_id)
         DHT_delfriend(fr_c->dht, friend_con->dht_temp_pk, friend_con->dht_lock);
     }
 
+    index_map_remove(&fr_c->conns_index, friend_con->real_public_key);
     return wipe_friend_conn(fr_c, friendcon_id);
 }
 
@@ -823,6 +817,11 @@ Friend_Connections *new_friend_connections(Onion_Client *onion_c, bool local_dis
         return NULL;
     }
 
+    if (index_map_init(&temp->conns_index, CRYPTO_PUBLIC_KEY_SIZE, 0) == -1) {
+        free(temp);
+        return NULL;
+    }
+
     temp->dht = onion_c->dht;
     temp->net_crypto = onion_c->c;
     temp->onion_c = onion_c;
@@ -915,5 +914,6 @@ void kill_friend_connections(Friend_Connections *fr_c)
         LANdiscovery_kill(fr_c->dht);
     }
 
+    index_map_free(&fr_c->conns_index);
     free(fr_c);
 }
@@ -101,6 +101,7 @@ typedef struct {
 
     Friend_Conn *conns;
     uint32_t num_cons;
+    Index_Map conns_index; /* Real public key to friendcon_id. */
 
     int (*fr_request_callback)(void *object, const uint8_t *source_pubkey, const uint8_t *data, uint16_t len,
                                void *userdata);
@@ -29,6 +29,12 @@
 
 #include "util.h"
 
+/* Interval in seconds to send ping messages */
+#define GROUP_PING_INTERVAL 20
+
+/* Time in seconds without a ping after which a peer is removed. */
+#define GROUP_PEER_TIMEOUT (GROUP_PING_INTERVAL * 3)
+
 /* return 1 if the groupnumber is not valid.
  * return 0 if the groupnumber is valid.
  */
@@ -399,6 +405,8 @@ static int connect_to_closest(Group_Chats *g_c, int groupnumber, void *userdata)
     return 0;
 }
 
+static void peer_timed_out(void *object, uint32_t number, void *userdata);
+
 /* Add a peer to the group chat.
  *
  * do_gc_callback indicates whether we want to trigger callbacks set by the client
@@ -436,9 +444,24 @@ static int addpeer(Group_Chats *g_c, int groupnumber, const uint8_t *real_pk, co
         return -1;
     }
 
+    /* The timer number holds the groupnumber in the high and the peer number
+     * in the low 16 bits.
+     */
+    if (groupnumber > UINT16_MAX) {
+        return -1;
+    }
+
+    const uint32_t timeout_timer = timer_new(g_c->peer_timeouts, &peer_timed_out, g_c,
+                                   ((uint32_t)groupnumber << 16) | peer_number);
+
+    if (timeout_timer == 0) {
+        return -1;
+    }
+
     Group_Peer *temp = (Group_Peer *)realloc(g->group, sizeof(Group_Peer) * (g->numpeers + 1));
 
     if (temp == NULL) {
+        timer_kill(g_c->peer_timeouts, timeout_timer);
         return -1;
     }
 
@@ -450,6 +473,8 @@ static int addpeer(Group_Chats *g_c, int groupnumber, const uint8_t *real_pk, co
     g->group[g->numpeers].peer_number = peer_number;
 
     g->group[g->numpeers].last_recv = unix_time();
+    g->group[g->numpeers].timeout_timer = timeout_timer;
+    timer_set(g_c->peer_timeouts, timeout_timer, unix_time() + GROUP_PEER_TIMEOUT);
     ++g->numpeers;
 
     add_to_closest(g_c, groupnumber, real_pk, temp_pk);
@@ -521,6 +546,7 @@ static int delpeer(Group_Chats *g_c, int groupnumber, int peer_index, void *user
         remove_close_conn(g_c, groupnumber, friendcon_id);
     }
 
+    timer_kill(g_c->peer_timeouts, g->group[peer_index].timeout_timer);
     --g->numpeers;
 
     void *peer_object = g->group[peer_index].object;
@@ -783,6 +809,8 @@ int del_groupchat(Group_Chats *g_c, int groupnumber)
     }
 
     for (i = 0; i < g->numpeers; ++i) {
+        timer_kill(g_c->peer_timeouts, g->group[i].timeout_timer);
+
         if (g->peer_on_leave) {
             g->peer_on_leave(g->object, groupnumber, i, g->group[i].object);
         }
@@ -2375,9 +2403,6 @@ void *group_peer_get_object(const Group_Chats *g_c, int groupnumber, int peernum
     return g->group[peernumber].object;
 }
 
-/* Interval in seconds to send ping messages */
-#define GROUP_PING_INTERVAL 20
-
 static int ping_groupchat(Group_Chats *g_c, int groupnumber)
 {
     Group_c *g = get_group_c(g_c, groupnumber);
@@ -2395,27 +2420,41 @@ static int ping_groupchat(Group_Chats *g_c, int groupnumber)
     return 0;
 }
 
-static int groupchat_clear_timedout(Group_Chats *g_c, int groupnumber, void *userdata)
+/* Pings only move last_recv, the timer of a peer is moved to the new timeout
+ * when it runs out. Only other peers of connected groups are removed, the
+ * timers of the others are checked again later.
+ */
+static void peer_timed_out(void *object, uint32_t number, void *userdata)
 {
+    Group_Chats *g_c = (Group_Chats *)object;
+    const int groupnumber = number >> 16;
     Group_c *g = get_group_c(g_c, groupnumber);
 
     if (!g) {
-        return -1;
+        return;
     }
 
-    uint32_t i;
+    const int peer_index = get_peer_index(g, number & 0xFFFF);
 
-    for (i = 0; i < g->numpeers; ++i) {
-        if (g->peer_number != g->group[i].peer_number && is_timeout(g->group[i].last_recv, GROUP_PING_INTERVAL * 3)) {
-            delpeer(g_c, groupnumber, i, userdata);
-        }
+    if (peer_index == -1) {
+        return;
+    }
 
-        if (g->group == NULL || i >= g->numpeers) {
-            break;
+    Group_Peer *peer = &g->group[peer_index];
+    uint64_t deadline = peer->last_recv + GROUP_PEER_TIMEOUT;
+
+    if (is_timeout(peer->last_recv, GROUP_PEER_TIMEOUT)) {
+        if (g->peer_number == peer->peer_number) {
+            deadline = unix_time() + GROUP_PEER_TIMEOUT;
+        } else if (g->status != GROUPCHAT_STATUS_CONNECTED) {
+            deadline = unix_time() + 1;
+        } else {
+            delpeer(g_c, groupnumber, peer_index, userdata);
+            return;
         }
     }
 
-    return 0;
+    timer_set(g_c->peer_timeouts, peer->timeout_timer, deadline);
 }
 
 /* Send current name (set in messenger) to all online groups.
@@ -2450,6 +2489,13 @@ Group_Chats *new_groupchats(Messenger *m)
         return NULL;
     }
 
+    temp->peer_timeouts = timer_wheel_new(unix_time());
+
+    if (temp->peer_timeouts == NULL) {
+        free(temp);
+        return NULL;
+    }
+
     temp->m = m;
     temp->fr_c = m->fr_c;
     m->conferences_object = temp;
@@ -2473,10 +2519,11 @@ void do_groupchats(Group_Chats *g_c, void *userdata)
         if (g->status == GROUPCHAT_STATUS_CONNECTED) {
             connect_to_closest(g_c, i, userdata);
             ping_groupchat(g_c, i);
-            groupchat_clear_timedout(g_c, i, userdata);
         }
     }
 
+    timer_wheel_run(g_c->peer_timeouts, unix_time(), userdata);
+
     // TODO(irungentoo):
 }
 
@@ -2489,11 +2536,17 @@ void kill_groupchats(Group_Chats *g_c)
         del_groupchat(g_c, i);
     }
 
+    timer_wheel_kill(g_c->peer_timeouts);
     m_callback_conference_invite(g_c->m, NULL);
     g_c->m->conferences_object = NULL;
     free(g_c);
 }
 
+uint32_t groupchats_run_interval(const Group_Chats *g_c)
+{
+    return unix_time_until(timer_wheel_next_deadline(g_c->peer_timeouts));
+}
+
 /* Return the number of chats in the instance m.
  * You should use this to determine how much memory to allocate
  * for copy_chatlist.
@@ -25,6 +25,7 @@
 #define GROUP_H
 
 #include "Messenger.h"
+#include "util.h"
 
 enum {
     GROUPCHAT_STATUS_NONE,
@@ -44,6 +45,7 @@ typedef struct {
     uint8_t     temp_pk[CRYPTO_PUBLIC_KEY_SIZE];
 
     uint64_t    last_recv;
+    uint32_t    timeout_timer;
     uint32_t    last_message_number;
 
     uint8_t     nick[MAX_NAME_LENGTH];
@@ -115,6 +117,8 @@ typedef struct {
     Group_c *chats;
     uint32_t num_chats;
 
+    Timer_Wheel *peer_timeouts;
+
     void (*invite_callback)(Messenger *m, uint32_t, int, const uint8_t *, size_t, void *);
     void (*message_callback)(Messenger *m, uint32_t, uint32_t, int, const uint8_t *, size_t, void *);
     void (*group_namelistchange)(Messenger *m, int, int, uint8_t, void *);
@@ -389,6 +393,9 @@ Group_Chats *new_groupchats(Messenger *m);
 /* main groupchats loop. */
 void do_groupchats(Group_Chats *g_c, void *userdata);
 
+/* return the time in milliseconds until the next peer may time out. */
+uint32_t groupchats_run_interval(const Group_Chats *g_c);
+
 /* Free everything related with group chats. */
 void kill_groupchats(Group_Chats *g_c);
 
@@ -0,0 +1,244 @@
+/*
+ * A hash map from fixed size keys, e.g. public keys, to indexes in an array.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "index_map.h"
+
+#include "crypto_core.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_MAP_MIN_SIZE 8
+
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* The seed keeps others from picking keys that all land in the same slots. */
+static uint32_t hash_key(const Index_Map *map, const uint8_t *key)
+{
+    uint64_t hash = map->seed;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= map->key_size; i += sizeof(uint64_t)) {
+        uint64_t chunk;
+        memcpy(&chunk, key + i, sizeof(chunk));
+        hash = mix(hash ^ chunk);
+    }
+
+    if (i < map->key_size) {
+        uint64_t chunk = 0;
+        memcpy(&chunk, key + i, map->key_size - i);
+        hash = mix(hash ^ chunk);
+    }
+
+    return (uint32_t)hash;
+}
+
+static uint8_t *slot_key(const Index_Map *map, uint32_t slot)
+{
+    return map->keys + (size_t)slot * map->key_size;
+}
+
+/* return slot of key, or of the empty slot it would go in. */
+static uint32_t find_slot(const Index_Map *map, const uint8_t *key)
+{
+    const uint32_t mask = map->size - 1;
+    uint32_t slot = hash_key(map, key) & mask;
+
+    while (map->ids[slot] != -1 && memcmp(slot_key(map, slot), key, map->key_size) != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static int alloc_slots(Index_Map *map, uint32_t size)
+{
+    uint8_t *keys = (uint8_t *)malloc((size_t)size * map->key_size);
+    int32_t *ids = (int32_t *)malloc((size_t)size * sizeof(int32_t));
+
+    if (keys == NULL || ids == NULL) {
+        free(keys);
+        free(ids);
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < size; ++i) {
+        ids[i] = -1;
+    }
+
+    map->keys = keys;
+    map->ids = ids;
+    map->size = size;
+    return 0;
+}
+
+static int resize(Index_Map *map, uint32_t size)
+{
+    Index_Map old = *map;
+
+    if (alloc_slots(map, size) == -1) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < old.size; ++i) {
+        if (old.ids[i] != -1) {
+            const uint32_t slot = find_slot(map, slot_key(&old, i));
+            memcpy(slot_key(map, slot), slot_key(&old, i), map->key_size);
+            map->ids[slot] = old.ids[i];
+        }
+    }
+
+    free(old.keys);
+    free(old.ids);
+    return 0;
+}
+
+int index_map_init(Index_Map *map, uint32_t key_size, uint32_t capacity)
+{
+    uint32_t size = INDEX_MAP_MIN_SIZE;
+
+    /* At most 3/4 of the slots are used, so probes stay short. */
+    while (size / 4 * 3 < capacity && size < (1U << 31)) {
+        size *= 2;
+    }
+
+    memset(map, 0, sizeof(Index_Map));
+    map->key_size = key_size;
+    map->seed = random_64b();
+
+    if (key_size == 0 || alloc_slots(map, size) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void index_map_free(Index_Map *map)
+{
+    free(map->keys);
+    free(map->ids);
+    map->keys = NULL;
+    map->ids = NULL;
+    map->size = 0;
+    map->count = 0;
+}
+
+int32_t index_map_find(const Index_Map *map, const uint8_t *key)
+{
+    if (map->size == 0) {
+        return -1;
+    }
+
+    return map->ids[find_slot(map, key)];
+}
+
+int index_map_add(Index_Map *map, const uint8_t *key, int32_t id)
+{
+    if (id < 0 || map->size == 0) {
+        return -1;
+    }
+
+    if ((map->count + 1) > map->size / 4 * 3) {
+        if (map->size >= (1U << 31) || resize(map, map->size * 2) == -1) {
+            return -1;
+        }
+    }
+
+    const uint32_t slot = find_slot(map, key);
+
+    if (map->ids[slot] != -1) {
+        return -1;
+    }
+
+    memcpy(slot_key(map, slot), key, map->key_size);
+    map->ids[slot] = id;
+    ++map->count;
+    return 0;
+}
+
+int index_map_update(Index_Map *map, const uint8_t *key, int32_t id)
+{
+    if (id < 0 || map->size == 0) {
+        return -1;
+    }
+
+    const uint32_t slot = find_slot(map, key);
+
+    if (map->ids[slot] == -1) {
+        return -1;
+    }
+
+    map->ids[slot] = id;
+    return 0;
+}
+
+int index_map_remove(Index_Map *map, const uint8_t *key)
+{
+    if (map->size == 0) {
+        return -1;
+    }
+
+    const uint32_t mask = map->size - 1;
+    uint32_t hole = find_slot(map, key);
+
+    if (map->ids[hole] == -1) {
+        return -1;
+    }
+
+    /* Move keys after the hole back into it if their probe passes it, so
+     * lookups never stop early at a slot that was emptied.
+     */
+    uint32_t slot = hole;
+
+    while (1) {
+        slot = (slot + 1) & mask;
+
+        if (map->ids[slot] == -1) {
+            break;
+        }
+
+        const uint32_t home = hash_key(map, slot_key(map, slot)) & mask;
+
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            memcpy(slot_key(map, hole), slot_key(map, slot), map->key_size);
+            map->ids[hole] = map->ids[slot];
+            hole = slot;
+        }
+    }
+
+    map->ids[hole] = -1;
+    --map->count;
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * A hash map from fixed size keys, e.g. public keys, to indexes in an array.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INDEX_MAP_H
+#define INDEX_MAP_H
+
+#include <stdint.h>
+
+/* Open addressing with linear probing. Tables that are looked up by public key
+ * on packet paths (friends, connections) keep one next to their array, so a
+ * lookup doesn't cost more with every entry added to the array.
+ */
+typedef struct {
+    uint8_t *keys;      /* size keys of key_size bytes. */
+    int32_t *ids;       /* -1 if the slot is empty. */
+    uint32_t size;      /* Number of slots, always a power of 2. */
+    uint32_t count;     /* Number of slots in use. */
+    uint32_t key_size;
+    uint64_t seed;
+} Index_Map;
+
+/* Initialize a map for keys of key_size bytes with room for capacity keys.
+ * It grows when more are added.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int index_map_init(Index_Map *map, uint32_t key_size, uint32_t capacity);
+
+/* Free a map initialized with index_map_init(). */
+void index_map_free(Index_Map *map);
+
+/* return id of key.
+ * return -1 if key isn't in the map.
+ */
+int32_t index_map_find(const Index_Map *map, const uint8_t *key);
+
+/* Add key with id, id must not be negative.
+ *
+ * return 0 on success.
+ * return -1 if key is in the map already or on failure.
+ */
+int index_map_add(Index_Map *map, const uint8_t *key, int32_t id);
+
+/* Change the id of key, e.g. when the entry it belongs to is moved in its array.
+ *
+ * return 0 on success.
+ * return -1 if key isn't in the map.
+ */
+int index_map_update(Index_Map *map, const uint8_t *key, int32_t id);
+
+/* return 0 on success.
+ * return -1 if key isn't in the map.
+ */
+int index_map_remove(Index_Map *map, const uint8_t *key);
+
+#endif
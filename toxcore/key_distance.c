@@ -0,0 +1,154 @@
+/*
+ * XOR distances between public keys, the DHT metric.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "key_distance.h"
+
+#include "crypto_core.h"
+
+#include <string.h>
+
+/* SSE2 is part of every x86-64 CPU, so it is picked when compiling rather
+ * than checked for at run time.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KEY_DISTANCE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static uint64_t load_be64(const uint8_t *bytes)
+{
+    return ((uint64_t)bytes[0] << 56) | ((uint64_t)bytes[1] << 48) | ((uint64_t)bytes[2] << 40) |
+           ((uint64_t)bytes[3] << 32) | ((uint64_t)bytes[4] << 24) | ((uint64_t)bytes[5] << 16) |
+           ((uint64_t)bytes[6] << 8) | (uint64_t)bytes[7];
+}
+
+uint64_t key_distance_prefix(const uint8_t *target, const uint8_t *key)
+{
+    return load_be64(target) ^ load_be64(key);
+}
+
+#ifdef KEY_DISTANCE_SSE2
+/* equal_mask has a 1 bit for every byte two vectors have in common.
+ *
+ * return index of the first byte they differ in, 16 if there is none.
+ */
+static unsigned int first_unequal_byte(unsigned int equal_mask)
+{
+    const unsigned int unequal = ~equal_mask & 0xffff;
+
+    if (unequal == 0) {
+        return 16;
+    }
+
+#if defined(__GNUC__)
+    return __builtin_ctz(unequal);
+#else
+    unsigned int i = 0;
+
+    while (!(unequal & (1u << i))) {
+        ++i;
+    }
+
+    return i;
+#endif
+}
+#endif
+
+int key_distance_cmp(const uint8_t *target, const uint8_t *key1, const uint8_t *key2)
+{
+    unsigned int i;
+
+#ifdef KEY_DISTANCE_SSE2
+
+    /* Keys that are close to each other only differ after a few bytes, so
+     * the bytes are compared 16 at a time.
+     */
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += 16) {
+        const __m128i t = _mm_loadu_si128((const __m128i *)(target + i));
+        const __m128i distance1 = _mm_xor_si128(t, _mm_loadu_si128((const __m128i *)(key1 + i)));
+        const __m128i distance2 = _mm_xor_si128(t, _mm_loadu_si128((const __m128i *)(key2 + i)));
+        const unsigned int j = first_unequal_byte(_mm_movemask_epi8(_mm_cmpeq_epi8(distance1, distance2)));
+
+        if (j != 16) {
+            return (uint8_t)(target[i + j] ^ key1[i + j]) < (uint8_t)(target[i + j] ^ key2[i + j]) ? -1 : 1;
+        }
+    }
+
+#else
+
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        const uint64_t t = load_be64(target + i);
+        const uint64_t distance1 = t ^ load_be64(key1 + i);
+        const uint64_t distance2 = t ^ load_be64(key2 + i);
+
+        if (distance1 != distance2) {
+            return distance1 < distance2 ? -1 : 1;
+        }
+    }
+
+#endif
+
+    return 0;
+}
+
+unsigned int key_common_bits(const uint8_t *key1, const uint8_t *key2)
+{
+    unsigned int i = 0;
+
+#ifdef KEY_DISTANCE_SSE2
+
+    for (; i < CRYPTO_PUBLIC_KEY_SIZE; i += 16) {
+        const __m128i bytes1 = _mm_loadu_si128((const __m128i *)(key1 + i));
+        const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(key2 + i));
+        const unsigned int j = first_unequal_byte(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes1, bytes2)));
+
+        if (j != 16) {
+            i += j;
+            break;
+        }
+    }
+
+#else
+
+    while (i < CRYPTO_PUBLIC_KEY_SIZE && key1[i] == key2[i]) {
+        ++i;
+    }
+
+#endif
+
+    if (i >= CRYPTO_PUBLIC_KEY_SIZE) {
+        return CRYPTO_PUBLIC_KEY_SIZE * 8;
+    }
+
+    const uint8_t distance = key1[i] ^ key2[i];
+    unsigned int bits = 0;
+
+    while (!(distance & (0x80 >> bits))) {
+        ++bits;
+    }
+
+    return i * 8 + bits;
+}
@@ -0,0 +1,47 @@
+/*
+ * XOR distances between public keys, the DHT metric.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KEY_DISTANCE_H
+#define KEY_DISTANCE_H
+
+#include <stdint.h>
+
+/* The distance of two public keys is their XOR, read as a big endian number.
+ * All functions here take keys of CRYPTO_PUBLIC_KEY_SIZE bytes.
+ */
+
+/* return the first 8 bytes of the distance of key to target as a number.
+ * A key with a smaller prefix is closer to target, keys with equal prefixes
+ * need key_distance_cmp().
+ */
+uint64_t key_distance_prefix(const uint8_t *target, const uint8_t *key);
+
+/* return -1 if key1 is closer to target than key2.
+ * return 1 if key2 is closer.
+ * return 0 if they are the same distance, i.e. the same key.
+ */
+int key_distance_cmp(const uint8_t *target, const uint8_t *key1, const uint8_t *key2);
+
+/* return number of leading bits key1 and key2 have in common, 256 if they are equal. */
+unsigned int key_common_bits(const uint8_t *key1, const uint8_t *key2);
+
+#endif
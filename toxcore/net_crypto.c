@@ -418,6 +418,31 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
 }
 
 
+/* Index ip_port as an address of connection crypt_connection_id.
+ *
+ * return -1 if it is an address of a connection already or on failure.
+ * return 0 on success.
+ */
+static int add_ip_port_index(Net_Crypto *c, IP_Port ip_port, int crypt_connection_id)
+{
+    uint8_t key[IPPORT_KEY_SIZE];
+    ipport_pack_key(key, &ip_port);
+    return index_map_add(&c->ip_port_index, key, crypt_connection_id);
+}
+
+/* Remove ip_port from the index if it is an address of connection
+ * crypt_connection_id.
+ */
+static void remove_ip_port_index(Net_Crypto *c, IP_Port ip_port, int crypt_connection_id)
+{
+    uint8_t key[IPPORT_KEY_SIZE];
+    ipport_pack_key(key, &ip_port);
+
+    if (index_map_find(&c->ip_port_index, key) == crypt_connection_id) {
+        index_map_remove(&c->ip_port_index, key);
+    }
+}
+
 /* Associate an ip_port to a connection.
  *
  * return -1 on failure.
@@ -433,21 +458,21 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
 
     if (ip_port.ip.family == AF_INET) {
         if (!ipport_equal(&ip_port, &conn->ip_portv4) && LAN_ip(conn->ip_portv4.ip) != 0) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (add_ip_port_index(c, ip_port, crypt_connection_id) == -1) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
+            remove_ip_port_index(c, conn->ip_portv4, crypt_connection_id);
             conn->ip_portv4 = ip_port;
             return 0;
         }
     } else if (ip_port.ip.family == AF_INET6) {
         if (!ipport_equal(&ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (add_ip_port_index(c, ip_port, crypt_connection_id) == -1) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+            remove_ip_port_index(c, conn->ip_portv6, crypt_connection_id);
             conn->ip_portv6 = ip_port;
             return 0;
         }
@@ -574,31 +599,160 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+/* return the slot of packet number in array, which must have slots. */
+static Packet_Data **packet_slot(const Packets_Array *array, uint32_t number)
+{
+    return &array->buffer[number & (array->buffer_size - 1)];
+}
+
+/* return the packet with number in array, NULL if there is none. */
+static Packet_Data *packet_at(const Packets_Array *array, uint32_t number)
+{
+    if (array->buffer_size == 0) {
+        return NULL;
+    }
+
+    return *packet_slot(array, number);
+}
+
+/* Move the packets of array to size new slots, enough for all numbers in it.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int resize_packets_array(Packets_Array *array, uint32_t size)
+{
+    Packet_Data **buffer = (Packet_Data **)calloc(size, sizeof(Packet_Data *));
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    if (array->buffer_size != 0) {
+        uint32_t i;
+
+        for (i = array->buffer_start; i != array->buffer_end; ++i) {
+            buffer[i & (size - 1)] = *packet_slot(array, i);
+        }
+    }
+
+    free(array->buffer);
+    array->buffer = buffer;
+    array->buffer_size = size;
+    return 0;
+}
+
+/* Grow array until it has a slot for every number from buffer_start to number,
+ * or CRYPTO_PACKET_BUFFER_SIZE slots.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int reserve_packets_array(Packets_Array *array, uint32_t number)
+{
+    uint32_t needed = number - array->buffer_start + 1;
+
+    if (needed > CRYPTO_PACKET_BUFFER_SIZE) {
+        needed = CRYPTO_PACKET_BUFFER_SIZE;
+    }
+
+    if (needed <= array->buffer_size) {
+        return 0;
+    }
+
+    uint32_t size = array->buffer_size != 0 ? array->buffer_size : CRYPTO_PACKET_BUFFER_MIN_SIZE;
+
+    while (size < needed) {
+        size *= 2;
+    }
+
+    return resize_packets_array(array, size);
+}
+
+/* Halve the slots of array while a quarter of them hold all numbers in it, so
+ * a connection only keeps a large array while a lot of data is in flight.
+ */
+static void shrink_packets_array(Packets_Array *array)
+{
+    uint32_t size = array->buffer_size;
+
+    while (size > CRYPTO_PACKET_BUFFER_MIN_SIZE && num_packets_array(array) <= size / 4) {
+        size /= 2;
+    }
+
+    if (size != array->buffer_size) {
+        /* On failure the array just stays larger. */
+        resize_packets_array(array, size);
+    }
+}
+
+/* Copy the used part of src to dest, most packets are much smaller than
+ * MAX_CRYPTO_DATA_SIZE.
+ */
+static void copy_packet_data(Packet_Data *dest, const Packet_Data *src)
+{
+    dest->sent_time = src->sent_time;
+    dest->length = src->length;
+    memcpy(dest->data, src->data, src->length);
+}
+
+/* return size of the block a packet of length bytes is stored in. Only the
+ * used part of data is allocated, see copy_packet_data().
+ */
+static size_t packet_data_size(uint16_t length)
+{
+    return offsetof(Packet_Data, data) + length;
+}
+
+/* return a copy of data allocated from pool.
+ * return NULL on failure.
+ */
+static Packet_Data *new_packet_data(Packet_Pool *pool, const Packet_Data *data)
+{
+    Packet_Data *new_d = (Packet_Data *)packet_pool_alloc(pool, packet_data_size(data->length));
+
+    if (new_d != NULL) {
+        copy_packet_data(new_d, data);
+    }
+
+    return new_d;
+}
+
+static void free_packet_data(Packet_Pool *pool, Packet_Data *data)
+{
+    if (data != NULL) {
+        packet_pool_free(pool, data, packet_data_size(data->length));
+    }
+}
+
 /* Add data with packet number to array.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(Packet_Pool *pool, Packets_Array *array, uint32_t number, const Packet_Data *data)
 {
     if (number - array->buffer_start > CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (reserve_packets_array(array, number) == -1) {
+        return -1;
+    }
 
-    if (array->buffer[num]) {
+    Packet_Data **slot = packet_slot(array, number);
+
+    if (*slot) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = new_packet_data(pool, data);
 
     if (new_d == NULL) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
-    array->buffer[num] = new_d;
+    *slot = new_d;
 
     if ((number - array->buffer_start) >= (array->buffer_end - array->buffer_start)) {
         array->buffer_end = number + 1;
@@ -621,36 +775,52 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data *packet = *packet_slot(array, number);
 
-    if (!array->buffer[num]) {
+    if (!packet) {
         return 0;
     }
 
-    *data = array->buffer[num];
+    *data = packet;
     return 1;
 }
 
-/* Add data to end of array.
+/* Add a packet of header followed by data to end of array, copying both
+ * straight into the block it is stored in.
  *
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(Packet_Pool *pool, Packets_Array *array, const uint8_t *header,
+                                      uint16_t header_length, const uint8_t *data, uint16_t length)
 {
     if (num_packets_array(array) >= CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    if (reserve_packets_array(array, array->buffer_end) == -1) {
+        return -1;
+    }
+
+    Packet_Data *new_d = (Packet_Data *)packet_pool_alloc(pool, packet_data_size(header_length + length));
 
     if (new_d == NULL) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
+    new_d->sent_time = 0;
+    new_d->length = header_length + length;
+
+    if (header_length != 0) {
+        memcpy(new_d->data, header, header_length);
+    }
+
+    if (length != 0) {
+        memcpy(new_d->data + header_length, data, length);
+    }
+
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    *packet_slot(array, id) = new_d;
     ++array->buffer_end;
     return id;
 }
@@ -660,23 +830,23 @@ static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *d
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(Packet_Pool *pool, Packets_Array *array, Packet_Data *data)
 {
     if (array->buffer_end == array->buffer_start) {
         return -1;
     }
 
-    uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    Packet_Data **slot = packet_slot(array, array->buffer_start);
 
-    if (!array->buffer[num]) {
+    if (!*slot) {
         return -1;
     }
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
+    copy_packet_data(data, *slot);
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
-    array->buffer[num] = NULL;
+    free_packet_data(pool, *slot);
+    *slot = NULL;
     return id;
 }
 
@@ -685,7 +855,7 @@ static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(Packets_Array *array, uint32_t number)
+static int clear_buffer_until(Packet_Pool *pool, Packets_Array *array, uint32_t number)
 {
     uint32_t num_spots = array->buffer_end - array->buffer_start;
 
@@ -696,32 +866,31 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packet_slot(array, i);
 
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
+        if (*slot) {
+            free_packet_data(pool, *slot);
+            *slot = NULL;
         }
     }
 
     array->buffer_start = i;
+    shrink_packets_array(array);
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+static int clear_buffer(Packet_Pool *pool, Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (array->buffer[num]) {
-            free(array->buffer[num]);
-            array->buffer[num] = NULL;
-        }
+        free_packet_data(pool, *packet_slot(array, i));
     }
 
     array->buffer_start = i;
+    free(array->buffer);
+    array->buffer = NULL;
+    array->buffer_size = 0;
     return 0;
 }
 
@@ -740,6 +909,10 @@ static int set_buffer_end(Packets_Array *array, uint32_t number)
         return -1;
     }
 
+    if (number != array->buffer_start && reserve_packets_array(array, number - 1) == -1) {
+        return -1;
+    }
+
     array->buffer_end = number;
     return 0;
 }
@@ -771,9 +944,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
-
-        if (!recv_array->buffer[num]) {
+        if (!*packet_slot(recv_array, i)) {
             data[cur_len] = n;
             n = 0;
             ++cur_len;
@@ -803,7 +974,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Packets_Array *send_array, const uint8_t *data, uint16_t length,
+static int handle_request_packet(Packet_Pool *pool, Packets_Array *send_array, const uint8_t *data, uint16_t length,
                                  uint64_t *latest_send_time, uint64_t rtt_time)
 {
     if (length < 1) {
@@ -832,14 +1003,14 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data **slot = packet_slot(send_array, i);
 
         if (n == data[0]) {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
 
                 if ((sent_time + rtt_time) < temp_time) {
-                    send_array->buffer[num]->sent_time = 0;
+                    (*slot)->sent_time = 0;
                 }
             }
 
@@ -848,15 +1019,15 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
             n = 0;
             ++requested;
         } else {
-            if (send_array->buffer[num]) {
-                uint64_t sent_time = send_array->buffer[num]->sent_time;
+            if (*slot) {
+                uint64_t sent_time = (*slot)->sent_time;
 
                 if (l_sent_time < sent_time) {
                     l_sent_time = sent_time;
                 }
 
-                free(send_array->buffer[num]);
-                send_array->buffer[num] = NULL;
+                free_packet_data(pool, *slot);
+                *slot = NULL;
             }
         }
 
@@ -924,25 +1095,81 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static int send_data_packet_parts(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                  const uint8_t *header, uint16_t header_length, const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    const uint32_t total_length = header_length + length;
+
+    if (total_length == 0 || total_length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
     num = net_htonl(num);
     buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - total_length) % CRYPTO_MAX_PADDING;
+    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + total_length);
     memcpy(packet, &buffer_start, sizeof(uint32_t));
     memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
     memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+
+    if (header_length != 0) {
+        memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, header, header_length);
+    }
+
+    if (length != 0) {
+        memcpy(packet + (sizeof(uint32_t) * 2) + padding_length + header_length, data, length);
+    }
 
     return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
 }
 
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    return send_data_packet_parts(c, crypt_connection_id, buffer_start, num, NULL, 0, data, length);
+}
+
+/* The send array is resized and its packets are freed by whichever thread
+ * holds conn->mutex, so a packet is copied out under it before it is sent, as
+ * sending takes conn->mutex itself.
+ *
+ * return -1 if number isn't in the send array.
+ * return 0 if there is no packet or it was already sent.
+ * return 1 if the packet was copied to dt.
+ */
+static int copy_unsent_packet(Crypto_Connection *conn, uint32_t number, Packet_Data *dt)
+{
+    Packet_Data *packet;
+    pthread_mutex_lock(&conn->mutex);
+    int ret = get_data_pointer(&conn->send_array, &packet, number);
+
+    if (ret == 1) {
+        if (packet->sent_time) {
+            ret = 0;
+        } else {
+            dt->sent_time = 0;
+            dt->length = packet->length;
+            memcpy(dt->data, packet->data, packet->length);
+        }
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+    return ret;
+}
+
+/* Set the sent time of packet number in the send array, if it is still there. */
+static void set_packet_sent_time(Crypto_Connection *conn, uint32_t number, uint64_t sent_time)
+{
+    Packet_Data *packet;
+    pthread_mutex_lock(&conn->mutex);
+
+    if (get_data_pointer(&conn->send_array, &packet, number) == 1) {
+        packet->sent_time = sent_time;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+}
+
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
 {
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
@@ -954,20 +1181,19 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     /* If last packet send failed, try to send packet again.
        If sending it fails we won't be able to send the new packet. */
     if (conn->maximum_speed_reached) {
-        Packet_Data *dt = NULL;
+        Packet_Data dt;
+        pthread_mutex_lock(&conn->mutex);
         uint32_t packet_num = conn->send_array.buffer_end - 1;
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        pthread_mutex_unlock(&conn->mutex);
 
         uint8_t send_failed = 0;
 
-        if (ret == 1) {
-            if (!dt->sent_time) {
-                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
-                    send_failed = 1;
-                } else {
-                    dt->sent_time = current_time_monotonic();
-                }
+        if (copy_unsent_packet(conn, packet_num, &dt) == 1) {
+            if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt.data,
+                                        dt.length) != 0) {
+                send_failed = 1;
+            } else {
+                set_packet_sent_time(conn, packet_num, current_time_monotonic());
             }
         }
 
@@ -984,10 +1210,10 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
 /*  return -1 if data could not be put in packet queue.
  *  return positive packet number if data was put into the queue.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *header,
+                                    uint16_t header_length, const uint8_t *data, uint16_t length, uint8_t congestion_control)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (header_length + length == 0 || header_length + length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
@@ -1005,12 +1231,9 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return -1;
     }
 
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
     pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
+    int64_t packet_num = add_data_end_of_buffer(&conn->packet_pool, &conn->send_array, header, header_length, data,
+                         length);
     pthread_mutex_unlock(&conn->mutex);
 
     if (packet_num == -1) {
@@ -1021,12 +1244,9 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return packet_num;
     }
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = NULL;
-
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic();
-        }
+    if (send_data_packet_parts(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, header, header_length,
+                               data, length) == 0) {
+        set_packet_sent_time(conn, packet_num, current_time_monotonic());
     } else {
         conn->maximum_speed_reached = 1;
         LOGGER_ERROR(c->log, "send_data_packet failed\n");
@@ -1131,28 +1351,29 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     }
 
     uint64_t temp_time = current_time_monotonic();
-    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    uint32_t i, num_sent = 0;
+    pthread_mutex_lock(&conn->mutex);
+    uint32_t buffer_start = conn->send_array.buffer_start;
+    uint32_t array_size = num_packets_array(&conn->send_array);
+    pthread_mutex_unlock(&conn->mutex);
 
     for (i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
-        uint32_t packet_num = (i + conn->send_array.buffer_start);
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        Packet_Data dt;
+        uint32_t packet_num = (i + buffer_start);
+        int ret = copy_unsent_packet(conn, packet_num, &dt);
 
         if (ret == -1) {
-            return -1;
+            /* Acknowledged packets were cleared while we were sending. */
+            break;
         }
 
         if (ret == 0) {
             continue;
         }
 
-        if (dt->sent_time) {
-            continue;
-        }
-
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt.data,
+                                    dt.length) == 0) {
+            set_packet_sent_time(conn, packet_num, temp_time);
             ++num_sent;
         }
 
@@ -1347,6 +1568,11 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
     num = net_ntohl(num);
 
     uint64_t rtt_calc_time = 0;
+    int cleared = 0;
+
+    /* Clearing can shrink the array and gives packets back to the pool
+     * while another thread adds to them. */
+    pthread_mutex_lock(&conn->mutex);
 
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
@@ -1355,9 +1581,13 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_calc_time = packet_time->sent_time;
         }
 
-        if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
-            return -1;
-        }
+        cleared = clear_buffer_until(&conn->packet_pool, &conn->send_array, buffer_start);
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (cleared != 0) {
+        return -1;
     }
 
     uint8_t *real_data = data + (sizeof(uint32_t) * 2);
@@ -1396,7 +1626,10 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(&conn->send_array, real_data, real_length, &rtt_calc_time, rtt_time);
+        pthread_mutex_lock(&conn->mutex);
+        int requested = handle_request_packet(&conn->packet_pool, &conn->send_array, real_data, real_length, &rtt_calc_time,
+                                              rtt_time);
+        pthread_mutex_unlock(&conn->mutex);
 
         if (requested == -1) {
             return -1;
@@ -1407,16 +1640,56 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         set_buffer_end(&conn->recv_array, num);
     } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
         Packet_Data dt;
-        dt.length = real_length;
-        memcpy(dt.data, real_data, real_length);
 
-        if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0) {
-            return -1;
+        /* A packet that arrives in order is passed to the callback straight
+         * from the decryption buffer instead of going through recv_array. */
+        pthread_mutex_lock(&conn->mutex);
+        bool in_order = (num == conn->recv_array.buffer_start && !packet_at(&conn->recv_array, num));
+
+        if (in_order) {
+            if (conn->recv_array.buffer_end == conn->recv_array.buffer_start) {
+                conn->recv_array.buffer_end = num + 1;
+            }
+
+            ++conn->recv_array.buffer_start;
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
+
+        if (in_order) {
+            if (conn->connection_data_callback) {
+                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id,
+                                               real_data, real_length, userdata);
+            }
+
+            /* conn might get killed in callback. */
+            conn = get_crypto_connection(c, crypt_connection_id);
+
+            if (conn == 0) {
+                return -1;
+            }
+        } else {
+            dt.sent_time = 0;
+            dt.length = real_length;
+            memcpy(dt.data, real_data, real_length);
+
+            pthread_mutex_lock(&conn->mutex);
+            int ret = add_data_to_buffer(&conn->packet_pool, &conn->recv_array, num, &dt);
+            pthread_mutex_unlock(&conn->mutex);
+
+            if (ret != 0) {
+                return -1;
+            }
         }
 
         while (1) {
             pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(&conn->recv_array, &dt);
+            int ret = read_data_beg_buffer(&conn->packet_pool, &conn->recv_array, &dt);
+
+            if (ret == -1) {
+                shrink_packets_array(&conn->recv_array);
+            }
+
             pthread_mutex_unlock(&conn->mutex);
 
             if (ret == -1) {
@@ -1578,6 +1851,13 @@ static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
 }
 
 
+/* Small messages and file chunks get blocks of their own size. */
+static void init_packet_pool(Packet_Pool *pool)
+{
+    const size_t sizes[] = {packet_data_size(64), packet_data_size(256), sizeof(Packet_Data)};
+    packet_pool_init(pool, sizes, sizeof(sizes) / sizeof(sizes[0]));
+}
+
 /* Create a new empty crypto connection.
  *
  * return -1 on failure.
@@ -1589,6 +1869,7 @@ static int create_crypto_connection(Net_Crypto *c)
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
         if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
+            init_packet_pool(&c->crypto_connections[i].packet_pool);
             return i;
         }
     }
@@ -1614,6 +1895,8 @@ static int create_crypto_connection(Net_Crypto *c)
             pthread_mutex_unlock(&c->connections_mutex);
             return -1;
         }
+
+        init_packet_pool(&c->crypto_connections[id].packet_pool);
     }
 
     pthread_mutex_unlock(&c->connections_mutex);
@@ -1633,6 +1916,10 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
+    if (c->crypto_connections[crypt_connection_id].status != CRYPTO_CONN_NO_CONNECTION) {
+        index_map_remove(&c->connections_index, c->crypto_connections[crypt_connection_id].public_key);
+    }
+
     /* Keep mutex, only destroy it when connection is realloced out. */
     pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
     crypto_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
@@ -1661,17 +1948,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return index_map_find(&c->connections_index, public_key);
 }
 
 /* Add a source to the crypto connection.
@@ -1824,10 +2101,12 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
     conn->status = CRYPTO_CONN_NOT_CONFIRMED;
 
-    if (create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
+    if (index_map_add(&c->connections_index, conn->public_key, crypt_connection_id) == -1
+            || create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
+        index_map_remove(&c->connections_index, conn->public_key);
         conn->status = CRYPTO_CONN_NO_CONNECTION;
         return -1;
     }
@@ -1889,12 +2168,14 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     conn->cookie_request_number = random_64b();
     uint8_t cookie_request[COOKIE_REQUEST_LENGTH];
 
-    if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
-                              conn->shared_key) != sizeof(cookie_request)
+    if (index_map_add(&c->connections_index, conn->public_key, crypt_connection_id) == -1
+            || create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
+                                     conn->shared_key) != sizeof(cookie_request)
             || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
+        index_map_remove(&c->connections_index, conn->public_key);
         conn->status = CRYPTO_CONN_NO_CONNECTION;
         return -1;
     }
@@ -2217,7 +2498,9 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, void (*function)(
  */
 static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+    uint8_t key[IPPORT_KEY_SIZE];
+    ipport_pack_key(key, &ip_port);
+    return index_map_find(&c->ip_port_index, key);
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
@@ -2563,15 +2846,23 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control)
 {
-    if (length == 0) {
+    return write_cryptpacket_parts(c, crypt_connection_id, NULL, 0, data, length, congestion_control);
+}
+
+int64_t write_cryptpacket_parts(Net_Crypto *c, int crypt_connection_id, const uint8_t *header, uint16_t header_length,
+                                const uint8_t *data, uint16_t length, uint8_t congestion_control)
+{
+    if (header_length + length == 0 || header_length + length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
-    if (data[0] < CRYPTO_RESERVED_PACKETS) {
+    const uint8_t packet_id = header_length != 0 ? header[0] : data[0];
+
+    if (packet_id < CRYPTO_RESERVED_PACKETS) {
         return -1;
     }
 
-    if (data[0] >= PACKET_ID_LOSSY_RANGE_START) {
+    if (packet_id >= PACKET_ID_LOSSY_RANGE_START) {
         return -1;
     }
 
@@ -2589,7 +2880,7 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    int64_t ret = send_lossless_packet(c, crypt_connection_id, header, header_length, data, length, congestion_control);
 
     if (ret == -1) {
         return -1;
@@ -2701,11 +2992,12 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        remove_ip_port_index(c, conn->ip_portv4, crypt_connection_id);
+        remove_ip_port_index(c, conn->ip_portv6, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        clear_buffer(&conn->packet_pool, &conn->send_array);
+        clear_buffer(&conn->packet_pool, &conn->recv_array);
+        packet_pool_free_all(&conn->packet_pool);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
@@ -2822,11 +3114,35 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
+    temp->last_packet_pool_trim = unix_time();
+
+    if (index_map_init(&temp->connections_index, CRYPTO_PUBLIC_KEY_SIZE, 0) == -1
+            || index_map_init(&temp->ip_port_index, IPPORT_KEY_SIZE, 0) == -1) {
+        kill_net_crypto(temp);
+        return NULL;
+    }
 
     return temp;
 }
 
+/* Free the packet blocks connections didn't need since the last time. */
+static void trim_packet_pools(Net_Crypto *c)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        Crypto_Connection *conn = get_crypto_connection(c, i);
+
+        if (conn == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&conn->mutex);
+        packet_pool_trim(&conn->packet_pool);
+        pthread_mutex_unlock(&conn->mutex);
+    }
+}
+
 static void kill_timedout(Net_Crypto *c, void *userdata)
 {
     uint32_t i;
@@ -2869,6 +3185,11 @@ uint32_t crypto_run_interval(const Net_Crypto *c)
     return c->current_sleep_time;
 }
 
+bool crypto_idle(const Net_Crypto *c)
+{
+    return c->crypto_connections_length == 0 && !tcp_connections_send_pending(c->tcp_c);
+}
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata)
 {
@@ -2876,6 +3197,11 @@ void do_net_crypto(Net_Crypto *c, void *userdata)
     kill_timedout(c, userdata);
     do_tcp(c, userdata);
     send_crypto_packets(c);
+
+    if (is_timeout(c->last_packet_pool_trim, CRYPTO_PACKET_POOL_TRIM_INTERVAL)) {
+        trim_packet_pools(c);
+        c->last_packet_pool_trim = unix_time();
+    }
 }
 
 void kill_net_crypto(Net_Crypto *c)
@@ -2890,7 +3216,8 @@ void kill_net_crypto(Net_Crypto *c)
     pthread_mutex_destroy(&c->connections_mutex);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    index_map_free(&c->ip_port_index);
+    index_map_free(&c->connections_index);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
@@ -28,6 +28,7 @@
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
 #include "logger.h"
+#include "packet_pool.h"
 
 #include <pthread.h>
 
@@ -40,6 +41,14 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 /* Must be a power of 2 */
 
+/* The packet arrays of a connection start with this many slots and grow up to
+ * CRYPTO_PACKET_BUFFER_SIZE while packets are in flight. Must be a power of 2. */
+#define CRYPTO_PACKET_BUFFER_MIN_SIZE 16
+
+/* Interval in seconds at which the packet blocks of connections that weren't
+ * needed since the last time are freed. */
+#define CRYPTO_PACKET_POOL_TRIM_INTERVAL 10
+
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
@@ -96,7 +105,8 @@ typedef struct {
 } Packet_Data;
 
 typedef struct {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    Packet_Data **buffer; /* buffer_size slots, packet number n is in slot n % buffer_size. */
+    uint32_t  buffer_size;
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
 } Packets_Array;
@@ -132,6 +142,9 @@ typedef struct {
     Packets_Array send_array;
     Packets_Array recv_array;
 
+    /* The packets of both arrays, only used with mutex held. */
+    Packet_Pool packet_pool;
+
     int (*connection_status_callback)(void *object, int id, uint8_t status, void *userdata);
     void *connection_status_callback_object;
     int connection_status_callback_id;
@@ -203,6 +216,7 @@ typedef struct {
     unsigned int connection_use_counter;
 
     uint32_t crypto_connections_length; /* Length of connections array. */
+    Index_Map connections_index; /* Real public key to crypt_connection_id. */
 
     /* Our public and secret keys. */
     uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
@@ -217,7 +231,9 @@ typedef struct {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
-    BS_LIST ip_port_list;
+    Index_Map ip_port_index; /* Packed direct ip_ports of connections to crypt_connection_id. */
+
+    uint64_t last_packet_pool_trim;
 } Net_Crypto;
 
 
@@ -327,6 +343,14 @@ bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control);
 
+/* Sends a lossless cryptopacket made of header followed by data, as
+ * write_cryptpacket() would send them joined, without the caller having to
+ * copy them into one buffer first. The first byte of header, or of data if
+ * header_length is 0, is the packet id.
+ */
+int64_t write_cryptpacket_parts(Net_Crypto *c, int crypt_connection_id, const uint8_t *header, uint16_t header_length,
+                                const uint8_t *data, uint16_t length, uint8_t congestion_control);
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -418,6 +442,13 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info);
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
 
+/* return 1 if there are no connections and no data waiting to be written to
+ * a TCP relay, so do_net_crypto has nothing to do until a packet arrives or
+ * unix_time() advances.
+ * return 0 otherwise.
+ */
+bool crypto_idle(const Net_Crypto *c);
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata);
 
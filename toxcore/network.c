@@ -28,16 +28,23 @@
 #define _DARWIN_C_SOURCE
 #define _XOPEN_SOURCE 600
 
+#if defined(__linux__)
+/* Needed for recvmmsg()/sendmmsg() and struct mmsghdr. */
+#define _GNU_SOURCE
+#endif
+
 #if defined(_WIN32) && _WIN32_WINNT >= _WIN32_WINNT_WINXP
 #define _WIN32_WINNT  0x501
 #endif
 
 #include "network.h"
 
+#include "crypto_core.h"
 #include "logger.h"
 #include "util.h"
 
 #include <assert.h>
+#include <stdio.h>
 #ifdef __APPLE__
 #include <mach/clock.h>
 #include <mach/mach.h>
@@ -60,6 +67,24 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define NET_HAVE_MMSG 1
+#include <netinet/udp.h>
+#endif
+
+#if defined(NET_HAVE_MMSG) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define NET_HAVE_OFFLOAD 1
+
+/* Largest UDP payload, the limit for a segmented send or an aggregated receive. */
+#define NET_OFFLOAD_MAX_SIZE 65507
+#endif
+
+#ifdef SO_REUSEPORT
+#include <poll.h>
+#define NET_HAVE_SHARDS 1
+#endif
 
 #else
 
@@ -217,6 +242,21 @@ int set_socket_reuseaddr(Socket sock)
     return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&set, sizeof(set)) == 0);
 }
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure
+ */
+int set_socket_reuseport(Socket sock)
+{
+#ifdef SO_REUSEPORT
+    int set = 1;
+    return (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&set, sizeof(set)) == 0);
+#else
+    return 0;
+#endif
+}
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -264,9 +304,25 @@ static uint64_t last_monotime;
 static uint64_t add_monotime;
 #endif
 
+static current_time_cb *current_time_callback;
+static void *current_time_callback_object;
+
+/* Make current_time_monotonic() return the time from callback instead of
+ * the system clock. Pass NULL to go back to the system clock.
+ */
+void current_time_monotonic_set_callback(current_time_cb *callback, void *object)
+{
+    current_time_callback = callback;
+    current_time_callback_object = object;
+}
+
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void)
 {
+    if (current_time_callback != NULL) {
+        return current_time_callback(current_time_callback_object);
+    }
+
     uint64_t time;
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
     uint64_t old_add_monotime = add_monotime;
@@ -351,169 +407,1416 @@ void get_ip6(IP6 *result, const struct in6_addr *addr)
 
 void fill_addr4(IP4 ip, struct in_addr *addr)
 {
-    addr->s_addr = ip.uint32;
+    addr->s_addr = ip.uint32;
+}
+
+void fill_addr6(IP6 ip, struct in6_addr *addr)
+{
+    assert(sizeof(ip.uint8) == sizeof(addr->s6_addr));
+    memcpy(addr->s6_addr, ip.uint8, sizeof(ip.uint8));
+}
+
+/* Fill addr with the socket address to use when sending to ip_port from a
+ * socket of the given family.
+ *
+ * return size of the address on success.
+ * return 0 if ip_port can't be reached from a socket of this family.
+ */
+static size_t ip_port_to_sockaddr(Family family, IP_Port ip_port, struct sockaddr_storage *addr)
+{
+    /* socket AF_INET, but target IP NOT: can't send */
+    if ((family == AF_INET) && (ip_port.ip.family != AF_INET)) {
+        return 0;
+    }
+
+    if (ip_port.ip.family == AF_INET) {
+        if (family == AF_INET6) {
+            /* must convert to IPV4-in-IPV6 address */
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_port = ip_port.port;
+
+            /* there should be a macro for this in a standards compliant
+             * environment, not found */
+            IP6 ip6;
+
+            ip6.uint32[0] = 0;
+            ip6.uint32[1] = 0;
+            ip6.uint32[2] = net_htonl(0xFFFF);
+            ip6.uint32[3] = ip_port.ip.ip4.uint32;
+            fill_addr6(ip6, &addr6->sin6_addr);
+
+            addr6->sin6_flowinfo = 0;
+            addr6->sin6_scope_id = 0;
+            return sizeof(struct sockaddr_in6);
+        }
+
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+
+        addr4->sin_family = AF_INET;
+        fill_addr4(ip_port.ip.ip4, &addr4->sin_addr);
+        addr4->sin_port = ip_port.port;
+        return sizeof(struct sockaddr_in);
+    }
+
+    if (ip_port.ip.family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = ip_port.port;
+        fill_addr6(ip_port.ip.ip6, &addr6->sin6_addr);
+
+        addr6->sin6_flowinfo = 0;
+        addr6->sin6_scope_id = 0;
+        return sizeof(struct sockaddr_in6);
+    }
+
+    /* unknown address type*/
+    return 0;
+}
+
+/* Convert the address a packet was received from into ip_port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is not supported.
+ */
+static int sockaddr_to_ip_port(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
+
+        ip_port->ip.family = addr_in->sin_family;
+        get_ip4(&ip_port->ip.ip4, &addr_in->sin_addr);
+        ip_port->port = addr_in->sin_port;
+        return 0;
+    }
+
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
+        ip_port->ip.family = addr_in6->sin6_family;
+        get_ip6(&ip_port->ip.ip6, &addr_in6->sin6_addr);
+        ip_port->port = addr_in6->sin6_port;
+
+        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
+            ip_port->ip.family = AF_INET;
+            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Receive buffers and send queue used in batched mode.
+ *
+ * Where recvmmsg()/sendmmsg() are available a whole batch is moved with a
+ * single system call, otherwise the same buffers are filled and drained with
+ * one recvfrom()/sendto() per datagram.
+ *
+ * The receive buffers are only used by the thread polling the socket, but
+ * packets are queued from any thread that sends, e.g. the toxav thread, so
+ * the send queue and its message headers are only touched with send_mutex
+ * held.
+ */
+struct Net_Batch {
+    uint8_t recv_data[NET_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+    struct sockaddr_storage recv_addr[NET_BATCH_SIZE];
+    uint16_t recv_length[NET_BATCH_SIZE];
+
+    uint8_t send_data[NET_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+    struct sockaddr_storage send_addr[NET_BATCH_SIZE];
+    size_t send_addrsize[NET_BATCH_SIZE];
+    uint16_t send_length[NET_BATCH_SIZE];
+    IP_Port send_ip_port[NET_BATCH_SIZE];
+    unsigned int send_count;
+    pthread_mutex_t send_mutex;
+
+#ifdef NET_HAVE_MMSG
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+    struct iovec iovecs[NET_BATCH_SIZE];
+    struct mmsghdr send_msgs[NET_BATCH_SIZE];
+    struct iovec send_iovecs[NET_BATCH_SIZE];
+#endif
+
+#ifdef NET_HAVE_OFFLOAD
+    /* Receive buffers for GRO aggregates, NULL unless offload is enabled. */
+    uint8_t (*gro_data)[NET_OFFLOAD_MAX_SIZE];
+    /* Size of the segments in each received buffer. */
+    uint16_t recv_segment[NET_BATCH_SIZE];
+    /* Index of the first queued packet of each sent message. */
+    unsigned int msg_first[NET_BATCH_SIZE + 1];
+
+    union {
+        size_t align; /* cmsghdr alignment */
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control[NET_BATCH_SIZE], send_control[NET_BATCH_SIZE];
+#endif
+};
+
+#ifdef NET_STATS
+/* return bucket of the handler time histogram for a call that took time us. */
+static unsigned int net_stats_bucket(uint64_t time)
+{
+    unsigned int bucket = 0;
+    uint64_t limit = 1;
+
+    while (bucket < NET_STATS_HISTOGRAM_SIZE - 1 && time >= limit) {
+        ++bucket;
+        limit *= 4;
+    }
+
+    return bucket;
+}
+#endif
+
+/* Count a packet passed to the socket, res being the return value of sendto(). */
+static void net_stats_sent(Networking_Core *net, const uint8_t *data, uint16_t length, int res)
+{
+#ifdef NET_STATS
+
+    if (length < 1) {
+        return;
+    }
+
+    Net_Packet_Stats *stats = &net->stats.packets[data[0]];
+
+    if (res < 0) {
+        ++stats->send_failed;
+        return;
+    }
+
+    ++stats->sent_packets;
+    stats->sent_bytes += length;
+#endif
+}
+
+static void flush_batch(Networking_Core *net, Net_Batch *batch);
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (net->family == 0) { /* Socket not initialized */
+        return -1;
+    }
+
+    if (net->backend != NULL) {
+        int res = net->backend->send(net->backend_object, ip_port, data, length);
+        loglogdata(net->log, "O=>", data, length, ip_port, res);
+        net_stats_sent(net, data, length, res);
+        return res;
+    }
+
+    if (net->batch != NULL) {
+        Net_Batch *batch = net->batch;
+
+        if (length > MAX_UDP_PACKET_SIZE) {
+            return -1;
+        }
+
+        pthread_mutex_lock(&batch->send_mutex);
+
+        if (batch->send_count == NET_BATCH_SIZE) {
+            flush_batch(net, batch);
+        }
+
+        const unsigned int i = batch->send_count;
+        batch->send_addrsize[i] = ip_port_to_sockaddr(net->family, ip_port, &batch->send_addr[i]);
+
+        if (batch->send_addrsize[i] == 0) {
+            pthread_mutex_unlock(&batch->send_mutex);
+            return -1;
+        }
+
+        memcpy(batch->send_data[i], data, length);
+        batch->send_length[i] = length;
+        batch->send_ip_port[i] = ip_port;
+        ++batch->send_count;
+        pthread_mutex_unlock(&batch->send_mutex);
+
+        /* The datagram is sent by the next networking_flush(). */
+        return length;
+    }
+
+    struct sockaddr_storage addr;
+
+    size_t addrsize = ip_port_to_sockaddr(net->family, ip_port, &addr);
+
+    if (addrsize == 0) {
+        return -1;
+    }
+
+    int res = sendto(net->sock, (const char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
+
+    loglogdata(net->log, "O=>", data, length, ip_port, res);
+    net_stats_sent(net, data, length, res);
+
+    return res;
+}
+
+#ifdef NET_HAVE_OFFLOAD
+/* Log and count the result res of sending the queued packets first to
+ * last - 1 as one message.
+ */
+static void offload_sent(Networking_Core *net, const Net_Batch *batch, unsigned int first, unsigned int last,
+                         int res)
+{
+    unsigned int i;
+
+    for (i = first; i < last; ++i) {
+        int len = res < 0 ? -1 : batch->send_length[i];
+        loglogdata(net->log, "O=>", batch->send_data[i], batch->send_length[i], batch->send_ip_port[i], len);
+        net_stats_sent(net, batch->send_data[i], batch->send_length[i], len);
+    }
+}
+
+/* Send the queued packets, coalescing runs of packets to the same address
+ * into one UDP_SEGMENT message. The kernel splits such a message back into
+ * datagrams of the size of the first one, so a run ends after a packet
+ * shorter than the first.
+ */
+static void networking_flush_offload(Networking_Core *net, Net_Batch *batch)
+{
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    while (i < batch->send_count) {
+        const unsigned int first = i;
+        const uint16_t segment = batch->send_length[first];
+        size_t total = 0;
+
+        do {
+            batch->send_iovecs[i].iov_base = batch->send_data[i];
+            batch->send_iovecs[i].iov_len = batch->send_length[i];
+            total += batch->send_length[i];
+            ++i;
+        } while (i < batch->send_count
+                 && batch->send_length[i - 1] == segment
+                 && batch->send_length[i] <= segment
+                 && total + batch->send_length[i] <= NET_OFFLOAD_MAX_SIZE
+                 && ipport_equal(&batch->send_ip_port[i], &batch->send_ip_port[first]));
+
+        struct msghdr *hdr = &batch->send_msgs[count].msg_hdr;
+        memset(&batch->send_msgs[count], 0, sizeof(batch->send_msgs[count]));
+        hdr->msg_name = &batch->send_addr[first];
+        hdr->msg_namelen = batch->send_addrsize[first];
+        hdr->msg_iov = &batch->send_iovecs[first];
+        hdr->msg_iovlen = i - first;
+
+        if (i - first > 1) {
+            memset(&batch->send_control[count], 0, sizeof(batch->send_control[count]));
+            hdr->msg_control = batch->send_control[count].buf;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+
+        batch->msg_first[count] = first;
+        ++count;
+    }
+
+    batch->msg_first[count] = batch->send_count;
+
+    unsigned int m = 0;
+
+    while (m < count) {
+        int sent = sendmmsg(net->sock, &batch->send_msgs[m], count - m, 0);
+
+        if (sent > 0) {
+            unsigned int j;
+
+            for (j = 0; j < (unsigned int)sent; ++j, ++m) {
+                offload_sent(net, batch, batch->msg_first[m], batch->msg_first[m + 1], batch->send_msgs[m].msg_len);
+            }
+
+            continue;
+        }
+
+        /* The message at m failed. If it was segmented, the device may not
+         * support it: send its packets one by one instead.
+         */
+        unsigned int k;
+
+        for (k = batch->msg_first[m]; k < batch->msg_first[m + 1]; ++k) {
+            int res = batch->msg_first[m + 1] - batch->msg_first[m] == 1 ? -1 :
+                      sendto(net->sock, (const char *)batch->send_data[k], batch->send_length[k], 0,
+                             (struct sockaddr *)&batch->send_addr[k], batch->send_addrsize[k]);
+            offload_sent(net, batch, k, k + 1, res);
+        }
+
+        ++m;
+    }
+}
+#endif
+
+/* Send the packets queued in batch, with its send_mutex held. */
+static void flush_batch(Networking_Core *net, Net_Batch *batch)
+{
+    if (batch->send_count == 0) {
+        return;
+    }
+
+#ifdef NET_HAVE_OFFLOAD
+
+    if (batch->gro_data != NULL) {
+        networking_flush_offload(net, batch);
+        batch->send_count = 0;
+        return;
+    }
+
+#endif
+
+    unsigned int i = 0;
+
+#ifdef NET_HAVE_MMSG
+
+    for (i = 0; i < batch->send_count; ++i) {
+        batch->send_iovecs[i].iov_base = batch->send_data[i];
+        batch->send_iovecs[i].iov_len = batch->send_length[i];
+
+        memset(&batch->send_msgs[i], 0, sizeof(batch->send_msgs[i]));
+        batch->send_msgs[i].msg_hdr.msg_name = &batch->send_addr[i];
+        batch->send_msgs[i].msg_hdr.msg_namelen = batch->send_addrsize[i];
+        batch->send_msgs[i].msg_hdr.msg_iov = &batch->send_iovecs[i];
+        batch->send_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    i = 0;
+
+    while (i < batch->send_count) {
+        int sent = sendmmsg(net->sock, &batch->send_msgs[i], batch->send_count - i, 0);
+
+        if (sent <= 0) {
+            /* The datagram at i failed, drop it and carry on with the rest. */
+            loglogdata(net->log, "O=>", batch->send_data[i], batch->send_length[i], batch->send_ip_port[i], -1);
+            net_stats_sent(net, batch->send_data[i], batch->send_length[i], -1);
+            ++i;
+            continue;
+        }
+
+        int j;
+
+        for (j = 0; j < sent; ++i, ++j) {
+            loglogdata(net->log, "O=>", batch->send_data[i], batch->send_length[i], batch->send_ip_port[i],
+                       batch->send_msgs[i].msg_len);
+            net_stats_sent(net, batch->send_data[i], batch->send_length[i], batch->send_msgs[i].msg_len);
+        }
+    }
+
+#else
+
+    for (i = 0; i < batch->send_count; ++i) {
+        int res = sendto(net->sock, (const char *)batch->send_data[i], batch->send_length[i], 0,
+                         (struct sockaddr *)&batch->send_addr[i], batch->send_addrsize[i]);
+        loglogdata(net->log, "O=>", batch->send_data[i], batch->send_length[i], batch->send_ip_port[i], res);
+        net_stats_sent(net, batch->send_data[i], batch->send_length[i], res);
+    }
+
+#endif
+
+    batch->send_count = 0;
+}
+
+/* Send all packets queued by sendpacket() in batched mode.
+ */
+void networking_flush(Networking_Core *net)
+{
+    Net_Batch *batch = net->batch;
+
+    if (batch == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&batch->send_mutex);
+    flush_batch(net, batch);
+    pthread_mutex_unlock(&batch->send_mutex);
+}
+
+/* Function to receive data
+ *  ip and port of sender is put into ip_port.
+ *  Packet data is put into data.
+ *  Packet length is put into length.
+ */
+static int receivepacket(Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    struct sockaddr_storage addr;
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    int addrlen = sizeof(addr);
+#else
+    socklen_t addrlen = sizeof(addr);
+#endif
+    *length = 0;
+    int fail_or_len = recvfrom(sock, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+
+    if (fail_or_len < 0) {
+
+        if (fail_or_len < 0 && errno != EWOULDBLOCK) {
+            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+        }
+
+        return -1; /* Nothing received. */
+    }
+
+    *length = (uint32_t)fail_or_len;
+
+    if (sockaddr_to_ip_port(&addr, ip_port) == -1) {
+        return -1;
+    }
+
+    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
+
+    return 0;
+}
+
+/* Receive up to NET_BATCH_SIZE packets into the batch receive buffers.
+ *
+ * return number of packets received.
+ */
+static unsigned int receivepacket_batch(Logger *log, Socket sock, Net_Batch *batch)
+{
+    unsigned int count = 0;
+
+#ifdef NET_HAVE_MMSG
+    unsigned int i;
+
+    for (i = 0; i < NET_BATCH_SIZE; ++i) {
+        batch->iovecs[i].iov_base = batch->recv_data[i];
+        batch->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+
+        memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+        batch->msgs[i].msg_hdr.msg_name = &batch->recv_addr[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->recv_addr[i]);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+
+#ifdef NET_HAVE_OFFLOAD
+
+        if (batch->gro_data != NULL) {
+            batch->iovecs[i].iov_base = batch->gro_data[i];
+            batch->iovecs[i].iov_len = NET_OFFLOAD_MAX_SIZE;
+            batch->msgs[i].msg_hdr.msg_control = batch->control[i].buf;
+            batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->control[i].buf);
+        }
+
+#endif
+    }
+
+    int received = recvmmsg(sock, batch->msgs, NET_BATCH_SIZE, 0, NULL);
+
+    if (received < 0) {
+        if (errno != EWOULDBLOCK) {
+            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+        }
+
+        return 0;
+    }
+
+    count = received;
+
+    for (i = 0; i < count; ++i) {
+        batch->recv_length[i] = batch->msgs[i].msg_len;
+
+#ifdef NET_HAVE_OFFLOAD
+        batch->recv_segment[i] = batch->msgs[i].msg_len;
+
+        if (batch->gro_data == NULL) {
+            continue;
+        }
+
+        struct cmsghdr *cmsg;
+
+        for (cmsg = CMSG_FIRSTHDR(&batch->msgs[i].msg_hdr); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&batch->msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+
+                if (segment > 0 && segment < batch->recv_segment[i]) {
+                    batch->recv_segment[i] = segment;
+                }
+            }
+        }
+
+#endif
+    }
+
+#else
+
+    while (count < NET_BATCH_SIZE) {
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+        int addrlen = sizeof(batch->recv_addr[count]);
+#else
+        socklen_t addrlen = sizeof(batch->recv_addr[count]);
+#endif
+        int fail_or_len = recvfrom(sock, (char *)batch->recv_data[count], MAX_UDP_PACKET_SIZE, 0,
+                                   (struct sockaddr *)&batch->recv_addr[count], &addrlen);
+
+        if (fail_or_len < 0) {
+            if (errno != EWOULDBLOCK) {
+                LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+            }
+
+            break;
+        }
+
+        batch->recv_length[count] = fail_or_len;
+        ++count;
+    }
+
+#endif
+
+    return count;
+}
+
+/* Number of entries of the rate limiter table, a power of 2. */
+#define NET_RATE_LIMIT_TABLE_SIZE 8192
+
+/* Entries looked at for a source before the least recently used is evicted. */
+#define NET_RATE_LIMIT_PROBES 8
+
+/* Tokens are counted in 1/NET_RATE_LIMIT_TOKEN packets, so that a bucket
+ * refills by rate tokens per ms.
+ */
+#define NET_RATE_LIMIT_TOKEN 1000
+
+/* Token bucket of one source address and packet id. */
+typedef struct {
+    /* IPv4 address or IPv6 /64 prefix. */
+    uint64_t addr;
+    uint32_t tokens;
+    /* Time of the last refill in ms, truncated. */
+    uint32_t time;
+    /* 0 if the entry is unused. */
+    uint8_t family;
+    uint8_t packet_id;
+} Net_Rate_Limit_Entry;
+
+struct Net_Rate_Limiter {
+    uint32_t rate[256];
+    uint32_t burst[256];
+    uint64_t dropped[256];
+
+    /* Random, so that no one can pick addresses that collide. */
+    uint64_t seed;
+    Net_Rate_Limit_Entry table[NET_RATE_LIMIT_TABLE_SIZE];
+};
+
+/* Limit packets with packet_id to rate per second from each source address,
+ * allowing bursts of up to burst packets.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_rate_limit(Networking_Core *net, uint8_t packet_id, uint32_t rate, uint32_t burst)
+{
+    if (rate != 0 && (burst == 0 || burst > UINT32_MAX / NET_RATE_LIMIT_TOKEN)) {
+        return -1;
+    }
+
+    if (net->rate_limiter == NULL) {
+        if (rate == 0) {
+            return 0;
+        }
+
+        net->rate_limiter = (Net_Rate_Limiter *)calloc(1, sizeof(Net_Rate_Limiter));
+
+        if (net->rate_limiter == NULL) {
+            return -1;
+        }
+
+        random_bytes((uint8_t *)&net->rate_limiter->seed, sizeof(net->rate_limiter->seed));
+    }
+
+    net->rate_limiter->rate[packet_id] = rate;
+    net->rate_limiter->burst[packet_id] = burst;
+    return 0;
+}
+
+/* return the number of packets with packet_id dropped by the rate limit. */
+uint64_t networking_get_rate_limit_drops(const Networking_Core *net, uint8_t packet_id)
+{
+    if (net->rate_limiter == NULL) {
+        return 0;
+    }
+
+    return net->rate_limiter->dropped[packet_id];
+}
+
+static uint32_t net_rate_limit_index(uint64_t seed, uint64_t addr, uint8_t family, uint8_t packet_id)
+{
+    uint64_t x = (addr ^ seed) + (((uint64_t)family << 8) | packet_id) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+/* Take a token from the bucket of the sender of a packet with packet_id.
+ *
+ * return true if the bucket is empty and the packet should be dropped.
+ */
+static bool net_rate_limited(Net_Rate_Limiter *limiter, const IP *ip, uint8_t packet_id)
+{
+    const uint32_t rate = limiter->rate[packet_id];
+
+    if (rate == 0) {
+        return false;
+    }
+
+    uint64_t addr;
+
+    if (ip->family == AF_INET) {
+        addr = ip->ip4.uint32;
+    } else if (ip->family == AF_INET6) {
+        addr = ip->ip6.uint64[0];
+    } else {
+        return false;
+    }
+
+    const uint32_t now = (uint32_t)current_time_monotonic();
+    const uint32_t full = limiter->burst[packet_id] * NET_RATE_LIMIT_TOKEN;
+    const uint32_t index = net_rate_limit_index(limiter->seed, addr, ip->family, packet_id);
+    Net_Rate_Limit_Entry *entry = NULL;
+    Net_Rate_Limit_Entry *unused = NULL;
+    Net_Rate_Limit_Entry *oldest = NULL;
+    unsigned int i;
+
+    for (i = 0; i < NET_RATE_LIMIT_PROBES; ++i) {
+        Net_Rate_Limit_Entry *e = &limiter->table[(index + i) % NET_RATE_LIMIT_TABLE_SIZE];
+
+        if (e->family == 0) {
+            if (unused == NULL) {
+                unused = e;
+            }
+
+            continue;
+        }
+
+        if (e->addr == addr && e->family == ip->family && e->packet_id == packet_id) {
+            entry = e;
+            break;
+        }
+
+        if (oldest == NULL || (uint32_t)(now - e->time) > (uint32_t)(now - oldest->time)) {
+            oldest = e;
+        }
+    }
+
+    if (entry == NULL) {
+        /* Entries that weren't used for a while have full buckets, so
+         * replacing them with a new full bucket loses nothing.
+         */
+        entry = unused != NULL ? unused : oldest;
+        entry->addr = addr;
+        entry->family = ip->family;
+        entry->packet_id = packet_id;
+        entry->tokens = full;
+    } else {
+        const uint64_t tokens = entry->tokens + (uint64_t)(uint32_t)(now - entry->time) * rate;
+        entry->tokens = tokens > full ? full : (uint32_t)tokens;
+    }
+
+    entry->time = now;
+
+    if (entry->tokens < NET_RATE_LIMIT_TOKEN) {
+        ++limiter->dropped[packet_id];
+        return true;
+    }
+
+    entry->tokens -= NET_RATE_LIMIT_TOKEN;
+    return false;
+}
+
+struct Net_Capture {
+    FILE *file;
+};
+
+struct Net_Capture_Reader {
+    FILE *file;
+};
+
+/* Size of the record header of an IPv6 packet, the largest one. */
+#define NET_CAPTURE_HEADER_SIZE (sizeof(uint64_t) + 1 + sizeof(IP6) + sizeof(uint16_t) + sizeof(uint16_t))
+
+/* Append a record of a received packet to the capture file of net.
+ * Capturing stops if the file can't be written.
+ */
+static void net_capture_write(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    uint8_t header[NET_CAPTURE_HEADER_SIZE];
+    uint64_t time = current_time_actual();
+    size_t size = 0;
+
+    memcpy(header, &time, sizeof(time));
+    host_to_net(header, sizeof(time));
+    size += sizeof(time);
+
+    if (ip_port.ip.family == AF_INET) {
+        header[size] = TOX_AF_INET;
+        memcpy(header + size + 1, ip_port.ip.ip4.uint8, sizeof(IP4));
+        size += 1 + sizeof(IP4);
+    } else if (ip_port.ip.family == AF_INET6) {
+        header[size] = TOX_AF_INET6;
+        memcpy(header + size + 1, ip_port.ip.ip6.uint8, sizeof(IP6));
+        size += 1 + sizeof(IP6);
+    } else {
+        return;
+    }
+
+    /* The port is in network byte order already. */
+    memcpy(header + size, &ip_port.port, sizeof(uint16_t));
+    size += sizeof(uint16_t);
+    header[size] = length >> 8;
+    header[size + 1] = length & 0xff;
+    size += sizeof(uint16_t);
+
+    if (fwrite(header, 1, size, net->capture->file) != size
+            || fwrite(data, 1, length, net->capture->file) != length) {
+        LOGGER_ERROR(net->log, "Failed to write to the packet capture, stopping it");
+        networking_capture_stop(net);
+    }
+}
+
+/* Record every packet passed to the packet handlers of net to the file at
+ * path, replacing its contents. A capture already running is stopped first.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_capture_start(Networking_Core *net, const char *path)
+{
+    networking_capture_stop(net);
+
+    Net_Capture *capture = (Net_Capture *)calloc(1, sizeof(Net_Capture));
+
+    if (capture == NULL) {
+        return -1;
+    }
+
+    capture->file = fopen(path, "wb");
+
+    if (capture->file == NULL) {
+        LOGGER_ERROR(net->log, "Failed to open packet capture file %s", path);
+        free(capture);
+        return -1;
+    }
+
+    if (fwrite(NET_CAPTURE_MAGIC, 1, NET_CAPTURE_MAGIC_SIZE, capture->file) != NET_CAPTURE_MAGIC_SIZE) {
+        fclose(capture->file);
+        free(capture);
+        return -1;
+    }
+
+    net->capture = capture;
+    return 0;
+}
+
+/* Stop capturing and close the capture file. */
+void networking_capture_stop(Networking_Core *net)
+{
+    if (net->capture == NULL) {
+        return;
+    }
+
+    fclose(net->capture->file);
+    free(net->capture);
+    net->capture = NULL;
+}
+
+/* Open the capture file at path for reading.
+ *
+ * return NULL on failure or if it is not a capture file.
+ */
+Net_Capture_Reader *net_capture_open(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    char magic[NET_CAPTURE_MAGIC_SIZE];
+
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+            || memcmp(magic, NET_CAPTURE_MAGIC, NET_CAPTURE_MAGIC_SIZE) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    Net_Capture_Reader *reader = (Net_Capture_Reader *)calloc(1, sizeof(Net_Capture_Reader));
+
+    if (reader == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    reader->file = file;
+    return reader;
+}
+
+/* Read the next packet of the capture into data, the time it was received
+ * at in us into time and its sender into ip_port.
+ *
+ * return the length of the packet.
+ * return 0 at the end of the capture.
+ * return -1 if the file is truncated or invalid or the packet is longer than
+ * max_length.
+ */
+int net_capture_read(Net_Capture_Reader *reader, uint64_t *time, IP_Port *ip_port, uint8_t *data,
+                     uint16_t max_length)
+{
+    uint8_t header[NET_CAPTURE_HEADER_SIZE];
+    const size_t read = fread(header, 1, sizeof(uint64_t) + 1, reader->file);
+
+    if (read == 0 && feof(reader->file)) {
+        return 0;
+    }
+
+    if (read != sizeof(uint64_t) + 1) {
+        return -1;
+    }
+
+    net_to_host(header, sizeof(uint64_t));
+    memcpy(time, header, sizeof(uint64_t));
+
+    const uint8_t family = header[sizeof(uint64_t)];
+    size_t ip_size;
+
+    ip_reset(&ip_port->ip);
+
+    if (family == TOX_AF_INET) {
+        ip_port->ip.family = AF_INET;
+        ip_size = sizeof(IP4);
+    } else if (family == TOX_AF_INET6) {
+        ip_port->ip.family = AF_INET6;
+        ip_size = sizeof(IP6);
+    } else {
+        return -1;
+    }
+
+    const size_t rest = ip_size + sizeof(uint16_t) + sizeof(uint16_t);
+
+    if (fread(header, 1, rest, reader->file) != rest) {
+        return -1;
+    }
+
+    if (family == TOX_AF_INET) {
+        memcpy(ip_port->ip.ip4.uint8, header, sizeof(IP4));
+    } else {
+        memcpy(ip_port->ip.ip6.uint8, header, sizeof(IP6));
+    }
+
+    memcpy(&ip_port->port, header + ip_size, sizeof(uint16_t));
+    const uint16_t length = (header[ip_size + 2] << 8) | header[ip_size + 3];
+
+    if (length == 0 || length > max_length || fread(data, 1, length, reader->file) != length) {
+        return -1;
+    }
+
+    return length;
+}
+
+void net_capture_close(Net_Capture_Reader *reader)
+{
+    if (reader == NULL) {
+        return;
+    }
+
+    fclose(reader->file);
+    free(reader);
+}
+
+void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
+{
+    net->packethandlers[byte].function = cb;
+    net->packethandlers[byte].object = object;
+}
+
+static void networking_dispatch(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                                void *userdata)
+{
+    if (length < 1) {
+        return;
+    }
+
+    if (net->capture != NULL) {
+        net_capture_write(net, ip_port, data, length);
+    }
+
+    if (net->rate_limiter != NULL && net_rate_limited(net->rate_limiter, &ip_port.ip, data[0])) {
+        return;
+    }
+
+#ifdef NET_STATS
+    Net_Packet_Stats *stats = &net->stats.packets[data[0]];
+    ++stats->recv_packets;
+    stats->recv_bytes += length;
+#endif
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+#ifdef NET_STATS
+        ++stats->recv_unhandled;
+#endif
+        return;
+    }
+
+#ifdef NET_STATS
+    uint64_t start = current_time_actual();
+#endif
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+
+#ifdef NET_STATS
+    uint64_t time = current_time_actual() - start;
+    stats->handler_time += time;
+    ++stats->handler_histogram[net_stats_bucket(time)];
+#endif
+}
+
+/* Pass a packet to the packet handlers of net as if it was received from
+ * ip_port, e.g. to replay a capture.
+ */
+void networking_inject_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata)
+{
+    networking_dispatch(net, ip_port, data, length, userdata);
+}
+
+void networking_handle_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata)
+{
+    if (length < 1 || !net->packethandlers[data[0]].function) {
+        return;
+    }
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+}
+
+/* Dispatch the first count packets in the receive buffers of batch to the
+ * handlers of net.
+ */
+static void networking_dispatch_batch(Networking_Core *net, const Net_Batch *batch, unsigned int count,
+                                      void *userdata)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        IP_Port ip_port;
+
+        if (sockaddr_to_ip_port(&batch->recv_addr[i], &ip_port) == -1) {
+            continue;
+        }
+
+#ifdef NET_HAVE_OFFLOAD
+
+        if (batch->gro_data != NULL) {
+            /* Split GRO aggregates back into the datagrams that were sent. */
+            const uint8_t *data = batch->gro_data[i];
+            uint16_t left = batch->recv_length[i];
+
+            while (left != 0) {
+                const uint16_t length = left < batch->recv_segment[i] ? left : batch->recv_segment[i];
+
+                if (length <= MAX_UDP_PACKET_SIZE) {
+                    loglogdata(net->log, "=>O", data, MAX_UDP_PACKET_SIZE, ip_port, length);
+                    networking_dispatch(net, ip_port, data, length, userdata);
+                }
+
+                data += length;
+                left -= length;
+            }
+
+            continue;
+        }
+
+#endif
+
+        loglogdata(net->log, "=>O", batch->recv_data[i], MAX_UDP_PACKET_SIZE, ip_port, batch->recv_length[i]);
+
+        networking_dispatch(net, ip_port, batch->recv_data[i], batch->recv_length[i], userdata);
+    }
+}
+
+/* Drain sock through the receive buffers of batch and dispatch the packets
+ * to the handlers of net.
+ */
+static void networking_poll_socket(Networking_Core *net, Socket sock, Net_Batch *batch, void *userdata)
+{
+    unsigned int count;
+
+    do {
+        count = receivepacket_batch(net->log, sock, batch);
+        networking_dispatch_batch(net, batch, count, userdata);
+    } while (count == NET_BATCH_SIZE);
 }
 
-void fill_addr6(IP6 ip, struct in6_addr *addr)
+static void networking_poll_batch(Networking_Core *net, void *userdata)
 {
-    assert(sizeof(ip.uint8) == sizeof(addr->s6_addr));
-    memcpy(addr->s6_addr, ip.uint8, sizeof(ip.uint8));
+    networking_poll_socket(net, net->sock, net->batch, userdata);
+    networking_flush(net);
 }
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
- */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net->family == 0) { /* Socket not initialized */
-        return -1;
+        return;
     }
 
-    /* socket AF_INET, but target IP NOT: can't send */
-    if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET)) {
-        return -1;
-    }
+    unix_time_update();
 
-    struct sockaddr_storage addr;
+    IP_Port ip_port;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint32_t length;
 
-    size_t addrsize = 0;
+    if (net->backend != NULL) {
+        int len;
 
-    if (ip_port.ip.family == AF_INET) {
-        if (net->family == AF_INET6) {
-            /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+        while ((len = net->backend->recv(net->backend_object, &ip_port, data, sizeof(data))) > 0) {
+            loglogdata(net->log, "=>O", data, MAX_UDP_PACKET_SIZE, ip_port, len);
+            networking_dispatch(net, ip_port, data, len, userdata);
+        }
 
-            addrsize = sizeof(struct sockaddr_in6);
-            addr6->sin6_family = AF_INET6;
-            addr6->sin6_port = ip_port.port;
+        return;
+    }
 
-            /* there should be a macro for this in a standards compliant
-             * environment, not found */
-            IP6 ip6;
+    if (net->batch != NULL) {
+        networking_poll_batch(net, userdata);
+        return;
+    }
 
-            ip6.uint32[0] = 0;
-            ip6.uint32[1] = 0;
-            ip6.uint32[2] = net_htonl(0xFFFF);
-            ip6.uint32[3] = ip_port.ip.ip4.uint32;
-            fill_addr6(ip6, &addr6->sin6_addr);
+    while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
+        networking_dispatch(net, ip_port, data, length, userdata);
+    }
+}
 
-            addr6->sin6_flowinfo = 0;
-            addr6->sin6_scope_id = 0;
-        } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+/* Enable or disable batched I/O.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_batching(Networking_Core *net, bool enabled)
+{
+    if (!enabled) {
+        networking_set_offload(net, 0);
+        networking_flush(net);
 
-            addrsize = sizeof(struct sockaddr_in);
-            addr4->sin_family = AF_INET;
-            fill_addr4(ip_port.ip.ip4, &addr4->sin_addr);
-            addr4->sin_port = ip_port.port;
+        if (net->batch != NULL) {
+            pthread_mutex_destroy(&net->batch->send_mutex);
         }
-    } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
-        addr6->sin6_family = AF_INET6;
-        addr6->sin6_port = ip_port.port;
-        fill_addr6(ip_port.ip.ip6, &addr6->sin6_addr);
+        free(net->batch);
+        net->batch = NULL;
+        return 0;
+    }
 
-        addr6->sin6_flowinfo = 0;
-        addr6->sin6_scope_id = 0;
-    } else {
-        /* unknown address type*/
+    if (net->batch != NULL) {
+        return 0;
+    }
+
+    if (net->backend != NULL) {
         return -1;
     }
 
-    int res = sendto(net->sock, (const char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
+    net->batch = (Net_Batch *)calloc(1, sizeof(Net_Batch));
 
-    loglogdata(net->log, "O=>", data, length, ip_port, res);
+    if (net->batch == NULL) {
+        return -1;
+    }
 
-    return res;
+    if (pthread_mutex_init(&net->batch->send_mutex, NULL) != 0) {
+        free(net->batch);
+        net->batch = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
-/* Function to receive data
- *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
- */
-static int receivepacket(Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+static void free_batch(Net_Batch *batch)
 {
-    memset(ip_port, 0, sizeof(IP_Port));
-    struct sockaddr_storage addr;
-#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
-    int addrlen = sizeof(addr);
-#else
-    socklen_t addrlen = sizeof(addr);
-#endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+    if (batch == NULL) {
+        return;
+    }
 
-    if (fail_or_len < 0) {
+#ifdef NET_HAVE_OFFLOAD
+    free(batch->gro_data);
+#endif
+    pthread_mutex_destroy(&batch->send_mutex);
+    free(batch);
+}
 
-        if (fail_or_len < 0 && errno != EWOULDBLOCK) {
-            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+/* Enable or disable UDP segmentation offload in batched mode.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_offload(Networking_Core *net, bool enabled)
+{
+#ifdef NET_HAVE_OFFLOAD
+    Net_Batch *batch = net->batch;
+
+    if (!enabled) {
+        if (batch != NULL && batch->gro_data != NULL) {
+            networking_flush(net);
+            int off = 0;
+            setsockopt(net->sock, SOL_UDP, UDP_GRO, (const char *)&off, sizeof(off));
+            free(batch->gro_data);
+            batch->gro_data = NULL;
         }
 
-        return -1; /* Nothing received. */
+        return 0;
     }
 
-    *length = (uint32_t)fail_or_len;
+    if (batch == NULL) {
+        return -1;
+    }
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    if (batch->gro_data != NULL) {
+        return 0;
+    }
 
-        ip_port->ip.family = addr_in->sin_family;
-        get_ip4(&ip_port->ip.ip4, &addr_in->sin_addr);
-        ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
-        ip_port->ip.family = addr_in6->sin6_family;
-        get_ip6(&ip_port->ip.ip6, &addr_in6->sin6_addr);
-        ip_port->port = addr_in6->sin6_port;
+    int on = 1;
 
-        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
-            ip_port->ip.family = AF_INET;
-            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
-        }
-    } else {
+    if (setsockopt(net->sock, SOL_UDP, UDP_GRO, (const char *)&on, sizeof(on)) != 0) {
+        LOGGER_WARNING(net->log, "UDP_GRO is not supported: %u, %s", errno, strerror(errno));
         return -1;
     }
 
-    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
+    networking_flush(net);
+    batch->gro_data = (uint8_t (*)[NET_OFFLOAD_MAX_SIZE])malloc(NET_BATCH_SIZE * NET_OFFLOAD_MAX_SIZE);
+
+    if (batch->gro_data == NULL) {
+        int off = 0;
+        setsockopt(net->sock, SOL_UDP, UDP_GRO, (const char *)&off, sizeof(off));
+        return -1;
+    }
 
     return 0;
+#else
+    return enabled ? -1 : 0;
+#endif
 }
 
-void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
+/* A socket bound to the same port as the Networking_Core with SO_REUSEPORT,
+ * read by its own thread. The kernel spreads incoming datagrams over all
+ * sockets in the group by hashing the source address, so packets from one
+ * peer are always read by the same thread.
+ */
+typedef struct {
+    Networking_Core *net;
+    /* Owns the socket and the receive buffers of the shard. */
+    Networking_Core *shard;
+    void *userdata;
+    pthread_t thread;
+} Net_Shard;
+
+struct Net_Shards {
+    /* Held while packets are dispatched to the handlers of net. */
+    pthread_mutex_t lock;
+    /* Cleared with lock held to stop the threads. */
+    bool running;
+
+    Net_Shard *shards;
+    unsigned int count;
+};
+
+#ifdef NET_HAVE_SHARDS
+
+/* Wait this long for packets before checking if the shard should stop. */
+#define NET_SHARD_POLL_TIMEOUT_MS 100
+
+static void *networking_shard_thread(void *arg)
 {
-    net->packethandlers[byte].function = cb;
-    net->packethandlers[byte].object = object;
+    Net_Shard *shard = (Net_Shard *)arg;
+    Networking_Core *net = shard->net;
+
+    while (1) {
+        struct pollfd pfd;
+        pfd.fd = shard->shard->sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        /* Wait and receive without the lock, only the handlers need it. If
+         * the buffers were filled, poll() returns at once for the rest.
+         */
+        int ready = poll(&pfd, 1, NET_SHARD_POLL_TIMEOUT_MS);
+        unsigned int count = 0;
+
+        if (ready > 0) {
+            count = receivepacket_batch(net->log, shard->shard->sock, shard->shard->batch);
+        }
+
+        networking_lock(net);
+
+        if (!net->shards->running) {
+            networking_unlock(net);
+            break;
+        }
+
+        if (count > 0) {
+            unix_time_update();
+            networking_dispatch_batch(net, shard->shard->batch, count, shard->userdata);
+        }
+
+        networking_unlock(net);
+
+        /* The send queue has its own lock. */
+        networking_flush(net);
+    }
+
+    return NULL;
 }
 
-void networking_poll(Networking_Core *net, void *userdata)
+#endif
+
+/* Stop the shard threads and close their sockets. */
+static void networking_stop_shards(Networking_Core *net)
 {
-    if (net->family == 0) { /* Socket not initialized */
+    Net_Shards *shards = net->shards;
+
+    if (shards == NULL) {
         return;
     }
 
-    unix_time_update();
+    pthread_mutex_lock(&shards->lock);
+    shards->running = 0;
+    pthread_mutex_unlock(&shards->lock);
 
-    IP_Port ip_port;
-    uint8_t data[MAX_UDP_PACKET_SIZE];
-    uint32_t length;
+    unsigned int i;
 
-    while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
+    for (i = 0; i < shards->count; ++i) {
+        pthread_join(shards->shards[i].thread, NULL);
+        kill_networking(shards->shards[i].shard);
+    }
+
+    pthread_mutex_destroy(&shards->lock);
+    free(shards->shards);
+    free(shards);
+    net->shards = NULL;
+}
+
+/* Bind count more sockets to the port of net and start one thread per
+ * socket reading packets from it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_start_shards(Networking_Core *net, IP ip, unsigned int count, void *userdata)
+{
+#ifdef NET_HAVE_SHARDS
+
+    if (net->family == 0 || net->backend != NULL || net->shards != NULL || count == 0) {
+        return -1;
+    }
+
+    Net_Shards *shards = (Net_Shards *)calloc(1, sizeof(Net_Shards));
+
+    if (shards == NULL) {
+        return -1;
+    }
+
+    shards->shards = (Net_Shard *)calloc(count, sizeof(Net_Shard));
+
+    if (shards->shards == NULL || pthread_mutex_init(&shards->lock, NULL) != 0) {
+        free(shards->shards);
+        free(shards);
+        return -1;
+    }
+
+    shards->running = 1;
+    net->shards = shards;
+
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        Net_Shard *shard = &shards->shards[i];
+        shard->net = net;
+        shard->userdata = userdata;
+        shard->shard = new_networking_reuseport(net->log, ip, net_ntohs(net->port), NULL);
+
+        if (shard->shard == NULL || networking_set_batching(shard->shard, 1) != 0) {
+            kill_networking(shard->shard);
+            break;
         }
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
+        if (pthread_create(&shard->thread, NULL, networking_shard_thread, shard) != 0) {
+            kill_networking(shard->shard);
+            break;
         }
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        ++shards->count;
+    }
+
+    if (shards->count != count) {
+        LOGGER_ERROR(net->log, "Failed to start networking shard %u of %u", shards->count + 1, count);
+        networking_stop_shards(net);
+        return -1;
+    }
+
+    LOGGER_DEBUG(net->log, "Started %u networking shards on port %u", count, net_ntohs(net->port));
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Take the lock held while the shard threads dispatch packets.
+ * Does nothing if no shards were started.
+ */
+void networking_lock(Networking_Core *net)
+{
+    if (net->shards != NULL) {
+        pthread_mutex_lock(&net->shards->lock);
+    }
+}
+
+void networking_unlock(Networking_Core *net)
+{
+    if (net->shards != NULL) {
+        pthread_mutex_unlock(&net->shards->lock);
     }
 }
 
+/* Copy the packet counters of net into stats.
+ *
+ * return 0 on success.
+ * return -1 if toxcore was built without NET_STATS.
+ */
+int networking_get_stats(const Networking_Core *net, Net_Stats *stats)
+{
+#ifdef NET_STATS
+    memcpy(stats, &net->stats, sizeof(Net_Stats));
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Copy the traffic counters of packet_id into stats.
+ *
+ * return 0 on success.
+ * return -1 if toxcore was built without NET_STATS.
+ */
+int networking_get_packet_stats(const Networking_Core *net, uint8_t packet_id, Net_Packet_Stats *stats)
+{
+#ifdef NET_STATS
+    *stats = net->stats.packets[packet_id];
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 #ifndef VANILLA_NACL
 /* Used for sodium_init() */
 #include <sodium.h>
@@ -571,6 +1874,9 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port)
     return new_networking_ex(log, ip, port, port + (TOX_PORTRANGE_TO - TOX_PORTRANGE_FROM), 0);
 }
 
+static Networking_Core *new_networking_internal(Logger *log, IP ip, uint16_t port_from, uint16_t port_to,
+        bool reuseport, unsigned int *error);
+
 /* Initialize networking.
  * Bind to ip and port.
  * ip must be in network order EX: 127.0.0.1 = (7F000001).
@@ -582,6 +1888,67 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port)
  * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
  */
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+{
+    return new_networking_internal(log, ip, port_from, port_to, 0, error);
+}
+
+/* Initialize networking with SO_REUSEPORT set on the socket, so that more
+ * sockets (see networking_start_shards()) can be bound to the same port.
+ * Unlike new_networking_ex() only the given port is tried.
+ *
+ *  return Networking_Core object if no problems
+ *  return NULL if there are problems.
+ *
+ * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
+ */
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error)
+{
+    if (port == 0) {
+        if (error) {
+            *error = 2;
+        }
+
+        return NULL;
+    }
+
+    return new_networking_internal(log, ip, port, port, 1, error);
+}
+
+/* Initialize networking without a socket. Packets are sent and received
+ * through backend, called with object. ip_port is the address the backend
+ * delivers packets to this instance on.
+ *
+ *  return Networking_Core object if no problems
+ *  return NULL if there are problems.
+ */
+Networking_Core *new_networking_backend(Logger *log, IP_Port ip_port, const Net_Backend *backend, void *object)
+{
+    if (ip_port.ip.family != AF_INET && ip_port.ip.family != AF_INET6) {
+        LOGGER_ERROR(log, "Invalid address family: %u\n", ip_port.ip.family);
+        return NULL;
+    }
+
+    if (networking_at_startup() != 0) {
+        return NULL;
+    }
+
+    Networking_Core *temp = (Networking_Core *)calloc(1, sizeof(Networking_Core));
+
+    if (temp == NULL) {
+        return NULL;
+    }
+
+    temp->log = log;
+    temp->family = ip_port.ip.family;
+    temp->port = ip_port.port;
+    temp->sock = (Socket) -1;
+    temp->backend = backend;
+    temp->backend_object = object;
+    return temp;
+}
+
+static Networking_Core *new_networking_internal(Logger *log, IP ip, uint16_t port_from, uint16_t port_to,
+        bool reuseport, unsigned int *error)
 {
     /* If both from and to are 0, use default port range
      * If one is 0 and the other is non-0, use the non-0 value as only port
@@ -672,6 +2039,17 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
         return NULL;
     }
 
+    if (reuseport && !set_socket_reuseport(temp->sock)) {
+        LOGGER_ERROR(log, "Failed to set SO_REUSEPORT: %u, %s\n", errno, strerror(errno));
+        kill_networking(temp);
+
+        if (error) {
+            *error = 1;
+        }
+
+        return NULL;
+    }
+
     /* Bind our socket to port PORT and the given IP address (usually 0.0.0.0 or ::) */
     uint16_t *portptr = NULL;
     struct sockaddr_storage addr;
@@ -793,10 +2171,16 @@ void kill_networking(Networking_Core *net)
         return;
     }
 
-    if (net->family != 0) { /* Socket not initialized */
+    networking_stop_shards(net);
+
+    if (net->family != 0 && net->backend == NULL) { /* Socket not initialized */
+        networking_flush(net);
         kill_sock(net->sock);
     }
 
+    networking_capture_stop(net);
+    free(net->rate_limiter);
+    free_batch(net->batch);
     free(net);
 }
 
@@ -933,6 +2317,20 @@ void ipport_copy(IP_Port *target, const IP_Port *source)
     memcpy(target, source, sizeof(IP_Port));
 }
 
+void ipport_pack_key(uint8_t *key, const IP_Port *ip_port)
+{
+    memset(key, 0, IPPORT_KEY_SIZE);
+    key[0] = ip_port->ip.family;
+
+    if (ip_port->ip.family == AF_INET) {
+        memcpy(key + 1, ip_port->ip.ip4.uint8, sizeof(IP4));
+    } else {
+        memcpy(key + 1, ip_port->ip.ip6.uint8, sizeof(IP6));
+    }
+
+    memcpy(key + 1 + sizeof(IP6), &ip_port->port, sizeof(uint16_t));
+}
+
 /* ip_ntoa
  *   converts ip into a string
  *   ip_str must be of length at least IP_NTOA_LEN
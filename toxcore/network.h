@@ -33,6 +33,7 @@
 #include "ccompat.h"
 #include "logger.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -260,6 +261,16 @@ void ip_copy(IP *target, const IP *source);
 /* copies an ip_port structure */
 void ipport_copy(IP_Port *target, const IP_Port *source);
 
+/* Size of the key ipport_pack_key() makes. */
+#define IPPORT_KEY_SIZE (1 + sizeof(IP6) + sizeof(uint16_t))
+
+/* Write the family, the address padded with zeros to the size of an IPv6 one,
+ * and the port of ip_port to key, IPPORT_KEY_SIZE bytes. Unlike the bytes of
+ * the struct, which have padding, two keys are equal exactly if the families,
+ * addresses and ports are, so they can be hashed and compared with memcmp.
+ */
+void ipport_pack_key(uint8_t *key, const IP_Port *ip_port);
+
 /*
  * addr_resolve():
  *  uses getaddrinfo to resolve an address into an IP address
@@ -308,6 +319,59 @@ typedef struct {
     void *object;
 } Packet_Handles;
 
+/* Maximum number of packets received or sent with one system call in batched mode. */
+#define NET_BATCH_SIZE 32
+
+/* Functions that replace the UDP socket of a Networking_Core, see
+ * new_networking_backend().
+ */
+typedef struct {
+    /* Send a packet to ip_port.
+     * return the number of bytes sent or -1 on failure.
+     */
+    int (*send)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+    /* Take the next packet waiting for this instance, if any.
+     * return its length, 0 if there is none.
+     */
+    int (*recv)(void *object, IP_Port *ip_port, uint8_t *data, uint16_t max_length);
+} Net_Backend;
+
+typedef struct Net_Batch Net_Batch;
+typedef struct Net_Shards Net_Shards;
+typedef struct Net_Capture Net_Capture;
+typedef struct Net_Rate_Limiter Net_Rate_Limiter;
+
+/* Number of buckets in the handler time histogram. Bucket 0 counts calls that
+ * took less than 1us, bucket i calls that took [4^(i-1), 4^i) us and the last
+ * bucket everything slower.
+ */
+#define NET_STATS_HISTOGRAM_SIZE 8
+
+/* Traffic counters of one packet id. */
+typedef struct {
+    /* Packets passed to the handlers and their total size. */
+    uint64_t recv_packets;
+    uint64_t recv_bytes;
+    /* Received packets dropped because no handler was registered. */
+    uint64_t recv_unhandled;
+
+    /* Packets handed to the socket and their total size. */
+    uint64_t sent_packets;
+    uint64_t sent_bytes;
+    /* Packets the socket refused. */
+    uint64_t send_failed;
+
+    /* Total time spent in the handler in us. */
+    uint64_t handler_time;
+    uint64_t handler_histogram[NET_STATS_HISTOGRAM_SIZE];
+} Net_Packet_Stats;
+
+typedef struct {
+    /* Indexed by the first byte of the packet. */
+    Net_Packet_Stats packets[256];
+} Net_Stats;
+
 typedef struct {
     Logger *log;
     Packet_Handles packethandlers[256];
@@ -316,6 +380,26 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+    /* Buffers for batched I/O, NULL if batching is disabled. */
+    Net_Batch *batch;
+
+    /* Extra receive sockets and their threads, NULL if none were started. */
+    Net_Shards *shards;
+
+    /* Replaces sock if not NULL. */
+    const Net_Backend *backend;
+    void *backend_object;
+
+    /* File received packets are recorded to, NULL if not capturing. */
+    Net_Capture *capture;
+
+    /* Per source limits of received packets, NULL if none were set. */
+    Net_Rate_Limiter *rate_limiter;
+
+#ifdef NET_STATS
+    Net_Stats stats;
+#endif
 } Networking_Core;
 
 /* Run this before creating sockets.
@@ -357,6 +441,13 @@ int set_socket_nosigpipe(Socket sock);
  */
 int set_socket_reuseaddr(Socket sock);
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure or if the platform doesn't support it
+ */
+int set_socket_reuseport(Socket sock);
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -364,14 +455,174 @@ int set_socket_reuseaddr(Socket sock);
  */
 int set_socket_dualstack(Socket sock);
 
+typedef uint64_t current_time_cb(void *object);
+
+/* Make current_time_monotonic() return the time from callback instead of
+ * the system clock. Pass NULL to go back to the system clock.
+ *
+ * This is process wide and meant for simulations that drive many instances
+ * from one thread with a virtual clock.
+ */
+void current_time_monotonic_set_callback(current_time_cb *callback, void *object);
+
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
+/* Function to send packet(data) of length length to ip_port.
+ *
+ * In batched mode the packet is only queued, and length is returned if it
+ * could be queued. It is sent by the next networking_flush(). Packets can be
+ * queued from any thread.
+ */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Send all packets queued by sendpacket() in batched mode.
+ * networking_poll() calls this after handling the received packets, call it
+ * again after sending packets outside of networking_poll().
+ */
+void networking_flush(Networking_Core *net);
+
+/* Enable or disable batched I/O.
+ *
+ * When enabled, networking_poll() reads up to NET_BATCH_SIZE packets per
+ * recvmmsg() and sendpacket() queues packets to be sent with sendmmsg().
+ * Platforms without these calls fall back to one recvfrom()/sendto() per
+ * packet.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_batching(Networking_Core *net, bool enabled);
+
+/* Enable or disable UDP segmentation offload. Batching must be enabled.
+ *
+ * When enabled, networking_flush() sends runs of queued packets to the same
+ * address as one UDP_SEGMENT message, and networking_poll() accepts UDP_GRO
+ * aggregates and splits them into the packets they were made of. This takes
+ * Linux 4.18 for sending and 5.0 for receiving, and makes bulk transfers to
+ * one peer, like file transfers, a lot cheaper.
+ *
+ * return 0 on success.
+ * return -1 on failure or if the platform doesn't support it.
+ */
+int networking_set_offload(Networking_Core *net, bool enabled);
+
+/* Bind count more sockets to the port of net and start one thread per
+ * socket that reads packets from it and dispatches them to the handlers of
+ * net with userdata. net must have been created with
+ * new_networking_reuseport() on the same ip.
+ *
+ * The shards wait for and receive packets without the networking lock, the
+ * handlers are called with it held, so only the system calls run in
+ * parallel. Once the shards are started everything else that touches state
+ * reachable from the handlers, networking_poll() included, must be called
+ * with the lock held too.
+ *
+ * The shards are stopped by kill_networking().
+ *
+ * return 0 on success.
+ * return -1 on failure or if SO_REUSEPORT is not supported.
+ */
+int networking_start_shards(Networking_Core *net, IP ip, unsigned int count, void *userdata);
+
+/* Take and release the lock the shard threads hold while dispatching.
+ * Do nothing if no shards were started.
+ */
+void networking_lock(Networking_Core *net);
+void networking_unlock(Networking_Core *net);
+
+/* Copy the per packet id traffic counters of net into stats.
+ *
+ * The counters are only collected if toxcore was built with NET_STATS, they
+ * cost nothing otherwise.
+ *
+ * return 0 on success.
+ * return -1 if toxcore was built without NET_STATS.
+ */
+int networking_get_stats(const Networking_Core *net, Net_Stats *stats);
+
+/* Copy the traffic counters of packet_id into stats.
+ *
+ * return 0 on success.
+ * return -1 if toxcore was built without NET_STATS.
+ */
+int networking_get_packet_stats(const Networking_Core *net, uint8_t packet_id, Net_Packet_Stats *stats);
+
+/* Limit packets with packet_id to rate per second from each source address,
+ * allowing bursts of up to burst packets. IPv6 sources are limited per /64
+ * prefix. Packets over the limit are dropped before their handler runs, so
+ * floods of requests that are expensive to handle cost little.
+ *
+ * A rate of 0 removes the limit of packet_id.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_rate_limit(Networking_Core *net, uint8_t packet_id, uint32_t rate, uint32_t burst);
+
+/* return the number of packets with packet_id dropped by the rate limit. */
+uint64_t networking_get_rate_limit_drops(const Networking_Core *net, uint8_t packet_id);
+
+/* Packet capture files start with NET_CAPTURE_MAGIC, followed by one record
+ * per received packet:
+ *
+ * [uint64_t time in us, big endian]
+ * [uint8_t family, TOX_AF_INET or TOX_AF_INET6]
+ * [4 or 16 bytes of address]
+ * [uint16_t port, big endian]
+ * [uint16_t length, big endian]
+ * [length bytes of packet]
+ */
+#define NET_CAPTURE_MAGIC "TOXCAP01"
+#define NET_CAPTURE_MAGIC_SIZE 8
+
+/* Record every packet passed to the packet handlers of net to the file at
+ * path, replacing its contents. A capture already running is stopped first.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_capture_start(Networking_Core *net, const char *path);
+
+/* Stop capturing and close the capture file. */
+void networking_capture_stop(Networking_Core *net);
+
+typedef struct Net_Capture_Reader Net_Capture_Reader;
+
+/* Open the capture file at path for reading.
+ *
+ * return NULL on failure or if it is not a capture file.
+ */
+Net_Capture_Reader *net_capture_open(const char *path);
+
+/* Read the next packet of the capture into data, the time it was received
+ * at in us into time and its sender into ip_port.
+ *
+ * return the length of the packet.
+ * return 0 at the end of the capture.
+ * return -1 if the file is truncated or invalid or the packet is longer than
+ * max_length.
+ */
+int net_capture_read(Net_Capture_Reader *reader, uint64_t *time, IP_Port *ip_port, uint8_t *data,
+                     uint16_t max_length);
+
+void net_capture_close(Net_Capture_Reader *reader);
+
+/* Pass a packet to the packet handlers of net as if it was received from
+ * ip_port, e.g. to replay a capture.
+ */
+void networking_inject_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata);
+
+/* Pass a packet received earlier straight to its handler, without capturing,
+ * rate limiting or counting it again, e.g. once the shared key it needed was
+ * computed by a precompute pool.
+ */
+void networking_handle_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
@@ -417,6 +668,21 @@ size_t net_sendto_ip4(Socket sock, const char* buf, size_t n, IP_Port ip_port);
 Networking_Core *new_networking(Logger *log, IP ip, uint16_t port);
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error);
 
+/* Same as above, but binds only to port and sets SO_REUSEPORT on the socket
+ * first, so that networking_start_shards() can bind more sockets to it.
+ */
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error);
+
+/* Initialize networking without a socket. Packets are sent and received
+ * through backend, called with object. ip_port is the address the backend
+ * delivers packets to this instance on. Batching and shards are not
+ * available on such an instance.
+ *
+ *  return Networking_Core object if no problems
+ *  return NULL if there are problems.
+ */
+Networking_Core *new_networking_backend(Logger *log, IP_Port ip_port, const Net_Backend *backend, void *object);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
@@ -0,0 +1,529 @@
+/*
+ * An on-disk cache of the DHT nodes that answered us, to bootstrap from after
+ * a restart.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _XOPEN_SOURCE 600
+
+#include "node_cache.h"
+
+#include "index_map.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define NODE_CACHE_MAGIC 0x546f784e /* "ToxN" */
+#define NODE_CACHE_VERSION 1
+
+#define NODE_CACHE_HEADER_SIZE 16
+#define NODE_CACHE_RECORD_SIZE 64
+
+/* Records looked at for one to replace when a node answers a full cache. */
+#define NODE_CACHE_PROBES 4
+
+/* Offsets of the record fields. */
+#define RECORD_PUBLIC_KEY 0
+#define RECORD_IP (RECORD_PUBLIC_KEY + CRYPTO_PUBLIC_KEY_SIZE)
+#define RECORD_LAST_SEEN (RECORD_IP + sizeof(IP6))
+#define RECORD_PORT (RECORD_LAST_SEEN + sizeof(uint32_t))
+#define RECORD_RTT (RECORD_PORT + sizeof(uint16_t))
+#define RECORD_REQUESTS (RECORD_RTT + sizeof(uint16_t))
+#define RECORD_ANSWERS (RECORD_REQUESTS + sizeof(uint16_t))
+#define RECORD_FAMILY (RECORD_ANSWERS + sizeof(uint16_t))
+
+struct Node_Cache {
+    uint8_t *data;      /* The header, then capacity records. */
+    size_t size;
+    uint32_t capacity;
+    uint32_t count;
+    Index_Map index;    /* Public key to record number. */
+
+    uint32_t *free_records; /* Numbers of the unused records. */
+    uint32_t num_free;
+    uint32_t hand;          /* Next record to look at in a full cache. */
+
+    char *path;
+#ifndef _WIN32
+    int fd;
+#endif
+};
+
+static void put_be16(uint8_t *bytes, uint16_t num)
+{
+    bytes[0] = num >> 8;
+    bytes[1] = num & 0xff;
+}
+
+static uint16_t get_be16(const uint8_t *bytes)
+{
+    return ((uint16_t)bytes[0] << 8) | bytes[1];
+}
+
+static void put_be32(uint8_t *bytes, uint32_t num)
+{
+    put_be16(bytes, num >> 16);
+    put_be16(bytes + 2, num & 0xffff);
+}
+
+static uint32_t get_be32(const uint8_t *bytes)
+{
+    return ((uint32_t)get_be16(bytes) << 16) | get_be16(bytes + 2);
+}
+
+static uint8_t *record(const Node_Cache *cache, uint32_t i)
+{
+    return cache->data + NODE_CACHE_HEADER_SIZE + (size_t)i * NODE_CACHE_RECORD_SIZE;
+}
+
+static bool record_used(const uint8_t *rec)
+{
+    return get_be32(rec + RECORD_LAST_SEEN) != 0;
+}
+
+static void record_to_entry(const uint8_t *rec, Node_Cache_Entry *entry)
+{
+    memset(entry, 0, sizeof(Node_Cache_Entry));
+    memcpy(entry->public_key, rec + RECORD_PUBLIC_KEY, CRYPTO_PUBLIC_KEY_SIZE);
+
+    ip_init(&entry->ip_port.ip, 0);
+
+    if (rec[RECORD_FAMILY] == TOX_AF_INET6) {
+        entry->ip_port.ip.family = AF_INET6;
+        memcpy(entry->ip_port.ip.ip6.uint8, rec + RECORD_IP, sizeof(IP6));
+    } else {
+        entry->ip_port.ip.family = AF_INET;
+        memcpy(entry->ip_port.ip.ip4.uint8, rec + RECORD_IP, sizeof(IP4));
+    }
+
+    /* The port is stored in network byte order, as IP_Port keeps it. */
+    memcpy(&entry->ip_port.port, rec + RECORD_PORT, sizeof(uint16_t));
+    entry->last_seen = get_be32(rec + RECORD_LAST_SEEN);
+    entry->rtt_ms = get_be16(rec + RECORD_RTT);
+    entry->requests = get_be16(rec + RECORD_REQUESTS);
+    entry->answers = get_be16(rec + RECORD_ANSWERS);
+}
+
+/* Higher is better, see node_cache_best(). */
+static uint64_t record_score(const uint8_t *rec, uint64_t now)
+{
+    const uint64_t requests = get_be16(rec + RECORD_REQUESTS);
+    const uint64_t answers = get_be16(rec + RECORD_ANSWERS);
+    const uint64_t last_seen = get_be32(rec + RECORD_LAST_SEEN);
+    const uint64_t hours = now > last_seen ? (now - last_seen) / 3600 : 0;
+    const uint64_t rtt = get_be16(rec + RECORD_RTT);
+
+    /* Nodes that were asked a few times only don't get the full share yet. */
+    const uint64_t answered = ((answers + 1) << 20) / (requests + 2);
+
+    return answered / ((1 + hours) * (4 + rtt / 64));
+}
+
+static void write_header(Node_Cache *cache)
+{
+    put_be32(cache->data, NODE_CACHE_MAGIC);
+    put_be16(cache->data + 4, NODE_CACHE_VERSION);
+    put_be16(cache->data + 6, NODE_CACHE_RECORD_SIZE);
+    put_be32(cache->data + 8, cache->capacity);
+    put_be32(cache->data + 12, 0);
+}
+
+/* return number of records of the file of old_size bytes read into the cache,
+ * 0 if it isn't a cache file of this version.
+ */
+static uint32_t valid_records(const Node_Cache *cache, size_t old_size)
+{
+    if (old_size < NODE_CACHE_HEADER_SIZE
+            || get_be32(cache->data) != NODE_CACHE_MAGIC
+            || get_be16(cache->data + 4) != NODE_CACHE_VERSION
+            || get_be16(cache->data + 6) != NODE_CACHE_RECORD_SIZE) {
+        return 0;
+    }
+
+    const uint32_t in_file = (old_size - NODE_CACHE_HEADER_SIZE) / NODE_CACHE_RECORD_SIZE;
+    const uint32_t in_header = get_be32(cache->data + 8);
+    return MIN(MIN(in_file, in_header), cache->capacity);
+}
+
+#ifndef _WIN32
+
+static int map_file(Node_Cache *cache, size_t *old_size)
+{
+    struct stat st;
+
+    cache->fd = open(cache->path, O_RDWR | O_CREAT, 0600);
+
+    if (cache->fd == -1) {
+        return -1;
+    }
+
+    if (fstat(cache->fd, &st) != 0 || ftruncate(cache->fd, cache->size) != 0) {
+        close(cache->fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+
+    if (data == MAP_FAILED) {
+        close(cache->fd);
+        return -1;
+    }
+
+    cache->data = (uint8_t *)data;
+    *old_size = st.st_size;
+    return 0;
+}
+
+static void unmap_file(Node_Cache *cache)
+{
+    munmap(cache->data, cache->size);
+    close(cache->fd);
+}
+
+#else
+
+/* Without mmap() the file is read into memory and written back on sync. */
+static int map_file(Node_Cache *cache, size_t *old_size)
+{
+    cache->data = (uint8_t *)calloc(1, cache->size);
+
+    if (cache->data == NULL) {
+        return -1;
+    }
+
+    FILE *file = fopen(cache->path, "rb");
+    *old_size = 0;
+
+    if (file != NULL) {
+        *old_size = fread(cache->data, 1, cache->size, file);
+        fclose(file);
+    }
+
+    return 0;
+}
+
+static void unmap_file(Node_Cache *cache)
+{
+    free(cache->data);
+}
+
+#endif
+
+Node_Cache *node_cache_open(const char *path, uint32_t capacity)
+{
+    if (capacity == 0 || capacity > (1 << 24)) {
+        return NULL;
+    }
+
+    Node_Cache *cache = (Node_Cache *)calloc(1, sizeof(Node_Cache));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->path = (char *)malloc(strlen(path) + 1);
+    cache->free_records = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+
+    if (cache->path == NULL || cache->free_records == NULL
+            || index_map_init(&cache->index, CRYPTO_PUBLIC_KEY_SIZE, capacity) != 0) {
+        free(cache->free_records);
+        free(cache->path);
+        free(cache);
+        return NULL;
+    }
+
+    strcpy(cache->path, path);
+    cache->capacity = capacity;
+    cache->size = NODE_CACHE_HEADER_SIZE + (size_t)capacity * NODE_CACHE_RECORD_SIZE;
+
+    size_t old_size;
+
+    if (map_file(cache, &old_size) != 0) {
+        index_map_free(&cache->index);
+        free(cache->free_records);
+        free(cache->path);
+        free(cache);
+        return NULL;
+    }
+
+    const uint32_t kept = valid_records(cache, old_size);
+    uint32_t i;
+
+    memset(record(cache, kept), 0, (size_t)(capacity - kept) * NODE_CACHE_RECORD_SIZE);
+    write_header(cache);
+
+    for (i = 0; i < kept; ++i) {
+        uint8_t *rec = record(cache, i);
+
+        if (!record_used(rec)) {
+            continue;
+        }
+
+        if (index_map_add(&cache->index, rec + RECORD_PUBLIC_KEY, i) != 0) {
+            /* Twice in the file, or out of memory: forget it. */
+            memset(rec, 0, NODE_CACHE_RECORD_SIZE);
+            continue;
+        }
+
+        ++cache->count;
+    }
+
+    /* Taken from the end, so the lowest numbers are used first. */
+    for (i = capacity; i != 0; --i) {
+        if (!record_used(record(cache, i - 1))) {
+            cache->free_records[cache->num_free++] = i - 1;
+        }
+    }
+
+    return cache;
+}
+
+int node_cache_sync(Node_Cache *cache)
+{
+#ifndef _WIN32
+    return msync(cache->data, cache->size, MS_SYNC) == 0 ? 0 : -1;
+#else
+    FILE *file = fopen(cache->path, "wb");
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    const size_t written = fwrite(cache->data, 1, cache->size, file);
+
+    if (fclose(file) != 0 || written != cache->size) {
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+void node_cache_close(Node_Cache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    node_cache_sync(cache);
+    unmap_file(cache);
+    index_map_free(&cache->index);
+    free(cache->free_records);
+    free(cache->path);
+    free(cache);
+}
+
+/* Keep the counters from overflowing, the recent ones count as much. */
+static void count_request(uint8_t *rec, uint16_t requests, uint16_t answers)
+{
+    if (requests == UINT16_MAX) {
+        requests /= 2;
+        answers /= 2;
+    }
+
+    put_be16(rec + RECORD_REQUESTS, requests);
+    put_be16(rec + RECORD_ANSWERS, answers);
+}
+
+void node_cache_asked(Node_Cache *cache, const uint8_t *public_key)
+{
+    const int32_t i = index_map_find(&cache->index, public_key);
+
+    if (i == -1) {
+        return;
+    }
+
+    uint8_t *rec = record(cache, i);
+    count_request(rec, get_be16(rec + RECORD_REQUESTS) + 1, get_be16(rec + RECORD_ANSWERS));
+}
+
+/* return number of the record to store a node not in the cache in.
+ * return -1 if the cache is full and the records looked at all score at least
+ * score.
+ *
+ * A full cache isn't searched for its lowest score: the next
+ * NODE_CACHE_PROBES records after the hand are compared, so a node that keeps
+ * answering a bootstrap node costs the same however large the cache is, and the
+ * hand still comes around to every record.
+ */
+static int32_t free_record(Node_Cache *cache, uint64_t score, uint64_t now)
+{
+    if (cache->num_free != 0) {
+        return cache->free_records[--cache->num_free];
+    }
+
+    const uint32_t probes = MIN(NODE_CACHE_PROBES, cache->capacity);
+    int32_t lowest = -1;
+    uint64_t lowest_score = score;
+    uint32_t i;
+
+    for (i = 0; i < probes; ++i) {
+        const uint32_t number = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        const uint64_t rec_score = record_score(record(cache, number), now);
+
+        if (rec_score < lowest_score) {
+            lowest = number;
+            lowest_score = rec_score;
+        }
+    }
+
+    return lowest;
+}
+
+int node_cache_answered(Node_Cache *cache, const uint8_t *public_key, IP_Port ip_port, uint16_t rtt_ms)
+{
+    if (ip_port.ip.family != AF_INET && ip_port.ip.family != AF_INET6) {
+        return -1;
+    }
+
+    const uint64_t now = unix_time();
+    int32_t i = index_map_find(&cache->index, public_key);
+    uint8_t *rec;
+
+    if (i != -1) {
+        rec = record(cache, i);
+        const uint16_t requests = get_be16(rec + RECORD_REQUESTS);
+        const uint16_t answers = get_be16(rec + RECORD_ANSWERS) + 1;
+        /* Answers to requests sent before the node was cached. */
+        count_request(rec, requests < answers ? answers : requests, answers);
+
+        /* Smooth the round trip time, one slow answer says little. */
+        const uint16_t rtt = get_be16(rec + RECORD_RTT);
+        put_be16(rec + RECORD_RTT, rtt - rtt / 4 + rtt_ms / 4);
+    } else {
+        uint8_t new_rec[NODE_CACHE_RECORD_SIZE] = {0};
+        memcpy(new_rec + RECORD_PUBLIC_KEY, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        put_be32(new_rec + RECORD_LAST_SEEN, now);
+        put_be16(new_rec + RECORD_RTT, rtt_ms);
+        put_be16(new_rec + RECORD_REQUESTS, 1);
+        put_be16(new_rec + RECORD_ANSWERS, 1);
+
+        i = free_record(cache, record_score(new_rec, now), now);
+
+        if (i == -1) {
+            return -1;
+        }
+
+        rec = record(cache, i);
+
+        if (record_used(rec)) {
+            index_map_remove(&cache->index, rec + RECORD_PUBLIC_KEY);
+            --cache->count;
+        }
+
+        if (index_map_add(&cache->index, public_key, i) != 0) {
+            memset(rec, 0, NODE_CACHE_RECORD_SIZE);
+            cache->free_records[cache->num_free++] = i;
+            return -1;
+        }
+
+        memcpy(rec, new_rec, NODE_CACHE_RECORD_SIZE);
+        ++cache->count;
+    }
+
+    memset(rec + RECORD_IP, 0, sizeof(IP6));
+
+    if (ip_port.ip.family == AF_INET) {
+        rec[RECORD_FAMILY] = TOX_AF_INET;
+        memcpy(rec + RECORD_IP, ip_port.ip.ip4.uint8, sizeof(IP4));
+    } else {
+        rec[RECORD_FAMILY] = TOX_AF_INET6;
+        memcpy(rec + RECORD_IP, ip_port.ip.ip6.uint8, sizeof(IP6));
+    }
+
+    memcpy(rec + RECORD_PORT, &ip_port.port, sizeof(uint16_t));
+    put_be32(rec + RECORD_LAST_SEEN, now);
+    return 0;
+}
+
+typedef struct {
+    uint64_t score;
+    uint32_t index;
+} Node_Cache_Score;
+
+static int cmp_score(const void *a, const void *b)
+{
+    const Node_Cache_Score *score1 = (const Node_Cache_Score *)a;
+    const Node_Cache_Score *score2 = (const Node_Cache_Score *)b;
+
+    if (score1->score != score2->score) {
+        return score1->score > score2->score ? -1 : 1;
+    }
+
+    return score1->index < score2->index ? -1 : score1->index > score2->index;
+}
+
+uint32_t node_cache_best(const Node_Cache *cache, Node_Cache_Entry *entries, uint32_t max_entries)
+{
+    if (cache->count == 0 || max_entries == 0) {
+        return 0;
+    }
+
+    Node_Cache_Score *scores = (Node_Cache_Score *)malloc(cache->count * sizeof(Node_Cache_Score));
+
+    if (scores == NULL) {
+        return 0;
+    }
+
+    const uint64_t now = unix_time();
+    uint32_t num = 0;
+    uint32_t i;
+
+    for (i = 0; i < cache->capacity && num < cache->count; ++i) {
+        const uint8_t *rec = record(cache, i);
+
+        if (record_used(rec)) {
+            scores[num].score = record_score(rec, now);
+            scores[num].index = i;
+            ++num;
+        }
+    }
+
+    qsort(scores, num, sizeof(Node_Cache_Score), cmp_score);
+
+    num = MIN(num, max_entries);
+
+    for (i = 0; i < num; ++i) {
+        record_to_entry(record(cache, scores[i].index), &entries[i]);
+    }
+
+    free(scores);
+    return num;
+}
+
+uint32_t node_cache_count(const Node_Cache *cache)
+{
+    return cache->count;
+}
@@ -0,0 +1,99 @@
+/*
+ * An on-disk cache of the DHT nodes that answered us, to bootstrap from after
+ * a restart.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NODE_CACHE_H
+#define NODE_CACHE_H
+
+#include "crypto_core.h"
+#include "network.h"
+
+/* Number of nodes kept by a cache if no other capacity is given. */
+#define NODE_CACHE_DEFAULT_SIZE 1024
+
+/* The cache file is a header followed by one fixed size record per node, all
+ * numbers big endian. The file is memory mapped where possible, so a record is
+ * written as soon as the node it belongs to answers.
+ *
+ * Header:
+ * [uint32_t magic][uint16_t version][uint16_t record size][uint32_t capacity][uint32_t 0]
+ *
+ * Record, 64 bytes, unused if last seen is 0:
+ * [public key (32 bytes)][IPv4 or IPv6 address (16 bytes)][uint32_t last seen (unix time)]
+ * [port (2 bytes)][uint16_t round trip time (ms)][uint16_t requests][uint16_t answers]
+ * [uint8_t family, TOX_AF_INET or TOX_AF_INET6][3 bytes 0]
+ *
+ * A file of another version or record size is started over, it only holds
+ * nodes that can be found again.
+ */
+typedef struct Node_Cache Node_Cache;
+
+typedef struct {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    IP_Port ip_port;
+    uint64_t last_seen;
+    uint16_t rtt_ms;
+    uint16_t requests;  /* Get nodes requests and pings sent to the node. */
+    uint16_t answers;   /* Of those, the number it answered. */
+} Node_Cache_Entry;
+
+/* Open the cache file at path, creating it if it doesn't exist, for capacity
+ * nodes. The nodes of a larger file that don't fit are dropped.
+ *
+ * return NULL on failure.
+ */
+Node_Cache *node_cache_open(const char *path, uint32_t capacity);
+
+/* Write the cache back to its file and close it. */
+void node_cache_close(Node_Cache *cache);
+
+/* Make sure the records written so far are on disk.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int node_cache_sync(Node_Cache *cache);
+
+/* Count a get nodes request or ping sent to public_key if it is in the cache. */
+void node_cache_asked(Node_Cache *cache, const uint8_t *public_key);
+
+/* Store that public_key answered from ip_port after rtt_ms milliseconds.
+ * A node that isn't in a full cache replaces the lowest scored of the next few
+ * records, taken in turn, if its own score is higher.
+ *
+ * return 0 if the node is in the cache afterwards.
+ * return -1 if it isn't.
+ */
+int node_cache_answered(Node_Cache *cache, const uint8_t *public_key, IP_Port ip_port, uint16_t rtt_ms);
+
+/* Copy up to max_entries nodes with the highest scores to entries, highest
+ * first. The score of a node is the share of requests it answered, divided by
+ * the hours since it last did and by its round trip time.
+ *
+ * return number of entries copied.
+ */
+uint32_t node_cache_best(const Node_Cache *cache, Node_Cache_Entry *entries, uint32_t max_entries);
+
+/* return number of nodes in the cache. */
+uint32_t node_cache_count(const Node_Cache *cache);
+
+#endif
@@ -325,6 +325,15 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
+/* Offset at which the plaintext of a send packet is put in the buffer of the
+ * packet forwarded to the next hop. The data following the ip_port then
+ * already sits right behind the packet id and nonce, and needs no copy.
+ */
+#define SEND_PLAIN_OFFSET (1 + CRYPTO_NONCE_SIZE - SIZE_IPPORT)
+
+static int onion_send_1_in_place(const Onion *onion, uint8_t *data, uint16_t len, IP_Port source,
+                                 const uint8_t *nonce);
+
 static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
     Onion *onion = (Onion *)object;
@@ -339,20 +348,35 @@ static int handle_send_initial(void *object, IP_Port source, const uint8_t *pack
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    uint8_t data[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
+    DHT_get_shared_key_recv(onion->dht, shared_key, packet + 1 + CRYPTO_NONCE_SIZE);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
+                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), data + SEND_PLAIN_OFFSET);
 
     if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE)) {
         return 1;
     }
 
-    return onion_send_1(onion, plain, len, source, packet + 1);
+    return onion_send_1_in_place(onion, data, len, source, packet + 1);
 }
 
 int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
+{
+    if (len > ONION_MAX_PACKET_SIZE - SEND_PLAIN_OFFSET) {
+        return 1;
+    }
+
+    uint8_t data[ONION_MAX_PACKET_SIZE];
+    memcpy(data + SEND_PLAIN_OFFSET, plain, len);
+    return onion_send_1_in_place(onion, data, len, source, nonce);
+}
+
+/* Forward the plaintext of len bytes at data + SEND_PLAIN_OFFSET as a send 1
+ * packet, building the packet in data around it.
+ */
+static int onion_send_1_in_place(const Onion *onion, uint8_t *data, uint16_t len, IP_Port source,
+                                 const uint8_t *nonce)
 {
     if (len > ONION_MAX_PACKET_SIZE + SIZE_IPPORT - (1 + CRYPTO_NONCE_SIZE + ONION_RETURN_1)) {
         return 1;
@@ -364,17 +388,16 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 
     IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
+    if (ipport_unpack(&send_to, data + SEND_PLAIN_OFFSET, len, 0) == -1) {
         return 1;
     }
 
     uint8_t ip_port[SIZE_IPPORT];
     ipport_pack(ip_port, &source);
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
+    /* Overwrites the ip_port unpacked above. */
     data[0] = NET_PACKET_ONION_SEND_1;
     memcpy(data + 1, nonce, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
     uint8_t *ret_part = data + data_len;
     random_nonce(ret_part);
@@ -408,11 +431,12 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    uint8_t data[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
+    DHT_get_shared_key_recv(onion->dht, shared_key, packet + 1 + CRYPTO_NONCE_SIZE);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
-                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
+                                     length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1),
+                                     data + SEND_PLAIN_OFFSET);
 
     if (len != length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1 + CRYPTO_MAC_SIZE)) {
         return 1;
@@ -420,14 +444,13 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1) {
+    if (ipport_unpack(&send_to, data + SEND_PLAIN_OFFSET, len, 0) == -1) {
         return 1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
+    /* Overwrites the ip_port unpacked above. */
     data[0] = NET_PACKET_ONION_SEND_2;
     memcpy(data + 1, packet + 1, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
     uint8_t *ret_part = data + data_len;
     random_nonce(ret_part);
@@ -466,7 +489,7 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
 
     uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + CRYPTO_NONCE_SIZE);
+    DHT_get_shared_key_recv(onion->dht, shared_key, packet + 1 + CRYPTO_NONCE_SIZE);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
 
@@ -480,10 +503,10 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
-    memcpy(data, plain + SIZE_IPPORT, len - SIZE_IPPORT);
+    /* The packet to forward is the plaintext after the ip_port. */
+    uint8_t *data = plain + SIZE_IPPORT;
     uint16_t data_len = (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + (len - SIZE_IPPORT);
+    uint8_t *ret_part = data + data_len;
     random_nonce(ret_part);
     uint8_t ret_data[RETURN_2 + SIZE_IPPORT];
     ipport_pack(ret_data, &source);
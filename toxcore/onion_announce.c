@@ -233,64 +233,18 @@ static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
     return -1;
 }
 
-typedef struct {
-    const uint8_t *base_public_key;
-    Onion_Announce_Entry entry;
-} Cmp_data;
-
-static int cmp_entry(const void *a, const void *b)
-{
-    Cmp_data cmp1, cmp2;
-    memcpy(&cmp1, a, sizeof(Cmp_data));
-    memcpy(&cmp2, b, sizeof(Cmp_data));
-    Onion_Announce_Entry entry1 = cmp1.entry;
-    Onion_Announce_Entry entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
-
-    int t1 = is_timeout(entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = is_timeout(entry2.time, ONION_ANNOUNCE_TIMEOUT);
-
-    if (t1 && t2) {
-        return 0;
-    }
-
-    if (t1) {
-        return -1;
-    }
-
-    if (t2) {
-        return 1;
-    }
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1) {
-        return 1;
-    }
-
-    if (close == 2) {
-        return -1;
-    }
-
-    return 0;
-}
-
 static void sort_onion_announce_list(Onion_Announce_Entry *list, unsigned int length, const uint8_t *comp_public_key)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(Cmp_data, cmp_list, length);
+    VLA(List_Sort_Key, keys, length);
+    uint32_t i;
 
-    for (uint32_t i = 0; i < length; i++) {
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
+    for (i = 0; i < length; ++i) {
+        /* Timed out entries go first. */
+        const uint8_t group = !is_timeout(list[i].time, ONION_ANNOUNCE_TIMEOUT);
+        list_sort_key_init(&keys[i], comp_public_key, list[i].public_key, i, group);
     }
 
-    qsort(cmp_list, length, sizeof(Cmp_data), cmp_entry);
-
-    for (uint32_t i = 0; i < length; i++) {
-        list[i] = cmp_list[i].entry;
-    }
+    sort_list_by_keys(list, sizeof(Onion_Announce_Entry), keys, length);
 }
 
 /* add entry to entries list
@@ -343,8 +297,13 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
     }
 
     const uint8_t *packet_public_key = packet + 1 + CRYPTO_NONCE_SIZE;
+
+    if (DHT_defer_packet(onion_a->dht, source, packet_public_key, packet, length)) {
+        return 0;
+    }
+
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion_a->shared_keys_recv, shared_key, onion_a->dht->self_secret_key, packet_public_key);
+    DHT_get_shared_key_recv(onion_a->dht, shared_key, packet_public_key);
 
     uint8_t plain[ONION_PING_ID_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_PUBLIC_KEY_SIZE +
                   ONION_ANNOUNCE_SENDBACK_DATA_LENGTH];
@@ -35,6 +35,7 @@
    timeout for onion announce packets. */
 #define ANNOUNCE_ARRAY_SIZE 256
 #define ANNOUNCE_TIMEOUT 10
+#define ANNOUNCE_SENDBACK_DATA_SIZE (sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t))
 
 /* Add a node to the path_nodes bootstrap array.
  *
@@ -378,7 +379,7 @@ static int send_onion_packet_tcp_udp(const Onion_Client *onion_c, const Onion_Pa
 static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
                         uint32_t path_num, uint64_t *sendback)
 {
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
     memcpy(data, &num, sizeof(uint32_t));
     memcpy(data + sizeof(uint32_t), public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE, &ip_port, sizeof(IP_Port));
@@ -407,7 +408,7 @@ static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, u
 {
     uint64_t sback;
     memcpy(&sback, sendback, sizeof(uint64_t));
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
 
     if (ping_array_check(data, sizeof(data), &onion_c->announce_ping_array, sback) != sizeof(data)) {
         return ~0;
@@ -471,64 +472,18 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, IP_
     return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
 }
 
-typedef struct {
-    const uint8_t *base_public_key;
-    Onion_Node entry;
-} Cmp_data;
-
-static int cmp_entry(const void *a, const void *b)
-{
-    Cmp_data cmp1, cmp2;
-    memcpy(&cmp1, a, sizeof(Cmp_data));
-    memcpy(&cmp2, b, sizeof(Cmp_data));
-    Onion_Node entry1 = cmp1.entry;
-    Onion_Node entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
-
-    int t1 = is_timeout(entry1.timestamp, ONION_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.timestamp, ONION_NODE_TIMEOUT);
-
-    if (t1 && t2) {
-        return 0;
-    }
-
-    if (t1) {
-        return -1;
-    }
-
-    if (t2) {
-        return 1;
-    }
-
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
-
-    if (close == 1) {
-        return 1;
-    }
-
-    if (close == 2) {
-        return -1;
-    }
-
-    return 0;
-}
-
 static void sort_onion_node_list(Onion_Node *list, unsigned int length, const uint8_t *comp_public_key)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(Cmp_data, cmp_list, length);
+    VLA(List_Sort_Key, keys, length);
+    uint32_t i;
 
-    for (uint32_t i = 0; i < length; i++) {
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
+    for (i = 0; i < length; ++i) {
+        /* Timed out entries go first. */
+        const uint8_t group = !is_timeout(list[i].timestamp, ONION_NODE_TIMEOUT);
+        list_sort_key_init(&keys[i], comp_public_key, list[i].public_key, i, group);
     }
 
-    qsort(cmp_list, length, sizeof(Cmp_data), cmp_entry);
-
-    for (uint32_t i = 0; i < length; i++) {
-        list[i] = cmp_list[i].entry;
-    }
+    sort_list_by_keys(list, sizeof(Onion_Node), keys, length);
 }
 
 static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
@@ -1091,19 +1046,7 @@ static int send_dhtpk_announce(Onion_Client *onion_c, uint16_t friend_num, uint8
  */
 int onion_friend_num(const Onion_Client *onion_c, const uint8_t *public_key)
 {
-    unsigned int i;
-
-    for (i = 0; i < onion_c->num_friends; ++i) {
-        if (onion_c->friends_list[i].status == 0) {
-            continue;
-        }
-
-        if (public_key_cmp(public_key, onion_c->friends_list[i].real_public_key) == 0) {
-            return i;
-        }
-    }
-
-    return -1;
+    return index_map_find(&onion_c->friends_index, public_key);
 }
 
 /* Set the size of the friend list to num.
@@ -1161,6 +1104,10 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
         ++onion_c->num_friends;
     }
 
+    if (index_map_add(&onion_c->friends_index, public_key, index) == -1) {
+        return -1;
+    }
+
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     crypto_new_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
@@ -1181,6 +1128,10 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num)
     //if (onion_c->friends_list[friend_num].know_dht_public_key)
     //    DHT_delfriend(onion_c->dht, onion_c->friends_list[friend_num].dht_public_key, 0);
 
+    if (onion_c->friends_list[friend_num].status != 0) {
+        index_map_remove(&onion_c->friends_index, onion_c->friends_list[friend_num].real_public_key);
+    }
+
     crypto_memzero(&(onion_c->friends_list[friend_num]), sizeof(Onion_Friend));
     unsigned int i;
 
@@ -1638,7 +1589,13 @@ Onion_Client *new_onion_client(Net_Crypto *c)
         return NULL;
     }
 
-    if (ping_array_init(&onion_c->announce_ping_array, ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT) != 0) {
+    if (ping_array_init(&onion_c->announce_ping_array, ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT, ANNOUNCE_SENDBACK_DATA_SIZE) != 0) {
+        free(onion_c);
+        return NULL;
+    }
+
+    if (index_map_init(&onion_c->friends_index, CRYPTO_PUBLIC_KEY_SIZE, 0) == -1) {
+        ping_array_free_all(&onion_c->announce_ping_array);
         free(onion_c);
         return NULL;
     }
@@ -1664,6 +1621,7 @@ void kill_onion_client(Onion_Client *onion_c)
     }
 
     ping_array_free_all(&onion_c->announce_ping_array);
+    index_map_free(&onion_c->friends_index);
     realloc_onion_friends(onion_c, 0);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, NULL, NULL);
     networking_registerhandler(onion_c->net, NET_PACKET_ONION_DATA_RESPONSE, NULL, NULL);
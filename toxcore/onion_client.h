@@ -131,6 +131,7 @@ typedef struct {
     Networking_Core *net;
     Onion_Friend    *friends_list;
     uint16_t       num_friends;
+    Index_Map      friends_index; /* Real public key to friend number. */
 
     Onion_Node clients_announce_list[MAX_ONION_CLIENTS_ANNOUNCE];
 
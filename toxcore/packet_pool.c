@@ -0,0 +1,179 @@
+/*
+ * Free lists of packet sized blocks, so packets that are queued and freed at a
+ * high rate don't each cost a malloc() and a free().
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "packet_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A free block holds the pointer to the next one. */
+struct Packet_Block {
+    Packet_Block *next;
+};
+
+int packet_pool_init(Packet_Pool *pool, const size_t *sizes, uint32_t num_sizes)
+{
+    if (num_sizes == 0 || num_sizes > PACKET_POOL_MAX_CLASSES) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 1; i < num_sizes; ++i) {
+        if (sizes[i] <= sizes[i - 1]) {
+            return -1;
+        }
+    }
+
+    memset(pool, 0, sizeof(Packet_Pool));
+
+    for (i = 0; i < num_sizes; ++i) {
+        pool->classes[i].size = sizes[i] < sizeof(Packet_Block) ? sizeof(Packet_Block) : sizes[i];
+    }
+
+    pool->num_classes = num_sizes;
+    return 0;
+}
+
+/* Free the first count blocks on the free list of size_class. */
+static void free_blocks(Packet_Size_Class *size_class, uint32_t count)
+{
+    while (count > 0 && size_class->free_list != NULL) {
+        Packet_Block *block = size_class->free_list;
+        size_class->free_list = block->next;
+        --size_class->free_count;
+        --count;
+        free(block);
+    }
+}
+
+void packet_pool_free_all(Packet_Pool *pool)
+{
+    uint32_t i;
+
+    for (i = 0; i < pool->num_classes; ++i) {
+        free_blocks(&pool->classes[i], pool->classes[i].free_count);
+    }
+}
+
+/* return the smallest class blocks of size fit in.
+ * return NULL if there is none.
+ */
+static Packet_Size_Class *size_class_of(Packet_Pool *pool, size_t size)
+{
+    uint32_t i;
+
+    for (i = 0; i < pool->num_classes; ++i) {
+        if (size <= pool->classes[i].size) {
+            return &pool->classes[i];
+        }
+    }
+
+    return NULL;
+}
+
+void *packet_pool_alloc(Packet_Pool *pool, size_t size)
+{
+    Packet_Size_Class *size_class = size_class_of(pool, size);
+
+    if (size_class == NULL) {
+        return NULL;
+    }
+
+    Packet_Block *block = size_class->free_list;
+
+    if (block != NULL) {
+        size_class->free_list = block->next;
+        --size_class->free_count;
+    } else {
+        block = (Packet_Block *)malloc(size_class->size);
+
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    ++size_class->in_use;
+
+    if (size_class->high_water < size_class->in_use) {
+        size_class->high_water = size_class->in_use;
+    }
+
+    return block;
+}
+
+void packet_pool_free(Packet_Pool *pool, void *block, size_t size)
+{
+    if (block == NULL) {
+        return;
+    }
+
+    Packet_Size_Class *size_class = size_class_of(pool, size);
+    Packet_Block *free_block = (Packet_Block *)block;
+
+    free_block->next = size_class->free_list;
+    size_class->free_list = free_block;
+    ++size_class->free_count;
+    --size_class->in_use;
+}
+
+uint32_t packet_pool_trim(Packet_Pool *pool)
+{
+    uint32_t freed = 0;
+    uint32_t i;
+
+    for (i = 0; i < pool->num_classes; ++i) {
+        Packet_Size_Class *size_class = &pool->classes[i];
+
+        /* As many blocks as were used on top of the ones in use now are kept,
+         * for the next burst like the last one.
+         */
+        const uint32_t keep = size_class->high_water - size_class->in_use;
+
+        if (size_class->free_count > keep) {
+            const uint32_t count = size_class->free_count - keep;
+            free_blocks(size_class, count);
+            freed += count;
+        }
+
+        size_class->high_water = size_class->in_use;
+    }
+
+    return freed;
+}
+
+uint32_t packet_pool_free_blocks(const Packet_Pool *pool)
+{
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < pool->num_classes; ++i) {
+        count += pool->classes[i].free_count;
+    }
+
+    return count;
+}
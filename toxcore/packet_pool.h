@@ -0,0 +1,87 @@
+/*
+ * Free lists of packet sized blocks, so packets that are queued and freed at a
+ * high rate don't each cost a malloc() and a free().
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACKET_POOL_MAX_CLASSES 4
+
+/* A pool has a size class for every block size it was initialized with. A
+ * block is taken from the free list of the smallest class it fits in, and is
+ * put back on that list when freed. Blocks the pool held on to but that weren't
+ * needed between two calls of packet_pool_trim() are freed, so the memory of a
+ * burst, e.g. a file transfer, goes back once the burst is over.
+ *
+ * A pool isn't locked, a pool used from several threads must be locked by its
+ * owner.
+ */
+typedef struct Packet_Block Packet_Block;
+
+typedef struct {
+    size_t size;
+    Packet_Block *free_list;
+    uint32_t free_count;
+    uint32_t in_use;
+    uint32_t high_water; /* Most blocks in use at once since the last trim. */
+} Packet_Size_Class;
+
+typedef struct {
+    Packet_Size_Class classes[PACKET_POOL_MAX_CLASSES];
+    uint32_t num_classes;
+} Packet_Pool;
+
+/* Initialize a pool with num_sizes size classes, of the block sizes in sizes
+ * from smallest to largest.
+ *
+ * return 0 on success.
+ * return -1 if the sizes aren't valid.
+ */
+int packet_pool_init(Packet_Pool *pool, const size_t *sizes, uint32_t num_sizes);
+
+/* Free the blocks on the free lists of a pool initialized with
+ * packet_pool_init(). Blocks still in use must be freed with packet_pool_free()
+ * before.
+ */
+void packet_pool_free_all(Packet_Pool *pool);
+
+/* return a block of at least size bytes.
+ * return NULL if size is larger than the largest size class or on failure.
+ */
+void *packet_pool_alloc(Packet_Pool *pool, size_t size);
+
+/* Give back block, size must be the one it was allocated with. */
+void packet_pool_free(Packet_Pool *pool, void *block, size_t size);
+
+/* Free the blocks on the free lists that weren't in use since the last trim.
+ *
+ * return number of blocks freed.
+ */
+uint32_t packet_pool_trim(Packet_Pool *pool);
+
+/* return number of blocks on the free lists. */
+uint32_t packet_pool_free_blocks(const Packet_Pool *pool);
+
+#endif
@@ -56,7 +56,7 @@ struct PING {
 
 #define PING_PLAIN_SIZE (1 + sizeof(uint64_t))
 #define DHT_PING_SIZE (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + PING_PLAIN_SIZE + CRYPTO_MAC_SIZE)
-#define PING_DATA_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port))
+#define PING_DATA_SIZE (CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint64_t))
 
 int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *public_key)
 {
@@ -76,12 +76,19 @@ int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *public_key)
     uint8_t data[PING_DATA_SIZE];
     id_copy(data, public_key);
     memcpy(data + CRYPTO_PUBLIC_KEY_SIZE, &ipp, sizeof(IP_Port));
+    /* The send time gives the round trip time of the node for the node cache. */
+    const uint64_t sent_time = current_time_monotonic();
+    memcpy(data + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port), &sent_time, sizeof(sent_time));
     ping_id = ping_array_add(&ping->ping_array, data, sizeof(data));
 
     if (ping_id == 0) {
         return 1;
     }
 
+    if (ping->dht->node_cache != NULL) {
+        node_cache_asked(ping->dht->node_cache, public_key);
+    }
+
     uint8_t ping_plain[PING_PLAIN_SIZE];
     ping_plain[0] = NET_PACKET_PING_REQUEST;
     memcpy(ping_plain + 1, &ping_id, sizeof(ping_id));
@@ -149,6 +156,10 @@ static int handle_ping_request(void *object, IP_Port source, const uint8_t *pack
         return 1;
     }
 
+    if (DHT_defer_packet(dht, source, packet + 1, packet, length)) {
+        return 0;
+    }
+
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
@@ -233,6 +244,14 @@ static int handle_ping_response(void *object, IP_Port source, const uint8_t *pac
     }
 
     addto_lists(dht, source, packet + 1);
+
+    if (dht->node_cache != NULL) {
+        uint64_t sent_time;
+        memcpy(&sent_time, data + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port), sizeof(sent_time));
+        const uint64_t rtt = current_time_monotonic() - sent_time;
+        node_cache_answered(dht->node_cache, packet + 1, source, rtt < UINT16_MAX ? rtt : UINT16_MAX);
+    }
+
     return 0;
 }
 
@@ -284,7 +303,9 @@ int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port)
         return -1;
     }
 
-    if (in_list(ping->dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
+    const Client_data *client = DHT_close_client(ping->dht, public_key);
+
+    if (client != NULL && in_list(client, 1, public_key, ip_port)) {
         return -1;
     }
 
@@ -359,7 +380,7 @@ PING *new_ping(DHT *dht)
         return NULL;
     }
 
-    if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT) != 0) {
+    if (ping_array_init(&ping->ping_array, PING_NUM_MAX, PING_TIMEOUT, PING_DATA_SIZE) != 0) {
         free(ping);
         return NULL;
     }
@@ -30,53 +30,36 @@
 #include "crypto_core.h"
 #include "util.h"
 
+/* Entries aren't swept when they time out: a timed out entry fails the check
+ * and its slot is written over when the array comes around to it again.
+ */
 static void clear_entry(Ping_Array *array, uint32_t index)
 {
-    free(array->entries[index].data);
-    array->entries[index].data = NULL;
-    array->entries[index].length =
-        array->entries[index].time =
-            array->entries[index].ping_id = 0;
+    array->entries[index].length = 0;
+    array->entries[index].time = 0;
+    array->entries[index].ping_id = 0;
 }
 
-/* Clear timed out entries.
- */
-static void ping_array_clear_timedout(Ping_Array *array)
+static uint8_t *entry_data(const Ping_Array *array, uint32_t index)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-
-        if (!is_timeout(array->entries[index].time, array->timeout)) {
-            break;
-        }
-
-        clear_entry(array, index);
-        ++array->last_deleted;
-    }
+    return array->data + (size_t)index * array->max_length;
 }
 
 /* Add a data with length to the Ping_Array list and return a ping_id.
+ * The oldest entry is dropped if the array is full.
  *
  * return ping_id on success.
- * return 0 on failure.
+ * return 0 if length is larger than the max_length of the array.
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 {
-    ping_array_clear_timedout(array);
-    uint32_t index = array->last_added % array->total_size;
-
-    if (array->entries[index].data != NULL) {
-        array->last_deleted = array->last_added - array->total_size;
-        clear_entry(array, index);
-    }
-
-    array->entries[index].data = malloc(length);
-
-    if (array->entries[index].data == NULL) {
+    if (length > array->max_length) {
         return 0;
     }
 
-    memcpy(array->entries[index].data, data, length);
+    uint32_t index = array->last_added % array->total_size;
+
+    memcpy(entry_data(array, index), data, length);
     array->entries[index].length = length;
     array->entries[index].time = unix_time();
     ++array->last_added;
@@ -121,11 +104,7 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
         return -1;
     }
 
-    if (array->entries[index].data == NULL) {
-        return -1;
-    }
-
-    memcpy(data, array->entries[index].data, array->entries[index].length);
+    memcpy(data, entry_data(array, index), array->entries[index].length);
     uint32_t len = array->entries[index].length;
     clear_entry(array, index);
     return len;
@@ -134,24 +113,31 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
 /* Initialize a Ping_Array.
  * size represents the total size of the array and should be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * max_length is the largest data that will be added.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
+int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout, uint32_t max_length)
 {
-    if (size == 0 || timeout == 0 || empty_array == NULL) {
+    if (size == 0 || timeout == 0 || max_length == 0 || empty_array == NULL) {
         return -1;
     }
 
     empty_array->entries = (Ping_Array_Entry *)calloc(size, sizeof(Ping_Array_Entry));
+    empty_array->data = (uint8_t *)calloc(size, max_length);
 
-    if (empty_array->entries == NULL) {
+    if (empty_array->entries == NULL || empty_array->data == NULL) {
+        free(empty_array->entries);
+        free(empty_array->data);
+        empty_array->entries = NULL;
+        empty_array->data = NULL;
         return -1;
     }
 
-    empty_array->last_deleted = empty_array->last_added = 0;
+    empty_array->last_added = 0;
     empty_array->total_size = size;
+    empty_array->max_length = max_length;
     empty_array->timeout = timeout;
     return 0;
 }
@@ -160,13 +146,8 @@ int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
  */
 void ping_array_free_all(Ping_Array *array)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-        clear_entry(array, index);
-        ++array->last_deleted;
-    }
-
     free(array->entries);
+    free(array->data);
     array->entries = NULL;
+    array->data = NULL;
 }
-
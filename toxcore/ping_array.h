@@ -27,27 +27,31 @@
 #include "network.h"
 
 typedef struct {
-    void *data;
-    uint32_t length;
-    uint64_t time;
     uint64_t ping_id;
+    uint64_t time;
+    uint32_t length;
 } Ping_Array_Entry;
 
 
+/* The data of every entry is stored in its slot of a buffer allocated at init,
+ * so adding, checking and expiring entries never allocates.
+ */
 typedef struct {
     Ping_Array_Entry *entries;
+    uint8_t *data; /* total_size slots of max_length bytes. */
 
-    uint32_t last_deleted; /* number representing the next entry to be deleted. */
     uint32_t last_added; /* number representing the last entry to be added. */
     uint32_t total_size; /* The length of entries */
-    uint32_t timeout; /* The timeout after which entries are cleared. */
+    uint32_t max_length; /* The largest data an entry can hold. */
+    uint32_t timeout; /* The timeout after which entries are no longer valid. */
 } Ping_Array;
 
 
 /* Add a data with length to the Ping_Array list and return a ping_id.
+ * The oldest entry is dropped if the array is full.
  *
  * return ping_id on success.
- * return 0 on failure.
+ * return 0 if length is larger than the max_length of the array.
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length);
 
@@ -63,11 +67,12 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
 /* Initialize a Ping_Array.
  * size represents the total size of the array and should be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * max_length is the largest data that will be added.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout);
+int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout, uint32_t max_length);
 
 /* Free all the allocated memory in a Ping_Array.
  */
@@ -0,0 +1,352 @@
+/*
+ * Worker threads for the public key crypto of packets from unknown keys.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "precompute_pool.h"
+
+#include "crypto_core.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+typedef struct Precompute_Job Precompute_Job;
+
+struct Precompute_Job {
+    Precompute_Job *next;
+    precompute_work_cb *work;
+    precompute_done_cb *done;
+    void *object;
+    uint16_t length;
+    /* length bytes of data follow the job. */
+};
+
+typedef struct {
+    Precompute_Job *first;
+    Precompute_Job *last;
+} Precompute_Queue;
+
+struct Precompute_Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_t *threads;
+    uint16_t num_threads;
+    bool stopping;
+
+    Precompute_Queue waiting; /* Jobs for the workers. */
+    Precompute_Queue done;    /* Jobs for do_precompute_pool(). */
+
+    uint32_t pending;
+    uint32_t max_pending;
+    uint64_t dropped;
+
+    int wake_fds[2];
+};
+
+static uint8_t *job_data(Precompute_Job *job)
+{
+    return (uint8_t *)(job + 1);
+}
+
+static void free_job(Precompute_Job *job)
+{
+    crypto_memzero(job_data(job), job->length);
+    free(job);
+}
+
+static void queue_push(Precompute_Queue *queue, Precompute_Job *job)
+{
+    job->next = NULL;
+
+    if (queue->last != NULL) {
+        queue->last->next = job;
+    } else {
+        queue->first = job;
+    }
+
+    queue->last = job;
+}
+
+static Precompute_Job *queue_pop(Precompute_Queue *queue)
+{
+    Precompute_Job *job = queue->first;
+
+    if (job != NULL) {
+        queue->first = job->next;
+
+        if (queue->first == NULL) {
+            queue->last = NULL;
+        }
+    }
+
+    return job;
+}
+
+static void queue_free(Precompute_Queue *queue)
+{
+    Precompute_Job *job;
+
+    while ((job = queue_pop(queue)) != NULL) {
+        free_job(job);
+    }
+}
+
+static void *precompute_thread(void *arg)
+{
+    Precompute_Pool *pool = (Precompute_Pool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        while (!pool->stopping && pool->waiting.first == NULL) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+
+        if (pool->stopping) {
+            break;
+        }
+
+        Precompute_Job *job = queue_pop(&pool->waiting);
+        pthread_mutex_unlock(&pool->lock);
+
+        job->work(job_data(job), job->length);
+
+        pthread_mutex_lock(&pool->lock);
+        const bool was_empty = pool->done.first == NULL;
+        queue_push(&pool->done, job);
+
+#ifndef _WIN32
+
+        if (was_empty && pool->wake_fds[1] != -1) {
+            const uint8_t byte = 0;
+
+            if (write(pool->wake_fds[1], &byte, 1) != 1) {
+                /* The pipe is full, so do_precompute_pool() will be called anyway. */
+            }
+        }
+
+#endif
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int open_wake_fds(int *fds)
+{
+    fds[0] = -1;
+    fds[1] = -1;
+#ifndef _WIN32
+
+    if (pipe(fds) != 0) {
+        fds[0] = -1;
+        fds[1] = -1;
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+    return 0;
+}
+
+static void close_wake_fds(const int *fds)
+{
+#ifndef _WIN32
+
+    if (fds[0] != -1) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+#endif
+}
+
+Precompute_Pool *new_precompute_pool(uint16_t num_threads, uint32_t max_pending)
+{
+    if (num_threads == 0 || max_pending == 0) {
+        return NULL;
+    }
+
+    Precompute_Pool *pool = (Precompute_Pool *)calloc(1, sizeof(Precompute_Pool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+
+    if (pool->threads == NULL || open_wake_fds(pool->wake_fds) == -1) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        close_wake_fds(pool->wake_fds);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&pool->work_ready, NULL) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        close_wake_fds(pool->wake_fds);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    pool->max_pending = max_pending;
+
+    while (pool->num_threads < num_threads) {
+        if (pthread_create(&pool->threads[pool->num_threads], NULL, precompute_thread, pool) != 0) {
+            kill_precompute_pool(pool);
+            return NULL;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return pool;
+}
+
+void kill_precompute_pool(Precompute_Pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    uint16_t i;
+
+    for (i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    queue_free(&pool->waiting);
+    queue_free(&pool->done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+    close_wake_fds(pool->wake_fds);
+    free(pool->threads);
+    free(pool);
+}
+
+int precompute_pool_submit(Precompute_Pool *pool, precompute_work_cb *work, precompute_done_cb *done, void *object,
+                           const uint8_t *data, uint16_t length)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->pending >= pool->max_pending) {
+        ++pool->dropped;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    ++pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+
+    Precompute_Job *job = (Precompute_Job *)malloc(sizeof(Precompute_Job) + length);
+
+    if (job == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        --pool->pending;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    job->work = work;
+    job->done = done;
+    job->object = object;
+    job->length = length;
+    memcpy(job_data(job), data, length);
+
+    pthread_mutex_lock(&pool->lock);
+    queue_push(&pool->waiting, job);
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void do_precompute_pool(Precompute_Pool *pool, void *userdata)
+{
+    pthread_mutex_lock(&pool->lock);
+    Precompute_Queue done = pool->done;
+    pool->done.first = NULL;
+    pool->done.last = NULL;
+
+#ifndef _WIN32
+
+    if (pool->wake_fds[0] != -1) {
+        uint8_t bytes[64];
+
+        while (read(pool->wake_fds[0], bytes, sizeof(bytes)) > 0) {
+            continue;
+        }
+    }
+
+#endif
+    pthread_mutex_unlock(&pool->lock);
+
+    Precompute_Job *job;
+    uint32_t count = 0;
+
+    /* The lock isn't held here, so done callbacks can submit new jobs. */
+    while ((job = queue_pop(&done)) != NULL) {
+        job->done(job->object, job_data(job), job->length, userdata);
+        free_job(job);
+        ++count;
+    }
+
+    if (count != 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= count;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+int precompute_pool_fd(const Precompute_Pool *pool)
+{
+    return pool->wake_fds[0];
+}
+
+uint64_t precompute_pool_dropped(Precompute_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    const uint64_t dropped = pool->dropped;
+    pthread_mutex_unlock(&pool->lock);
+    return dropped;
+}
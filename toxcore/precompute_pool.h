@@ -0,0 +1,78 @@
+/*
+ * Worker threads for the public key crypto of packets from unknown keys.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PRECOMPUTE_POOL_H
+#define PRECOMPUTE_POOL_H
+
+#include <stdint.h>
+
+/* A precompute pool runs the expensive part of handling a packet, usually
+ * encrypt_precompute() for a public key that isn't in any cache yet, on worker
+ * threads. The rest of the handling is done later by do_precompute_pool() on
+ * the thread that handles packets, so one slow packet doesn't hold up all the
+ * ones behind it.
+ */
+typedef struct Precompute_Pool Precompute_Pool;
+
+/* Run on a worker thread with the copy of the job data. Must only touch data. */
+typedef void precompute_work_cb(uint8_t *data, uint16_t length);
+
+/* Run by do_precompute_pool() with the data the work callback left. */
+typedef void precompute_done_cb(void *object, uint8_t *data, uint16_t length, void *userdata);
+
+/* Start num_threads workers. At most max_pending jobs can be waiting for a
+ * worker or for do_precompute_pool() at once.
+ *
+ * return NULL on failure.
+ */
+Precompute_Pool *new_precompute_pool(uint16_t num_threads, uint32_t max_pending);
+
+/* Stop the workers and drop the jobs that are not done, without calling their
+ * done callbacks. Must be called before the objects jobs were submitted for
+ * are freed.
+ */
+void kill_precompute_pool(Precompute_Pool *pool);
+
+/* Copy data and run work on it on a worker thread, then done with object.
+ * Job data is wiped when the job is freed, so it can hold keys.
+ *
+ * return 0 on success.
+ * return -1 if max_pending jobs are pending already or on failure.
+ */
+int precompute_pool_submit(Precompute_Pool *pool, precompute_work_cb *work, precompute_done_cb *done, void *object,
+                           const uint8_t *data, uint16_t length);
+
+/* Call the done callbacks of the jobs the workers finished.
+ * Must be called from the thread (or with the lock) packets are handled with.
+ */
+void do_precompute_pool(Precompute_Pool *pool, void *userdata);
+
+/* return a file descriptor that becomes readable when do_precompute_pool() has
+ * jobs to finish, to wait for with poll(). It is drained by do_precompute_pool().
+ * return -1 if there is none on this platform.
+ */
+int precompute_pool_fd(const Precompute_Pool *pool);
+
+/* return number of jobs that were refused because the pool was full. */
+uint64_t precompute_pool_dropped(Precompute_Pool *pool);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * A cache of the shared keys computed for the public keys of other nodes.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "shared_key_cache.h"
+
+#include <string.h>
+
+/* Number of keys a public key can be stored in. */
+#define SHARED_KEY_CACHE_WAYS 8
+
+typedef struct {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+} Shared_Key_Entry;
+
+/* The tags and use times of a set share a cache line, the keys themselves are
+ * only read when a tag matches.
+ */
+typedef struct {
+    uint32_t tags[SHARED_KEY_CACHE_WAYS]; /* 0 if the entry is unused. */
+    uint32_t last_used[SHARED_KEY_CACHE_WAYS];
+    Shared_Key_Entry entries[SHARED_KEY_CACHE_WAYS];
+} Shared_Key_Set;
+
+struct Shared_Key_Cache {
+    Shared_Key_Set *sets;
+    uint32_t num_sets; /* Always a power of 2. */
+    uint32_t clock;
+    uint64_t seed;
+
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    bool has_secret_key;
+
+    Shared_Key_Cache_Stats stats;
+};
+
+Shared_Key_Cache *shared_key_cache_new(uint32_t capacity)
+{
+    Shared_Key_Cache *cache = (Shared_Key_Cache *)calloc(1, sizeof(Shared_Key_Cache));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->num_sets = 1;
+
+    while (cache->num_sets * SHARED_KEY_CACHE_WAYS < capacity && cache->num_sets < (1 << 24)) {
+        cache->num_sets *= 2;
+    }
+
+    cache->sets = (Shared_Key_Set *)calloc(cache->num_sets, sizeof(Shared_Key_Set));
+
+    if (cache->sets == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    /* Keeps others from picking public keys that all land in the same set. */
+    cache->seed = random_64b();
+    return cache;
+}
+
+void shared_key_cache_free(Shared_Key_Cache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    crypto_memzero(cache->sets, cache->num_sets * sizeof(Shared_Key_Set));
+    crypto_memzero(cache->secret_key, sizeof(cache->secret_key));
+    free(cache->sets);
+    free(cache);
+}
+
+static uint64_t hash_public_key(const Shared_Key_Cache *cache, const uint8_t *public_key)
+{
+    uint64_t x;
+    memcpy(&x, public_key, sizeof(x));
+    x ^= cache->seed;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Drop the keys of another secret key than secret_key. */
+static void use_secret_key(Shared_Key_Cache *cache, const uint8_t *secret_key)
+{
+    if (!cache->has_secret_key || public_key_cmp(cache->secret_key, secret_key) != 0) {
+        crypto_memzero(cache->sets, cache->num_sets * sizeof(Shared_Key_Set));
+        memcpy(cache->secret_key, secret_key, sizeof(cache->secret_key));
+        cache->has_secret_key = 1;
+    }
+}
+
+static Shared_Key_Set *find_set(const Shared_Key_Cache *cache, const uint8_t *public_key, uint32_t *tag)
+{
+    const uint64_t hash = hash_public_key(cache, public_key);
+    *tag = (uint32_t)(hash >> 32) | 1;
+    return &cache->sets[hash & (cache->num_sets - 1)];
+}
+
+/* return index of public_key in set, or SHARED_KEY_CACHE_WAYS if it isn't in it. */
+static uint32_t find_entry(const Shared_Key_Set *set, uint32_t tag, const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < SHARED_KEY_CACHE_WAYS; ++i) {
+        if (set->tags[i] == tag && public_key_cmp(public_key, set->entries[i].public_key) == 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* Store shared_key in an unused entry of set, else in the one unused for the longest time. */
+static void store_entry(Shared_Key_Cache *cache, Shared_Key_Set *set, uint32_t tag, const uint8_t *public_key,
+                        const uint8_t *shared_key)
+{
+    const uint32_t now = ++cache->clock;
+    uint32_t oldest = 0;
+    uint32_t i;
+
+    for (i = 1; i < SHARED_KEY_CACHE_WAYS && set->tags[oldest] != 0; ++i) {
+        if (set->tags[i] == 0 || now - set->last_used[i] > now - set->last_used[oldest]) {
+            oldest = i;
+        }
+    }
+
+    if (set->tags[oldest] != 0) {
+        ++cache->stats.evictions;
+    }
+
+    set->tags[oldest] = tag;
+    set->last_used[oldest] = now;
+    memcpy(set->entries[oldest].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(set->entries[oldest].shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+}
+
+void shared_key_cache_get(Shared_Key_Cache *cache, uint8_t *shared_key, const uint8_t *secret_key,
+                          const uint8_t *public_key)
+{
+    use_secret_key(cache, secret_key);
+
+    uint32_t tag;
+    Shared_Key_Set *set = find_set(cache, public_key, &tag);
+    const uint32_t i = find_entry(set, tag, public_key);
+
+    if (i != SHARED_KEY_CACHE_WAYS) {
+        memcpy(shared_key, set->entries[i].shared_key, CRYPTO_SHARED_KEY_SIZE);
+        set->last_used[i] = ++cache->clock;
+        ++cache->stats.hits;
+        return;
+    }
+
+    ++cache->stats.misses;
+    encrypt_precompute(public_key, secret_key, shared_key);
+    store_entry(cache, set, tag, public_key, shared_key);
+}
+
+bool shared_key_cache_contains(const Shared_Key_Cache *cache, const uint8_t *secret_key, const uint8_t *public_key)
+{
+    if (!cache->has_secret_key || public_key_cmp(cache->secret_key, secret_key) != 0) {
+        return 0;
+    }
+
+    uint32_t tag;
+    const Shared_Key_Set *set = find_set(cache, public_key, &tag);
+    return find_entry(set, tag, public_key) != SHARED_KEY_CACHE_WAYS;
+}
+
+void shared_key_cache_put(Shared_Key_Cache *cache, const uint8_t *secret_key, const uint8_t *public_key,
+                          const uint8_t *shared_key)
+{
+    use_secret_key(cache, secret_key);
+
+    uint32_t tag;
+    Shared_Key_Set *set = find_set(cache, public_key, &tag);
+    const uint32_t i = find_entry(set, tag, public_key);
+
+    ++cache->stats.misses;
+
+    if (i != SHARED_KEY_CACHE_WAYS) {
+        set->last_used[i] = ++cache->clock;
+        return;
+    }
+
+    store_entry(cache, set, tag, public_key, shared_key);
+}
+
+uint32_t shared_key_cache_capacity(const Shared_Key_Cache *cache)
+{
+    return cache->num_sets * SHARED_KEY_CACHE_WAYS;
+}
+
+void shared_key_cache_get_stats(const Shared_Key_Cache *cache, Shared_Key_Cache_Stats *stats)
+{
+    *stats = cache->stats;
+}
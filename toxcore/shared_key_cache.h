@@ -0,0 +1,72 @@
+/*
+ * A cache of the shared keys computed for the public keys of other nodes.
+ */
+
+/*
+ * Copyright © 2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SHARED_KEY_CACHE_H
+#define SHARED_KEY_CACHE_H
+
+#include "crypto_core.h"
+
+/* Number of keys kept by a cache if no other capacity is given. */
+#define SHARED_KEY_CACHE_DEFAULT_SIZE 8192
+
+typedef struct Shared_Key_Cache Shared_Key_Cache;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;  /* Keys dropped to make room for another one. */
+} Shared_Key_Cache_Stats;
+
+/* Create a cache that keeps about capacity keys, the least recently used ones
+ * are dropped first.
+ *
+ * return NULL on failure.
+ */
+Shared_Key_Cache *shared_key_cache_new(uint32_t capacity);
+
+void shared_key_cache_free(Shared_Key_Cache *cache);
+
+/* Shared key generations are costly, it is therefor smart to store commonly used
+ * ones so that they can re used later without being computed again.
+ *
+ * If the shared key of secret_key and public_key is in the cache, copy it to
+ * shared_key, else compute it into shared_key and store it. Keys stored for
+ * another secret_key are dropped when the secret_key changes.
+ */
+void shared_key_cache_get(Shared_Key_Cache *cache, uint8_t *shared_key, const uint8_t *secret_key,
+                          const uint8_t *public_key);
+
+/* return true if the shared key of secret_key and public_key is in the cache. */
+bool shared_key_cache_contains(const Shared_Key_Cache *cache, const uint8_t *secret_key, const uint8_t *public_key);
+
+/* Store a shared key computed elsewhere, e.g. by a precompute pool. It counts
+ * as a miss, the shared_key_cache_get() that finds it afterwards as a hit.
+ */
+void shared_key_cache_put(Shared_Key_Cache *cache, const uint8_t *secret_key, const uint8_t *public_key,
+                          const uint8_t *shared_key);
+
+/* return the number of keys the cache can keep. */
+uint32_t shared_key_cache_capacity(const Shared_Key_Cache *cache);
+
+void shared_key_cache_get_stats(const Shared_Key_Cache *cache, Shared_Key_Cache_Stats *stats);
+
+#endif
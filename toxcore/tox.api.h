@@ -290,6 +290,11 @@ const FILE_ID_LENGTH              = 32;
  */
 const MAX_FILENAME_LENGTH         = 255;
 
+/**
+ * The number of buckets in the handler time histogram of ${net_stats.handler_histogram}.
+ */
+const NET_HISTOGRAM_SIZE          = 8;
+
 
 /*******************************************************************************
  *
@@ -564,6 +569,18 @@ static class options {
        */
       any user_data;
     }
+
+    /**
+     * Queue UDP packets and send them in batches, sending runs of packets to
+     * the same address as one segmented message (UDP GSO) and accepting
+     * aggregated packets (UDP GRO). This makes bulk transfers such as file
+     * transfers much cheaper on fast networks. (Default: disabled).
+     *
+     * Only available on Linux 4.18 and newer, it is silently ignored
+     * elsewhere. Packets sent outside of ${tox.iterate} are sent at the end of the
+     * next call to it.
+     */
+    bool udp_offload_enabled;
   }
 
 
@@ -834,6 +851,43 @@ const uint32_t iteration_interval();
 void iterate(any user_data);
 
 
+/**
+ * Return the time in milliseconds before $iterate() has to be called again
+ * if none of the sockets from ${fds.get} has data to read before then.
+ *
+ * While there are connections to friends or data waiting to be written to a
+ * TCP socket this is the same as $iteration_interval(). An idle instance only
+ * has timers with a resolution of one second, and the deadline is the time
+ * until the next of them can expire.
+ *
+ * Event loops that wait on the sockets can sleep this long instead of waking
+ * up every $iteration_interval() milliseconds.
+ */
+const uint32_t iteration_deadline();
+
+
+int32_t[size] fds {
+  /**
+   * Return the number of sockets written by $get. This function cannot fail.
+   * The result is always greater than 0.
+   */
+  size();
+
+  /**
+   * Write the sockets Tox reads from to an array. These are file descriptors
+   * on POSIX systems and SOCKET handles on Windows. When one of them becomes
+   * readable, $iterate() should be called.
+   *
+   * The set changes as connections to TCP relays come and go, so get it again
+   * after each call to $iterate().
+   *
+   * @param fds An array large enough to hold $size elements. If this
+   *   parameter is NULL, this function has no effect.
+   */
+  get();
+}
+
+
 /*******************************************************************************
  *
  * :: Internal client information (Tox address/id)
@@ -2567,6 +2621,65 @@ inline namespace self {
 
 }
 
+
+/**
+ * Traffic counters kept for each UDP packet id, the first byte of a packet.
+ */
+enum class NET_COUNTER {
+  /**
+   * Packets received and passed to a handler.
+   */
+  RECV_PACKETS,
+  /**
+   * Total size of the packets passed to a handler.
+   */
+  RECV_BYTES,
+  /**
+   * Packets received and dropped because no handler is registered for them.
+   */
+  RECV_UNHANDLED,
+  /**
+   * Packets handed to the socket.
+   */
+  SENT_PACKETS,
+  /**
+   * Total size of the packets handed to the socket.
+   */
+  SENT_BYTES,
+  /**
+   * Packets the socket refused to send.
+   */
+  SEND_FAILED,
+  /**
+   * Total time spent in the handler, in microseconds.
+   */
+  HANDLER_TIME,
+}
+
+
+namespace net_stats {
+
+  /**
+   * Return a traffic counter of the UDP socket for one packet id.
+   *
+   * The counters are only collected if toxcore was built with NET_STATS.
+   * Otherwise this function always returns 0.
+   */
+  const uint64_t get(uint8_t packet_id, NET_COUNTER counter);
+
+  /**
+   * Return the number of handler calls for the packet id that fell into a
+   * bucket of the handler time histogram. Bucket 0 counts calls that took less
+   * than 1 microsecond, bucket i calls that took from 4^(i-1) up to 4^i
+   * microseconds and the last bucket all slower calls.
+   *
+   * Returns 0 if bucket is not less than $NET_HISTOGRAM_SIZE or if toxcore was
+   * built without NET_STATS.
+   */
+  const uint64_t handler_histogram(uint8_t packet_id, uint8_t bucket);
+
+}
+
 } // class tox
 
 %{
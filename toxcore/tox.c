@@ -34,6 +34,7 @@ typedef struct Messenger Tox;
 #include "Messenger.h"
 #include "group.h"
 #include "logger.h"
+#include "util.h"
 
 #include "../toxencryptsave/defines.h"
 
@@ -122,6 +123,7 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         m_options.tcp_server_port = tox_options_get_tcp_port(options);
         m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(options);
         m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(options);
+        m_options.udp_offload_enabled = tox_options_get_udp_offload_enabled(options);
 
         m_options.log_callback = (logger_cb *)tox_options_get_log_callback(options);
         m_options.log_user_data = tox_options_get_log_user_data(options);
@@ -328,7 +330,8 @@ void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb
 uint32_t tox_iteration_interval(const Tox *tox)
 {
     const Messenger *m = tox;
-    return messenger_run_interval(m);
+    const uint32_t interval = messenger_run_interval(m);
+    return MIN(interval, groupchats_run_interval((const Group_Chats *)m->conferences_object));
 }
 
 void tox_iterate(Tox *tox, void *user_data)
@@ -336,6 +339,49 @@ void tox_iterate(Tox *tox, void *user_data)
     Messenger *m = tox;
     do_messenger(m, user_data);
     do_groupchats((Group_Chats *)m->conferences_object, user_data);
+
+    /* Send what was queued in batched mode (udp_offload_enabled). */
+    networking_flush(m->net);
+}
+
+uint32_t tox_iteration_deadline(const Tox *tox)
+{
+    const Messenger *m = tox;
+    const uint32_t interval = messenger_run_deadline(m);
+    return MIN(interval, groupchats_run_interval((const Group_Chats *)m->conferences_object));
+}
+
+size_t tox_get_fds_size(const Tox *tox)
+{
+    const Messenger *m = tox;
+    Socket unused;
+    return messenger_fds(m, &unused, 0);
+}
+
+void tox_get_fds(const Tox *tox, int32_t *fds)
+{
+    if (fds == NULL) {
+        return;
+    }
+
+    const Messenger *m = tox;
+    Socket unused;
+    unsigned int count = messenger_fds(m, &unused, 0);
+    Socket *socks = (Socket *)malloc(count * sizeof(Socket));
+
+    if (socks == NULL) {
+        return;
+    }
+
+    count = messenger_fds(m, socks, count);
+
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        fds[i] = (int32_t)socks[i];
+    }
+
+    free(socks);
 }
 
 void tox_self_get_address(const Tox *tox, uint8_t *address)
@@ -1543,3 +1589,54 @@ uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error)
     SET_ERROR_PARAMETER(error, TOX_ERR_GET_PORT_NOT_BOUND);
     return 0;
 }
+
+uint64_t tox_net_stats_get(const Tox *tox, uint8_t packet_id, TOX_NET_COUNTER counter)
+{
+    const Messenger *m = tox;
+    Net_Packet_Stats stats;
+
+    if (networking_get_packet_stats(m->net, packet_id, &stats) == -1) {
+        return 0;
+    }
+
+    switch (counter) {
+        case TOX_NET_COUNTER_RECV_PACKETS:
+            return stats.recv_packets;
+
+        case TOX_NET_COUNTER_RECV_BYTES:
+            return stats.recv_bytes;
+
+        case TOX_NET_COUNTER_RECV_UNHANDLED:
+            return stats.recv_unhandled;
+
+        case TOX_NET_COUNTER_SENT_PACKETS:
+            return stats.sent_packets;
+
+        case TOX_NET_COUNTER_SENT_BYTES:
+            return stats.sent_bytes;
+
+        case TOX_NET_COUNTER_SEND_FAILED:
+            return stats.send_failed;
+
+        case TOX_NET_COUNTER_HANDLER_TIME:
+            return stats.handler_time;
+    }
+
+    return 0;
+}
+
+uint64_t tox_net_stats_handler_histogram(const Tox *tox, uint8_t packet_id, uint8_t bucket)
+{
+    const Messenger *m = tox;
+    Net_Packet_Stats stats;
+
+    if (bucket >= NET_STATS_HISTOGRAM_SIZE) {
+        return 0;
+    }
+
+    if (networking_get_packet_stats(m->net, packet_id, &stats) == -1) {
+        return 0;
+    }
+
+    return stats.handler_histogram[bucket];
+}
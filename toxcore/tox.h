@@ -313,6 +313,13 @@ uint32_t tox_file_id_length(void);
 
 uint32_t tox_max_filename_length(void);
 
+/**
+ * The number of buckets in the handler time histogram of tox_net_stats_handler_histogram.
+ */
+#define TOX_NET_HISTOGRAM_SIZE         8
+
+uint32_t tox_net_histogram_size(void);
+
 
 /*******************************************************************************
  *
@@ -623,6 +630,19 @@ struct Tox_Options {
      */
     void *log_user_data;
 
+
+    /**
+     * Queue UDP packets and send them in batches, sending runs of packets to
+     * the same address as one segmented message (UDP GSO) and accepting
+     * aggregated packets (UDP GRO). This makes bulk transfers such as file
+     * transfers much cheaper on fast networks. (Default: disabled).
+     *
+     * Only available on Linux 4.18 and newer, it is silently ignored
+     * elsewhere. Packets sent outside of tox_iterate are sent at the end of the
+     * next call to it.
+     */
+    bool udp_offload_enabled;
+
 };
 
 
@@ -686,6 +706,10 @@ void *tox_options_get_log_user_data(const struct Tox_Options *options);
 
 void tox_options_set_log_user_data(struct Tox_Options *options, void *user_data);
 
+bool tox_options_get_udp_offload_enabled(const struct Tox_Options *options);
+
+void tox_options_set_udp_offload_enabled(struct Tox_Options *options, bool udp_offload_enabled);
+
 /**
  * Initialises a Tox_Options object with the default options.
  *
@@ -983,6 +1007,39 @@ uint32_t tox_iteration_interval(const Tox *tox);
  */
 void tox_iterate(Tox *tox, void *user_data);
 
+/**
+ * Return the time in milliseconds before tox_iterate() has to be called again
+ * if none of the sockets from tox_get_fds has data to read before then.
+ *
+ * While there are connections to friends or data waiting to be written to a
+ * TCP socket this is the same as tox_iteration_interval(). An idle instance only
+ * has timers with a resolution of one second, and the deadline is the time
+ * until the next of them can expire.
+ *
+ * Event loops that wait on the sockets can sleep this long instead of waking
+ * up every tox_iteration_interval() milliseconds.
+ */
+uint32_t tox_iteration_deadline(const Tox *tox);
+
+/**
+ * Return the number of sockets written by tox_get_fds. This function cannot fail.
+ * The result is always greater than 0.
+ */
+size_t tox_get_fds_size(const Tox *tox);
+
+/**
+ * Write the sockets Tox reads from to an array. These are file descriptors
+ * on POSIX systems and SOCKET handles on Windows. When one of them becomes
+ * readable, tox_iterate() should be called.
+ *
+ * The set changes as connections to TCP relays come and go, so get it again
+ * after each call to tox_iterate().
+ *
+ * @param fds An array large enough to hold tox_get_fds_size elements. If this
+ *   parameter is NULL, this function has no effect.
+ */
+void tox_get_fds(const Tox *tox, int32_t *fds);
+
 
 /*******************************************************************************
  *
@@ -2933,6 +2990,68 @@ uint16_t tox_self_get_udp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
  */
 uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
 
+/**
+ * Traffic counters kept for each UDP packet id, the first byte of a packet.
+ */
+typedef enum TOX_NET_COUNTER {
+
+    /**
+     * Packets received and passed to a handler.
+     */
+    TOX_NET_COUNTER_RECV_PACKETS,
+
+    /**
+     * Total size of the packets passed to a handler.
+     */
+    TOX_NET_COUNTER_RECV_BYTES,
+
+    /**
+     * Packets received and dropped because no handler is registered for them.
+     */
+    TOX_NET_COUNTER_RECV_UNHANDLED,
+
+    /**
+     * Packets handed to the socket.
+     */
+    TOX_NET_COUNTER_SENT_PACKETS,
+
+    /**
+     * Total size of the packets handed to the socket.
+     */
+    TOX_NET_COUNTER_SENT_BYTES,
+
+    /**
+     * Packets the socket refused to send.
+     */
+    TOX_NET_COUNTER_SEND_FAILED,
+
+    /**
+     * Total time spent in the handler, in microseconds.
+     */
+    TOX_NET_COUNTER_HANDLER_TIME,
+
+} TOX_NET_COUNTER;
+
+
+/**
+ * Return a traffic counter of the UDP socket for one packet id.
+ *
+ * The counters are only collected if toxcore was built with NET_STATS.
+ * Otherwise this function always returns 0.
+ */
+uint64_t tox_net_stats_get(const Tox *tox, uint8_t packet_id, TOX_NET_COUNTER counter);
+
+/**
+ * Return the number of handler calls for the packet id that fell into a
+ * bucket of the handler time histogram. Bucket 0 counts calls that took less
+ * than 1 microsecond, bucket i calls that took from 4^(i-1) up to 4^i
+ * microseconds and the last bucket all slower calls.
+ *
+ * Returns 0 if bucket is not less than TOX_NET_HISTOGRAM_SIZE or if toxcore was
+ * built without NET_STATS.
+ */
+uint64_t tox_net_stats_handler_histogram(const Tox *tox, uint8_t packet_id, uint8_t bucket);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,7 @@ CONST_FUNCTION(max_custom_packet_size, MAX_CUSTOM_PACKET_SIZE)
 CONST_FUNCTION(hash_length, HASH_LENGTH)
 CONST_FUNCTION(file_id_length, FILE_ID_LENGTH)
 CONST_FUNCTION(max_filename_length, MAX_FILENAME_LENGTH)
+CONST_FUNCTION(net_histogram_size, NET_HISTOGRAM_SIZE)
 
 
 #define ACCESSORS(type, ns, name) \
@@ -52,6 +53,7 @@ ACCESSORS(size_t, savedata_, length)
 ACCESSORS(tox_log_cb *, log_, callback)
 ACCESSORS(void *, log_, user_data)
 ACCESSORS(bool, , local_discovery_enabled)
+ACCESSORS(bool, , udp_offload_enabled)
 
 const uint8_t *tox_options_get_savedata_data(const struct Tox_Options *options)
 {
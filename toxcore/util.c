@@ -62,6 +62,394 @@ int is_timeout(uint64_t timestamp, uint64_t timeout)
     return timestamp + timeout <= unix_time();
 }
 
+/* return the time in milliseconds until unix_time_update() next advances unix_time().
+ * Timers based on unix_time() can't expire before then.
+ */
+uint32_t unix_time_next_update(void)
+{
+    return 1000 - (current_time_monotonic() % 1000);
+}
+
+uint32_t unix_time_until(uint64_t time)
+{
+    const uint64_t now = unix_time();
+
+    if (time <= now) {
+        return 0;
+    }
+
+    if (time - now > UINT32_MAX / 1000) {
+        return UINT32_MAX;
+    }
+
+    return (uint32_t)(time - now - 1) * 1000 + unix_time_next_update();
+}
+
+/* Timer wheel */
+
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 6
+
+/* The lists a timer can be in: the slots of all levels, the timers set to a
+ * time the wheel has passed already, and the timers that are being run out by
+ * timer_wheel_run().
+ */
+#define TIMER_LIST_DUE (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define TIMER_LIST_RUNNING (TIMER_LIST_DUE + 1)
+#define TIMER_LIST_NONE (TIMER_LIST_RUNNING + 1)
+#define TIMER_LIST_FREE (TIMER_LIST_RUNNING + 2)
+
+typedef struct {
+    uint64_t deadline;
+    timer_cb *callback;
+    void *object;
+    uint32_t number;
+
+    /* The timers of a list are linked by their numbers, 0 ends a list. */
+    uint32_t next;
+    uint32_t prev;
+    uint16_t list;
+} Timer;
+
+struct Timer_Wheel {
+    Timer *timers; /* Timer 0 is unused. */
+    uint32_t timers_size;
+    uint32_t free_timers;
+
+    uint32_t lists[TIMER_LIST_RUNNING + 1];
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; /* A bit for every slot that isn't empty. */
+
+    /* Every timer with a deadline before now has run out. */
+    uint64_t now;
+};
+
+static uint32_t level_shift(uint32_t level)
+{
+    return level * TIMER_WHEEL_SLOT_BITS;
+}
+
+static void timer_unlink(Timer_Wheel *wheel, uint32_t timer)
+{
+    Timer *t = &wheel->timers[timer];
+
+    if (t->list > TIMER_LIST_RUNNING) {
+        return;
+    }
+
+    if (t->prev != 0) {
+        wheel->timers[t->prev].next = t->next;
+    } else {
+        wheel->lists[t->list] = t->next;
+
+        if (t->next == 0 && t->list < TIMER_LIST_DUE) {
+            wheel->occupied[t->list / TIMER_WHEEL_SLOTS] &= ~(1ULL << (t->list % TIMER_WHEEL_SLOTS));
+        }
+    }
+
+    if (t->next != 0) {
+        wheel->timers[t->next].prev = t->prev;
+    }
+
+    t->list = TIMER_LIST_NONE;
+    t->next = t->prev = 0;
+}
+
+static void timer_link(Timer_Wheel *wheel, uint32_t timer, uint16_t list)
+{
+    Timer *t = &wheel->timers[timer];
+
+    t->list = list;
+    t->prev = 0;
+    t->next = wheel->lists[list];
+
+    if (t->next != 0) {
+        wheel->timers[t->next].prev = timer;
+    }
+
+    wheel->lists[list] = timer;
+
+    if (list < TIMER_LIST_DUE) {
+        wheel->occupied[list / TIMER_WHEEL_SLOTS] |= 1ULL << (list % TIMER_WHEEL_SLOTS);
+    }
+}
+
+/* Put timer in the slot its deadline falls in, seen from the current time of
+ * the wheel.
+ */
+static void timer_place(Timer_Wheel *wheel, uint32_t timer)
+{
+    uint64_t deadline = wheel->timers[timer].deadline;
+    uint32_t level;
+
+    if (deadline < wheel->now) {
+        timer_link(wheel, timer, TIMER_LIST_DUE);
+        return;
+    }
+
+    for (level = 0; level + 1 < TIMER_WHEEL_LEVELS; ++level) {
+        if (deadline - wheel->now < (1ULL << level_shift(level + 1))) {
+            break;
+        }
+    }
+
+    /* Beyond the last level, the timer waits in it until it is closer. */
+    if (deadline - wheel->now >= (1ULL << level_shift(TIMER_WHEEL_LEVELS))) {
+        deadline = wheel->now + (1ULL << level_shift(TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    const uint32_t slot = (deadline >> level_shift(level)) % TIMER_WHEEL_SLOTS;
+    timer_link(wheel, timer, level * TIMER_WHEEL_SLOTS + slot);
+}
+
+Timer_Wheel *timer_wheel_new(uint64_t now)
+{
+    Timer_Wheel *wheel = (Timer_Wheel *)calloc(1, sizeof(Timer_Wheel));
+
+    if (wheel == NULL) {
+        return NULL;
+    }
+
+    wheel->now = now;
+    return wheel;
+}
+
+void timer_wheel_kill(Timer_Wheel *wheel)
+{
+    if (wheel == NULL) {
+        return;
+    }
+
+    free(wheel->timers);
+    free(wheel);
+}
+
+uint32_t timer_new(Timer_Wheel *wheel, timer_cb *callback, void *object, uint32_t number)
+{
+    if (wheel->free_timers == 0) {
+        const uint32_t new_size = wheel->timers_size == 0 ? 16 : wheel->timers_size * 2;
+
+        if (new_size <= wheel->timers_size) {
+            return 0;
+        }
+
+        Timer *new_timers = (Timer *)realloc(wheel->timers, new_size * sizeof(Timer));
+
+        if (new_timers == NULL) {
+            return 0;
+        }
+
+        uint32_t i;
+
+        /* Timer 0 stays out of the free list. */
+        for (i = new_size - 1; i >= wheel->timers_size && i != 0; --i) {
+            new_timers[i].list = TIMER_LIST_FREE;
+            new_timers[i].next = wheel->free_timers;
+            wheel->free_timers = i;
+        }
+
+        wheel->timers = new_timers;
+        wheel->timers_size = new_size;
+    }
+
+    const uint32_t timer = wheel->free_timers;
+    Timer *t = &wheel->timers[timer];
+
+    wheel->free_timers = t->next;
+    t->deadline = 0;
+    t->callback = callback;
+    t->object = object;
+    t->number = number;
+    t->next = t->prev = 0;
+    t->list = TIMER_LIST_NONE;
+    return timer;
+}
+
+static bool timer_valid(const Timer_Wheel *wheel, uint32_t timer)
+{
+    return timer != 0 && timer < wheel->timers_size && wheel->timers[timer].list != TIMER_LIST_FREE;
+}
+
+void timer_set(Timer_Wheel *wheel, uint32_t timer, uint64_t deadline)
+{
+    if (!timer_valid(wheel, timer)) {
+        return;
+    }
+
+    timer_unlink(wheel, timer);
+    wheel->timers[timer].deadline = deadline;
+    timer_place(wheel, timer);
+}
+
+void timer_stop(Timer_Wheel *wheel, uint32_t timer)
+{
+    if (!timer_valid(wheel, timer)) {
+        return;
+    }
+
+    timer_unlink(wheel, timer);
+}
+
+void timer_kill(Timer_Wheel *wheel, uint32_t timer)
+{
+    if (!timer_valid(wheel, timer)) {
+        return;
+    }
+
+    timer_unlink(wheel, timer);
+    wheel->timers[timer].list = TIMER_LIST_FREE;
+    wheel->timers[timer].next = wheel->free_timers;
+    wheel->free_timers = timer;
+}
+
+/* Move the timers of list to the running list, or back into the wheel. */
+static void timer_move_list(Timer_Wheel *wheel, uint16_t list, bool running)
+{
+    while (wheel->lists[list] != 0) {
+        const uint32_t timer = wheel->lists[list];
+        timer_unlink(wheel, timer);
+
+        if (running) {
+            timer_link(wheel, timer, TIMER_LIST_RUNNING);
+        } else {
+            timer_place(wheel, timer);
+        }
+    }
+}
+
+/* return index of the lowest bit set in bits, which must not be 0. */
+static uint32_t lowest_bit(uint64_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    uint32_t i = 0;
+
+    while (!(bits & (1ULL << i))) {
+        ++i;
+    }
+
+    return i;
+#endif
+}
+
+/* return the time the first slot that isn't empty is reached. */
+static uint64_t timer_wheel_next_slot(const Timer_Wheel *wheel)
+{
+    uint64_t next = UINT64_MAX;
+    uint32_t level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t occupied = wheel->occupied[level];
+
+        if (occupied == 0) {
+            continue;
+        }
+
+        const uint32_t shift = level_shift(level);
+        const uint32_t current = (wheel->now >> shift) % TIMER_WHEEL_SLOTS;
+        const uint64_t current_start = wheel->now >> shift << shift;
+
+        /* Bit i is now the slot i slots after the current one. */
+        if (current != 0) {
+            occupied = (occupied >> current) | (occupied << (TIMER_WHEEL_SLOTS - current));
+        }
+
+        /* A slot of a higher level is reached when all levels below start
+         * over. The current one was passed unless that is happening now, so
+         * its timers are a whole rotation away.
+         */
+        uint64_t start;
+
+        if (current_start < wheel->now && (occupied & ~1ULL) == 0) {
+            start = current_start + (1ULL << (shift + TIMER_WHEEL_SLOT_BITS));
+        } else {
+            if (current_start < wheel->now) {
+                occupied &= ~1ULL;
+            }
+
+            start = current_start + ((uint64_t)lowest_bit(occupied) << shift);
+        }
+
+        if (start < next) {
+            next = start;
+        }
+    }
+
+    return next;
+}
+
+/* Call the callbacks of the timers in the running list. Timers set again by
+ * their callbacks can't go back into it.
+ */
+static uint32_t timer_run_out(Timer_Wheel *wheel, void *userdata)
+{
+    uint32_t count = 0;
+
+    while (wheel->lists[TIMER_LIST_RUNNING] != 0) {
+        const uint32_t timer = wheel->lists[TIMER_LIST_RUNNING];
+        timer_unlink(wheel, timer);
+
+        const Timer *t = &wheel->timers[timer];
+        t->callback(t->object, t->number, userdata);
+        ++count;
+    }
+
+    return count;
+}
+
+/* Run out the timers due at the current time of the wheel, after moving the
+ * timers of the slots of higher levels that start now down the wheel.
+ */
+static uint32_t timer_wheel_tick(Timer_Wheel *wheel, void *userdata)
+{
+    uint32_t level;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (wheel->now % (1ULL << level_shift(level)) != 0) {
+            break;
+        }
+
+        const uint32_t slot = (wheel->now >> level_shift(level)) % TIMER_WHEEL_SLOTS;
+        timer_move_list(wheel, level * TIMER_WHEEL_SLOTS + slot, 0);
+    }
+
+    timer_move_list(wheel, wheel->now % TIMER_WHEEL_SLOTS, 1);
+    ++wheel->now;
+    return timer_run_out(wheel, userdata);
+}
+
+uint32_t timer_wheel_run(Timer_Wheel *wheel, uint64_t now, void *userdata)
+{
+    /* Timers that were set to a time the wheel had passed run out first. */
+    timer_move_list(wheel, TIMER_LIST_DUE, 1);
+    uint32_t count = timer_run_out(wheel, userdata);
+
+    while (wheel->now <= now) {
+        const uint64_t next = timer_wheel_next_slot(wheel);
+
+        if (next > now) {
+            wheel->now = now + 1;
+            break;
+        }
+
+        /* Slots in between are empty, and so are the slots above they would move down. */
+        wheel->now = next;
+        count += timer_wheel_tick(wheel, userdata);
+    }
+
+    return count;
+}
+
+uint64_t timer_wheel_next_deadline(const Timer_Wheel *wheel)
+{
+    if (wheel->lists[TIMER_LIST_DUE] != 0) {
+        return wheel->now > 0 ? wheel->now - 1 : 0;
+    }
+
+    return timer_wheel_next_slot(wheel);
+}
+
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src)
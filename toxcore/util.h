@@ -38,6 +38,64 @@
 void unix_time_update(void);
 uint64_t unix_time(void);
 int is_timeout(uint64_t timestamp, uint64_t timeout);
+uint32_t unix_time_next_update(void);
+
+/* return the time in milliseconds until unix_time() reaches time, 0 if it has
+ * already, UINT32_MAX if time is UINT64_MAX or too far away.
+ */
+uint32_t unix_time_until(uint64_t time);
+
+/* Timer wheel
+ *
+ * Holds deadlines so that a module only touches the objects whose timers ran
+ * out, instead of checking every object with is_timeout() on every iteration.
+ * The wheel has levels of 64 slots, each slot of a level covering 64 times the
+ * time of a slot of the level below, so adding and removing a timer is O(1)
+ * however far away its deadline is. Times are in whatever unit the module
+ * passes, unix_time() for timers in seconds.
+ *
+ * A timer is a number returned by timer_new(), 0 is never a timer.
+ */
+typedef struct Timer_Wheel Timer_Wheel;
+
+typedef void timer_cb(void *object, uint32_t number, void *userdata);
+
+/* return a new timer wheel starting at time now, NULL on failure. */
+Timer_Wheel *timer_wheel_new(uint64_t now);
+void timer_wheel_kill(Timer_Wheel *wheel);
+
+/* Create a timer that calls callback(object, number, userdata) when it runs
+ * out. It isn't running until timer_set() is called.
+ *
+ * return the timer on success.
+ * return 0 on failure.
+ */
+uint32_t timer_new(Timer_Wheel *wheel, timer_cb *callback, void *object, uint32_t number);
+
+/* Run timer out at deadline, replacing the deadline it had before. A timer
+ * runs out once, it must be set again to run out again.
+ */
+void timer_set(Timer_Wheel *wheel, uint32_t timer, uint64_t deadline);
+
+/* Stop timer if it is running. */
+void timer_stop(Timer_Wheel *wheel, uint32_t timer);
+
+/* Stop and delete timer. */
+void timer_kill(Timer_Wheel *wheel, uint32_t timer);
+
+/* Call the callbacks of all timers with a deadline up to and including now.
+ * Callbacks may set, stop and kill any timers, including their own.
+ *
+ * return the number of callbacks called.
+ */
+uint32_t timer_wheel_run(Timer_Wheel *wheel, uint64_t now, void *userdata);
+
+/* return the earliest time timer_wheel_run() may have a callback to call.
+ * Timers more than 64 time units away are only known up to their slot, so the
+ * deadline may be earlier than that of the next timer.
+ * return UINT64_MAX if no timer is running.
+ */
+uint64_t timer_wheel_next_deadline(const Timer_Wheel *wheel);
 
 
 /* id functions */